@@ -0,0 +1,182 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mpscring.hpp>
+
+//
+// スタックを持たない非同期タスク(状態機械)
+// step()を繰り返し呼び、待ち条件が揃うまでRunningを返して抜ける
+// 再開位置はswitchのcaseラベルで持つので、待ちをまたぐ値はメンバに置くこと
+//
+namespace Async
+{
+    enum class Status : uint8_t
+    {
+        Running,
+        Done,
+        Failed,
+        TimedOut,
+        Cancelled,
+    };
+
+    class Task
+    {
+        friend class Runner;
+        bool cancelRequest = false;
+        bool running = false;
+
+    protected:
+        uint16_t resume = 0; // 再開位置(__LINE__)
+        uint32_t waitStart = 0;
+        bool timedOut = false;
+
+        // 取り消されたときの後始末
+        virtual void onCancel() {}
+        // 終了時(ステップを回したスレッドで呼ばれる)
+        virtual void onFinish(Status) {}
+
+    public:
+        virtual ~Task() = default;
+        // now: 現在時刻(ms)
+        virtual Status step(uint32_t now) = 0;
+
+        bool isRunning() const { return __atomic_load_n(&running, __ATOMIC_ACQUIRE); }
+        void cancel() { __atomic_store_n(&cancelRequest, true, __ATOMIC_RELEASE); }
+
+        // 1回分を回す(取り消し要求があれば後始末して終える)
+        Status advance(uint32_t now)
+        {
+            Status st;
+            if (__atomic_load_n(&cancelRequest, __ATOMIC_ACQUIRE))
+            {
+                onCancel();
+                st = Status::Cancelled;
+            }
+            else
+                st = step(now);
+            if (st != Status::Running)
+            {
+                resume = 0;
+                onFinish(st);
+                __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+            }
+            return st;
+        }
+        // 投入前に呼ぶ。すでに動いていればfalse(成功したら引数を設定してから投入する)
+        bool prepare()
+        {
+            bool expected = false;
+            if (!__atomic_compare_exchange_n(&running, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                return false;
+            resume = 0;
+            cancelRequest = false;
+            return true;
+        }
+    };
+
+    ///
+    /// 複数のタスクを1本のワーカーで交互に回す
+    /// submit()はどのスレッドからでもよく、ステップはpump()を呼ぶ1スレッドで回す
+    ///
+    class Runner
+    {
+        static constexpr int MaxTasks = 8;
+        Worker::MpscRing<Task *, MaxTasks> inbox;
+        Task *tasks[MaxTasks];
+        int numTasks = 0;
+        bool active = false;
+
+    public:
+        // prepare()済みのタスクを受け付けたらtrue
+        // startedがtrueなら呼び出し側がpump()を回すジョブを起こす
+        bool submit(Task *t, bool &started)
+        {
+            started = false;
+            if (!inbox.tryPush(t))
+            {
+                __atomic_store_n(&t->running, false, __ATOMIC_RELEASE);
+                return false;
+            }
+            started = !__atomic_exchange_n(&active, true, __ATOMIC_ACQ_REL);
+            return true;
+        }
+
+        // 全タスクを1ステップずつ進める。動いているタスクが無くなればfalse(pumpを終えてよい)
+        bool pump(uint32_t now)
+        {
+            Task *t;
+            while (numTasks < MaxTasks && inbox.tryPop(t))
+                tasks[numTasks++] = t;
+            for (int i = 0; i < numTasks;)
+            {
+                if (tasks[i]->advance(now) == Status::Running)
+                    i++;
+                else
+                    tasks[i] = tasks[--numTasks];
+            }
+            if (numTasks > 0)
+                return true;
+            // 終える直前に投入されたものを取りこぼさない
+            __atomic_store_n(&active, false, __ATOMIC_RELEASE);
+            if (inbox.size() == 0)
+                return false;
+            bool expected = false;
+            return __atomic_compare_exchange_n(&active, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        }
+        // pump()を回すジョブを起こせなかったとき(次のsubmit()でやり直す)
+        void pumpFailed() { __atomic_store_n(&active, false, __ATOMIC_RELEASE); }
+        int size() const { return numTasks; }
+    };
+
+    ///
+    /// prepare()済みのタスクを1つ、終わるまでその場で回す
+    /// now(): 現在時刻(ms), wait(): 次のステップまで待つ, cancelled(): 外からの取り消し
+    ///
+    template <typename Now, typename Wait, typename Cancelled>
+    Status run(Task &t, Now now, Wait wait, Cancelled cancelled)
+    {
+        while (true)
+        {
+            if (cancelled())
+                t.cancel();
+            auto st = t.advance(now());
+            if (st != Status::Running)
+                return st;
+            wait();
+        }
+    }
+}
+
+// 状態機械の記述用
+#define ASYNC_BEGIN() \
+    switch (resume)   \
+    {                 \
+    case 0:
+#define ASYNC_END()                \
+    }                              \
+    return Async::Status::Done
+#define ASYNC_RETURN(st) return (st)
+// 一度抜けて次のステップで続きから
+#define ASYNC_YIELD()                       \
+    do                                      \
+    {                                       \
+        resume = __LINE__;                  \
+        return Async::Status::Running;      \
+    case __LINE__:;                         \
+    } while (0)
+// condが成り立つまで待つ。ms経過したらtimedOutを立てて先へ進む
+#define ASYNC_AWAIT(cond, ms)                                         \
+    do                                                                \
+    {                                                                 \
+        waitStart = now;                                              \
+        resume = __LINE__;                                            \
+    case __LINE__:                                                    \
+        timedOut = !(cond);                                           \
+        if (timedOut && uint32_t(now - waitStart) < uint32_t(ms))     \
+            return Async::Status::Running;                            \
+    } while (0)
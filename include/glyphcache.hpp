@@ -0,0 +1,171 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <Arduino.h>
+#include <LovyanGFX.hpp>
+
+namespace UI
+{
+    ///
+    /// グリフキャッシュ
+    /// よく使う文字を1bppに展開して保持し、drawBitmapで転送する
+    /// (4ウェイ×64セット、セット内はLRU)
+    ///
+    class GlyphCache
+    {
+    public:
+        struct Stats
+        {
+            uint32_t hits = 0;
+            uint32_t misses = 0;
+            uint32_t glyphs = 0; // 描画した文字数
+            uint32_t time = 0;   // 描画にかかった時間(us)
+        };
+
+    private:
+        static constexpr int Ways = 4;
+        static constexpr int Sets = 64;
+        static constexpr int MaxWidth = 32;
+        static constexpr int Stride = MaxWidth / 8;
+
+        struct Slot
+        {
+            uint32_t code = 0; // 0は空き
+            uint32_t used = 0;
+            uint8_t width = 0;   // 送り幅
+            uint8_t bmWidth = 0; // ビットマップ幅
+        };
+
+        const lgfx::IFont *font = nullptr;
+        int height = 0;
+        Slot slots[Sets][Ways];
+        uint8_t *bitmaps = nullptr;
+        LGFX_Sprite work;
+        uint32_t tick = 0;
+        Stats stats;
+
+        static uint32_t decode(const char *s, int &n)
+        {
+            uint8_t c = s[0];
+            if (c < 0x80)
+            {
+                n = 1;
+                return c;
+            }
+            n = c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+            uint32_t cp = c & (0x7f >> n);
+            for (int i = 1; i < n; i++)
+            {
+                if ((uint8_t(s[i]) & 0xc0) != 0x80)
+                {
+                    n = i;
+                    return 0;
+                }
+                cp = (cp << 6) | (s[i] & 0x3f);
+            }
+            return cp;
+        }
+        uint8_t *bitmapOf(int set, int way)
+        {
+            return bitmaps + (set * Ways + way) * Stride * height;
+        }
+
+        // 見つからなければ展開して登録する
+        const Slot *lookup(uint32_t cp, const char *utf8, int n, const uint8_t *&bm)
+        {
+            int set = (cp ^ (cp >> 6)) & (Sets - 1);
+            auto *ways = slots[set];
+            int victim = 0;
+            for (int i = 0; i < Ways; i++)
+            {
+                if (ways[i].code == cp)
+                {
+                    stats.hits++;
+                    ways[i].used = ++tick;
+                    bm = bitmapOf(set, i);
+                    return &ways[i];
+                }
+                if (ways[i].used < ways[victim].used)
+                    victim = i;
+            }
+            stats.misses++;
+            char str[5];
+            memcpy(str, utf8, n);
+            str[n] = '\0';
+            int adv = work.textWidth(str);
+            if (adv <= 0 || adv > MaxWidth)
+                return nullptr;
+            work.fillScreen(TFT_BLACK);
+            work.drawString(str, 0, 0);
+            auto &sl = ways[victim];
+            sl.code = cp;
+            sl.used = ++tick;
+            sl.width = adv;
+            sl.bmWidth = MaxWidth;
+            auto *dst = bitmapOf(set, victim);
+            memcpy(dst, work.getBuffer(), Stride * height);
+            bm = dst;
+            return &sl;
+        }
+
+    public:
+        // fontの文字だけをキャッシュする(h: フォントの高さ)
+        bool init(const lgfx::IFont *f, int h)
+        {
+            font = f;
+            height = h;
+            size_t sz = Sets * Ways * Stride * height;
+            bitmaps = static_cast<uint8_t *>(heap_caps_malloc(sz, MALLOC_CAP_SPIRAM));
+            if (!bitmaps)
+                bitmaps = static_cast<uint8_t *>(heap_caps_malloc(sz, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+            if (!bitmaps)
+                return false;
+            work.setColorDepth(1);
+            if (!work.createSprite(MaxWidth, height))
+            {
+                heap_caps_free(bitmaps);
+                bitmaps = nullptr;
+                return false;
+            }
+            work.setFont(font);
+            work.setTextColor(TFT_WHITE);
+            return true;
+        }
+        bool handles(const lgfx::IFont *f) const { return bitmaps && f == font; }
+        const Stats &getStats() const { return stats; }
+
+        // 背景なしの文字列描画(LGFX::drawStringと同じ左上基準)
+        template <typename G>
+        void drawString(G *gfx, const char *str, int x, int y, int color)
+        {
+            uint32_t startTime = micros();
+            char fallback[5];
+            while (*str)
+            {
+                int n;
+                uint32_t cp = decode(str, n);
+                const uint8_t *bm;
+                const Slot *sl = cp ? lookup(cp, str, n, bm) : nullptr;
+                if (sl)
+                {
+                    gfx->drawBitmap(x, y, bm, sl->bmWidth, height, color);
+                    x += sl->width;
+                }
+                else
+                {
+                    // キャッシュできない文字はそのまま描く
+                    memcpy(fallback, str, n);
+                    fallback[n] = '\0';
+                    gfx->setTextColor(color);
+                    x += gfx->drawString(fallback, x, y);
+                }
+                str += n;
+                stats.glyphs++;
+            }
+            stats.time += micros() - startTime;
+        }
+    };
+}
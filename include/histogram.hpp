@@ -0,0 +1,70 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stdint.h>
+
+namespace Profile
+{
+    ///
+    /// 対数ヒストグラム(1/16us単位、2のべき乗毎に4分割)
+    ///
+    class Histogram
+    {
+        static constexpr int SubBits = 2;
+        static constexpr int NumBuckets = 32 << SubBits;
+
+        uint32_t buckets[NumBuckets]{};
+        uint32_t total = 0;
+
+        static int bucketOf(uint32_t v)
+        {
+            if (v < (1u << SubBits))
+                return v;
+            int msb = 31 - __builtin_clz(v);
+            int sub = (v >> (msb - SubBits)) & ((1 << SubBits) - 1);
+            return ((msb - SubBits + 1) << SubBits) + sub;
+        }
+        static uint32_t valueOf(int b)
+        {
+            if (b < (1 << SubBits))
+                return b;
+            int msb = (b >> SubBits) + SubBits - 1;
+            int sub = b & ((1 << SubBits) - 1);
+            return (1u << msb) | (sub << (msb - SubBits));
+        }
+
+    public:
+        void record(uint32_t v)
+        {
+            buckets[bucketOf(v)]++;
+            // 古いサンプルの影響を減らすため、溜まったら半減させる
+            if (++total >= 0x10000)
+            {
+                total = 0;
+                for (auto &b : buckets)
+                {
+                    b >>= 1;
+                    total += b;
+                }
+            }
+        }
+        // パーセンタイル(0-100)に相当するバケットの下限値
+        uint32_t percentile(int p) const
+        {
+            if (total == 0)
+                return 0;
+            uint32_t target = (uint64_t)total * p / 100;
+            uint32_t sum = 0;
+            for (int i = 0; i < NumBuckets; i++)
+            {
+                sum += buckets[i];
+                if (sum > target)
+                    return valueOf(i);
+            }
+            return valueOf(NumBuckets - 1);
+        }
+    };
+}
@@ -0,0 +1,451 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// 応答を溜めずに流すHTTP/1.1クライアント
+// 受信は呼び出し側が用意したバッファ1つで行い、本文は届いた分ずつHttpSinkへ渡す
+// (Content-Length、chunked、切断まで、のどれでも)
+// 接続はArduinoのClientと同じ形(connect/write/available/read/connected/stop)なら何でもよく、
+// ホストのテストではソケットで差し替える
+//
+namespace Net
+{
+    // poll()の戻り値(正ならステータスコード)
+    enum HttpResult : int
+    {
+        HttpRunning = 0,
+        HttpConnectFailed = -1,
+        HttpSendFailed = -2,
+        HttpConnectionLost = -3,
+        HttpBadResponse = -4,
+        HttpAborted = -5, // 受け取り側がfalseを返した
+        HttpBadUrl = -6,
+    };
+
+    ///
+    /// 本文の受け取り側
+    ///
+    class HttpSink
+    {
+    public:
+        virtual ~HttpSink() = default;
+        // falseを返すと打ち切る
+        virtual bool onBody(const uint8_t *data, size_t size) = 0;
+    };
+
+    ///
+    /// 応答の逐次パーサ
+    /// 行は固定長の領域に読み、長すぎる行は切り詰める(見るヘッダは先頭だけで足りる)
+    ///
+    class HttpParser
+    {
+    public:
+        enum class State : uint8_t
+        {
+            StatusLine,
+            Header,
+            Body,      // Content-Lengthまたは切断まで
+            ChunkSize,
+            ChunkData,
+            ChunkEnd,  // チャンク末尾のCRLF
+            Trailer,
+            Done,
+            Error,
+        };
+        static constexpr size_t MaxLine = 128;
+
+    private:
+        State state = State::StatusLine;
+        char line[MaxLine];
+        uint8_t lineLen = 0;
+        bool sawCR = false;
+        bool untilClose = false;
+        uint32_t remaining = 0; // 本文またはチャンクの残り
+        HttpSink *sink = nullptr;
+
+        static bool startsWithNoCase(const char *s, const char *prefix)
+        {
+            for (; *prefix; s++, prefix++)
+            {
+                char a = *s >= 'A' && *s <= 'Z' ? *s + 32 : *s;
+                if (a != *prefix)
+                    return false;
+            }
+            return true;
+        }
+        static bool containsNoCase(const char *s, const char *word)
+        {
+            for (; *s; s++)
+                if (startsWithNoCase(s, word))
+                    return true;
+            return false;
+        }
+        static const char *value(const char *s)
+        {
+            while (*s && *s != ':')
+                s++;
+            if (*s == ':')
+                s++;
+            while (*s == ' ' || *s == '\t')
+                s++;
+            return s;
+        }
+
+        void fail() { state = State::Error; }
+        // ヘッダの終わり。本文の読み方を決める
+        void endHeaders()
+        {
+            if (status >= 100 && status < 200)
+            {
+                // 100 Continueなどは読み捨てて次の応答を待つ
+                state = State::StatusLine;
+                contentLength = -1;
+                chunked = false;
+                return;
+            }
+            if (head || status == 204 || status == 304)
+                state = State::Done;
+            else if (chunked)
+                state = State::ChunkSize;
+            else if (contentLength >= 0)
+            {
+                remaining = contentLength;
+                state = remaining > 0 ? State::Body : State::Done;
+            }
+            else
+            {
+                // 長さが分からなければ切断までが本文
+                untilClose = true;
+                keepAlive = false;
+                state = State::Body;
+            }
+        }
+        void onLine()
+        {
+            line[lineLen] = '\0';
+            switch (state)
+            {
+            case State::StatusLine:
+                if (lineLen == 0)
+                    return; // 前の応答の後の空行
+                if (!startsWithNoCase(line, "http/1.") || lineLen < 12)
+                    return fail();
+                keepAlive = line[7] == '1';
+                status = atoi(line + 9);
+                state = status >= 100 ? State::Header : State::Error;
+                break;
+            case State::Header:
+                if (lineLen == 0)
+                    endHeaders();
+                else if (startsWithNoCase(line, "content-length:"))
+                    contentLength = strtol(value(line), nullptr, 10);
+                else if (startsWithNoCase(line, "transfer-encoding:"))
+                    chunked = containsNoCase(value(line), "chunked");
+                else if (startsWithNoCase(line, "connection:"))
+                {
+                    if (containsNoCase(value(line), "close"))
+                        keepAlive = false;
+                    else if (containsNoCase(value(line), "keep-alive"))
+                        keepAlive = true;
+                }
+                break;
+            case State::ChunkSize:
+            {
+                char *end;
+                remaining = strtoul(line, &end, 16);
+                if (end == line)
+                    return fail();
+                state = remaining > 0 ? State::ChunkData : State::Trailer;
+                break;
+            }
+            case State::ChunkEnd:
+                state = lineLen == 0 ? State::ChunkSize : State::Error;
+                break;
+            case State::Trailer:
+                if (lineLen == 0)
+                    state = State::Done;
+                break;
+            default:
+                break;
+            }
+        }
+        // 1行分を読み進める。読んだバイト数を返す
+        size_t feedLine(const uint8_t *p, size_t n)
+        {
+            size_t i = 0;
+            while (i < n)
+            {
+                char c = p[i++];
+                if (c == '\n')
+                {
+                    onLine();
+                    lineLen = 0;
+                    sawCR = false;
+                    return i;
+                }
+                if (sawCR && lineLen < MaxLine - 1)
+                    line[lineLen++] = '\r';
+                sawCR = c == '\r';
+                if (!sawCR && lineLen < MaxLine - 1)
+                    line[lineLen++] = c;
+            }
+            return i;
+        }
+
+    public:
+        // 結果
+        int status = 0;
+        int32_t contentLength = -1;
+        bool chunked = false;
+        bool keepAlive = false;
+        bool head = false;      // HEADの応答(本文なし)
+        bool aborted = false;   // 受け取り側が打ち切った
+        uint32_t bodyBytes = 0; // 受け取った本文
+
+        void reset(HttpSink *s, bool isHead = false)
+        {
+            state = State::StatusLine;
+            lineLen = 0;
+            sawCR = false;
+            untilClose = false;
+            remaining = 0;
+            sink = s;
+            status = 0;
+            contentLength = -1;
+            chunked = false;
+            keepAlive = false;
+            head = isHead;
+            aborted = false;
+            bodyBytes = 0;
+        }
+
+        // 届いたバイト列を渡す。終わるか失敗したら残りは読まない
+        void feed(const uint8_t *p, size_t n)
+        {
+            while (n > 0 && state != State::Done && state != State::Error)
+            {
+                size_t used;
+                if (state == State::Body || state == State::ChunkData)
+                {
+                    used = n;
+                    if (!untilClose && used > remaining)
+                        used = remaining;
+                    if (sink && !sink->onBody(p, used))
+                    {
+                        aborted = true;
+                        fail();
+                        return;
+                    }
+                    bodyBytes += used;
+                    if (!untilClose && (remaining -= used) == 0)
+                        state = state == State::Body ? State::Done : State::ChunkEnd;
+                }
+                else
+                    used = feedLine(p, n);
+                p += used;
+                n -= used;
+            }
+        }
+        // 相手が切断した
+        void finish()
+        {
+            if (state == State::Body && untilClose)
+                state = State::Done;
+            else if (state != State::Done)
+                fail();
+        }
+
+        State getState() const { return state; }
+        bool isDone() const { return state == State::Done; }
+        bool isError() const { return state == State::Error; }
+        bool started() const { return state != State::StatusLine || lineLen > 0; }
+    };
+
+    ///
+    /// 接続の使い回し(keep-alive)をするクライアント
+    /// request()で送り、poll()を繰り返して受け取る(poll()は届いている分だけ読んで戻る)
+    ///
+    template <typename Conn>
+    class HttpClient
+    {
+    public:
+        static constexpr size_t MaxHost = 64;
+        struct Stats
+        {
+            uint32_t requests;
+            uint32_t reused;  // 前の接続で送れた
+            uint32_t retries; // 使い回した接続が切れていて張り直した
+            uint32_t bytes;   // 受信(ヘッダ込み)
+        };
+
+    private:
+        Conn &conn;
+        uint8_t *buff;
+        size_t size;
+        HttpParser parser;
+        char host[MaxHost] = {};
+        uint16_t port = 0;
+        bool open = false;
+        bool reused = false;
+        // 張り直して送り直すための要求
+        const char *method = nullptr;
+        const char *url = nullptr;
+        const char *type = nullptr;
+        const char *body = nullptr;
+        HttpSink *sink = nullptr;
+        Stats stats{};
+
+        // http://host[:port]/path だけを扱う
+        static bool parseUrl(const char *url, char *host, size_t hostSize, uint16_t &port, const char *&path)
+        {
+            static const char scheme[] = "http://";
+            if (strncmp(url, scheme, sizeof(scheme) - 1) != 0)
+                return false;
+            const char *h = url + sizeof(scheme) - 1;
+            const char *end = h;
+            while (*end && *end != ':' && *end != '/')
+                end++;
+            size_t len = end - h;
+            if (len == 0 || len >= hostSize)
+                return false;
+            memcpy(host, h, len);
+            host[len] = '\0';
+            port = 80;
+            if (*end == ':')
+            {
+                char *e;
+                port = strtoul(end + 1, &e, 10);
+                if (port == 0)
+                    return false;
+                end = e;
+            }
+            path = *end == '/' ? end : "/";
+            return true;
+        }
+        bool writeAll(const void *p, size_t n)
+        {
+            return n == 0 || conn.write(static_cast<const uint8_t *>(p), n) == n;
+        }
+        // 要求行とヘッダは受信バッファを借りて組み立てる。入らなければ0
+        size_t build(const char *h, uint16_t p, const char *path)
+        {
+            char *out = reinterpret_cast<char *>(buff);
+            int n = snprintf(out, size, "%s %s HTTP/1.1\r\nHost: %s:%u\r\nConnection: keep-alive\r\n",
+                             method, path, h, p);
+            if (n >= 0 && size_t(n) < size && body)
+                n += snprintf(out + n, size - n, "Content-Type: %s\r\nContent-Length: %u\r\n",
+                              type ? type : "application/octet-stream", unsigned(strlen(body)));
+            if (n < 0 || size_t(n) + 2 >= size)
+                return 0;
+            memcpy(out + n, "\r\n", 2);
+            return n + 2;
+        }
+        int start()
+        {
+            char h[MaxHost];
+            uint16_t p;
+            const char *path;
+            reused = false;
+            if (!parseUrl(url, h, sizeof(h), p, path))
+                return HttpBadUrl;
+            size_t n = build(h, p, path);
+            if (n == 0)
+                return HttpSendFailed; // 送り直しても同じ
+            reused = open && conn.connected() && p == port && strcmp(h, host) == 0;
+            if (!reused)
+            {
+                close();
+                if (!conn.connect(h, p))
+                    return HttpConnectFailed;
+                strcpy(host, h);
+                port = p;
+                open = true;
+            }
+            parser.reset(sink, strcmp(method, "HEAD") == 0);
+            if (writeAll(buff, n) && writeAll(body, body ? strlen(body) : 0))
+                return HttpRunning;
+            close();
+            return HttpSendFailed;
+        }
+
+    public:
+        // buff: 受信と要求の組み立てに使う(要求行とヘッダが入る大きさにする)
+        HttpClient(Conn &c, uint8_t *b, size_t n) : conn(c), buff(b), size(n) {}
+
+        // 送る(文字列は終わるまで保持しておくこと)。失敗したら負のHttpResult
+        int request(const char *m, const char *u, const char *t, const char *b, HttpSink *s)
+        {
+            method = m;
+            url = u;
+            type = t;
+            body = b;
+            sink = s;
+            stats.requests++;
+            int ret = start();
+            if (ret == HttpSendFailed && reused)
+            {
+                // 相手がkeep-aliveを閉じていた
+                stats.retries++;
+                ret = start();
+            }
+            else if (ret == HttpRunning && reused)
+                stats.reused++;
+            return ret;
+        }
+        // 届いている分を読む。HttpRunning、ステータスコード、または負のHttpResult
+        int poll()
+        {
+            if (!open)
+                return HttpConnectionLost;
+            int avail;
+            while (!parser.isDone() && !parser.isError() && (avail = conn.available()) > 0)
+            {
+                int n = conn.read(buff, size_t(avail) < size ? avail : size);
+                if (n <= 0)
+                    break;
+                stats.bytes += n;
+                parser.feed(buff, n);
+            }
+            if (!parser.isDone() && !parser.isError() && !conn.connected() && conn.available() <= 0)
+            {
+                // 使い回した接続が何も返さずに切れていたら、張り直して送り直す
+                if (reused && !parser.started())
+                {
+                    stats.retries++;
+                    close();
+                    return start();
+                }
+                parser.finish();
+            }
+            if (parser.isError())
+            {
+                close();
+                return parser.aborted ? HttpAborted : parser.status > 0 ? HttpConnectionLost : HttpBadResponse;
+            }
+            if (!parser.isDone())
+                return HttpRunning;
+            if (!parser.keepAlive)
+                close();
+            return parser.status;
+        }
+        void close()
+        {
+            if (open)
+                conn.stop();
+            open = false;
+        }
+
+        bool isOpen() const { return open; }
+        const HttpParser &getParser() const { return parser; }
+        const Stats &getStats() const { return stats; }
+    };
+}
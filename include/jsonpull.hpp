@@ -0,0 +1,506 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <schema.hpp>
+
+//
+// 逐次(プル型)のJSONパーサ
+// 受信したかたまりをfeed()で渡し、next()でイベントを1つずつ取り出す(NeedMoreで次のかたまりを待つ)
+// ヒープは使わない。値はかたまりの中を直接指すビューで返す
+// かたまりの境目をまたいだ値だけは内部の固定長領域へ写し、入りきらなければ切り詰める(truncated())
+//
+//   Json::Parser<> json;
+//   json.feed(data, size);
+//   for (Json::Event ev; (ev = json.next()) != Json::Event::NeedMore;) { ... }
+//
+// value()の指す先は次のnext()またはfeed()まで有効。文字列はエスケープを解かずに返すので、
+// 解いた文字列が要るときはcopyValue()で写す
+//
+namespace Json
+{
+    using Store::StringView;
+
+    enum class Event : uint8_t
+    {
+        NeedMore, // 渡された分を読み終えた
+        BeginObject,
+        EndObject,
+        BeginArray,
+        EndArray,
+        Key,
+        String,
+        Number,
+        True,
+        False,
+        Null,
+        End,   // 値が1つ読み終わった(以降は空白だけ)
+        Error, // 以降はずっとError
+    };
+
+    template <int MaxDepth = 16, size_t ScratchSize = 64>
+    class Parser
+    {
+        static_assert(MaxDepth <= 32, "nesting is kept in a bit stack");
+
+        enum class Expect : uint8_t
+        {
+            Value,
+            ValueOrEnd, // '['の直後
+            Key,
+            KeyOrEnd,   // '{'の直後
+            Colon,
+            CommaOrEnd,
+            Done,
+        };
+        enum class Token : uint8_t
+        {
+            None,
+            String,
+            Number,
+            Literal,
+        };
+
+        const char *data = nullptr;
+        size_t size = 0;
+        size_t pos = 0;
+        bool eof = false;
+        bool failed = false;
+
+        uint32_t stack = 0; // 1ならオブジェクト
+        int level = 0;
+        Expect expect = Expect::Value;
+
+        // 読みかけの値(かたまりをまたいだらscratchに溜める)
+        Token token = Token::None;
+        bool isKey = false;
+        bool inEscape = false;
+        bool escaped = false;
+        bool spilled = false;
+        bool cut = false;
+        size_t start = 0;
+        char scratch[ScratchSize];
+        size_t scratchLen = 0;
+
+        // 今の値
+        StringView current;
+        Event currentEvent = Event::NeedMore;
+        bool currentEscaped = false;
+        bool currentCut = false;
+
+        // skip()
+        bool skipping = false;
+        int skipLevel = 0;
+
+        bool inObject() const { return level > 0 && (stack >> (level - 1)) & 1; }
+        bool expectsValue() const { return expect == Expect::Value || expect == Expect::ValueOrEnd; }
+        Event fail()
+        {
+            failed = true;
+            return Event::Error;
+        }
+        void afterValue() { expect = level == 0 ? Expect::Done : Expect::CommaOrEnd; }
+        Event push(bool object)
+        {
+            if (level >= MaxDepth)
+                return fail();
+            stack = object ? stack | (1u << level) : stack & ~(1u << level);
+            level++;
+            expect = object ? Expect::KeyOrEnd : Expect::ValueOrEnd;
+            return object ? Event::BeginObject : Event::BeginArray;
+        }
+        Event pop(bool object)
+        {
+            bool empty = expect == (object ? Expect::KeyOrEnd : Expect::ValueOrEnd);
+            if (level == 0 || inObject() != object || (!empty && expect != Expect::CommaOrEnd))
+                return fail();
+            level--;
+            afterValue();
+            return object ? Event::EndObject : Event::EndArray;
+        }
+
+        // 値の続き[from, to)を溜める
+        void spill(size_t from, size_t to)
+        {
+            size_t n = to - from;
+            if (scratchLen + n > ScratchSize)
+            {
+                n = ScratchSize - scratchLen;
+                cut = true;
+            }
+            if (n > 0)
+                memcpy(scratch + scratchLen, data + from, n);
+            scratchLen += n;
+            spilled = true;
+        }
+        // かたまりが尽きた。読みかけの値を写しておく(かたまりの領域は次のfeed()で上書きされてよい)
+        Event suspend()
+        {
+            spill(start, size);
+            start = size;
+            return Event::NeedMore;
+        }
+        // 読み終えた値[start, end)を今の値にする
+        void complete(size_t end)
+        {
+            if (spilled)
+            {
+                spill(start, end);
+                current = StringView(scratch, scratchLen);
+            }
+            else
+                current = StringView(data + start, end - start);
+            currentEscaped = escaped;
+            currentCut = cut;
+            token = Token::None;
+            spilled = false;
+        }
+        void begin(Token t, size_t at)
+        {
+            token = t;
+            start = at;
+            inEscape = false;
+            escaped = false;
+            spilled = false;
+            cut = false;
+            scratchLen = 0;
+        }
+        static bool isNumberChar(char c) { return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E'; }
+        static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+        // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+        static bool validNumber(StringView v)
+        {
+            size_t i = 0, n = v.size();
+            if (i < n && v[i] == '-')
+                i++;
+            if (i < n && v[i] == '0')
+                i++;
+            else if (i < n && isDigit(v[i]))
+                while (i < n && isDigit(v[i]))
+                    i++;
+            else
+                return false;
+            if (i < n && v[i] == '.')
+            {
+                if (++i >= n || !isDigit(v[i]))
+                    return false;
+                while (i < n && isDigit(v[i]))
+                    i++;
+            }
+            if (i < n && (v[i] == 'e' || v[i] == 'E'))
+            {
+                if (++i < n && (v[i] == '+' || v[i] == '-'))
+                    i++;
+                if (i >= n || !isDigit(v[i]))
+                    return false;
+                while (i < n && isDigit(v[i]))
+                    i++;
+            }
+            return i == n;
+        }
+
+        // 読みかけの値を進める。読み終えたらそのイベント、かたまりが尽きたらNeedMore
+        Event scan()
+        {
+            size_t i = pos;
+            if (token == Token::String)
+            {
+                for (; i < size; i++)
+                {
+                    char c = data[i];
+                    if (inEscape)
+                        inEscape = false;
+                    else if (c == '\\')
+                        inEscape = escaped = true;
+                    else if (c == '"')
+                        break;
+                    else if (uint8_t(c) < 0x20)
+                        return fail();
+                }
+                pos = i;
+                if (i == size)
+                    return eof ? fail() : suspend();
+                complete(i);
+                pos = i + 1;
+                if (isKey)
+                {
+                    expect = Expect::Colon;
+                    return Event::Key;
+                }
+                afterValue();
+                return Event::String;
+            }
+            // 数値・true/false/nullは区切りが来るまで
+            bool number = token == Token::Number;
+            while (i < size && (number ? isNumberChar(data[i]) : (data[i] >= 'a' && data[i] <= 'z')))
+                i++;
+            pos = i;
+            if (i == size && !eof)
+                return suspend();
+            complete(i);
+            afterValue();
+            if (currentCut)
+                return fail();
+            if (number)
+                return validNumber(current) ? Event::Number : fail();
+            if (current == StringView("true"))
+                return Event::True;
+            if (current == StringView("false"))
+                return Event::False;
+            if (current == StringView("null"))
+                return Event::Null;
+            return fail();
+        }
+
+        Event step()
+        {
+            if (token != Token::None)
+                return scan();
+            for (; pos < size; pos++)
+            {
+                char c = data[pos];
+                switch (c)
+                {
+                case ' ':
+                case '\t':
+                case '\r':
+                case '\n':
+                    continue;
+                case '{':
+                case '[':
+                    if (!expectsValue())
+                        return fail();
+                    pos++;
+                    return push(c == '{');
+                case '}':
+                case ']':
+                    pos++;
+                    return pop(c == '}');
+                case ',':
+                    if (expect != Expect::CommaOrEnd)
+                        return fail();
+                    expect = inObject() ? Expect::Key : Expect::Value;
+                    continue;
+                case ':':
+                    if (expect != Expect::Colon)
+                        return fail();
+                    expect = Expect::Value;
+                    continue;
+                case '"':
+                    isKey = expect == Expect::Key || expect == Expect::KeyOrEnd;
+                    if (!isKey && !expectsValue())
+                        return fail();
+                    begin(Token::String, pos + 1);
+                    pos++;
+                    return scan();
+                default:
+                    if (!expectsValue())
+                        return fail();
+                    if (c == '-' || isDigit(c))
+                        begin(Token::Number, pos);
+                    else if (c >= 'a' && c <= 'z')
+                        begin(Token::Literal, pos);
+                    else
+                        return fail();
+                    return scan();
+                }
+            }
+            if (expect == Expect::Done)
+                return Event::End;
+            return eof ? fail() : Event::NeedMore;
+        }
+
+    public:
+        void reset()
+        {
+            data = nullptr;
+            size = pos = 0;
+            eof = failed = false;
+            stack = 0;
+            level = 0;
+            expect = Expect::Value;
+            token = Token::None;
+            current = StringView();
+            currentEvent = Event::NeedMore;
+            skipping = false;
+        }
+        // 次のかたまりを渡す(前のかたまりはNeedMoreが返るまで読んでおくこと)
+        // 読みかけの値は写してあるので、前のかたまりの領域は使い回してよい
+        void feed(const char *p, size_t n)
+        {
+            data = p;
+            size = n;
+            pos = start = 0;
+        }
+        // 入力の終わり(最後の数値を確定させる)
+        void finish()
+        {
+            eof = true;
+            if (pos >= size)
+                feed("", 0);
+        }
+
+        // 次のイベント
+        Event next()
+        {
+            if (failed)
+                return Event::Error;
+            for (;;)
+            {
+                Event ev = step();
+                currentEvent = ev;
+                if (!skipping || ev == Event::NeedMore || ev == Event::Error || ev == Event::End)
+                    return ev;
+                // 飛ばしている値が終わったか
+                bool value = ev != Event::Key && ev != Event::BeginObject && ev != Event::BeginArray;
+                if (value && level == skipLevel)
+                    skipping = false;
+            }
+        }
+        // 次の値を読み飛ばす(Keyの後なら値を、BeginObject/BeginArrayの後ならその終わりまで)
+        // 途中でNeedMoreが返っても、続きのnext()で飛ばし続ける
+        void skip()
+        {
+            if (currentEvent == Event::Key)
+                skipLevel = level;
+            else if (currentEvent == Event::BeginObject || currentEvent == Event::BeginArray)
+                skipLevel = level - 1;
+            else
+                return;
+            skipping = true;
+        }
+
+        // 入れ子の深さ(トップレベルの値が0、そのメンバーが1)
+        int depth() const { return level; }
+        // 値を1つ最後まで読めた(失敗した値の後はfalse)
+        bool done() const { return !failed && expect == Expect::Done && token == Token::None; }
+
+        // Key/String(引用符の中、エスケープは解かない)、Number、True/False/Nullの文字列
+        StringView value() const { return current; }
+        bool hasEscapes() const { return currentEscaped; }
+        // 境目をまたいだ長い文字列が切り詰められた
+        bool truncated() const { return currentCut; }
+        bool is(const char *key) const { return !currentEscaped && current == StringView(key); }
+
+        // 値を終端付きで写す(文字列はエスケープを解く)。入りきらなければ切り詰める。写した長さを返す
+        size_t copyValue(char *dst, size_t dstSize) const
+        {
+            if (dstSize == 0)
+                return 0;
+            size_t n = 0;
+            auto put = [&](char c) {
+                if (n + 1 < dstSize)
+                    dst[n++] = c;
+            };
+            for (size_t i = 0; i < current.size(); i++)
+            {
+                char c = current[i];
+                if (!currentEscaped || c != '\\' || i + 1 >= current.size())
+                {
+                    put(c);
+                    continue;
+                }
+                c = current[++i];
+                switch (c)
+                {
+                case 'b':
+                    put('\b');
+                    break;
+                case 'f':
+                    put('\f');
+                    break;
+                case 'n':
+                    put('\n');
+                    break;
+                case 'r':
+                    put('\r');
+                    break;
+                case 't':
+                    put('\t');
+                    break;
+                case 'u':
+                {
+                    // \uXXXX(サロゲートペアも)をUTF-8に
+                    uint32_t cp = 0;
+                    auto hex = [&](size_t at, uint32_t &v) {
+                        if (at + 4 > current.size())
+                            return false;
+                        v = 0;
+                        for (size_t k = at; k < at + 4; k++)
+                        {
+                            char h = current[k];
+                            v = v * 16 + (isDigit(h) ? h - '0' : (h | 0x20) >= 'a' && (h | 0x20) <= 'f' ? (h | 0x20) - 'a' + 10 : 0);
+                        }
+                        return true;
+                    };
+                    if (!hex(i + 1, cp))
+                        break;
+                    i += 4;
+                    uint32_t lo;
+                    if (cp >= 0xd800 && cp < 0xdc00 && i + 2 < current.size() && current[i + 1] == '\\' &&
+                        current[i + 2] == 'u' && hex(i + 3, lo) && lo >= 0xdc00 && lo < 0xe000)
+                    {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                        i += 6;
+                    }
+                    if (cp < 0x80)
+                        put(cp);
+                    else if (cp < 0x800)
+                    {
+                        put(0xc0 | cp >> 6);
+                        put(0x80 | (cp & 0x3f));
+                    }
+                    else if (cp < 0x10000)
+                    {
+                        put(0xe0 | cp >> 12);
+                        put(0x80 | (cp >> 6 & 0x3f));
+                        put(0x80 | (cp & 0x3f));
+                    }
+                    else
+                    {
+                        put(0xf0 | cp >> 18);
+                        put(0x80 | (cp >> 12 & 0x3f));
+                        put(0x80 | (cp >> 6 & 0x3f));
+                        put(0x80 | (cp & 0x3f));
+                    }
+                    break;
+                }
+                default: // \" \\ \/
+                    put(c);
+                    break;
+                }
+            }
+            dst[n] = '\0';
+            return n;
+        }
+        // Numberの値
+        bool getInt(int32_t &v) const
+        {
+            char buff[16];
+            if (current.size() >= sizeof(buff))
+                return false;
+            copyValue(buff, sizeof(buff));
+            char *end;
+            long l = strtol(buff, &end, 10);
+            if (*end != '\0')
+                return false;
+            v = l;
+            return true;
+        }
+        bool getFloat(float &v) const
+        {
+            char buff[32];
+            if (current.size() >= sizeof(buff))
+                return false;
+            copyValue(buff, sizeof(buff));
+            v = strtof(buff, nullptr);
+            return true;
+        }
+    };
+}
@@ -0,0 +1,673 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+//
+// 追記型(ログ構造)のキー・バリュー保存
+// 更新はセクタ末尾へのレコード追記だけで、セクタの消去は回収(compact)のときにしか起きない
+// セクタはリング状に順に使うので、消去回数は全セクタに均等に散る
+//
+// Flashは次を持つこと(実機はPartitionFlash、ホストでは模擬実装に差し替える)
+//   static constexpr uint32_t SectorSize;
+//   uint32_t sectorCount() const;
+//   bool read(uint32_t addr, void *dst, size_t size);
+//   bool write(uint32_t addr, const void *src, size_t size); // 1→0の書き込みのみ
+//   bool erase(uint32_t sector);                            // 全ビットを1に戻す
+//
+namespace Store
+{
+    inline uint32_t crc32(uint32_t crc, const void *data, size_t size)
+    {
+        static const uint32_t table[16] = {
+            0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+            0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+        auto p = static_cast<const uint8_t *>(data);
+        crc = ~crc;
+        while (size--)
+        {
+            crc ^= *p++;
+            crc = (crc >> 4) ^ table[crc & 15];
+            crc = (crc >> 4) ^ table[crc & 15];
+        }
+        return ~crc;
+    }
+
+    constexpr int MaxKeyLength = 15;
+
+    // レコードの種類
+    enum RecordFlag : uint8_t
+    {
+        Tombstone = 0x01, // 削除
+        Batched = 0x02,   // まとめ書きの一部(後ろにコミット印があるときだけ有効)
+        Commit = 0x04,    // まとめ書きのコミット印(値はレコード数)
+    };
+
+    ///
+    /// まとめて書く変更
+    /// RAM上に溜めておき、Log::commit()で一度に書く(全部書けるか、何も書かないか)
+    ///
+    template <int Size = 256, int MaxItems = 8>
+    class Batch
+    {
+        template <typename, int, int>
+        friend class Log;
+
+        struct Item
+        {
+            uint16_t offset; // buff内のキー位置(値はキーの直後)
+            uint16_t valueLen;
+            uint8_t keyLen;
+            uint8_t flags;
+        };
+        uint8_t buff[Size];
+        Item items[MaxItems];
+        int count = 0;
+        uint16_t used = 0;
+
+        const char *key(const Item &it) const { return reinterpret_cast<const char *>(buff + it.offset); }
+        const uint8_t *value(const Item &it) const { return buff + it.offset + it.keyLen + 1; }
+        int find(const char *k) const
+        {
+            for (int i = 0; i < count; i++)
+                if (strcmp(key(items[i]), k) == 0)
+                    return i;
+            return -1;
+        }
+        // i番目を詰めて消す
+        void erase(int i)
+        {
+            uint16_t off = items[i].offset;
+            uint16_t sz = items[i].keyLen + 1 + items[i].valueLen;
+            memmove(buff + off, buff + off + sz, used - off - sz);
+            used -= sz;
+            for (int j = i; j < count - 1; j++)
+            {
+                items[j] = items[j + 1];
+                items[j].offset -= sz;
+            }
+            count--;
+        }
+        bool add(const char *k, uint8_t flags, const void *data, size_t size)
+        {
+            size_t klen = strlen(k);
+            if (klen == 0 || klen > MaxKeyLength)
+                return false;
+            int i = find(k);
+            size_t need = klen + 1 + size;
+            size_t freed = i >= 0 ? items[i].keyLen + 1 + items[i].valueLen : 0;
+            if (used + need - freed > Size || (i < 0 && count >= MaxItems))
+                return false;
+            if (i >= 0)
+                erase(i);
+            auto &it = items[count++];
+            it.offset = used;
+            it.keyLen = klen;
+            it.valueLen = size;
+            it.flags = flags;
+            memcpy(buff + used, k, klen + 1);
+            if (size > 0)
+                memcpy(buff + used + klen + 1, data, size);
+            used += need;
+            return true;
+        }
+
+    public:
+        static constexpr int Capacity = MaxItems;
+
+        void clear() { count = used = 0; }
+        bool empty() const { return count == 0; }
+        int size() const { return count; }
+
+        // 同じキーは後のもので置き換える
+        bool put(const char *k, const void *data, size_t size) { return add(k, 0, data, size); }
+        bool putString(const char *k, const char *str) { return put(k, str, strlen(str)); }
+        bool remove(const char *k) { return add(k, Tombstone, nullptr, 0); }
+
+        // 変更(削除を含む)があるか
+        bool contains(const char *k) const { return find(k) >= 0; }
+        // 値の長さ。無ければ-1、削除予定なら-2
+        int get(const char *k, void *dst, size_t size) const
+        {
+            int i = find(k);
+            if (i < 0)
+                return -1;
+            auto &it = items[i];
+            if (it.flags & Tombstone)
+                return -2;
+            memcpy(dst, value(it), it.valueLen < size ? it.valueLen : size);
+            return it.valueLen;
+        }
+        // otherの変更を上書きで取り込む(入りきらなければ何もせずfalse)
+        template <typename B>
+        bool merge(const B &other)
+        {
+            Batch tmp = *this;
+            for (int i = 0; i < other.count; i++)
+            {
+                auto &it = other.items[i];
+                if (!tmp.add(other.key(it), it.flags, other.value(it), it.valueLen))
+                    return false;
+            }
+            *this = tmp;
+            return true;
+        }
+    };
+
+    ///
+    /// MaxKeys: 保持できるキーの数, MaxSectors: 扱うセクタ数の上限
+    ///
+    template <typename Flash, int MaxKeys = 32, int MaxSectors = 8>
+    class Log
+    {
+    public:
+        static constexpr int MaxKey = MaxKeyLength;
+        static constexpr int MaxValue = 1024;
+        static constexpr int MaxBatch = 8;
+
+    private:
+        static constexpr uint32_t SectorSize = Flash::SectorSize;
+        static constexpr uint32_t Magic = 0x3153564b; // "KVS1"
+        static constexpr uint32_t Free = 0xffffffff;  // 未使用セクタのseq
+
+        // セクタ先頭。消去直後にseq以外を書き、使い始めるときにseqを書き足す
+        struct SectorHeader
+        {
+            uint32_t magic;
+            uint32_t erases;
+            uint32_t crc; // magic,erasesのCRC
+            uint32_t seq;
+        };
+        // レコード先頭。続けてキー、値を置き、4バイト境界まで詰める
+        struct Record
+        {
+            uint8_t keyLen; // 0xffなら未書き込み
+            uint8_t flags;
+            uint16_t valueLen;
+            uint32_t crc; // keyLen,flags,valueLen,キー,値のCRC
+        };
+        static_assert(sizeof(SectorHeader) == 16 && sizeof(Record) == 8, "unexpected padding");
+        static constexpr uint32_t DataSize = SectorSize - sizeof(SectorHeader);
+
+        struct Entry
+        {
+            char key[MaxKey + 1];
+            uint32_t addr;
+            uint16_t valueLen;
+        };
+
+        Flash *flash = nullptr;
+        Entry entries[MaxKeys];
+        int numEntries = 0;
+        uint32_t numSectors = 0;
+        uint32_t seqs[MaxSectors];
+        uint32_t erases[MaxSectors];
+        bool blank[MaxSectors];
+        uint32_t head = 0;     // 追記中のセクタ
+        uint32_t writePos = 0; // head内の次の書き込み位置
+        uint32_t nextSeq = 1;
+        uint32_t liveBytes = 0;
+        uint32_t eraseCount = 0; // 起動後の消去回数
+        uint32_t writeBytes = 0; // 起動後の書き込み量
+
+        static uint32_t align(uint32_t n) { return (n + 3) & ~3u; }
+        static uint32_t recordSize(size_t klen, size_t vlen) { return align(sizeof(Record) + klen + vlen); }
+        uint32_t base(uint32_t s) const { return s * SectorSize; }
+
+        Entry *find(const char *key)
+        {
+            for (int i = 0; i < numEntries; i++)
+                if (strcmp(entries[i].key, key) == 0)
+                    return &entries[i];
+            return nullptr;
+        }
+        const Entry *find(const char *key) const { return const_cast<Log *>(this)->find(key); }
+        void drop(Entry *e)
+        {
+            liveBytes -= recordSize(strlen(e->key), e->valueLen);
+            *e = entries[--numEntries];
+        }
+        bool apply(const char *key, uint8_t flags, uint32_t addr, uint16_t vlen)
+        {
+            auto e = find(key);
+            if (flags & Tombstone)
+            {
+                if (e)
+                    drop(e);
+                return true;
+            }
+            if (e)
+                liveBytes -= recordSize(strlen(e->key), e->valueLen);
+            else if (numEntries < MaxKeys)
+            {
+                e = &entries[numEntries++];
+                strcpy(e->key, key);
+            }
+            else
+                return false;
+            e->addr = addr;
+            e->valueLen = vlen;
+            liveBytes += recordSize(strlen(key), vlen);
+            return true;
+        }
+
+        int freeCount() const
+        {
+            int n = 0;
+            for (uint32_t s = 0; s < numSectors; s++)
+                n += seqs[s] == Free;
+            return n;
+        }
+        int oldest() const
+        {
+            int v = -1;
+            for (uint32_t s = 0; s < numSectors; s++)
+                if (seqs[s] != Free && s != head && (v < 0 || seqs[s] < seqs[v]))
+                    v = s;
+            return v;
+        }
+
+        // 消去して、消去回数入りのヘッダを書いておく
+        bool format(uint32_t s)
+        {
+            if (!flash->erase(s))
+                return false;
+            eraseCount++;
+            SectorHeader h;
+            h.magic = Magic;
+            h.erases = ++erases[s];
+            h.crc = crc32(0, &h, 8);
+            seqs[s] = Free;
+            blank[s] = write(base(s), &h, 12);
+            return blank[s];
+        }
+        // headの次の空きセクタへ移る
+        bool advance()
+        {
+            for (uint32_t i = 1; i <= numSectors; i++)
+            {
+                uint32_t s = (head + i) % numSectors;
+                if (seqs[s] != Free)
+                    continue;
+                if (!blank[s] && !format(s))
+                    continue;
+                uint32_t seq = nextSeq++;
+                if (!write(base(s) + 12, &seq, 4))
+                    return false;
+                seqs[s] = seq;
+                blank[s] = false;
+                head = s;
+                writePos = sizeof(SectorHeader);
+                return true;
+            }
+            return false;
+        }
+
+        // レコードを1つ読み、CRCを確かめる。読み終えた(未書き込み・壊れている)ならfalse
+        bool readRecord(uint32_t addr, uint32_t end, Record &r, char *key)
+        {
+            if (addr + sizeof(Record) > end || !flash->read(addr, &r, sizeof(r)))
+                return false;
+            if (r.keyLen == 0 || r.keyLen > MaxKey || r.valueLen > MaxValue ||
+                addr + recordSize(r.keyLen, r.valueLen) > end)
+                return false;
+            if (!flash->read(addr + sizeof(r), key, r.keyLen))
+                return false;
+            key[r.keyLen] = '\0';
+            uint32_t crc = crc32(0, &r, 4);
+            crc = crc32(crc, key, r.keyLen);
+            uint8_t buff[32];
+            uint32_t p = addr + sizeof(r) + r.keyLen;
+            for (uint32_t left = r.valueLen; left > 0;)
+            {
+                uint32_t n = left < sizeof(buff) ? left : sizeof(buff);
+                if (!flash->read(p, buff, n))
+                    return false;
+                crc = crc32(crc, buff, n);
+                p += n;
+                left -= n;
+            }
+            return crc == r.crc;
+        }
+        // セクタを頭から読み、有効なレコードごとにf(addr,record,key)を呼ぶ
+        // 未書き込みか壊れたレコードで止まり、その位置を返す
+        template <typename F>
+        uint32_t scan(uint32_t s, F &&f)
+        {
+            Record r;
+            char key[MaxKey + 1];
+            uint32_t pos = sizeof(SectorHeader);
+            while (pos < SectorSize && readRecord(base(s) + pos, base(s) + SectorSize, r, key))
+            {
+                f(base(s) + pos, r, key);
+                pos += recordSize(r.keyLen, r.valueLen);
+            }
+            return pos;
+        }
+        // posから末尾まで消去されたままか
+        bool isBlank(uint32_t s, uint32_t pos)
+        {
+            uint32_t buff[8];
+            while (pos < SectorSize)
+            {
+                uint32_t n = SectorSize - pos < sizeof(buff) ? SectorSize - pos : sizeof(buff);
+                if (!flash->read(base(s) + pos, buff, n))
+                    return false;
+                for (uint32_t i = 0; i < n / 4; i++)
+                    if (buff[i] != 0xffffffff)
+                        return false;
+                pos += n;
+            }
+            return true;
+        }
+        bool write(uint32_t addr, const void *src, size_t size)
+        {
+            writeBytes += size;
+            return size == 0 || flash->write(addr, src, size);
+        }
+
+        // 足りなければ空きセクタへ移る。空きを1つ残せないときは先に一番古いセクタを回収する
+        bool reserve(uint32_t size, bool compaction)
+        {
+            if (writePos + size <= SectorSize)
+                return true;
+            for (uint32_t i = 0; !compaction && i < numSectors && freeCount() < 2; i++)
+                if (!compactOldest())
+                    break;
+            return advance();
+        }
+        // レコードを写す(回収用)。まとめ書きの印は外し、単独のレコードにする
+        bool copy(uint32_t from, const Record &src, uint32_t &to)
+        {
+            uint32_t size = recordSize(src.keyLen, src.valueLen);
+            if (!reserve(size, true))
+                return false;
+            to = base(head) + writePos;
+            writePos += size;
+            Record r = src;
+            r.flags &= ~Batched;
+            r.crc = crc32(0, &r, 4);
+            uint32_t body = sizeof(Record) + src.keyLen + src.valueLen;
+            uint8_t buff[32];
+            for (uint32_t done = sizeof(Record); done < body;)
+            {
+                uint32_t n = body - done < sizeof(buff) ? body - done : sizeof(buff);
+                if (!flash->read(from + done, buff, n) || !write(to + done, buff, n))
+                    return false;
+                r.crc = crc32(r.crc, buff, n);
+                done += n;
+            }
+            return write(to, &r, sizeof(r));
+        }
+        // 一番古いセクタの生きているレコードをheadへ写して消去する
+        bool compactOldest()
+        {
+            int v = oldest();
+            if (v < 0)
+                return false;
+            bool ok = true;
+            scan(v, [&](uint32_t addr, const Record &r, const char *key) {
+                auto e = find(key);
+                if (!ok || !e || e->addr != addr || (r.flags & (Tombstone | Commit)))
+                    return;
+                uint32_t to = 0;
+                ok = copy(addr, r, to);
+                if (ok)
+                    e->addr = to;
+            });
+            // 写しきれなければ消さずに残す(写した分は新しい方が使われる)
+            return ok && format(v);
+        }
+
+        // 空きを確保してから呼ぶ
+        bool writeRecord(const char *key, uint8_t flags, const void *data, size_t size, uint32_t &addr)
+        {
+            size_t klen = strlen(key);
+            uint32_t rs = recordSize(klen, size);
+            Record r;
+            r.keyLen = klen;
+            r.flags = flags;
+            r.valueLen = size;
+            r.crc = crc32(crc32(crc32(0, &r, 4), key, klen), data, size);
+            addr = base(head) + writePos;
+            static const uint8_t pad[4] = {0xff, 0xff, 0xff, 0xff};
+            // 先頭を最後に書けば、途中で電源が落ちても未書き込みに見えるだけで済む
+            bool ok = write(addr + sizeof(r), key, klen) &&
+                      write(addr + sizeof(r) + klen, data, size) &&
+                      write(addr + sizeof(r) + klen + size, pad, rs - sizeof(r) - klen - size) &&
+                      write(addr, &r, sizeof(r));
+            // 失敗した位置には書き足さない
+            writePos += rs;
+            return ok;
+        }
+        bool append(const char *key, uint8_t flags, const void *data, size_t size)
+        {
+            uint32_t addr;
+            return reserve(recordSize(strlen(key), size), false) &&
+                   writeRecord(key, flags, data, size, addr) &&
+                   apply(key, flags, addr, size);
+        }
+
+    public:
+        // 中身を読み直して索引を作る。有効なセクタが無ければ初期化する
+        bool mount(Flash *f)
+        {
+            flash = f;
+            numEntries = 0;
+            liveBytes = 0;
+            eraseCount = 0;
+            nextSeq = 1;
+            numSectors = flash->sectorCount();
+            if (numSectors > MaxSectors)
+                numSectors = MaxSectors;
+            if (numSectors < 3)
+                return false;
+            int used = 0;
+            for (uint32_t s = 0; s < numSectors; s++)
+            {
+                SectorHeader h;
+                seqs[s] = Free;
+                erases[s] = 0;
+                blank[s] = false;
+                if (!flash->read(base(s), &h, sizeof(h)) || h.magic != Magic || h.crc != crc32(0, &h, 8))
+                    continue;
+                erases[s] = h.erases;
+                seqs[s] = h.seq;
+                if (h.seq == Free)
+                {
+                    blank[s] = isBlank(s, sizeof(h));
+                }
+                else
+                {
+                    used++;
+                    if (h.seq >= nextSeq)
+                        nextSeq = h.seq + 1;
+                }
+            }
+            if (used == 0)
+            {
+                head = numSectors - 1;
+                return advance();
+            }
+            // 古い順に読み直す(同じキーは後のものが勝つ)
+            // まとめ書きはコミット印まで溜め、印が無ければ捨てる
+            struct Pending
+            {
+                char key[MaxKey + 1];
+                uint32_t addr;
+                uint16_t valueLen;
+                uint8_t flags;
+            } pending[MaxBatch];
+            int numPending = 0;
+            uint32_t last = 0;
+            for (int n = 0; n < used; n++)
+            {
+                uint32_t s = 0, best = Free;
+                for (uint32_t i = 0; i < numSectors; i++)
+                    if (seqs[i] != Free && seqs[i] > last && seqs[i] < best)
+                        best = seqs[s = i];
+                last = best;
+                numPending = 0;
+                writePos = scan(s, [&](uint32_t addr, const Record &r, const char *key) {
+                    if (r.flags & Commit)
+                    {
+                        uint16_t n = 0;
+                        flash->read(addr + sizeof(r) + r.keyLen, &n, sizeof(n));
+                        for (int i = 0; n == numPending && n <= MaxBatch && i < n; i++)
+                            apply(pending[i].key, pending[i].flags, pending[i].addr, pending[i].valueLen);
+                        numPending = 0;
+                    }
+                    else if (r.flags & Batched)
+                    {
+                        if (numPending < MaxBatch)
+                        {
+                            auto &p = pending[numPending];
+                            strcpy(p.key, key);
+                            p.addr = addr;
+                            p.valueLen = r.valueLen;
+                            p.flags = r.flags;
+                        }
+                        numPending++;
+                    }
+                    else
+                    {
+                        numPending = 0;
+                        apply(key, r.flags, addr, r.valueLen);
+                    }
+                });
+                head = s;
+            }
+            // 書きかけで途切れていたら、その後ろには書き足さない
+            // (コミット印の無いまとめ書きの後ろも同じ)
+            if (numPending > 0 || !isBlank(head, writePos))
+                writePos = SectorSize;
+            return true;
+        }
+
+        bool put(const char *key, const void *data, size_t size)
+        {
+            size_t klen = strlen(key);
+            if (klen == 0 || klen > MaxKey || size > MaxValue)
+                return false;
+            auto e = find(key);
+            if (!e && numEntries >= MaxKeys)
+                return false;
+            uint32_t live = liveBytes + recordSize(klen, size) - (e ? recordSize(klen, e->valueLen) : 0);
+            if (live > getCapacity())
+                return false;
+            return append(key, 0, data, size);
+        }
+        bool putString(const char *key, const char *str) { return put(key, str, strlen(str)); }
+
+        bool remove(const char *key)
+        {
+            if (!find(key))
+                return true;
+            return append(key, Tombstone, nullptr, 0);
+        }
+
+        // まとめて書き、最後にコミット印を書く。途中で電源が落ちれば全部無かったことになる
+        template <typename B>
+        bool commit(const B &batch)
+        {
+            static_assert(B::Capacity <= MaxBatch, "batch too large");
+            if (batch.count == 0)
+                return true;
+            if (batch.count == 1)
+            {
+                // 1件ならレコード単体で不可分
+                auto &it = batch.items[0];
+                if (it.flags & Tombstone)
+                    return remove(batch.key(it));
+                return put(batch.key(it), batch.value(it), it.valueLen);
+            }
+            uint32_t total = recordSize(1, 2);
+            uint32_t live = liveBytes;
+            int keys = numEntries;
+            for (int i = 0; i < batch.count; i++)
+            {
+                auto &it = batch.items[i];
+                auto e = find(batch.key(it));
+                total += recordSize(it.keyLen, it.valueLen);
+                if (e)
+                    live -= recordSize(it.keyLen, e->valueLen);
+                if (!(it.flags & Tombstone))
+                {
+                    live += recordSize(it.keyLen, it.valueLen);
+                    keys += e ? 0 : 1;
+                }
+                else
+                    keys -= e ? 1 : 0;
+            }
+            // 1セクタに収める(コミット印とレコードを別のセクタに分けない)
+            if (total > DataSize || live > getCapacity() || keys > MaxKeys)
+                return false;
+            if (!reserve(total, false))
+                return false;
+            uint32_t addrs[MaxBatch];
+            for (int i = 0; i < batch.count; i++)
+            {
+                auto &it = batch.items[i];
+                if (!writeRecord(batch.key(it), it.flags | Batched, batch.value(it), it.valueLen, addrs[i]))
+                {
+                    writePos = SectorSize;
+                    return false;
+                }
+            }
+            uint16_t n = batch.count;
+            uint32_t addr;
+            if (!writeRecord("$", Commit, &n, sizeof(n), addr))
+            {
+                writePos = SectorSize;
+                return false;
+            }
+            for (int i = 0; i < batch.count; i++)
+            {
+                auto &it = batch.items[i];
+                apply(batch.key(it), it.flags, addrs[i], it.valueLen);
+            }
+            return true;
+        }
+
+        // 値の長さ(無ければ-1)。buffには入るだけ入れる
+        int get(const char *key, void *buff, size_t size) const
+        {
+            auto e = find(key);
+            if (!e)
+                return -1;
+            size_t n = e->valueLen < size ? e->valueLen : size;
+            if (!flash->read(e->addr + sizeof(Record) + strlen(key), buff, n))
+                return -1;
+            return e->valueLen;
+        }
+        bool getString(const char *key, char *buff, size_t size) const
+        {
+            if (size == 0)
+                return false;
+            int n = get(key, buff, size - 1);
+            if (n < 0)
+                return false;
+            buff[n < int(size - 1) ? n : size - 1] = '\0';
+            return true;
+        }
+        bool contains(const char *key) const { return find(key) != nullptr; }
+
+        // 空きが減ってきたら、前もって一番古いセクタを回収しておく(バックグラウンド用)
+        bool needsCompaction() const { return flash && freeCount() < 2 && oldest() >= 0; }
+        bool compact() { return needsCompaction() && compactOldest(); }
+
+        int getKeyCount() const { return numEntries; }
+        uint32_t getLiveBytes() const { return liveBytes; }
+        // 生きているデータの上限(回収時に写す先を常に残せる量)
+        uint32_t getCapacity() const { return numSectors > 2 ? (numSectors - 2) * DataSize : 0; }
+        uint32_t getEraseCount() const { return eraseCount; }
+        uint32_t getWriteBytes() const { return writeBytes; }
+        uint32_t getSectorErases(uint32_t s) const { return s < numSectors ? erases[s] : 0; }
+        uint32_t getSectorCount() const { return numSectors; }
+    };
+}
@@ -0,0 +1,109 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Worker
+{
+    ///
+    /// ロックフリーの固定長リングバッファ(複数の投入側、取り出し側)
+    /// セルごとの通し番号で空き/使用中を判定する(D.Vyukov方式)
+    /// 満杯/空のときは待たずにfalseを返す
+    ///
+    template <typename T, size_t N>
+    class MpscRing
+    {
+        static_assert(N >= 2 && (N & (N - 1)) == 0, "ring size must be a power of 2");
+        static constexpr uint32_t Mask = N - 1;
+
+        struct Cell
+        {
+            uint32_t seq;
+            T data;
+        };
+        Cell cells[N];
+        uint32_t head = 0; // 次に書く位置
+        uint32_t tail = 0; // 次に読む位置
+        uint32_t highWater = 0;
+        uint32_t rejects = 0;
+
+        void updateHighWater(uint32_t depth)
+        {
+            uint32_t hw = __atomic_load_n(&highWater, __ATOMIC_RELAXED);
+            while (depth > hw &&
+                   !__atomic_compare_exchange_n(&highWater, &hw, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+        }
+
+    public:
+        MpscRing()
+        {
+            for (uint32_t i = 0; i < N; i++)
+                cells[i].seq = i;
+        }
+
+        bool tryPush(const T &v)
+        {
+            uint32_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+            Cell *cell;
+            while (true)
+            {
+                cell = &cells[pos & Mask];
+                uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+                int32_t diff = int32_t(seq - pos);
+                if (diff == 0)
+                {
+                    if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                        break;
+                }
+                else if (diff < 0)
+                {
+                    __atomic_fetch_add(&rejects, 1, __ATOMIC_RELAXED);
+                    return false; // 満杯
+                }
+                else
+                    pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+            }
+            cell->data = v;
+            __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+            updateHighWater(pos + 1 - __atomic_load_n(&tail, __ATOMIC_RELAXED));
+            return true;
+        }
+
+        bool tryPop(T &v)
+        {
+            uint32_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+            Cell *cell;
+            while (true)
+            {
+                cell = &cells[pos & Mask];
+                uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+                int32_t diff = int32_t(seq - (pos + 1));
+                if (diff == 0)
+                {
+                    if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                        break;
+                }
+                else if (diff < 0)
+                    return false; // 空
+                else
+                    pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+            }
+            v = cell->data;
+            __atomic_store_n(&cell->seq, pos + N, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        // 目安(他のスレッドが操作中なら前後する)
+        size_t size() const
+        {
+            return __atomic_load_n(&head, __ATOMIC_RELAXED) - __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+        uint32_t getHighWater() const { return __atomic_load_n(&highWater, __ATOMIC_RELAXED); }
+        uint32_t getRejects() const { return __atomic_load_n(&rejects, __ATOMIC_RELAXED); }
+    };
+}
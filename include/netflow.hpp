@@ -0,0 +1,301 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <async.hpp>
+#include <httpstream.hpp>
+
+namespace Net
+{
+    ///
+    /// 接続情報(ジョブやフローに値で渡す)
+    ///
+    struct Credentials
+    {
+        char ssid[32];
+        char password[32];
+    };
+
+    ///
+    /// 無線・時刻・HTTPの窓口
+    /// 実機はWiFiLink、ホストのテストでは模擬実装に差し替える
+    /// 待ちの発生する操作は開始と状態確認に分け、どれも呼び出し側を止めない
+    /// (httpStartだけは新しく接続するときに止まる)
+    ///
+    class Link
+    {
+    public:
+        static constexpr int ScanRunning = -1;
+        static constexpr int ScanFailed = -2;
+
+        virtual ~Link() = default;
+        virtual uint32_t now() = 0;
+
+        // 接続の参照を1つ増やす(同じ接続先へ接続済みなら何もしない)
+        // 他の接続先で使われている間は切り替えずにfalse(参照は増えない)
+        virtual bool connect(const Credentials &cred) = 0;
+        virtual bool isConnected() = 0;
+        // 参照を1つ減らし、0になったら切断する
+        virtual void release() = 0;
+
+        // スキャンは同時に1つだけ。startScan()が通ったownerがscanDelete()するまで結果を持つ
+        // 他のownerが持っていればfalse(待つ側はやり直す)
+        // channel: 0なら全チャンネル。完了するとイベントで起こす
+        virtual bool startScan(const void *owner, uint8_t channel = 0) = 0;
+        // ScanRunning/ScanFailed、または見つかった数(結果を読むのは持っているownerだけ)
+        virtual int scanComplete() = 0;
+        virtual void scanSSID(int i, char *buff, size_t size) = 0;
+        virtual int scanRSSI(int i) = 0;
+        virtual int scanChannel(int i) = 0;
+        // ownerが持っていれば結果を捨てて手放す(持っていなければ何もしない)
+        virtual void scanDelete(const void *owner) = 0;
+
+        virtual void startNtp(const char *server, long tz) = 0;
+        virtual bool getTime(struct tm &t) = 0;
+
+        // POSTを送る(同時に1つだけ)。失敗したら負のHttpResult
+        // 応答はhttpPoll()で受け取り、本文は届いた分ずつsinkへ流す
+        virtual int httpStart(const char *url, const char *type, const char *body, HttpSink *sink) = 0;
+        // HttpRunning、ステータスコード、または負のHttpResult
+        virtual int httpPoll() = 0;
+        // ここまでに受け取ったバイト数(待ち時間を数え直すのに使う)
+        virtual uint32_t httpReceived() = 0;
+        // 受け取りの途中でやめる
+        virtual void httpAbort() = 0;
+    };
+
+    ///
+    /// SSIDのスキャン(失敗したらやり直す)
+    /// Doneで終わったら結果を持ったままなので、読み終えたらdiscard()する
+    ///
+    class ScanFlow : public Async::Task
+    {
+        Link &link;
+        int retry = 0;
+        bool owning = false;
+
+    protected:
+        void onCancel() override { discard(); }
+
+    public:
+        static constexpr uint32_t Timeout = 10 * 1000;
+        static constexpr int MaxRetry = 3;
+        uint8_t channel = 0; // 0なら全チャンネル
+        int count = 0;
+
+        explicit ScanFlow(Link &l) : link(l) {}
+
+        Async::Status step(uint32_t now) override
+        {
+            ASYNC_BEGIN();
+            for (retry = 0; retry < MaxRetry; retry++)
+            {
+                // 他(接続前のスキャンなど)が持っていれば手放すまで待つ
+                ASYNC_AWAIT(owning = link.startScan(this, channel), Timeout);
+                if (timedOut)
+                    ASYNC_RETURN(Async::Status::TimedOut);
+                ASYNC_AWAIT(link.scanComplete() != Link::ScanRunning, Timeout);
+                count = link.scanComplete();
+                if (!timedOut && count >= 0)
+                    ASYNC_RETURN(Async::Status::Done);
+                discard();
+            }
+            ASYNC_RETURN(timedOut ? Async::Status::TimedOut : Async::Status::Failed);
+            ASYNC_END();
+        }
+        void discard()
+        {
+            if (owning)
+                link.scanDelete(this);
+            owning = false;
+        }
+    };
+
+    ///
+    /// つなぐ手順(フローの中から1ステップずつ回す)
+    /// Doneで終わったら接続の参照を1つ持っているので、使い終えたらrelease()する
+    ///
+    class Connector : public Async::Task
+    {
+    public:
+        virtual void release() = 0;
+    };
+
+    ///
+    /// 決まった接続先へつなぐ
+    ///
+    class ConnectFlow : public Connector
+    {
+        Link &link;
+        bool holding = false;
+
+    protected:
+        void onCancel() override { release(); }
+
+    public:
+        static constexpr uint32_t ConnectTimeout = 15 * 1000;
+        Credentials cred{};
+
+        explicit ConnectFlow(Link &l) : link(l) {}
+
+        Async::Status step(uint32_t now) override
+        {
+            ASYNC_BEGIN();
+            if (cred.ssid[0] == '\0')
+                ASYNC_RETURN(Async::Status::Failed);
+            // 他の接続先で使われていれば手放されるまで待つ
+            ASYNC_AWAIT(holding = link.connect(cred), ConnectTimeout);
+            if (!timedOut)
+                ASYNC_AWAIT(link.isConnected(), ConnectTimeout);
+            if (timedOut)
+            {
+                release();
+                ASYNC_RETURN(Async::Status::TimedOut);
+            }
+            ASYNC_END();
+        }
+        void release() override
+        {
+            if (holding)
+                link.release();
+            holding = false;
+        }
+    };
+
+    ///
+    /// Connectorを使うフローの共通部分
+    ///
+    class ConnectedFlow : public Async::Task
+    {
+    protected:
+        Link &link;
+        Async::Status connectStatus = Async::Status::Running;
+
+        void onCancel() override
+        {
+            if (!connector)
+                return;
+            if (connector->isRunning())
+            {
+                connector->cancel();
+                connector->advance(link.now());
+            }
+            connector->release();
+        }
+
+    public:
+        Connector *connector = nullptr; // 投入前に設定する
+
+        explicit ConnectedFlow(Link &l) : link(l) {}
+    };
+
+// Connectorを回してつなぐ(失敗したらそのステータスで終える)
+#define NET_CONNECT()                                                                      \
+    do                                                                                     \
+    {                                                                                      \
+        if (!connector || !connector->prepare())                                           \
+            ASYNC_RETURN(Async::Status::Failed);                                           \
+        while ((connectStatus = connector->advance(now)) == Async::Status::Running)        \
+            ASYNC_YIELD();                                                                 \
+        if (connectStatus != Async::Status::Done)                                          \
+            ASYNC_RETURN(connectStatus);                                                   \
+    } while (0)
+
+    ///
+    /// 接続してNTPで時刻を取る(結果はonFinishでtimeを使う)
+    ///
+    class TimeSyncFlow : public ConnectedFlow
+    {
+    public:
+        static constexpr uint32_t NtpTimeout = 10 * 1000;
+        const char *server = "";
+        long timeZone = 0;
+        struct tm time = {};
+
+        explicit TimeSyncFlow(Link &l) : ConnectedFlow(l) {}
+
+        Async::Status step(uint32_t now) override
+        {
+            ASYNC_BEGIN();
+            NET_CONNECT();
+            link.startNtp(server, timeZone);
+            ASYNC_AWAIT(link.getTime(time), NtpTimeout);
+            connector->release();
+            if (timedOut)
+                ASYNC_RETURN(Async::Status::TimedOut);
+            ASYNC_END();
+        }
+    };
+
+    ///
+    /// 接続してPOSTする
+    /// 応答の本文は届いた分ずつonBody()に渡る(既定ではresponseに入るだけ入れる)
+    ///
+    class HttpPostFlow : public ConnectedFlow, public HttpSink
+    {
+        bool requesting = false;
+        uint32_t received = 0;
+        size_t responseLen = 0;
+
+    protected:
+        void onCancel() override
+        {
+            if (requesting)
+                link.httpAbort();
+            requesting = false;
+            ConnectedFlow::onCancel();
+        }
+
+    public:
+        static constexpr uint32_t ResponseTimeout = 5 * 1000; // 何も届かないまま待つ時間
+        const char *url = "";
+        const char *contentType = "application/json";
+        const char *body = "";
+        int code = 0;
+        char response[256];
+
+        explicit HttpPostFlow(Link &l) : ConnectedFlow(l) {}
+
+        bool onBody(const uint8_t *data, size_t size) override
+        {
+            size_t n = sizeof(response) - 1 - responseLen;
+            if (n > size)
+                n = size;
+            memcpy(response + responseLen, data, n);
+            responseLen += n;
+            response[responseLen] = '\0';
+            return true;
+        }
+
+        Async::Status step(uint32_t now) override
+        {
+            ASYNC_BEGIN();
+            NET_CONNECT();
+            responseLen = 0;
+            response[0] = '\0';
+            code = link.httpStart(url, contentType, body, this);
+            requesting = code == HttpRunning;
+            // 届いている分ずつ読む(届くたびに待ち時間は数え直す)
+            while (requesting)
+            {
+                received = link.httpReceived();
+                ASYNC_AWAIT((code = link.httpPoll()) != HttpRunning || link.httpReceived() != received, ResponseTimeout);
+                requesting = !timedOut && code == HttpRunning;
+                if (timedOut)
+                    link.httpAbort();
+            }
+            connector->release();
+            if (code == HttpRunning)
+                ASYNC_RETURN(Async::Status::TimedOut);
+            if (code <= 0)
+                ASYNC_RETURN(Async::Status::Failed);
+            ASYNC_END();
+        }
+    };
+}
@@ -0,0 +1,323 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <Arduino.h>
+#include <netflow.hpp>
+
+namespace Net
+{
+    ///
+    /// 保存する接続先(設定にそのまま入れる)
+    ///
+    struct Network
+    {
+        Credentials cred;
+        uint16_t attempts;
+        uint16_t successes;
+    };
+
+    ///
+    /// 登録済みの接続先と、直近のスキャン結果
+    /// 電波の強さと過去の成功率で並べ、良さそうな順に試す
+    /// UIスレッドとワーカーの両方から触るので、中身はコピーで受け渡す
+    ///
+    class Networks
+    {
+    public:
+        static constexpr int MaxNetworks = 4;
+        static constexpr int MaxScan = 16;
+        static constexpr uint32_t ScanTTL = 60 * 1000; // これより新しいスキャン結果は使い回す
+
+    private:
+        struct Seen
+        {
+            char ssid[32];
+            int8_t rssi;
+        };
+
+        portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+        Network list[MaxNetworks]; // 最近使った順
+        int count = 0;
+        Seen seen[MaxScan];
+        int numSeen = 0;
+        uint32_t scanTime = 0;
+        bool scanValid = false;
+        bool changed = false;
+
+        int find(const char *ssid) const
+        {
+            for (int i = 0; i < count; i++)
+                if (strcmp(list[i].cred.ssid, ssid) == 0)
+                    return i;
+            return -1;
+        }
+        // i番目を先頭へ
+        void promote(int i)
+        {
+            Network n = list[i];
+            for (; i > 0; i--)
+                list[i] = list[i - 1];
+            list[0] = n;
+        }
+        // 見えていなければ-128
+        int rssiOf(const char *ssid) const
+        {
+            for (int i = 0; i < numSeen; i++)
+                if (strcmp(seen[i].ssid, ssid) == 0)
+                    return seen[i].rssi;
+            return -128;
+        }
+        // 成功率は1回目の失敗で0にならないよう(成功+1)/(試行+2)で見る。満点で20dB分の上乗せ
+        static int score(const Network &n, int rssi) { return rssi + 20 * (n.successes + 1) / (n.attempts + 2); }
+
+    public:
+        // 保存していたものを戻す
+        template <typename Array>
+        void load(const Array &a)
+        {
+            portENTER_CRITICAL(&mux);
+            count = 0;
+            for (const auto &n : a)
+                if (count < MaxNetworks && n.cred.ssid[0] != '\0')
+                    list[count++] = n;
+            changed = false;
+            portEXIT_CRITICAL(&mux);
+        }
+        // 変わっていればaへ写してtrue(呼び出し側で保存する)
+        template <typename Array>
+        bool take(Array &a)
+        {
+            portENTER_CRITICAL(&mux);
+            bool c = changed;
+            if (c)
+            {
+                a.clear();
+                for (int i = 0; i < count; i++)
+                    a.push(list[i]);
+            }
+            changed = false;
+            portEXIT_CRITICAL(&mux);
+            return c;
+        }
+
+        // 追加・パスワード変更。先頭に置き、溢れたら一番使っていないものを捨てる
+        void add(const Credentials &cred)
+        {
+            portENTER_CRITICAL(&mux);
+            int i = find(cred.ssid);
+            if (i < 0)
+            {
+                i = count < MaxNetworks ? count++ : MaxNetworks - 1;
+                list[i] = Network{};
+            }
+            list[i].cred = cred;
+            promote(i);
+            changed = true;
+            portEXIT_CRITICAL(&mux);
+        }
+        void remove(const char *ssid)
+        {
+            portENTER_CRITICAL(&mux);
+            int i = find(ssid);
+            if (i >= 0)
+            {
+                for (; i < count - 1; i++)
+                    list[i] = list[i + 1];
+                count--;
+                changed = true;
+            }
+            portEXIT_CRITICAL(&mux);
+        }
+        bool get(const char *ssid, Credentials &cred)
+        {
+            portENTER_CRITICAL(&mux);
+            int i = find(ssid);
+            if (i >= 0)
+                cred = list[i].cred;
+            portEXIT_CRITICAL(&mux);
+            return i >= 0;
+        }
+        // 最近使ったもの
+        bool latest(Credentials &cred)
+        {
+            portENTER_CRITICAL(&mux);
+            bool ok = count > 0;
+            if (ok)
+                cred = list[0].cred;
+            portEXIT_CRITICAL(&mux);
+            return ok;
+        }
+        int size() const { return count; }
+
+        // スキャン結果を覚える(結果を持っている側がlink.scanDelete()の前に呼ぶ)
+        void updateScan(Link &link, int found, uint32_t now)
+        {
+            Seen buff[MaxScan];
+            int n = 0;
+            for (int i = 0; i < found && n < MaxScan; i++)
+            {
+                link.scanSSID(i, buff[n].ssid, sizeof(buff[n].ssid));
+                if (buff[n].ssid[0] == '\0')
+                    continue;
+                buff[n++].rssi = constrain(link.scanRSSI(i), -127, 0);
+            }
+            portENTER_CRITICAL(&mux);
+            memcpy(seen, buff, sizeof(Seen) * n);
+            numSeen = n;
+            scanTime = now;
+            scanValid = true;
+            portEXIT_CRITICAL(&mux);
+        }
+        bool isScanFresh(uint32_t now)
+        {
+            portENTER_CRITICAL(&mux);
+            bool fresh = scanValid && now - scanTime < ScanTTL;
+            portEXIT_CRITICAL(&mux);
+            return fresh;
+        }
+
+        // 試す順に並べた候補を返す
+        // 新しいスキャン結果に見えていれば、見えているものだけを電波の強さ+成功率で
+        // そうでなければ(隠しSSIDなど)、またはuseScanがfalseなら全部を最近使った順で
+        int rank(Network *out, int max, uint32_t now, bool useScan = true)
+        {
+            portENTER_CRITICAL(&mux);
+            bool fresh = false;
+            if (useScan && scanValid && now - scanTime < ScanTTL)
+                for (int i = 0; i < count && !fresh; i++)
+                    fresh = rssiOf(list[i].cred.ssid) != -128;
+            int n = 0, scores[MaxNetworks];
+            for (int i = 0; i < count && n < max; i++)
+            {
+                int rssi = fresh ? rssiOf(list[i].cred.ssid) : 0;
+                if (rssi == -128)
+                    continue;
+                int s = fresh ? score(list[i], rssi) : -i;
+                // 挿入ソート(高い順)
+                int j = n++;
+                for (; j > 0 && scores[j - 1] < s; j--)
+                {
+                    out[j] = out[j - 1];
+                    scores[j] = scores[j - 1];
+                }
+                out[j] = list[i];
+                scores[j] = s;
+            }
+            portEXIT_CRITICAL(&mux);
+            return n;
+        }
+
+        // 試した結果。つながったものは先頭へ
+        void record(const char *ssid, bool ok)
+        {
+            portENTER_CRITICAL(&mux);
+            int i = find(ssid);
+            if (i >= 0)
+            {
+                auto &n = list[i];
+                // 古い結果の重みを下げる
+                if (n.attempts >= 1000)
+                {
+                    n.attempts /= 2;
+                    n.successes /= 2;
+                }
+                n.attempts++;
+                n.successes += ok ? 1 : 0;
+                if (ok)
+                    promote(i);
+                changed = true;
+            }
+            portEXIT_CRITICAL(&mux);
+        }
+    };
+
+    ///
+    /// 登録済みの接続先から選んでつなぐ
+    /// スキャン結果が古ければ先にスキャンし、候補を順に試す
+    ///
+    class JoinFlow : public Connector
+    {
+        Link &link;
+        Networks &networks;
+        Network candidates[Networks::MaxNetworks];
+        int numCandidates = 0;
+        int index = 0;
+        uint32_t start = 0;
+        bool holding = false;
+        bool warm = false;
+        bool scanning = false; // スキャン結果を持っている
+
+    protected:
+        void onCancel() override
+        {
+            release();
+            if (scanning)
+                link.scanDelete(this);
+            scanning = false;
+        }
+
+    public:
+        static constexpr uint32_t ScanTimeout = 10 * 1000;
+        static constexpr uint32_t ConnectTimeout = 10 * 1000;
+        // 結果
+        Credentials joined{};
+        uint32_t time = 0; // 開始からつながるまで(ms)
+        bool scanned = false;
+
+        JoinFlow(Link &l, Networks &n) : link(l), networks(n) {}
+
+        Async::Status step(uint32_t now) override
+        {
+            ASYNC_BEGIN();
+            start = now;
+            scanned = false;
+            holding = false;
+            // つながったままならスキャンせず最近使った順に試す(同じ先なら待たずに済む)
+            warm = link.isConnected();
+            if (!warm && !networks.isScanFresh(now))
+            {
+                // 他(画面のリストなど)がスキャン中なら終わるのを待つ。全チャンネルならその結果で足りる
+                ASYNC_AWAIT(networks.isScanFresh(now) || (scanning = link.startScan(this)), ScanTimeout);
+                if (scanning)
+                {
+                    ASYNC_AWAIT(link.scanComplete() != Link::ScanRunning, ScanTimeout);
+                    if (!timedOut && link.scanComplete() >= 0)
+                    {
+                        networks.updateScan(link, link.scanComplete(), now);
+                        scanned = true;
+                    }
+                    link.scanDelete(this);
+                    scanning = false;
+                }
+            }
+            numCandidates = networks.rank(candidates, Networks::MaxNetworks, now, !warm);
+            for (index = 0; index < numCandidates; index++)
+            {
+                // 他の接続先で使われている間は切り替えられない(その先が候補にあればそちらを使う)
+                if (!link.connect(candidates[index].cred))
+                    continue;
+                holding = true;
+                ASYNC_AWAIT(link.isConnected(), ConnectTimeout);
+                networks.record(candidates[index].cred.ssid, !timedOut);
+                if (!timedOut)
+                {
+                    joined = candidates[index].cred;
+                    time = now - start;
+                    ASYNC_RETURN(Async::Status::Done);
+                }
+                release();
+            }
+            ASYNC_RETURN(numCandidates > 0 ? Async::Status::TimedOut : Async::Status::Failed);
+            ASYNC_END();
+        }
+        void release() override
+        {
+            if (holding)
+                link.release();
+            holding = false;
+        }
+    };
+}
@@ -0,0 +1,42 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+
+namespace Store
+{
+    ///
+    /// パーティションテーブル上のデータ領域(Logのフラッシュ実装)
+    ///
+    class PartitionFlash
+    {
+        const esp_partition_t *part = nullptr;
+
+    public:
+        static constexpr uint32_t SectorSize = 4096;
+
+        bool begin(const char *label)
+        {
+            part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+            return part != nullptr;
+        }
+
+        uint32_t sectorCount() const { return part ? part->size / SectorSize : 0; }
+        bool read(uint32_t addr, void *dst, size_t size)
+        {
+            return esp_partition_read(part, addr, dst, size) == ESP_OK;
+        }
+        bool write(uint32_t addr, const void *src, size_t size)
+        {
+            return esp_partition_write(part, addr, src, size) == ESP_OK;
+        }
+        bool erase(uint32_t sector)
+        {
+            return esp_partition_erase_range(part, sector * SectorSize, SectorSize) == ESP_OK;
+        }
+    };
+}
@@ -0,0 +1,109 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+//
+// フレームプロファイラ
+// ENABLE_PROFILER 未定義時はマクロが空になり、計測コードは一切残らない
+//
+#ifdef ENABLE_PROFILER
+
+#include <Arduino.h>
+#include <histogram.hpp>
+#include <render.hpp>
+
+namespace Profile
+{
+    enum Phase : uint8_t
+    {
+        Frame,
+        Touch,
+        TouchCheck,
+        UpdateImage,
+        UpdateTime,
+        DrawWidgets,
+        WidgetDraw,
+        DrawImage,
+        NumPhase,
+    };
+
+    //
+    inline Histogram *histograms()
+    {
+        static Histogram hist[NumPhase];
+        return hist;
+    }
+    inline uint32_t &cpuMhz()
+    {
+        static uint32_t mhz = 240;
+        return mhz;
+    }
+    // クロック変更時に呼ぶ(サイクル数→時間の換算用)
+    inline void setCpuMhz(uint32_t mhz) { cpuMhz() = mhz; }
+
+    inline void record(Phase ph, uint32_t cycles)
+    {
+        histograms()[ph].record((cycles << 4) / cpuMhz());
+    }
+
+    ///
+    /// スコープ計測
+    ///
+    class Scope
+    {
+        Phase phase;
+        uint32_t start;
+
+    public:
+        Scope(Phase ph) : phase(ph), start(ESP.getCycleCount()) {}
+        ~Scope() { record(phase, ESP.getCycleCount() - start); }
+    };
+
+    ///
+    /// オーバーレイ
+    ///
+    class Overlay
+    {
+        static constexpr int LineH = 8;
+        uint32_t lastDraw = 0;
+
+    public:
+        static constexpr int Width = 126;
+        static constexpr int Height = LineH * (NumPhase + 1);
+
+        bool due() const { return millis() - lastDraw >= 1000; }
+
+        // 6x8フォントで描画する。呼び出し側でフォントを戻すこと
+        void draw(UI::Painter *gfx, int x, int y)
+        {
+            static const char *names[NumPhase] = {
+                "frame", "touch", "tchk", "image", "time", "widgets", "wdraw", "imgdraw"};
+            char buff[32];
+            lastDraw = millis();
+            gfx->setFont(&fonts::Font0);
+            gfx->setTextColor(TFT_CYAN, TFT_BLACK);
+            gfx->fillRect(x, y, Width, Height, TFT_BLACK);
+            gfx->drawString("phase    p50   p99us", x, y);
+            for (int i = 0; i < NumPhase; i++)
+            {
+                const auto &h = histograms()[i];
+                auto p50 = h.percentile(50);
+                auto p99 = h.percentile(99);
+                snprintf(buff, sizeof(buff), "%-7s%6u%6u", names[i], p50 >> 4, p99 >> 4);
+                gfx->drawString(buff, x, y + LineH * (i + 1));
+            }
+        }
+    };
+}
+
+#define PROFILE_CAT2(a, b) a##b
+#define PROFILE_CAT(a, b) PROFILE_CAT2(a, b)
+#define PROFILE_SCOPE(ph) Profile::Scope PROFILE_CAT(profScope, __LINE__)(Profile::ph)
+
+#else
+
+#define PROFILE_SCOPE(ph)
+
+#endif
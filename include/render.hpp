@@ -0,0 +1,517 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <Arduino.h>
+#include <LovyanGFX.hpp>
+#include <trace.hpp>
+#include <glyphcache.hpp>
+
+namespace UI
+{
+    ///
+    /// 描画インターフェース
+    /// 即時モードではLGFXにそのまま流し、描画タスクモードではコマンドバッファに積んで
+    /// 別コアの描画タスクがSPI転送を行う(入力処理が描画待ちで遅れない)
+    /// LCDとSDは同じSPIバスなので、SDを触る側はBusLockで転送と排他にする
+    ///
+    class Painter
+    {
+    public:
+        struct Stats
+        {
+            uint32_t frames = 0;
+            uint32_t stalls = 0;       // バッファ溢れで描画タスク待ちになった回数
+            uint32_t latencyCount = 0; // タッチ→転送完了
+            uint32_t latencySum = 0;
+            uint32_t latencyMax = 0;
+        };
+
+    private:
+        enum class Op : uint8_t
+        {
+            FillRect,
+            DrawRect,
+            FillRoundRect,
+            DrawRoundRect,
+            DrawString,
+            DrawChar,
+            TextColor,
+            TextColorBG,
+            Font,
+            PushImage,
+            PushImageRef,
+            ReadRect,
+            PushSprite,
+        };
+        struct Cmd
+        {
+            Op op;
+            uint8_t pad;
+            uint16_t len; // 後続データのバイト数
+            int16_t x, y, w, h, r;
+            int32_t c0, c1;
+            const void *ptr;
+        };
+        struct Buffer
+        {
+            uint8_t *data = nullptr;
+            size_t used = 0;
+            uint32_t stamp = 0;
+        };
+        static constexpr size_t BufferSize = 8 * 1024;
+        static constexpr uint16_t stackSize = 4096;
+
+        LGFX *gfx = nullptr;
+        bool deferred = false;
+        Buffer buffers[2];
+        Buffer *back = &buffers[0];
+        Buffer *front = &buffers[1];
+        bool renderBusy = false;
+        TaskHandle_t renderTask = nullptr;
+        SemaphoreHandle_t bus = nullptr;
+        uint32_t touchStamp = 0;
+        Stats stats; // 描画タスクと両方から書くのでアトミック操作で更新する
+
+        // 文字描画の状態(描画する側のスレッドで管理)
+        GlyphCache *glyphs = nullptr;
+        const lgfx::IFont *curFont = nullptr;
+        int textColor = TFT_WHITE;
+        bool textBG = false;
+
+        void applyTextColor(int fg)
+        {
+            textColor = fg;
+            textBG = false;
+            gfx->setTextColor(fg);
+        }
+        void applyTextColor(int fg, int bg)
+        {
+            textColor = fg;
+            textBG = true;
+            gfx->setTextColor(fg, bg);
+        }
+        void applyFont(const lgfx::IFont *font)
+        {
+            curFont = font;
+            gfx->setFont(font);
+        }
+        void applyString(const char *str, int x, int y)
+        {
+            if (glyphs && !textBG && glyphs->handles(curFont))
+                glyphs->drawString(gfx, str, x, y, textColor);
+            else
+                gfx->drawString(str, x, y);
+        }
+
+        static void job(void *arg)
+        {
+            Painter *self = static_cast<Painter *>(arg);
+            self->renderLoop();
+        }
+        void renderLoop()
+        {
+            while (true)
+            {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                {
+                    TRACE_SCOPE("render");
+                    lockBus();
+                    gfx->startWrite();
+                    execute(*front);
+                    gfx->endWrite();
+                    unlockBus();
+                }
+                finishFrame(front->stamp);
+                __atomic_store_n(&renderBusy, false, __ATOMIC_RELEASE);
+            }
+        }
+        void finishFrame(uint32_t stamp)
+        {
+            __atomic_fetch_add(&stats.frames, 1, __ATOMIC_RELAXED);
+            if (stamp)
+            {
+                uint32_t lt = micros() - stamp;
+                __atomic_fetch_add(&stats.latencyCount, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&stats.latencySum, lt, __ATOMIC_RELAXED);
+                if (lt > __atomic_load_n(&stats.latencyMax, __ATOMIC_RELAXED))
+                    __atomic_store_n(&stats.latencyMax, lt, __ATOMIC_RELAXED);
+            }
+        }
+        void lockBus()
+        {
+            if (bus)
+                xSemaphoreTake(bus, portMAX_DELAY);
+        }
+        void unlockBus()
+        {
+            if (bus)
+                xSemaphoreGive(bus);
+        }
+
+        //
+        void execute(const Buffer &buf)
+        {
+            size_t p = 0;
+            while (p < buf.used)
+            {
+                const auto &c = *reinterpret_cast<const Cmd *>(buf.data + p);
+                const auto *payload = buf.data + p + sizeof(Cmd);
+                switch (c.op)
+                {
+                case Op::FillRect:
+                    gfx->fillRect(c.x, c.y, c.w, c.h, c.c0);
+                    break;
+                case Op::DrawRect:
+                    gfx->drawRect(c.x, c.y, c.w, c.h, c.c0);
+                    break;
+                case Op::FillRoundRect:
+                    gfx->fillRoundRect(c.x, c.y, c.w, c.h, c.r, c.c0);
+                    break;
+                case Op::DrawRoundRect:
+                    gfx->drawRoundRect(c.x, c.y, c.w, c.h, c.r, c.c0);
+                    break;
+                case Op::DrawString:
+                    applyString(reinterpret_cast<const char *>(payload), c.x, c.y);
+                    break;
+                case Op::DrawChar:
+                    gfx->drawChar(c.c0, c.x, c.y);
+                    break;
+                case Op::TextColor:
+                    applyTextColor(c.c0);
+                    break;
+                case Op::TextColorBG:
+                    applyTextColor(c.c0, c.c1);
+                    break;
+                case Op::Font:
+                    applyFont(static_cast<const lgfx::IFont *>(c.ptr));
+                    break;
+                case Op::PushImage:
+                    gfx->pushImage(c.x, c.y, c.w, c.h, reinterpret_cast<const lgfx::rgb565_t *>(payload));
+                    break;
+                case Op::PushImageRef:
+                    gfx->pushImage(c.x, c.y, c.w, c.h, static_cast<const lgfx::rgb565_t *>(c.ptr));
+                    break;
+                case Op::PushSprite:
+                    static_cast<LGFX_Sprite *>(const_cast<void *>(c.ptr))->pushSprite(gfx, c.x, c.y);
+                    break;
+                case Op::ReadRect:
+                    gfx->readRect(c.x, c.y, c.w, c.h, static_cast<lgfx::rgb565_t *>(const_cast<void *>(c.ptr)));
+                    break;
+                }
+                p += sizeof(Cmd) + ((c.len + 3) & ~3);
+            }
+        }
+
+        // 描画タスクが空いていればバッファを渡す
+        bool kick()
+        {
+            if (__atomic_load_n(&renderBusy, __ATOMIC_ACQUIRE))
+                return false;
+            std::swap(front, back);
+            front->stamp = touchStamp;
+            touchStamp = 0;
+            back->used = 0;
+            __atomic_store_n(&renderBusy, true, __ATOMIC_RELEASE);
+            xTaskNotifyGive(renderTask);
+            return true;
+        }
+        // 積んだコマンドを描画タスクへ渡し、描き終わるまで待つ
+        void drain()
+        {
+            if (back->used > 0)
+                while (!kick())
+                    vTaskDelay(1);
+            while (__atomic_load_n(&renderBusy, __ATOMIC_ACQUIRE))
+                vTaskDelay(1);
+        }
+        Cmd *alloc(Op op, size_t len)
+        {
+            size_t sz = sizeof(Cmd) + ((len + 3) & ~3);
+            if (sz > BufferSize)
+                return nullptr;
+            if (back->used + sz > BufferSize)
+            {
+                // 溢れる場合のみ描画タスクの完了を待つ
+                __atomic_fetch_add(&stats.stalls, 1, __ATOMIC_RELAXED);
+                TRACE_SCOPE("renderStall");
+                while (!kick())
+                    vTaskDelay(1);
+            }
+            auto *c = reinterpret_cast<Cmd *>(back->data + back->used);
+            back->used += sz;
+            c->op = op;
+            c->len = len;
+            return c;
+        }
+        void record(Op op, int x, int y, int w, int h, int r, int c0, int c1 = 0)
+        {
+            if (auto *c = alloc(op, 0))
+            {
+                c->x = x;
+                c->y = y;
+                c->w = w;
+                c->h = h;
+                c->r = r;
+                c->c0 = c0;
+                c->c1 = c1;
+            }
+        }
+
+    public:
+        ///
+        /// SPIバスの占有(SDの読み書きを描画の転送と重ねない)
+        /// 描画タスクモードでは転送中のフレームが終わるまで待つ
+        ///
+        class BusLock
+        {
+            Painter &painter;
+
+        public:
+            explicit BusLock(Painter &p) : painter(p) { painter.lockBus(); }
+            ~BusLock() { painter.unlockBus(); }
+            // 長く占有するときに一度描画へ譲る
+            void yield()
+            {
+                painter.unlockBus();
+                painter.lockBus();
+            }
+        };
+
+        void init(LGFX *g, const lgfx::IFont *font)
+        {
+            gfx = g;
+            bus = xSemaphoreCreateMutex();
+            applyFont(font);
+        }
+        // 開始前(描画タスク起動前)に設定すること
+        void setGlyphCache(GlyphCache *gc) { glyphs = gc; }
+        // 描画タスクモードに切り替える(coreは入力処理と別のコアを指定)
+        void startTask(int core = 0)
+        {
+            for (auto &b : buffers)
+                b.data = static_cast<uint8_t *>(heap_caps_malloc(BufferSize, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+            // 確保できなければ直接描画のまま
+            if (!buffers[0].data || !buffers[1].data ||
+                xTaskCreatePinnedToCore(job, "Render", stackSize, this, 2, &renderTask, core) != pdPASS)
+            {
+                Serial.println("render: task mode unavailable, drawing directly");
+                for (auto &b : buffers)
+                {
+                    heap_caps_free(b.data);
+                    b.data = nullptr;
+                }
+                renderTask = nullptr;
+                return;
+            }
+            deferred = true;
+        }
+        bool isDeferred() const { return deferred; }
+        Stats getStats() const
+        {
+            Stats s;
+            s.frames = __atomic_load_n(&stats.frames, __ATOMIC_RELAXED);
+            s.stalls = __atomic_load_n(&stats.stalls, __ATOMIC_RELAXED);
+            s.latencyCount = __atomic_load_n(&stats.latencyCount, __ATOMIC_RELAXED);
+            s.latencySum = __atomic_load_n(&stats.latencySum, __ATOMIC_RELAXED);
+            s.latencyMax = __atomic_load_n(&stats.latencyMax, __ATOMIC_RELAXED);
+            return s;
+        }
+
+        // タッチ入力のあったフレームの時刻を記録する(遅延計測用)
+        void markTouch()
+        {
+            if (touchStamp == 0)
+                touchStamp = micros() | 1;
+        }
+
+        //
+        void startWrite()
+        {
+            if (!deferred)
+            {
+                lockBus();
+                gfx->startWrite();
+            }
+        }
+        void endWrite()
+        {
+            if (deferred)
+                flush();
+            else
+            {
+                gfx->endWrite();
+                unlockBus();
+                finishFrame(touchStamp);
+                touchStamp = 0;
+            }
+        }
+        // 積まれたコマンドがあれば描画タスクへ(毎フレーム呼ぶ)
+        void flush()
+        {
+            if (deferred && back->used > 0)
+                kick();
+        }
+
+        //
+        void fillRect(int x, int y, int w, int h, int color)
+        {
+            if (deferred)
+                record(Op::FillRect, x, y, w, h, 0, color);
+            else
+                gfx->fillRect(x, y, w, h, color);
+        }
+        void drawRect(int x, int y, int w, int h, int color)
+        {
+            if (deferred)
+                record(Op::DrawRect, x, y, w, h, 0, color);
+            else
+                gfx->drawRect(x, y, w, h, color);
+        }
+        void fillRoundRect(int x, int y, int w, int h, int r, int color)
+        {
+            if (deferred)
+                record(Op::FillRoundRect, x, y, w, h, r, color);
+            else
+                gfx->fillRoundRect(x, y, w, h, r, color);
+        }
+        void drawRoundRect(int x, int y, int w, int h, int r, int color)
+        {
+            if (deferred)
+                record(Op::DrawRoundRect, x, y, w, h, r, color);
+            else
+                gfx->drawRoundRect(x, y, w, h, r, color);
+        }
+        void drawString(const char *str, int x, int y)
+        {
+            if (!deferred)
+            {
+                applyString(str, x, y);
+                return;
+            }
+            size_t len = strlen(str) + 1;
+            if (auto *c = alloc(Op::DrawString, len))
+            {
+                c->x = x;
+                c->y = y;
+                memcpy(c + 1, str, len);
+            }
+        }
+        void drawString(const String &str, int x, int y)
+        {
+            drawString(str.c_str(), x, y);
+        }
+        void drawChar(uint16_t ch, int x, int y)
+        {
+            if (deferred)
+                record(Op::DrawChar, x, y, 0, 0, 0, ch);
+            else
+                gfx->drawChar(ch, x, y);
+        }
+        void setTextColor(int fg)
+        {
+            if (deferred)
+                record(Op::TextColor, 0, 0, 0, 0, 0, fg);
+            else
+                applyTextColor(fg);
+        }
+        void setTextColor(int fg, int bg)
+        {
+            if (deferred)
+                record(Op::TextColorBG, 0, 0, 0, 0, 0, fg, bg);
+            else
+                applyTextColor(fg, bg);
+        }
+        void setFont(const lgfx::IFont *font)
+        {
+            if (!deferred)
+            {
+                applyFont(font);
+                return;
+            }
+            if (auto *c = alloc(Op::Font, 0))
+                c->ptr = font;
+        }
+        // dataはRGB565。コピーされるので呼び出し後に再利用してよい
+        void pushImage(int x, int y, int w, int h, const uint16_t *data)
+        {
+            if (!deferred)
+            {
+                gfx->pushImage(x, y, w, h, reinterpret_cast<const lgfx::rgb565_t *>(data));
+                return;
+            }
+            size_t len = w * h * sizeof(uint16_t);
+            if (sizeof(Cmd) + len > BufferSize)
+            {
+                // バッファに入らない大きさは、先に積んだ分を描き終えてからここで直接描く
+                drain();
+                BusLock b(*this);
+                gfx->startWrite();
+                gfx->pushImage(x, y, w, h, reinterpret_cast<const lgfx::rgb565_t *>(data));
+                gfx->endWrite();
+                return;
+            }
+            if (auto *c = alloc(Op::PushImage, len))
+            {
+                c->x = x;
+                c->y = y;
+                c->w = w;
+                c->h = h;
+                memcpy(c + 1, data, len);
+            }
+        }
+
+        // コピーしない版: dataは描画が終わるまで保持されていること
+        void pushImageRef(int x, int y, int w, int h, const uint16_t *data)
+        {
+            if (!deferred)
+            {
+                gfx->pushImage(x, y, w, h, reinterpret_cast<const lgfx::rgb565_t *>(data));
+                return;
+            }
+            if (auto *c = alloc(Op::PushImageRef, 0))
+            {
+                c->x = x;
+                c->y = y;
+                c->w = w;
+                c->h = h;
+                c->ptr = data;
+            }
+        }
+        // 描画タスクモードでは先行するコマンドの描画後に読み出される
+        void readRect(int x, int y, int w, int h, uint16_t *data)
+        {
+            if (!deferred)
+            {
+                BusLock b(*this);
+                gfx->readRect(x, y, w, h, reinterpret_cast<lgfx::rgb565_t *>(data));
+                return;
+            }
+            if (auto *c = alloc(Op::ReadRect, 0))
+            {
+                c->x = x;
+                c->y = y;
+                c->w = w;
+                c->h = h;
+                c->ptr = data;
+            }
+        }
+        // スプライトは描画が終わるまで変更しないこと
+        void pushSprite(LGFX_Sprite *sp, int x, int y)
+        {
+            if (!deferred)
+            {
+                sp->pushSprite(gfx, x, y);
+                return;
+            }
+            if (auto *c = alloc(Op::PushSprite, 0))
+            {
+                c->x = x;
+                c->y = y;
+                c->ptr = sp;
+            }
+        }
+    };
+}
@@ -0,0 +1,206 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <Arduino.h>
+#include <netflow.hpp>
+
+namespace Net
+{
+    ///
+    /// 見えているアクセスポイント
+    ///
+    struct AccessPoint
+    {
+        char ssid[33];
+        int8_t rssi;
+        uint8_t channel;
+    };
+
+    ///
+    /// スキャン結果の集合(隠しSSIDを除き、SSIDごとに一番強いもの1つ、電波の強い順)
+    /// チャンネルを絞ったスキャンでは、そのチャンネルにいたものだけを入れ替え、他は前回の結果を残す
+    /// ワーカーが書き、UIスレッドはバージョンが変わったらsnapshot()で写す
+    ///
+    class ScanSet
+    {
+    public:
+        static constexpr int MaxEntries = 20;
+        static constexpr int MaxChannels = 14;
+
+    private:
+        portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+        AccessPoint items[MaxEntries];
+        int count = 0;
+        uint32_t version = 0;    // 並び(SSID)が変わるたびに増える
+        uint32_t changedAt = 0;  // 最後に並びが変わった時刻(us)
+        uint32_t fullScanAt = 0; // 最後に全チャンネルを見た時刻(ms)
+        bool hasFullScan = false;
+
+        int find(const char *ssid) const
+        {
+            for (int i = 0; i < count; i++)
+                if (strcmp(items[i].ssid, ssid) == 0)
+                    return i;
+            return -1;
+        }
+        static int weakest(const AccessPoint *a, int n)
+        {
+            int w = 0;
+            for (int i = 1; i < n; i++)
+                if (a[i].rssi < a[w].rssi)
+                    w = i;
+            return w;
+        }
+        // 表示する並び(SSIDの列)のハッシュ(FNV-1a)
+        uint32_t orderHash() const
+        {
+            uint32_t h = 2166136261u;
+            for (int i = 0; i < count; i++)
+                for (const char *p = items[i].ssid;; p++)
+                {
+                    h = (h ^ uint8_t(*p)) * 16777619u;
+                    if (*p == '\0')
+                        break;
+                }
+            return h;
+        }
+        // 同じSSIDが既にあれば(中継器や、見ていないチャンネルの前回の値)強い方を残す
+        void put(const AccessPoint &ap)
+        {
+            int i = find(ap.ssid);
+            if (i < 0)
+            {
+                // 溢れたら一番弱いものと比べる
+                if (count < MaxEntries)
+                    i = count++;
+                else if (items[i = weakest(items, count)].rssi >= ap.rssi)
+                    return;
+            }
+            else if (ap.rssi <= items[i].rssi)
+                return;
+            items[i] = ap;
+        }
+
+    public:
+        // スキャン結果を取り込む(結果を持っている側がlink.scanDelete()の前に呼ぶ)
+        // channel: そのスキャンで見たチャンネル(0なら全チャンネル)
+        // now: ms、doneAt: スキャンが終わった時刻(us、表示までの時間を測る)。並びが変わればtrue
+        bool merge(Link &link, int found, uint8_t channel, uint32_t now, uint32_t doneAt)
+        {
+            // 強いものからMaxEntries個
+            AccessPoint buff[MaxEntries];
+            int n = 0;
+            for (int i = 0; i < found; i++)
+            {
+                AccessPoint ap;
+                link.scanSSID(i, ap.ssid, sizeof(ap.ssid));
+                if (ap.ssid[0] == '\0')
+                    continue; // 隠しSSID
+                ap.rssi = constrain(link.scanRSSI(i), -127, 0);
+                ap.channel = link.scanChannel(i);
+                // 絞ったスキャンに他のチャンネルが混じっていても、見ていないものとして前回の値を残す
+                if (channel != 0 && ap.channel != channel)
+                    continue;
+                if (n < MaxEntries)
+                    buff[n++] = ap;
+                else
+                {
+                    int w = weakest(buff, n);
+                    if (buff[w].rssi < ap.rssi)
+                        buff[w] = ap;
+                }
+            }
+
+            portENTER_CRITICAL(&mux);
+            uint32_t before = orderHash();
+            // 見たチャンネルにいたものは入れ直す
+            int m = 0;
+            for (int i = 0; i < count; i++)
+                if (channel != 0 && items[i].channel != channel)
+                    items[m++] = items[i];
+            count = m;
+            for (int i = 0; i < n; i++)
+                put(buff[i]);
+            // 強い順(挿入ソート)
+            for (int i = 1; i < count; i++)
+            {
+                AccessPoint ap = items[i];
+                int j = i;
+                for (; j > 0 && items[j - 1].rssi < ap.rssi; j--)
+                    items[j] = items[j - 1];
+                items[j] = ap;
+            }
+            bool changed = orderHash() != before;
+            if (changed)
+            {
+                version++;
+                changedAt = doneAt;
+            }
+            if (channel == 0)
+            {
+                fullScanAt = now;
+                hasFullScan = true;
+            }
+            portEXIT_CRITICAL(&mux);
+            return changed;
+        }
+        void clear()
+        {
+            portENTER_CRITICAL(&mux);
+            count = 0;
+            hasFullScan = false;
+            version++;
+            changedAt = micros();
+            portEXIT_CRITICAL(&mux);
+        }
+
+        // 最後の全チャンネルスキャンがage(ms)より新しい
+        bool hasFullScanWithin(uint32_t now, uint32_t age)
+        {
+            portENTER_CRITICAL(&mux);
+            bool ok = hasFullScan && now - fullScanAt < age;
+            portEXIT_CRITICAL(&mux);
+            return ok;
+        }
+        // 何か見えているチャンネル(多い順に最大max個)
+        int channels(uint8_t *out, int max)
+        {
+            uint8_t num[MaxChannels + 1] = {};
+            portENTER_CRITICAL(&mux);
+            for (int i = 0; i < count; i++)
+                if (items[i].channel <= MaxChannels)
+                    num[items[i].channel]++;
+            portEXIT_CRITICAL(&mux);
+            int n = 0;
+            while (n < max)
+            {
+                int best = 0;
+                for (int ch = 1; ch <= MaxChannels; ch++)
+                    if (num[ch] > num[best])
+                        best = ch;
+                if (best == 0)
+                    break;
+                out[n++] = best;
+                num[best] = 0;
+            }
+            return n;
+        }
+
+        int size() const { return count; }
+        uint32_t getVersion() const { return version; }
+        // 写しを取る。並びが変わった時刻(us)も返す
+        int snapshot(AccessPoint *out, int max, uint32_t &ver, uint32_t &at)
+        {
+            portENTER_CRITICAL(&mux);
+            int n = count < max ? count : max;
+            memcpy(out, items, sizeof(AccessPoint) * n);
+            ver = version;
+            at = changedAt;
+            portEXIT_CRITICAL(&mux);
+            return n;
+        }
+    };
+}
@@ -0,0 +1,312 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+//
+// 設定の型付きフィールド(整数・列挙、固定長文字列、バイト列、配列、memcpyできる構造体)
+// 設定は構造体で持ち(RAM上の写し)、visit()でキーとメンバーの組を並べてスキーマにする
+//
+//   struct Settings {
+//       static constexpr uint16_t Version = 1;
+//       Store::FixedString<31> ssid;
+//       int32_t timeZone = 9 * 3600;
+//       template <typename V> void visit(V &&v) { v("ssid", ssid); v("tz", timeZone); }
+//       void migrate(uint16_t from, Store::Data &store) {} // 古い版からの移行
+//   };
+//
+// 保存形式は先頭2バイトのFieldHeader(型と要素の大きさ)に中身が続く
+// 読み込み時に型・大きさが合わなければそのフィールドは既定値のまま
+//
+namespace Store
+{
+    ///
+    /// 所有しない文字列の参照(終端は保証しない)
+    ///
+    class StringView
+    {
+        const char *ptr = "";
+        size_t len = 0;
+
+    public:
+        StringView() = default;
+        StringView(const char *p, size_t n) : ptr(p), len(n) {}
+        StringView(const char *p) : ptr(p), len(strlen(p)) {}
+
+        const char *data() const { return ptr; }
+        size_t size() const { return len; }
+        bool empty() const { return len == 0; }
+        char operator[](size_t i) const { return ptr[i]; }
+        bool operator==(StringView o) const { return len == o.len && memcmp(ptr, o.ptr, len) == 0; }
+        bool operator!=(StringView o) const { return !(*this == o); }
+    };
+
+    ///
+    /// 固定長の文字列(常に終端する)
+    ///
+    template <size_t N>
+    class FixedString
+    {
+        static_assert(N < 256, "too long");
+        char buff[N + 1] = {};
+        uint8_t len = 0;
+
+    public:
+        static constexpr size_t Capacity = N;
+
+        // 入りきらなければ切り詰めてfalse
+        bool assign(const char *s, size_t n)
+        {
+            bool fit = n <= N;
+            len = fit ? n : N;
+            memcpy(buff, s, len);
+            buff[len] = '\0';
+            return fit;
+        }
+        bool assign(const char *s) { return assign(s, strlen(s)); }
+        bool assign(StringView s) { return assign(s.data(), s.size()); }
+        FixedString &operator=(const char *s)
+        {
+            assign(s);
+            return *this;
+        }
+        void clear() { assign("", 0); }
+
+        const char *c_str() const { return buff; }
+        StringView view() const { return StringView(buff, len); }
+        size_t size() const { return len; }
+        bool empty() const { return len == 0; }
+    };
+
+    ///
+    /// 固定長のバイト列
+    ///
+    template <size_t N>
+    class Blob
+    {
+        uint8_t buff[N];
+        uint16_t len = 0;
+
+    public:
+        static constexpr size_t Capacity = N;
+
+        bool assign(const void *p, size_t n)
+        {
+            if (n > N)
+                return false;
+            memcpy(buff, p, n);
+            len = n;
+            return true;
+        }
+        void clear() { len = 0; }
+        const uint8_t *data() const { return buff; }
+        size_t size() const { return len; }
+        bool empty() const { return len == 0; }
+    };
+
+    ///
+    /// 要素数の上限が決まった配列(要素はmemcpyできる型)
+    ///
+    template <typename T, size_t N>
+    class SmallArray
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "element must be trivially copyable");
+        static_assert(N < 256, "too many elements");
+        T items[N];
+        uint8_t count = 0;
+
+    public:
+        static constexpr size_t Capacity = N;
+
+        bool push(const T &v)
+        {
+            if (count >= N)
+                return false;
+            items[count++] = v;
+            return true;
+        }
+        void erase(size_t i)
+        {
+            for (size_t j = i + 1; j < count; j++)
+                items[j - 1] = items[j];
+            count--;
+        }
+        void clear() { count = 0; }
+        // 読み込み用(nは上限以下であること)
+        void resize(size_t n) { count = n; }
+
+        T &operator[](size_t i) { return items[i]; }
+        const T &operator[](size_t i) const { return items[i]; }
+        T *begin() { return items; }
+        T *end() { return items + count; }
+        const T *begin() const { return items; }
+        const T *end() const { return items + count; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        bool full() const { return count >= N; }
+    };
+
+    ///
+    /// 型ごとの保存形式
+    ///
+    enum class FieldType : uint8_t
+    {
+        // 旧形式の生の文字列(先頭が印字可能文字)と区別できる値にしておく
+        Int = 0xf1,
+        String,
+        Blob,
+        Array,
+        Struct,
+    };
+    struct FieldHeader
+    {
+        FieldType type;
+        uint8_t elemSize;
+    };
+
+    template <typename T, typename = void>
+    struct Codec;
+
+    // そのままmemcpyで保存する構造体(上の入れ物は除く)
+    template <typename T>
+    struct IsStruct : std::integral_constant<bool, std::is_class<T>::value && std::is_trivially_copyable<T>::value>
+    {
+    };
+    template <size_t N>
+    struct IsStruct<FixedString<N>> : std::false_type
+    {
+    };
+    template <size_t N>
+    struct IsStruct<Blob<N>> : std::false_type
+    {
+    };
+    template <typename T, size_t N>
+    struct IsStruct<SmallArray<T, N>> : std::false_type
+    {
+    };
+
+    // 整数・列挙型
+    template <typename T>
+    struct Codec<T, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type>
+    {
+        static constexpr FieldType Type = FieldType::Int;
+        static constexpr size_t ElemSize = sizeof(T);
+        static constexpr size_t MaxSize = sizeof(T);
+        static size_t encode(const T &v, uint8_t *p)
+        {
+            memcpy(p, &v, sizeof(T));
+            return sizeof(T);
+        }
+        static bool decode(const uint8_t *p, size_t n, T &v)
+        {
+            if (n != sizeof(T))
+                return false;
+            memcpy(&v, p, sizeof(T));
+            return true;
+        }
+    };
+
+    template <size_t N>
+    struct Codec<FixedString<N>>
+    {
+        static constexpr FieldType Type = FieldType::String;
+        static constexpr size_t ElemSize = 1;
+        static constexpr size_t MaxSize = N;
+        static size_t encode(const FixedString<N> &v, uint8_t *p)
+        {
+            memcpy(p, v.c_str(), v.size());
+            return v.size();
+        }
+        static bool decode(const uint8_t *p, size_t n, FixedString<N> &v)
+        {
+            return n <= N && v.assign(reinterpret_cast<const char *>(p), n);
+        }
+    };
+
+    template <size_t N>
+    struct Codec<Blob<N>>
+    {
+        static constexpr FieldType Type = FieldType::Blob;
+        static constexpr size_t ElemSize = 1;
+        static constexpr size_t MaxSize = N;
+        static size_t encode(const Blob<N> &v, uint8_t *p)
+        {
+            memcpy(p, v.data(), v.size());
+            return v.size();
+        }
+        static bool decode(const uint8_t *p, size_t n, Blob<N> &v) { return v.assign(p, n); }
+    };
+
+    template <typename T, size_t N>
+    struct Codec<SmallArray<T, N>>
+    {
+        static_assert(sizeof(T) < 256, "element too large");
+        static constexpr FieldType Type = FieldType::Array;
+        static constexpr size_t ElemSize = sizeof(T);
+        static constexpr size_t MaxSize = sizeof(T) * N;
+        static size_t encode(const SmallArray<T, N> &v, uint8_t *p)
+        {
+            memcpy(p, v.begin(), v.size() * sizeof(T));
+            return v.size() * sizeof(T);
+        }
+        static bool decode(const uint8_t *p, size_t n, SmallArray<T, N> &v)
+        {
+            if (n % sizeof(T) != 0 || n / sizeof(T) > N)
+                return false;
+            v.resize(n / sizeof(T));
+            memcpy(v.begin(), p, n);
+            return true;
+        }
+    };
+
+    // 構造体(大きさが変わったら読まない。中身の並びを変えたときは版を上げること)
+    template <typename T>
+    struct Codec<T, typename std::enable_if<IsStruct<T>::value>::type>
+    {
+        static_assert(sizeof(T) < 256, "struct too large");
+        static constexpr FieldType Type = FieldType::Struct;
+        static constexpr size_t ElemSize = sizeof(T);
+        static constexpr size_t MaxSize = sizeof(T);
+        static size_t encode(const T &v, uint8_t *p)
+        {
+            memcpy(p, &v, sizeof(T));
+            return sizeof(T);
+        }
+        static bool decode(const uint8_t *p, size_t n, T &v)
+        {
+            if (n != sizeof(T))
+                return false;
+            memcpy(&v, p, sizeof(T));
+            return true;
+        }
+    };
+
+    // ヘッダ込みで書き出す。書いた長さを返す
+    template <typename T>
+    size_t encodeField(const T &v, uint8_t *p)
+    {
+        FieldHeader h{Codec<T>::Type, uint8_t(Codec<T>::ElemSize)};
+        memcpy(p, &h, sizeof(h));
+        return sizeof(h) + Codec<T>::encode(v, p + sizeof(h));
+    }
+    // 型・大きさが合えば読み込む(合わなければvはそのまま)
+    template <typename T>
+    bool decodeField(const uint8_t *p, size_t n, T &v)
+    {
+        FieldHeader h;
+        if (n < sizeof(h))
+            return false;
+        memcpy(&h, p, sizeof(h));
+        if (h.type != Codec<T>::Type || h.elemSize != Codec<T>::ElemSize)
+            return false;
+        return Codec<T>::decode(p + sizeof(h), n - sizeof(h), v);
+    }
+    template <typename T>
+    constexpr size_t fieldSize() { return sizeof(FieldHeader) + Codec<T>::MaxSize; }
+}
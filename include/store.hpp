@@ -5,115 +5,292 @@
 #pragma once
 
 #include <Arduino.h>
-#include <EEPROM.h>
-#include <vector>
+#include <kvstore.hpp>
+#include <partitionflash.hpp>
+#include <schema.hpp>
 
 namespace Store
 {
 
     ///
-    using Header = char[4];
-    class Data
+    /// 設定の保存先(partitions.csvのkvstore領域)
+    /// 書き込みはレコードの追記だけなので、保存のたびにセクタを消去しない
+    /// 回収(compact)はワーカーから呼んでよい(呼び出しは排他にしてある)
+    ///
+    /// begin()からcommit()までの書き込みはRAMに溜め、flush()で一度に書く
+    /// commit()はRAM上の受け渡しだけなので、flush()をワーカーで回せばUIはフラッシュを待たない
+    /// 溜めた変更が見えるのはbegin()を呼んだタスクだけ。その間の他のタスクの書き込みは書き込み待ちへ回す
+    /// (同時に開けるのは1つだけ)
+    ///
+    /// 設定はload(settings)で一度だけ構造体へ読み込み、以降はその写しを直接参照する(schema.hpp)
+    /// Flashはbegin(label)とLogのFlashの操作を持つ型(ホストのテストではSimFlash)
+    ///
+    template <typename Flash>
+    class BasicData
     {
-        struct Index
+        using Changes = Batch<512, 8>;
+
+        Flash flash;
+        Log<Flash> log;
+        SemaphoreHandle_t lock = nullptr;
+        bool ready = false;
+        TaskHandle_t owner = nullptr; // begin()したタスク
+        Changes open;    // begin()以降の変更(ownerのみ)
+        Changes pending; // commit()済みで書き込み待ち(lockの中で)
+        uint32_t flushes = 0;
+        uint32_t lastFlushTime = 0;
+        uint32_t maxFlushTime = 0;
+        uint32_t lastFlushBytes = 0;
+
+        struct Guard
         {
-            int pos;
-            int size;
+            SemaphoreHandle_t s;
+            Guard(SemaphoreHandle_t s) : s(s) { xSemaphoreTake(s, portMAX_DELAY); }
+            ~Guard() { xSemaphoreGive(s); }
         };
-        std::vector<Index> indices;
-        int writePoint;
+
+        bool isOwner() const { return __atomic_load_n(&owner, __ATOMIC_ACQUIRE) == xTaskGetCurrentTaskHandle(); }
+        // 他のタスクの書き込みは、開いている間と書き込み待ちに同じキーがあるときは書き込み待ちへ(順番を保つ)
+        bool deferred(const char *key) const
+        {
+            return __atomic_load_n(&owner, __ATOMIC_ACQUIRE) != nullptr || pending.contains(key);
+        }
 
     public:
-        void init(const Header h, size_t sz)
+        // commit()の結果
+        enum class Commit : uint8_t
+        {
+            Failed,  // 開いていない、または書き込み待ちに入りきらない(変更は捨てた)
+            Clean,   // 書き込み待ちはない
+            Pending, // flush()が必要
+        };
+
+        bool init(const char *label)
         {
-            EEPROM.begin(sz);
-            bool init = false;
-            size_t hsz = sizeof(Header);
-            for (int i = 0; i < hsz; i++)
+            lock = xSemaphoreCreateMutex();
+            if (!flash.begin(label))
             {
-                auto ch = EEPROM.readChar(i);
-                if (h[i] != ch)
-                {
-                    init = true;
-                    break;
-                }
+                Serial.println("store: no partition");
+                return false;
             }
-            indices.reserve(10);
-            if (init)
+            Guard g(lock);
+            if (!log.mount(&flash))
             {
-                // 初回使用→初期化
-                EEPROM.writeBytes(0, h, hsz);
-                EEPROM.writeByte(hsz, 0);
-                indices.resize(0);
-                Serial.println("initialize EEPROM");
-                writePoint = hsz + 1;
+                Serial.println("store: mount failed");
+                return false;
             }
-            else
+            ready = true;
+            Serial.printf("setup store: keys=%d live=%u/%u\n", log.getKeyCount(), log.getLiveBytes(), log.getCapacity());
+            return true;
+        }
+        // 既に他で開いていればfalse(同時に開けるのは1つだけ)
+        bool begin()
+        {
+            if (!lock)
+                return false;
+            Guard g(lock);
+            if (__atomic_load_n(&owner, __ATOMIC_ACQUIRE) != nullptr)
             {
-                char buff[24];
-                auto n = EEPROM.readByte(hsz);
-                indices.resize(n);
-                snprintf(buff, sizeof(buff), "setup EEPROM: num=%d", n);
-                Serial.println(buff);
-                int p = hsz + 1;
-                for (int i = 0; i < n; i++)
-                {
-                    auto &idx = indices[i];
-                    idx.size = EEPROM.readByte(p++);
-                    idx.pos = p;
-                    p += idx.size;
-                    // snprintf(buff, sizeof(buff), "data: %d(size=%d)", idx.pos, idx.size);
-                    // Serial.println(buff);
-                }
-                writePoint = p;
+                Serial.println("store: already begun");
+                return false;
             }
+            open.clear();
+            __atomic_store_n(&owner, xTaskGetCurrentTaskHandle(), __ATOMIC_RELEASE);
+            return true;
+        }
+        // 書き込み待ちに回す
+        Commit commit()
+        {
+            if (!isOwner())
+                return Commit::Failed;
+            Guard g(lock);
+            bool ok = pending.merge(open);
+            __atomic_store_n(&owner, nullptr, __ATOMIC_RELEASE);
+            if (!ok)
+            {
+                Serial.println("store: commit overflow");
+                return Commit::Failed;
+            }
+            return pending.empty() ? Commit::Clean : Commit::Pending;
+        }
+        // 溜めた変更を捨てる。その間に他のタスクが書いた分のflush()が必要ならtrue
+        bool rollback()
+        {
+            if (!isOwner())
+                return false;
+            Guard g(lock);
+            __atomic_store_n(&owner, nullptr, __ATOMIC_RELEASE);
+            return !pending.empty();
+        }
+
+        // 書き込み待ちをまとめて書く
+        bool flush()
+        {
+            if (!ready)
+                return false;
+            Guard g(lock);
+            if (pending.empty())
+                return true;
+            auto t = micros();
+            auto bytes = log.getWriteBytes();
+            bool ok = log.commit(pending);
+            if (ok)
+                pending.clear();
+            else
+                Serial.println("store: flush failed");
+            lastFlushTime = micros() - t;
+            lastFlushBytes = log.getWriteBytes() - bytes;
+            if (lastFlushTime > maxFlushTime)
+                maxFlushTime = lastFlushTime;
+            flushes++;
+            return ok;
+        }
+
+        bool put(const char *key, const void *data, size_t size)
+        {
+            if (isOwner())
+                return open.put(key, data, size);
+            if (!ready)
+                return false;
+            Guard g(lock);
+            if (deferred(key))
+                return pending.put(key, data, size);
+            if (log.put(key, data, size))
+                return true;
+            Serial.println("store: failed");
+            return false;
         }
-        void clearIndex()
+        // 値の長さ(無ければ-1)。buffには入るだけ入れる
+        int get(const char *key, void *buff, size_t size)
         {
-            indices.resize(0);
-            writePoint = sizeof(Header);
-            EEPROM.writeByte(writePoint++, 0);
-            Serial.println("clear EEPROM index");
+            if (!ready)
+                return -1;
+            // 書き込み前の変更を先に見る
+            int n = isOwner() ? open.get(key, buff, size) : -1;
+            Guard g(lock);
+            if (n == -1)
+                n = pending.get(key, buff, size);
+            if (n == -1)
+                n = log.get(key, buff, size);
+            return n < 0 ? -1 : n;
         }
-        int storeString(const char *str)
+
+        bool storeString(const char *key, const char *str) { return put(key, str, strlen(str)); }
+        bool loadString(const char *key, char *buff, size_t buffsize)
         {
-            if (indices.size() < indices.capacity())
+            int n = buffsize > 0 ? get(key, buff, buffsize - 1) : -1;
+            if (n < 0)
             {
-                Index idx;
-                int id = indices.size();
-                idx.pos = writePoint;
-                idx.size = strlen(str);
-                EEPROM.writeByte(writePoint++, idx.size);
-                EEPROM.writeBytes(writePoint, str, idx.size);
-                writePoint += idx.size;
-                indices.push_back(idx);
-                EEPROM.writeByte(sizeof(Header), indices.size());
-                EEPROM.commit();
-                // Serial.println(str);
-                // char buff[48];
-                // snprintf(buff, sizeof(buff), "store: id=%d,pos=%d,size=%d", id, idx.pos, idx.size);
-                // Serial.println(buff);
-                return id;
+                Serial.println("load: no data");
+                return false;
             }
-            Serial.println("store: failed");
-            return -1; // full
+            buff[n < int(buffsize - 1) ? n : buffsize - 1] = '\0';
+            return true;
+        }
+
+        // 型付きの1フィールド
+        template <typename T>
+        bool save(const char *key, const T &v)
+        {
+            uint8_t buff[fieldSize<T>()];
+            return put(key, buff, encodeField(v, buff));
         }
-        bool loadString(int i, char *buff, size_t buffsize) const
+        template <typename T>
+        bool load(const char *key, T &v)
         {
-            if (i < indices.size())
+            uint8_t buff[fieldSize<T>()];
+            int n = get(key, buff, sizeof(buff));
+            return n >= 0 && n <= int(sizeof(buff)) && decodeField(buff, n, v);
+        }
+
+        // スキーマ全体を読み込む。保存されている版が古ければmigrate()を呼んで書き直す
+        template <typename S>
+        bool load(S &s)
+        {
+            uint16_t version = 0;
+            load(VersionKey, version);
+            int missing = 0;
+            s.visit([&](const char *key, auto &field) {
+                if (!load(key, field))
+                    missing++;
+            });
+            if (version == S::Version)
             {
-                auto &idx = indices[i];
-                memset(buff, '\0', buffsize);
-                size_t rsz = buffsize - 1;
-                size_t sz = idx.size < rsz ? idx.size : rsz;
-                EEPROM.readBytes(idx.pos, buff, sz);
-                // char buff[48];
-                // snprintf(buff, sizeof(buff), "load: pos=%d,size=%d", idx.pos, idx.size);
-                // Serial.println(buff);
+                if (missing > 0)
+                    Serial.printf("store: %d fields missing or mismatched\n", missing);
                 return true;
             }
-            Serial.println("load: no data");
-            return false;
+            Serial.printf("store: migrate settings v%u -> v%u\n", version, S::Version);
+            if (!begin())
+                return false;
+            s.migrate(version, *this);
+            save(s);
+            version = S::Version;
+            save(VersionKey, version);
+            switch (commit())
+            {
+            case Commit::Pending:
+                return flush();
+            case Commit::Clean:
+                return true;
+            default:
+                return false;
+            }
+        }
+        // 変わったフィールドだけ書く(begin()/commit()の中で呼べばまとめて書く)
+        template <typename S>
+        bool save(S &s)
+        {
+            bool ok = true;
+            s.visit([&](const char *key, const auto &field) {
+                using T = typename std::decay<decltype(field)>::type;
+                uint8_t now[fieldSize<T>()], stored[fieldSize<T>()];
+                size_t n = encodeField(field, now);
+                int m = get(key, stored, sizeof(stored));
+                if (m != int(n) || memcmp(now, stored, n) != 0)
+                    ok &= put(key, now, n);
+            });
+            return ok;
         }
+        bool remove(const char *key)
+        {
+            if (isOwner())
+                return open.remove(key);
+            if (!ready)
+                return false;
+            Guard g(lock);
+            if (deferred(key))
+                return pending.remove(key);
+            return log.remove(key);
+        }
+
+        static constexpr const char *VersionKey = "$version";
+
+        bool needsCompaction()
+        {
+            if (!ready)
+                return false;
+            Guard g(lock);
+            return log.needsCompaction();
+        }
+        bool compact()
+        {
+            if (!ready)
+                return false;
+            Guard g(lock);
+            return log.compact();
+        }
+
+        int getKeyCount() const { return log.getKeyCount(); }
+        uint32_t getLiveBytes() const { return log.getLiveBytes(); }
+        uint32_t getCapacity() const { return log.getCapacity(); }
+        uint32_t getEraseCount() const { return log.getEraseCount(); }
+        uint32_t getWriteBytes() const { return log.getWriteBytes(); }
+        uint32_t getFlushCount() const { return flushes; }
+        uint32_t getLastFlushTime() const { return lastFlushTime; }
+        uint32_t getMaxFlushTime() const { return maxFlushTime; }
+        uint32_t getLastFlushBytes() const { return lastFlushBytes; }
+        Flash &getFlash() { return flash; }
     };
+    using Data = BasicData<PartitionFlash>;
 }
@@ -0,0 +1,80 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace UI
+{
+    ///
+    /// 文字列プール
+    /// 連続した領域に詰めて置き、位置と長さのハンドルで参照する
+    /// 個別の解放は無く、reset()でまとめて空にする
+    /// 入りきらなかった回数を数えておく(getOverflows())
+    ///
+    class StringPool
+    {
+    public:
+        struct Handle
+        {
+            uint16_t offset = 0;
+            uint16_t length = 0;
+            uint16_t size = 0; // 確保した領域(終端込み)。0なら未確保
+        };
+
+    private:
+        char *data = nullptr;
+        size_t capacity = 0;
+        size_t used = 0;
+        uint32_t overflows = 0;
+
+    public:
+        // 領域は呼び出し側が用意する
+        void attach(char *buff, size_t sz)
+        {
+            data = buff;
+            capacity = sz;
+            used = 0;
+        }
+        void reset() { used = 0; }
+
+        size_t getUsed() const { return used; }
+        size_t getCapacity() const { return capacity; }
+        uint32_t getOverflows() const { return overflows; }
+
+        // 終端込みで入らなければfalse
+        bool add(const char *s, Handle &h)
+        {
+            size_t len = strlen(s);
+            if (used + len + 1 > capacity || used + len >= 0xffff)
+            {
+                overflows++;
+                return false;
+            }
+            memcpy(data + used, s, len + 1);
+            h.offset = used;
+            h.length = len;
+            h.size = len + 1;
+            used += len + 1;
+            return true;
+        }
+        // 確保済みの領域に入れば同じ場所を書き換える(短くしても領域は縮めない)
+        bool replace(const char *s, Handle &h)
+        {
+            size_t len = strlen(s);
+            if (len + 1 > h.size)
+                return add(s, h);
+            memcpy(data + h.offset, s, len + 1);
+            h.length = len;
+            return true;
+        }
+        const char *get(const Handle &h) const
+        {
+            return data && h.size ? data + h.offset : "";
+        }
+    };
+}
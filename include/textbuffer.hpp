@@ -0,0 +1,160 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace UI
+{
+    ///
+    /// 編集用テキストバッファ(固定長のギャップバッファ、UTF-8の文字単位で操作)
+    /// ギャップの位置がカーソル
+    ///
+    class TextBuffer
+    {
+    public:
+        static constexpr size_t Capacity = 64;
+
+    private:
+        char data[Capacity];
+        size_t gapStart = 0;
+        size_t gapEnd = Capacity;
+        size_t limit = Capacity;
+
+        static bool isCont(char c) { return (uint8_t(c) & 0xc0) == 0x80; }
+        char at(size_t i) const { return i < gapStart ? data[i] : data[i + gapEnd - gapStart]; }
+
+    public:
+        // 受け付ける最大バイト数
+        void setLimit(size_t n) { limit = n < Capacity ? n : Capacity; }
+
+        size_t size() const { return Capacity - (gapEnd - gapStart); }
+        bool empty() const { return gapStart == 0 && gapEnd == Capacity; }
+        size_t cursor() const { return gapStart; }
+        bool atEnd() const { return gapEnd == Capacity; }
+
+        void clear()
+        {
+            gapStart = 0;
+            gapEnd = Capacity;
+        }
+
+        // 1文字(nバイト)をカーソル位置に挿入。入らなければfalse
+        bool insert(const char *s, size_t n)
+        {
+            if (size() + n > limit)
+                return false;
+            memcpy(data + gapStart, s, n);
+            gapStart += n;
+            return true;
+        }
+        bool insert(char c) { return insert(&c, 1); }
+        // 文字列を文字単位で入るだけ挿入する
+        size_t insertString(const char *s, size_t n)
+        {
+            size_t p = 0;
+            while (p < n)
+            {
+                size_t e = p + 1;
+                while (e < n && isCont(s[e]))
+                    e++;
+                if (!insert(s + p, e - p))
+                    break;
+                p = e;
+            }
+            return p;
+        }
+
+        // カーソル移動
+        bool left()
+        {
+            if (gapStart == 0)
+                return false;
+            do
+            {
+                data[--gapEnd] = data[--gapStart];
+            } while (gapStart > 0 && isCont(data[gapEnd]));
+            return true;
+        }
+        bool right()
+        {
+            if (gapEnd == Capacity)
+                return false;
+            do
+            {
+                data[gapStart++] = data[gapEnd++];
+            } while (gapEnd < Capacity && isCont(data[gapEnd]));
+            return true;
+        }
+        void home()
+        {
+            while (left())
+                ;
+        }
+        void end()
+        {
+            while (right())
+                ;
+        }
+
+        // カーソル前/後の1文字を削除
+        bool backSpace()
+        {
+            if (gapStart == 0)
+                return false;
+            do
+            {
+                gapStart--;
+            } while (gapStart > 0 && isCont(data[gapStart]));
+            return true;
+        }
+        bool erase()
+        {
+            if (gapEnd == Capacity)
+                return false;
+            do
+            {
+                gapEnd++;
+            } while (gapEnd < Capacity && isCont(data[gapEnd]));
+            return true;
+        }
+
+        // posから1文字取り出してposを進める(outは5バイト以上)。終端なら0
+        size_t getChar(size_t &pos, char *out) const
+        {
+            size_t sz = size();
+            size_t n = 0;
+            while (pos < sz && (n == 0 || isCont(at(pos))) && n < 4)
+                out[n++] = at(pos++);
+            out[n] = '\0';
+            return n;
+        }
+
+        // 連続した文字列にコピー(末尾は文字単位で切り詰め、常に終端する)
+        size_t copyTo(char *buff, size_t buffsize) const
+        {
+            if (buffsize == 0)
+                return 0;
+            size_t n = size();
+            if (n > buffsize - 1)
+            {
+                n = buffsize - 1;
+                while (n > 0 && isCont(at(n)))
+                    n--;
+            }
+            for (size_t i = 0; i < n; i++)
+                buff[i] = at(i);
+            buff[n] = '\0';
+            return n;
+        }
+        void assign(const char *s)
+        {
+            clear();
+            insertString(s, strlen(s));
+        }
+    };
+}
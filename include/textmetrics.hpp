@@ -0,0 +1,104 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+//
+// UTF-8文字列の計測
+// 表示幅は半角(ASCII)=1セル、それ以外=2セル
+//
+namespace Text
+{
+    struct Metrics
+    {
+        size_t bytes = 0;
+        size_t codePoints = 0;
+        size_t cells = 0;
+    };
+
+    // 定数文字列用(コンパイル時に評価できる)
+    constexpr size_t cellsConst(const char *str)
+    {
+        size_t len = 0;
+        while (uint8_t ch = *str)
+        {
+            int cnt = ch < 0x80 ? 1 : ch < 0xe0 ? 2 : ch < 0xf0 ? 3 : 4;
+            str += cnt;
+            len += cnt > 1 ? 2 : 1;
+        }
+        return len;
+    }
+
+    namespace Detail
+    {
+        constexpr uint32_t Ones = 0x01010101;
+        constexpr uint32_t Highs = 0x80808080;
+
+        // 各バイトのbit7だけが立ったマスクの立っている数
+        inline uint32_t countHighs(uint32_t m)
+        {
+            return ((m >> 7) * Ones) >> 24;
+        }
+        inline void addByte(Metrics &m, uint8_t ch)
+        {
+            m.bytes++;
+            if (ch < 0x80)
+            {
+                m.codePoints++;
+                m.cells++;
+            }
+            else if (ch >= 0xc0)
+            {
+                m.codePoints++;
+                m.cells += 2;
+            }
+        }
+    }
+
+    ///
+    /// 4バイト単位で数える
+    /// ASCII: bit7=0 / 先頭バイト: bit7=1,bit6=1 / 継続バイト: bit7=1,bit6=0
+    /// 最後のワードは終端の先まで読む(アラインしてあるので範囲外には出ない)。ASanはこれを誤検出するので外す
+    ///
+    __attribute__((no_sanitize_address)) inline Metrics measure(const char *str)
+    {
+        using namespace Detail;
+        Metrics m;
+        auto *p = reinterpret_cast<const uint8_t *>(str);
+        // 境界合わせ(アラインされたワード読みはページをまたがない)
+        while (reinterpret_cast<uintptr_t>(p) & 3)
+        {
+            if (*p == 0)
+                return m;
+            addByte(m, *p++);
+        }
+        size_t ascii = 0;
+        size_t lead = 0;
+        size_t words = 0;
+        while (true)
+        {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            if ((v - Ones) & ~v & Highs)
+                break; // 0のバイトを含む
+            ascii += countHighs(~v & Highs);
+            lead += countHighs(v & (v << 1) & Highs);
+            words++;
+            p += 4;
+        }
+        m.bytes += words * 4;
+        m.codePoints += ascii + lead;
+        m.cells += ascii + lead * 2;
+        while (*p)
+            addByte(m, *p++);
+        return m;
+    }
+
+    inline size_t cells(const char *str) { return measure(str).cells; }
+    inline size_t codePoints(const char *str) { return measure(str).codePoints; }
+}
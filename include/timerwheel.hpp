@@ -0,0 +1,99 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Worker
+{
+    ///
+    /// ハッシュ化タイマーホイール
+    /// 登録・取り消しはO(1)、1ティック進めるごとに1スロット分のリストだけを見る
+    /// 周回数(rounds)でホイール1周より長い待ちを表す
+    ///
+    template <int MaxTimers, int Slots>
+    class TimerWheel
+    {
+        static_assert((Slots & (Slots - 1)) == 0, "slot count must be a power of 2");
+        static constexpr uint32_t Mask = Slots - 1;
+        static constexpr int16_t None = -1;
+
+        struct Node
+        {
+            int16_t prev = None;
+            int16_t next = None;
+            uint32_t rounds = 0;
+            uint16_t slot = 0;
+            bool linked = false;
+        };
+        Node nodes[MaxTimers];
+        int16_t heads[Slots];
+        uint32_t tick = 0;
+
+    public:
+        TimerWheel()
+        {
+            for (auto &h : heads)
+                h = None;
+        }
+
+        uint32_t getTick() const { return tick; }
+        bool isLinked(int id) const { return nodes[id].linked; }
+
+        // ticks後に発火する(0は次のティック扱い)
+        void insert(int id, uint32_t ticks)
+        {
+            if (ticks == 0)
+                ticks = 1;
+            auto &n = nodes[id];
+            if (n.linked)
+                remove(id);
+            n.slot = (tick + ticks) & Mask;
+            n.rounds = (ticks - 1) / Slots;
+            n.prev = None;
+            n.next = heads[n.slot];
+            if (n.next != None)
+                nodes[n.next].prev = id;
+            heads[n.slot] = id;
+            n.linked = true;
+        }
+
+        void remove(int id)
+        {
+            auto &n = nodes[id];
+            if (!n.linked)
+                return;
+            if (n.prev != None)
+                nodes[n.prev].next = n.next;
+            else
+                heads[n.slot] = n.next;
+            if (n.next != None)
+                nodes[n.next].prev = n.prev;
+            n.linked = false;
+        }
+
+        // 1ティック進め、期限の来たものを外してfire(id)を呼ぶ(fire内で再登録してよい)
+        template <typename F>
+        void advance(F &&fire)
+        {
+            tick++;
+            int16_t id = heads[tick & Mask];
+            while (id != None)
+            {
+                auto &n = nodes[id];
+                int16_t next = n.next;
+                if (n.rounds == 0)
+                {
+                    remove(id);
+                    fire(id);
+                }
+                else
+                    n.rounds--;
+                id = next;
+            }
+        }
+    };
+}
@@ -0,0 +1,182 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+//
+// イベントトレース
+// コア毎のリングバッファにbegin/end/instantを記録し、バイナリでダンプする
+// (tools/trace2json.py でChrome trace JSONに変換)
+// ENABLE_TRACE 未定義時はマクロが空になる
+//
+#ifdef ENABLE_TRACE
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+namespace Trace
+{
+    enum Type : uint8_t
+    {
+        Begin,
+        End,
+        Instant,
+    };
+
+    struct Event
+    {
+        uint32_t ts; // us(esp_timer: 両コア共通の時刻)
+        const char *name;
+        TaskHandle_t task;
+        uint8_t type;
+        uint8_t core;
+        uint16_t pad;
+    };
+
+    ///
+    /// コア毎のリング(書き込み位置をアトミックに確保するだけでロックは取らない)
+    ///
+    struct Ring
+    {
+        static constexpr uint32_t Size = 512;
+        Event events[Size];
+        uint32_t head = 0;
+    };
+
+    inline Ring *rings()
+    {
+        static Ring ring[2];
+        return ring;
+    }
+    inline volatile bool &enabled()
+    {
+        static volatile bool en = true;
+        return en;
+    }
+
+    inline void emit(Type type, const char *name)
+    {
+        if (!enabled())
+            return;
+        auto core = xPortGetCoreID();
+        auto &r = rings()[core];
+        auto i = __atomic_fetch_add(&r.head, 1, __ATOMIC_RELAXED) & (Ring::Size - 1);
+        auto &ev = r.events[i];
+        ev.ts = (uint32_t)esp_timer_get_time();
+        ev.name = name;
+        ev.task = xTaskGetCurrentTaskHandle();
+        ev.type = type;
+        ev.core = core;
+    }
+
+    class Scope
+    {
+        const char *name;
+
+    public:
+        Scope(const char *n) : name(n) { emit(Begin, n); }
+        ~Scope() { emit(End, name); }
+    };
+
+    ///
+    /// ダンプ
+    /// "CTRC" ver 文字列表 タスク表 イベント列 の順(値は全てリトルエンディアン)
+    ///
+    class Dumper
+    {
+        static constexpr int MaxNames = 64;
+        Print &out;
+        uintptr_t names[MaxNames];
+        int numNames = 0;
+        uintptr_t tasks[16];
+        int numTasks = 0;
+
+        template <typename T>
+        void put(T v) { out.write((const uint8_t *)&v, sizeof(T)); }
+        void putString(const char *s)
+        {
+            uint8_t len = strnlen(s, 255);
+            put(len);
+            out.write((const uint8_t *)s, len);
+        }
+        static void addUnique(uintptr_t *tbl, int &num, int cap, uintptr_t v)
+        {
+            for (int i = 0; i < num; i++)
+                if (tbl[i] == v)
+                    return;
+            if (num < cap)
+                tbl[num++] = v;
+        }
+
+    public:
+        Dumper(Print &o) : out(o) {}
+
+        void dump()
+        {
+            // 書き込み中のイベントが落ち着くまで待つ
+            enabled() = false;
+            delay(10);
+
+            uint32_t count[2];
+            for (int c = 0; c < 2; c++)
+            {
+                const auto &r = rings()[c];
+                count[c] = r.head < Ring::Size ? r.head : Ring::Size;
+                for (uint32_t i = 0; i < count[c]; i++)
+                {
+                    const auto &ev = r.events[(r.head - count[c] + i) & (Ring::Size - 1)];
+                    addUnique(names, numNames, MaxNames, (uintptr_t)ev.name);
+                    addUnique(tasks, numTasks, 16, (uintptr_t)ev.task);
+                }
+            }
+
+            out.write((const uint8_t *)"CTRC", 4);
+            put<uint32_t>(1);
+            put<uint32_t>(numNames);
+            for (int i = 0; i < numNames; i++)
+            {
+                put<uint32_t>(names[i]);
+                putString((const char *)names[i]);
+            }
+            put<uint32_t>(numTasks);
+            for (int i = 0; i < numTasks; i++)
+            {
+                put<uint32_t>(tasks[i]);
+                putString(pcTaskGetTaskName((TaskHandle_t)tasks[i]));
+            }
+            for (int c = 0; c < 2; c++)
+            {
+                auto &r = rings()[c];
+                put<uint32_t>(count[c]);
+                for (uint32_t i = 0; i < count[c]; i++)
+                {
+                    const auto &ev = r.events[(r.head - count[c] + i) & (Ring::Size - 1)];
+                    put<uint32_t>(ev.ts);
+                    put<uint32_t>((uintptr_t)ev.name);
+                    put<uint32_t>((uintptr_t)ev.task);
+                    put<uint8_t>(ev.type);
+                    put<uint8_t>(ev.core);
+                }
+                r.head = 0;
+            }
+            enabled() = true;
+        }
+    };
+}
+
+#define TRACE_CAT2(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT2(a, b)
+#define TRACE_SCOPE(name) Trace::Scope TRACE_CAT(traceScope, __LINE__)(name)
+#define TRACE_BEGIN(name) Trace::emit(Trace::Begin, name)
+#define TRACE_END(name) Trace::emit(Trace::End, name)
+#define TRACE_INSTANT(name) Trace::emit(Trace::Instant, name)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#define TRACE_INSTANT(name)
+
+#endif
@@ -6,36 +6,20 @@
 
 #include <Arduino.h>
 #include <LovyanGFX.hpp>
-#include <vector>
-#include <array>
+#include <profiler.hpp>
+#include <render.hpp>
+#include <stringpool.hpp>
+#include <textbuffer.hpp>
+#include <textmetrics.hpp>
 
 namespace UI
 {
     ///
-    /// 文字列
+    /// 文字列の表示幅(セル数)
     ///
-    int utf8bc(char ch)
+    inline int utf8len(const char *str)
     {
-        if (0 <= uint8_t(ch) && uint8_t(ch) < 0x80)
-            return 1;
-        if (0xc2 <= uint8_t(ch) && uint8_t(ch) < 0xe0)
-            return 2;
-        if (0xe0 <= uint8_t(ch) && uint8_t(ch) < 0xf0)
-            return 3;
-        if (0xf0 <= uint8_t(ch) && uint8_t(ch) < 0xf8)
-            return 4;
-        return 0;
-    }
-    int utf8len(const char *str)
-    {
-        int len = 0;
-        while (char ch = *str)
-        {
-            int cnt = utf8bc(ch);
-            str += cnt;
-            len += cnt > 1 ? 2 : 1;
-        }
-        return len;
+        return Text::cells(str);
     }
 
     ///
@@ -62,7 +46,14 @@ namespace UI
         bool drawRequest = false;
         int fontWidth = 12;
         int fontHeight = 24;
-        std::vector<char> clipboard;
+        const lgfx::IFont *font = &fonts::lgfxJapanGothic_24;
+        char clipboard[TextBuffer::Capacity];
+        size_t clipSize = 0;
+        // ボタン等のキャプション置き場
+        char captionBuffer[512];
+        StringPool captions;
+
+        Context() { captions.attach(captionBuffer, sizeof(captionBuffer)); }
 
         void setBoundingBox(int x, int y, int w, int h)
         {
@@ -76,7 +67,7 @@ namespace UI
                 bbBottom = y + h;
             bbEnabled = true;
         }
-        void clear(LGFX *gfx)
+        void clear(Painter *gfx)
         {
             if (bbEnabled)
             {
@@ -84,24 +75,18 @@ namespace UI
                 resetBB();
             }
         }
-        void copy(std::vector<char> &src)
+        void copy(const TextBuffer &src)
         {
-            if (clipboard.capacity() == 0)
-                clipboard.reserve(48);
-            clipboard = src;
+            clipSize = src.copyTo(clipboard, sizeof(clipboard));
         }
-        void paste(std::vector<char> &dst, std::vector<char>::iterator &it)
+        void paste(TextBuffer &dst)
         {
-            for (auto c : clipboard)
-            {
-                if (dst.size() < dst.capacity())
-                    dst.insert(it++, c);
-                else
-                    break;
-            }
+            dst.insertString(clipboard, clipSize);
         }
     };
 
+    struct Layer;
+
     //
     // UI:ウィジェット基礎
     //
@@ -109,7 +94,8 @@ namespace UI
     {
     private:
         friend class Control;
-        friend class Layer;
+        friend struct Layer;
+        Layer *owner = nullptr;
         bool needUpdate = false;
         bool focused = false;
         Widget *focusNext = nullptr;
@@ -117,27 +103,20 @@ namespace UI
 
     protected:
         Context *context = nullptr;
-        LGFX *gfx = nullptr;
+        Painter *gfx = nullptr;
 
         int x = 0;
         int y = 0;
         int w = 0;
         int h = 0;
 
-        void initialize(Context *ctx, LGFX *g)
+        void initialize(Context *ctx, Painter *g)
         {
             context = ctx;
             gfx = g;
         }
 
-        void update(bool nu = true)
-        {
-            if (nu)
-            {
-                needUpdate = true;
-                context->drawRequest = true;
-            }
-        }
+        void update(bool nu = true);
         bool checkUpdate()
         {
             bool nu = needUpdate;
@@ -151,10 +130,15 @@ namespace UI
 
         //
         virtual void draw() {}
+        // 強制再描画の前に呼ばれる(部分描画するウィジェット用)
+        virtual void invalidate() {}
         void drawBase(bool forceDraw)
         {
+            if (forceDraw)
+                invalidate();
             if (checkUpdate() || forceDraw)
             {
+                PROFILE_SCOPE(WidgetDraw);
                 draw();
                 context->setBoundingBox(x, y, w, h);
             }
@@ -180,7 +164,7 @@ namespace UI
         virtual ~Widget() = default;
 
         //
-        virtual void setCaption(String c) {}
+        virtual void setCaption(const char *c) {}
 
         //
         int getWidth() const { return w; }
@@ -210,9 +194,19 @@ namespace UI
         Widget *currentFocus = nullptr;
         Widget *drawSet = nullptr;
         Widget *lastWidget = nullptr;
+        uint16_t *snapshot = nullptr; // PSRAM上の画面キャッシュ
+        bool cached = false;          // snapshotが現在の表示内容と一致
+        bool dirty = true;            // 最後の描画以降に更新要求あり
+        //
+        void invalidate()
+        {
+            cached = false;
+            dirty = true;
+        }
         //
         void appendWidget(Widget *w)
         {
+            w->owner = this;
             if (!currentFocus)
                 setFocus(w);
             if (lastWidget)
@@ -259,6 +253,17 @@ namespace UI
         }
     };
 
+    inline void Widget::update(bool nu)
+    {
+        if (nu)
+        {
+            needUpdate = true;
+            context->drawRequest = true;
+            if (owner)
+                owner->invalidate();
+        }
+    }
+
     ///
     /// コントローラ
     ///
@@ -266,19 +271,29 @@ namespace UI
     {
     public:
         using ChangeLayerHook = void (*)(void *);
+        struct LayerStats
+        {
+            uint32_t switches = 0;
+            uint32_t cacheHits = 0;
+            uint32_t lastTime = 0; // us
+            uint32_t maxTime = 0;
+        };
+        static constexpr int SnapshotWidth = 320;
+        static constexpr int SnapshotHeight = 205; // 情報表示より上
 
     private:
         Context context;
-        LGFX *gfx = nullptr;
+        Painter *gfx = nullptr;
         Layer layerPool[10]{};
         int layerIndex = 0;
         Layer *layer = nullptr;
         bool requestLayer = false;
         ChangeLayerHook layerHook = nullptr;
         void *layerHookArg = nullptr;
+        LayerStats layerStats;
 
     public:
-        void init(LGFX *g)
+        void init(Painter *g)
         {
             gfx = g;
             setLayer(0);
@@ -294,7 +309,36 @@ namespace UI
         }
         int getLayer() const { return layerIndex; }
         ///
-        bool needDraw() const { return context.drawRequest; }
+        /// レイヤーの画面キャッシュを有効にする(PSRAMが無ければfalse)
+        ///
+        bool enableSnapshot(int idx)
+        {
+            auto &l = layerPool[idx];
+            if (!l.snapshot)
+                l.snapshot = static_cast<uint16_t *>(heap_caps_malloc(SnapshotWidth * SnapshotHeight * sizeof(uint16_t), MALLOC_CAP_SPIRAM));
+            return l.snapshot != nullptr;
+        }
+        /// 何も更新が無いフレームで呼ぶ: 表示中のレイヤーを読み戻して保存
+        /// 読み戻しは描画タスクに積む(直接描画ではSPIの転送でループが止まるので取らない)
+        void captureIdle()
+        {
+            if (!gfx->isDeferred())
+                return;
+            if (requestLayer || context.drawRequest || !layer->snapshot || layer->cached || layer->dirty)
+                return;
+            // 読み戻し中に別スレッドから更新されたら無効になるよう先に立てる
+            layer->cached = true;
+            gfx->readRect(0, 0, SnapshotWidth, SnapshotHeight, layer->snapshot);
+        }
+        /// ウィジェット以外の描画(重ね表示など)でスナップショットの範囲が変わったら呼ぶ
+        void invalidateSnapshots()
+        {
+            for (auto &l : layerPool)
+                l.cached = false;
+        }
+        const LayerStats &getLayerStats() const { return layerStats; }
+        ///
+        bool needDraw() const { return context.drawRequest || requestLayer; }
         ///
         Widget *getCurrentFocus()
         {
@@ -322,18 +366,40 @@ namespace UI
         ///
         void drawWidgets()
         {
+            uint32_t startTime = micros();
+            bool forceDraw = requestLayer;
             if (requestLayer)
-                context.clear(gfx);
+            {
+                layerStats.switches++;
+                if (layer->cached)
+                {
+                    // 変化の無いレイヤーはキャッシュを1回転送するだけ
+                    gfx->pushImageRef(0, 0, SnapshotWidth, SnapshotHeight, layer->snapshot);
+                    context.setBoundingBox(0, 0, SnapshotWidth, SnapshotHeight);
+                    layerStats.cacheHits++;
+                    forceDraw = false;
+                }
+                else
+                    context.clear(gfx);
+            }
+            layer->dirty = false;
 
             auto *dset = layer->drawSet;
             auto *next = dset;
             for (auto *w = next; w; w = next)
             {
-                w->drawBase(requestLayer);
+                w->drawBase(forceDraw);
                 next = w->focusNext;
                 if (next == dset)
                     break;
             }
+            if (requestLayer)
+            {
+                uint32_t t = micros() - startTime;
+                layerStats.lastTime = t;
+                if (t > layerStats.maxTime)
+                    layerStats.maxTime = t;
+            }
             if (requestLayer && layerHook)
                 layerHook(layerHookArg);
             layerHook = nullptr;
@@ -379,7 +445,7 @@ namespace UI
         static constexpr int mY = 10; // margin Y
         static constexpr int rd = 8;  // round size
 
-        String caption{};
+        StringPool::Handle caption{};
         int len = 0;
 
         PressFunction pressFunc = nullptr;
@@ -392,13 +458,13 @@ namespace UI
             {
                 gfx->setTextColor(TFT_WHITE);
                 gfx->fillRoundRect(x, y, w, h, rd, TFT_BLUE);
-                gfx->drawString(caption, x + mX, y + mY);
+                gfx->drawString(context->captions.get(caption), x + mX, y + mY);
             }
             else
             {
                 gfx->setTextColor(TFT_BLACK);
                 gfx->fillRoundRect(x, y, w, h, rd, TFT_WHITE);
-                gfx->drawString(caption, x + mX, y + mY);
+                gfx->drawString(context->captions.get(caption), x + mX, y + mY);
                 gfx->drawRoundRect(x, y, w, h, rd, TFT_BLUE);
             }
         }
@@ -413,10 +479,14 @@ namespace UI
         ~TextButton() = default;
 
         //
-        void setCaption(String c) override
+        void setCaption(const char *c) override
         {
-            caption = c;
-            len = utf8len(c.c_str());
+            if (!context->captions.replace(c, caption))
+            {
+                Serial.printf("ui: caption pool full (%s)\n", c);
+                return;
+            }
+            len = utf8len(c);
 
             int width = len * context->fontWidth + mX * 2;
             int height = context->fontHeight + mY * 2;
@@ -446,7 +516,7 @@ namespace UI
         static constexpr int rd = 8;  // round size
         static constexpr int mB = 10; // box margin(X)
 
-        String caption{};
+        StringPool::Handle caption{};
         int len = 0;
 
         PressFunction updateFunc = nullptr;
@@ -472,7 +542,7 @@ namespace UI
                 gfx->fillRect(x + mX + ofs, y + ofsY + ofs, checkSize, checkSize, TFT_BLUE);
             }
             gfx->setTextColor(isF ? TFT_WHITE : TFT_BLACK);
-            gfx->drawString(caption, x + textX, y + mY);
+            gfx->drawString(context->captions.get(caption), x + textX, y + mY);
         }
         //
         void onPressed(int, int) override
@@ -491,10 +561,14 @@ namespace UI
         bool getValue() const { return checked; }
 
         //
-        void setCaption(String c) override
+        void setCaption(const char *c) override
         {
-            caption = c;
-            len = utf8len(c.c_str());
+            if (!context->captions.replace(c, caption))
+            {
+                Serial.printf("ui: caption pool full (%s)\n", c);
+                return;
+            }
+            len = utf8len(c);
 
             int width = len * context->fontWidth + mX * 2 + bS + mB;
             int height = context->fontHeight + mY * 2;
@@ -521,7 +595,15 @@ namespace UI
         static constexpr int mX = 5; // margin X
         static constexpr int mY = 5; // margin Y
 
-        std::vector<String> strList;
+        // 1項目あたりの文字列領域の目安(バイト)
+        static constexpr size_t EntryBytes = 48;
+
+        // ハンドル配列と文字列領域を1ブロックで確保する
+        void *block = nullptr;
+        StringPool::Handle *entries = nullptr;
+        StringPool pool;
+        size_t count = 0;
+        size_t capacity = 0;
         size_t selected = -1;
         int dispIndex = 0;
         int dispRow = 0;
@@ -539,10 +621,10 @@ namespace UI
                 int fg = idx == selected ? TFT_BLACK : TFT_WHITE;
                 int bg = idx == selected ? TFT_ORANGE : TFT_BLACK;
                 gfx->fillRect(x + mX, dy + mY, w - mX * 2, context->fontHeight, bg);
-                if (idx < strList.size())
+                if (idx < count)
                 {
                     gfx->setTextColor(fg);
-                    gfx->drawString(strList[idx], x + mX, dy + mY);
+                    gfx->drawString(pool.get(entries[idx]), x + mX, dy + mY);
                 }
                 dy += context->fontHeight + mY;
             }
@@ -552,7 +634,7 @@ namespace UI
         {
             size_t sel = ofsy / (context->fontHeight + mY) + dispIndex;
             portENTER_CRITICAL(&listMux);
-            if (sel < strList.size())
+            if (sel < count)
             {
                 if (sel != selected)
                 {
@@ -560,20 +642,20 @@ namespace UI
                     selected = sel;
                 }
                 else if (selectFunc)
-                    selectFunc(selected, strList[selected].c_str());
+                    selectFunc(selected, pool.get(entries[selected]));
             }
             portEXIT_CRITICAL(&listMux);
         }
 
     public:
-        ~ListBox() = default;
+        ~ListBox() { free(block); }
 
         //
         void scoll(int ofs)
         {
             int di = max(0, dispIndex + ofs);
-            if (di >= strList.size())
-                di = strList.size() - 1;
+            if (di >= count)
+                di = count - 1;
             if (di != dispIndex)
             {
                 dispIndex = di;
@@ -587,9 +669,13 @@ namespace UI
             selectFunc = sf;
         }
 
-        //
+        // n: 最大項目数(領域は最初に確保し、以後は増やさない限り再確保しない)
         void init(size_t n, int width = 0, int height = 0)
         {
+            void *newBlock = nullptr;
+            if (n > capacity)
+                newBlock = malloc(n * (sizeof(StringPool::Handle) + EntryBytes));
+
             portENTER_CRITICAL(&listMux);
             if (height == 0)
             {
@@ -602,10 +688,16 @@ namespace UI
                 dispRow = (height - mY) / (context->fontHeight + mY);
             }
 
-            if (n > strList.capacity())
+            void *oldBlock = nullptr;
+            if (newBlock)
             {
-                strList.reserve(n);
-                strList.resize(0);
+                oldBlock = block;
+                block = newBlock;
+                entries = static_cast<StringPool::Handle *>(block);
+                pool.attach(reinterpret_cast<char *>(entries + n), n * EntryBytes);
+                capacity = n;
+                count = 0;
+                selected = -1;
                 w = 0;
             }
             if (width != 0)
@@ -614,23 +706,26 @@ namespace UI
             }
             dispIndex = 0;
             portEXIT_CRITICAL(&listMux);
+            free(oldBlock);
         }
         void clear()
         {
             portENTER_CRITICAL(&listMux);
-            strList.resize(0);
+            count = 0;
+            pool.reset();
             selected = -1;
             dispIndex = 0;
             update();
             portEXIT_CRITICAL(&listMux);
         }
+        // 項目数か文字列領域が尽きたらfalse
         bool append(const char *s)
         {
             bool ret = false;
             portENTER_CRITICAL(&listMux);
-            if (strList.size() < strList.capacity())
+            if (count < capacity && pool.add(s, entries[count]))
             {
-                strList.push_back(s);
+                count++;
                 int width = utf8len(s) * context->fontWidth;
                 if (w < width)
                     w = width;
@@ -640,32 +735,75 @@ namespace UI
             portEXIT_CRITICAL(&listMux);
             return ret;
         }
-        size_t size() const { return strList.size(); }
+        // 中身をまとめて入れ替える(clear()+append()と違い、同じ項目が残れば選択を引き継ぐ)
+        // 変わらなければ再描画しない。入りきらない分は捨ててfalse
+        bool assign(const char *const *items, size_t n)
+        {
+            bool ret = true;
+            portENTER_CRITICAL(&listMux);
+            bool same = n == count;
+            for (size_t i = 0; same && i < n; i++)
+                same = strcmp(items[i], pool.get(entries[i])) == 0;
+            if (!same)
+            {
+                size_t sel = -1;
+                for (size_t i = 0; selected < count && i < n && sel == size_t(-1); i++)
+                    if (strcmp(items[i], pool.get(entries[selected])) == 0)
+                        sel = i;
+                pool.reset();
+                count = 0;
+                for (size_t i = 0; i < n; i++)
+                {
+                    if (count >= capacity || !pool.add(items[i], entries[count]))
+                    {
+                        ret = false;
+                        break;
+                    }
+                    int width = utf8len(items[i]) * context->fontWidth;
+                    if (w < width)
+                        w = width;
+                    count++;
+                }
+                selected = sel < count ? sel : -1;
+                if (dispIndex > 0 && dispIndex >= count)
+                    dispIndex = count > 0 ? count - 1 : 0;
+                update();
+            }
+            portEXIT_CRITICAL(&listMux);
+            return ret;
+        }
+        size_t size() const { return count; }
         const char *operator[](size_t idx) const
         {
-            if (idx < strList.size())
-                return strList[idx].c_str();
+            if (idx < count)
+                return pool.get(entries[idx]);
             return nullptr;
         }
+        // 文字列領域は詰めない(次のclear()で回収する)
         void erase(size_t idx)
         {
             portENTER_CRITICAL(&listMux);
-            if (idx < strList.size())
+            if (idx < count)
             {
-                strList.erase(strList.begin() + idx);
+                memmove(entries + idx, entries + idx + 1, (count - idx - 1) * sizeof(StringPool::Handle));
+                count--;
                 update();
             }
             portEXIT_CRITICAL(&listMux);
         }
+        // 文字列領域の使用量
+        size_t getPoolUsed() const { return pool.getUsed(); }
+        size_t getPoolCapacity() const { return pool.getCapacity(); }
     };
 
     //
-    // UI:キーボード
+    // キーボード配列(コンパイル時に生成し、フラッシュに置く)
     //
-    class Keyboard : public Widget
+    namespace KeyLayout
     {
-        static constexpr int mX = 5; // margin X
-        static constexpr int mY = 5; // margin Y
+        constexpr int Rows = 5;
+        constexpr int Columns = 10; // 1行の幅(キー幅の単位数)
+        constexpr int MaxKeys = Rows * Columns;
 
         enum class Type : uint8_t
         {
@@ -686,222 +824,419 @@ namespace UI
             Layer2,
             Layer3,
         };
+
         struct CharInfo
         {
-            Type type = Type::Char;
-            const char *dispChar = "a";
-            int code = 'a';
-            int size = 1;
-            CharInfo() = default;
-            CharInfo(int c, const char *d) : dispChar(d), code(c) {}
-            CharInfo(Type t, int s, const char *d) : type(t), dispChar(d), code('\0'), size(s) {}
+            Type type;
+            uint8_t size; // キー幅(単位数)
+            uint8_t len;  // dispCharの表示幅
+            char code;
+            const char *dispChar;
+            constexpr CharInfo(char c, const char *d) : type(Type::Char), size(1), len(Text::cellsConst(d)), code(c), dispChar(d) {}
+            constexpr CharInfo(Type t, int s, const char *d) : type(t), size(s), len(Text::cellsConst(d)), code('\0'), dispChar(d) {}
         };
-        using CharLine = std::vector<CharInfo>;
-        using CharLayer = std::array<CharLine, 5>;
+
+        ///
+        /// (行,列単位)→キー番号の表と、キー番号→位置の表
+        ///
+        struct Grid
+        {
+            uint8_t cell[Rows][Columns]{};
+            uint8_t row[MaxKeys]{};
+            uint8_t col[MaxKeys]{};
+            uint8_t rowWidth[Rows]{}; // 行ごとのキー幅の合計(行をまたいだキーは全幅を前の行に数える)
+            int numKeys = 0;
+            int numCells = 0;
+
+            // どの行もちょうどColumns幅で埋まっている
+            constexpr bool rowsFilled() const
+            {
+                for (int r = 0; r < Rows; r++)
+                    if (rowWidth[r] != Columns)
+                        return false;
+                return true;
+            }
+        };
+        template <size_t N>
+        constexpr Grid makeGrid(const CharInfo (&keys)[N])
+        {
+            Grid g{};
+            int r = 0;
+            int c = 0;
+            for (size_t i = 0; i < N && r < Rows; i++)
+            {
+                g.row[i] = r;
+                g.col[i] = c;
+                g.rowWidth[r] += keys[i].size;
+                for (int s = 0; s < keys[i].size && c < Columns; s++)
+                    g.cell[r][c++] = i;
+                g.numCells += keys[i].size;
+                if (c >= Columns)
+                {
+                    c = 0;
+                    r++;
+                }
+            }
+            g.numKeys = N;
+            return g;
+        }
+
+        struct Layer
+        {
+            const CharInfo *keys;
+            const Grid &grid;
+
+            const CharInfo *hit(int r, int c) const
+            {
+                if (r < 0 || r >= Rows || c < 0 || c >= Columns)
+                    return nullptr;
+                return &keys[grid.cell[r][c]];
+            }
+            // このレイヤーのキーならキー番号、違えば-1
+            int indexOf(const CharInfo *key) const
+            {
+                if (key < keys || key >= keys + grid.numKeys)
+                    return -1;
+                return key - keys;
+            }
+        };
+
+        constexpr CharInfo defaultKeys[] = {
+            {'1', "１"}, {'2', "２"}, {'3', "３"}, {'4', "４"}, {'5', "５"}, {'6', "６"}, {'7', "７"}, {'8', "８"}, {'9', "９"}, {'0', "０"},
+            {'q', "ｑ"}, {'w', "ｗ"}, {'e', "ｅ"}, {'r', "ｒ"}, {'t', "ｔ"}, {'y', "ｙ"}, {'u', "ｕ"}, {'i', "ｉ"}, {'o', "ｏ"}, {'p', "ｐ"},
+            {'a', "ａ"}, {'s', "ｓ"}, {'d', "ｄ"}, {'f', "ｆ"}, {'g', "ｇ"}, {'h', "ｈ"}, {'j', "ｊ"}, {'k', "ｋ"}, {'l', "ｌ"}, {'.', "."},
+            {'z', "ｚ"}, {'x', "ｘ"}, {'c', "ｃ"}, {'v', "ｖ"}, {'b', "ｂ"}, {'n', "ｎ"}, {'m', "ｍ"}, {'@', "＠"}, {Type::BackSpace, 2, "BS"},
+            {Type::Layer2, 2, "ABC"}, {Type::Space, 2, "SPC"}, {Type::Layer3, 2, "+="}, {Type::Left, 2, "←"}, {Type::Right, 2, "→"},
+        };
+        constexpr CharInfo shiftKeys[] = {
+            {'!', "！"}, {'"', "”"}, {'#', "＃"}, {'$', "＄"}, {'%', "％"}, {'&', "＆"}, {'\'', "’"}, {'(', "（"}, {')', "）"}, {'^', "＾"},
+            {'Q', "Ｑ"}, {'W', "Ｗ"}, {'E', "Ｅ"}, {'R', "Ｒ"}, {'T', "Ｔ"}, {'Y', "Ｙ"}, {'U', "Ｕ"}, {'I', "Ｉ"}, {'O', "Ｏ"}, {'P', "Ｐ"},
+            {'A', "Ａ"}, {'S', "Ｓ"}, {'D', "Ｄ"}, {'F', "Ｆ"}, {'G', "Ｇ"}, {'H', "Ｈ"}, {'J', "Ｊ"}, {'K', "Ｋ"}, {'L', "Ｌ"}, {';', "；"},
+            {'Z', "Ｚ"}, {'X', "Ｘ"}, {'C', "Ｃ"}, {'V', "Ｖ"}, {'B', "Ｂ"}, {'N', "Ｎ"}, {'M', "Ｍ"}, {'=', "＝"}, {Type::BackSpace, 2, "BS"},
+            {Type::Layer1, 2, "abc"}, {Type::Space, 2, "SPC"}, {Type::Layer3, 2, "+="}, {Type::Left, 2, "←"}, {Type::Right, 2, "→"},
+        };
+        constexpr CharInfo symbolKeys[] = {
+            {'+', "＋"}, {'-', "ー"}, {'/', "／"}, {'*', "＊"}, {'=', "＝"}, {':', "："}, {'[', "［"}, {']', "］"}, {'<', "＜"}, {'>', "＞"},
+            {'{', "｛"}, {'}', "｝"}, {'?', "？"}, {'_', "＿"}, {'|', "｜"}, {'~', "〜"}, {'\\', "￥"}, {',', "，"}, {'`', "｀"}, {'@', "＠"},
+            {'!', "！"}, {'"', "”"}, {'#', "＃"}, {'$', "＄"}, {'%', "％"}, {'&', "＆"}, {'\'', "’"}, {'(', "（"}, {')', "）"}, {'^', "＾"},
+            {'.', "．"}, {';', "；"}, {Type::Copy, 2, "写"}, {Type::Paste, 2, "貼"}, {Type::Clear, 2, "Clr"}, {Type::BackSpace, 2, "BS"},
+            {Type::Layer1, 2, "abc"}, {Type::Space, 2, "SPC"}, {Type::Layer2, 2, "ABC"}, {Type::Left, 2, "←"}, {Type::Right, 2, "→"},
+        };
+        constexpr Grid defaultGrid = makeGrid(defaultKeys);
+        constexpr Grid shiftGrid = makeGrid(shiftKeys);
+        constexpr Grid symbolGrid = makeGrid(symbolKeys);
+        static_assert(defaultGrid.numCells == MaxKeys, "default layout must fill 5x10");
+        static_assert(shiftGrid.numCells == MaxKeys, "shift layout must fill 5x10");
+        static_assert(symbolGrid.numCells == MaxKeys, "symbol layout must fill 5x10");
+        static_assert(defaultGrid.rowsFilled(), "each default row must be 10 units wide");
+        static_assert(shiftGrid.rowsFilled(), "each shift row must be 10 units wide");
+        static_assert(symbolGrid.rowsFilled(), "each symbol row must be 10 units wide");
+
+        constexpr Layer layers[] = {
+            {defaultKeys, defaultGrid},
+            {shiftKeys, shiftGrid},
+            {symbolKeys, symbolGrid},
+        };
+    }
+
+    //
+    // UI:キーボード
+    //
+    class Keyboard : public Widget
+    {
+        static constexpr int mX = 5; // margin X
+        static constexpr int mY = 5; // margin Y
+
+        using Type = KeyLayout::Type;
+        using CharInfo = KeyLayout::CharInfo;
+        using CharLayer = KeyLayout::Layer;
 
         String title{};
         String placeHolder = "Place Holder";
-        std::vector<char> body;
-        decltype(body)::iterator editIdx;
+        TextBuffer body;
         int layer = 0;
         const CharInfo *current = nullptr;
         bool passwordMode = false;
 
+        // 部分描画用
+        const CharInfo *drawnSel = nullptr;
+        bool fieldDirty = true;
+        bool keysDirty = true;
+        LGFX_Sprite atlas[3];
+        bool atlasFailed = false;
+        // 入力欄: 表示中のセル内容(UTF-8を詰めた値、全角の右半分は1)
+        static constexpr int MaxCells = 32;
+        uint32_t shown[MaxCells]{};
+        int shownCells = 0;
+        int shownCursor = -1;
+        bool placeHolderShown = false;
+        int scroll = 0; // 表示開始セル
+        uint32_t inputTime = 0;
+
+    public:
+        struct Stats
+        {
+            uint32_t keystrokes = 0; // キーに当たった押下の数
+            uint32_t pixels = 0; // 直近の描画で転送したピクセル数
+            uint32_t time = 0;   // 直近の描画時間(us)
+            uint32_t latency = 0; // 直近の入力→描画完了(us)
+        };
+
+    private:
+        Stats stats;
+
         const CharLayer &getLayer() const
         {
-            static const CharLayer defaultLayer = {
-                {{
-                     {'1', "１"},
-                     {'2', "２"},
-                     {'3', "３"},
-                     {'4', "４"},
-                     {'5', "５"},
-                     {'6', "６"},
-                     {'7', "７"},
-                     {'8', "８"},
-                     {'9', "９"},
-                     {'0', "０"},
-                 },
-                 {{'q', "ｑ"}, {'w', "ｗ"}, {'e', "ｅ"}, {'r', "ｒ"}, {'t', "ｔ"}, {'y', "ｙ"}, {'u', "ｕ"}, {'i', "ｉ"}, {'o', "ｏ"}, {'p', "ｐ"}},
-                 {{'a', "ａ"}, {'s', "ｓ"}, {'d', "ｄ"}, {'f', "ｆ"}, {'g', "ｇ"}, {'h', "ｈ"}, {'j', "ｊ"}, {'k', "ｋ"}, {'l', "ｌ"}, {'.', "."}},
-                 {{'z', "ｚ"},
-                  {'x', "ｘ"},
-                  {'c', "ｃ"},
-                  {'v', "ｖ"},
-                  {'b', "ｂ"},
-                  {'n', "ｎ"},
-                  {'m', "ｍ"},
-                  {'@', "＠"},
-                  {Type::BackSpace, 2, "BS"}},
-                 {{Type::Layer2, 2, "ABC"}, {Type::Space, 2, "SPC"}, {Type::Layer3, 2, "+="}, {Type::Left, 2, "←"}, {Type::Right, 2, "→"}}}};
-            if (layer == 0)
-                return defaultLayer;
-            static const CharLayer shiftLayer = {
-                {{
-                     {'!', "！"},
-                     {'"', "”"},
-                     {'#', "＃"},
-                     {'$', "＄"},
-                     {'%', "％"},
-                     {'&', "＆"},
-                     {'\'', "’"},
-                     {'(', "（"},
-                     {')', "）"},
-                     {'^', "＾"},
-                 },
-                 {{'Q', "Ｑ"}, {'W', "Ｗ"}, {'E', "Ｅ"}, {'R', "Ｒ"}, {'T', "Ｔ"}, {'Y', "Ｙ"}, {'U', "Ｕ"}, {'I', "Ｉ"}, {'O', "Ｏ"}, {'P', "Ｐ"}},
-                 {{'A', "Ａ"}, {'S', "Ｓ"}, {'D', "Ｄ"}, {'F', "Ｆ"}, {'G', "Ｇ"}, {'H', "Ｈ"}, {'J', "Ｊ"}, {'K', "Ｋ"}, {'L', "Ｌ"}, {';', "；"}},
-                 {
-                     {'Z', "Ｚ"},
-                     {'X', "Ｘ"},
-                     {'C', "Ｃ"},
-                     {'V', "Ｖ"},
-                     {'B', "Ｂ"},
-                     {'N', "Ｎ"},
-                     {'M', "Ｍ"},
-                     {'=', "＝"},
-                     {Type::BackSpace, 2, "BS"},
-                 },
-                 {{Type::Layer1, 2, "abc"}, {Type::Space, 2, "SPC"}, {Type::Layer3, 2, "+="}, {Type::Left, 2, "←"}, {Type::Right, 2, "→"}}}};
-            if (layer == 1)
-                return shiftLayer;
-            static const CharLayer symbolLayer = {
-                {{
-                     {'+', "＋"},
-                     {'-', "ー"},
-                     {'/', "／"},
-                     {'*', "＊"},
-                     {'=', "＝"},
-                     {':', "："},
-                     {'[', "［"},
-                     {']', "］"},
-                     {'<', "＜"},
-                     {'>', "＞"},
-                 },
-                 {
-                     {'{', "｛"},
-                     {'}', "｝"},
-                     {'?', "？"},
-                     {'_', "＿"},
-                     {'|', "｜"},
-                     {'~', "〜"},
-                     {'\\', "￥"},
-                     {',', "，"},
-                     {'`', "｀"},
-                     {'@', "＠"},
-                 },
-                 {
-                     {'!', "！"},
-                     {'"', "”"},
-                     {'#', "＃"},
-                     {'$', "＄"},
-                     {'%', "％"},
-                     {'&', "＆"},
-                     {'\'', "’"},
-                     {'(', "（"},
-                     {')', "）"},
-                     {'^', "＾"},
-                 },
-                 {
-                     {'.', "．"},
-                     {';', "；"},
-                     {Type::Copy, 2, "写"},
-                     {Type::Paste, 2, "貼"},
-                     {Type::Clear, 2, "Clr"},
-                     {Type::BackSpace, 2, "BS"},
-                 },
-                 {{Type::Layer1, 2, "abc"}, {Type::Space, 2, "SPC"}, {Type::Layer2, 2, "ABC"}, {Type::Left, 2, "←"}, {Type::Right, 2, "→"}}}};
-            return symbolLayer;
+            return KeyLayout::layers[layer];
         }
 
-        void draw() override
+        // キー1個の描画(画面とアトラス用スプライトの両方で使う)
+        template <typename G>
+        void drawKey(G *g, const CharInfo &c, int dx, int dy, bool sel) const
+        {
+            int w1 = context->fontWidth * 2 + mX;
+            int dw = w1 * c.size - mX;
+            int ofs = max(0, (w1 * c.size - context->fontWidth * c.len) / 2 - mX);
+            g->fillRect(dx, dy, dw, context->fontHeight, sel ? TFT_SKYBLUE : TFT_WHITE);
+            g->setTextColor(TFT_BLACK);
+            g->drawString(c.dispChar, dx + ofs, dy);
+        }
+        // キー領域の左上
+        int keysTop() const { return y + context->fontHeight + mY * 2; }
+        int keysHeight() const { return (context->fontHeight + mY) * KeyLayout::Rows; }
+        // 現在のレイヤーにあるキーならその位置を返す
+        bool findKey(const CharInfo *key, int &kx, int &ky) const
+        {
+            const auto &ly = getLayer();
+            int idx = ly.indexOf(key);
+            if (idx < 0)
+                return false;
+            kx = x + ly.grid.col[idx] * (context->fontWidth * 2 + mX);
+            ky = keysTop() + ly.grid.row[idx] * (context->fontHeight + mY);
+            return true;
+        }
+        // 全キーの描画
+        template <typename G>
+        void drawAllKeys(G *g, int ox, int oy) const
+        {
+            const auto &ly = getLayer();
+            int w1 = context->fontWidth * 2 + mX;
+            int rh = context->fontHeight + mY;
+            for (int i = 0; i < ly.grid.numKeys; i++)
+                drawKey(g, ly.keys[i], ox + ly.grid.col[i] * w1, oy + ly.grid.row[i] * rh, false);
+        }
+        // レイヤー毎のキートップ画像(PSRAM)。確保できなければnullptr
+        LGFX_Sprite *getAtlas()
+        {
+            auto &sp = atlas[layer];
+            if (sp.getBuffer())
+                return &sp;
+            if (atlasFailed)
+                return nullptr;
+            sp.setPsram(true);
+            sp.setColorDepth(16);
+            if (!sp.createSprite(w, keysHeight()))
+            {
+                atlasFailed = true;
+                return nullptr;
+            }
+            sp.fillScreen(TFT_BLACK);
+            sp.setFont(context->font);
+            drawAllKeys(&sp, 0, 0);
+            return &sp;
+        }
+
+        int visibleCells() const { return min(MaxCells, (w - mX * 2) / context->fontWidth); }
+        static uint32_t packChar(const char *s, size_t n)
+        {
+            uint32_t v = 0;
+            memcpy(&v, s, n);
+            return v;
+        }
+        void drawCursor(int cell, int color)
+        {
+            int fh = context->fontHeight;
+            gfx->fillRect(x + mX + cell * context->fontWidth, y + mY + fh - 3, context->fontWidth, 2, color);
+        }
+
+        // 入力欄: 前回の表示と比べて変わったセルから旧末尾までだけ描き直す
+        void drawField()
         {
-            const auto &nl = getLayer();
-            int dy = y + mY;
-            gfx->fillRect(x, y, w, context->fontHeight + mY, TFT_BLACK);
-            gfx->drawRect(x, y, w, context->fontHeight + mY, TFT_WHITE);
             int fontW = context->fontWidth;
+            int fh = context->fontHeight;
+            int dy = y + mY;
+            int tx = x + mX;
+            int visible = visibleCells();
+            if (fieldDirty)
             {
-                // カーソル表示
-                int curIdx = std::distance(body.begin(), editIdx);
-                int cy = dy + context->fontHeight - 2;
-                int bx = x + curIdx * fontW + mX;
-                gfx->fillRect(bx, cy, fontW, 2, TFT_GREEN);
+                gfx->fillRect(x, y, w, fh + mY, TFT_BLACK);
+                gfx->drawRect(x, y, w, fh + mY, TFT_WHITE);
+                stats.pixels += w * (fh + mY);
+                shownCells = 0;
+                shownCursor = -1;
+                placeHolderShown = false;
+                fieldDirty = false;
             }
             if (body.empty())
             {
-                // 未入力状態のプレースホルダー表示
-                gfx->setTextColor(TFT_DARKGRAY);
-                gfx->drawString(placeHolder, x + mX, dy);
+                scroll = 0;
+                if (!placeHolderShown)
+                {
+                    // 未入力状態のプレースホルダー表示
+                    gfx->fillRect(tx, dy, w - mX * 2, fh - 1, TFT_BLACK);
+                    gfx->setTextColor(TFT_DARKGRAY);
+                    gfx->drawString(placeHolder, tx, dy);
+                    stats.pixels += (w - mX * 2) * (fh - 1);
+                    placeHolderShown = true;
+                    shownCells = 0;
+                    shownCursor = -1;
+                }
+                if (shownCursor != 0)
+                {
+                    drawCursor(0, TFT_GREEN);
+                    shownCursor = 0;
+                }
+                return;
+            }
+            if (placeHolderShown)
+            {
+                gfx->fillRect(tx, dy, w - mX * 2, fh - 1, TFT_BLACK);
+                stats.pixels += (w - mX * 2) * (fh - 1);
+                placeHolderShown = false;
+                shownCells = 0;
+                shownCursor = -1;
             }
-            else
+
+            char ch[5];
+            size_t n;
+            // カーソルのセル位置→横スクロール
+            size_t pos = 0;
+            int cursorCell = 0;
+            while (pos < body.cursor() && (n = body.getChar(pos, ch)) > 0)
+                cursorCell += passwordMode || n == 1 ? 1 : 2;
+            if (cursorCell < scroll)
+                scroll = cursorCell;
+            else if (cursorCell >= scroll + visible)
+                scroll = cursorCell - visible + 1;
+
+            // 表示範囲のセルを並べる(範囲をまたぐ全角は表示しない)
+            uint32_t view[MaxCells]{};
+            int viewCells = 0;
+            int cell = 0;
+            pos = 0;
+            while (cell < scroll + visible && (n = body.getChar(pos, ch)) > 0)
+            {
+                int cw = passwordMode || n == 1 ? 1 : 2;
+                if (cell >= scroll && cell + cw <= scroll + visible)
+                {
+                    int v = cell - scroll;
+                    view[v] = passwordMode ? '*' : packChar(ch, n);
+                    if (cw == 2)
+                        view[v + 1] = 1;
+                    viewCells = v + cw;
+                }
+                cell += cw;
+            }
+
+            int first = 0;
+            while (first < viewCells && first < shownCells && view[first] == shown[first])
+                first++;
+            int last = max(viewCells, shownCells);
+            if (first < last)
             {
-                // 編集文字列
+                gfx->fillRect(tx + first * fontW, dy, (last - first) * fontW, fh - 1, TFT_BLACK);
+                stats.pixels += (last - first) * fontW * (fh - 1);
                 gfx->setTextColor(passwordMode ? TFT_RED : TFT_WHITE);
-                int dx = x + mX;
-                for (auto c : body)
+                for (int v = first; v < viewCells; v++)
                 {
-                    if (passwordMode)
-                        c = '*';
-                    gfx->drawChar(c, dx, dy + context->fontHeight - mY);
-                    dx += context->fontWidth;
+                    if (view[v] <= 1)
+                        continue;
+                    memcpy(ch, &view[v], 4);
+                    ch[4] = '\0';
+                    gfx->drawString(ch, tx + v * fontW, dy);
                 }
+                memcpy(shown, view, sizeof(shown));
+                shownCells = viewCells;
             }
-            //
-            dy += context->fontHeight + mY;
+
+            // カーソル(消去範囲に入っていれば描き直し)
+            int cc = cursorCell - scroll;
+            bool cleared = first <= shownCursor && shownCursor < last;
+            if (cc != shownCursor || (first <= cc && cc < last))
+            {
+                if (shownCursor >= 0 && shownCursor != cc && !cleared)
+                    drawCursor(shownCursor, TFT_BLACK);
+                drawCursor(cc, TFT_GREEN);
+                shownCursor = cc;
+            }
+        }
+
+        void drawKeys()
+        {
             int w1 = context->fontWidth * 2 + mX;
-            for (const auto &l : nl)
+            int kx, ky;
+            if (keysDirty)
             {
-                int dx = x;
-                for (const auto &c : l)
+                // キー全体: アトラスを1回転送(無ければ全キー描画)
+                if (auto *sp = getAtlas())
+                    gfx->pushSprite(sp, x, keysTop());
+                else
                 {
-                    int dw = w1 * c.size - mX;
-                    int dh = context->fontHeight;
-                    int len = utf8len(c.dispChar);
-                    int ofs = max(0, (w1 * c.size - fontW * len) / 2 - mX);
-                    bool sel = current == &c;
-                    gfx->fillRect(dx, dy, dw, dh, sel ? TFT_SKYBLUE : TFT_WHITE);
-                    gfx->setTextColor(TFT_BLACK);
-                    gfx->drawString(c.dispChar, dx + ofs, dy);
-                    dx += dw + mX;
+                    gfx->fillRect(x, keysTop(), w, keysHeight(), TFT_BLACK);
+                    drawAllKeys(gfx, x, keysTop());
                 }
-                dy += context->fontHeight + mY;
+                stats.pixels += w * keysHeight();
+                keysDirty = false;
+            }
+            else if (drawnSel != current && findKey(drawnSel, kx, ky))
+            {
+                // 前回の選択キーを戻す
+                drawKey(gfx, *drawnSel, kx, ky, false);
+                stats.pixels += (w1 * drawnSel->size - mX) * context->fontHeight;
+            }
+            if (findKey(current, kx, ky))
+            {
+                drawKey(gfx, *current, kx, ky, true);
+                stats.pixels += (w1 * current->size - mX) * context->fontHeight;
+            }
+            drawnSel = current;
+        }
+
+        void invalidate() override
+        {
+            fieldDirty = true;
+            keysDirty = true;
+        }
+
+        void draw() override
+        {
+            uint32_t startTime = micros();
+            stats.pixels = 0;
+            drawField();
+            drawKeys();
+            stats.time = micros() - startTime;
+            if (inputTime)
+            {
+                stats.latency = micros() - inputTime;
+                inputTime = 0;
             }
         }
 
         void onPressed(int ofsx, int ofsy) override
         {
             int rh = context->fontHeight + mY;
-            int sy = (ofsy - rh) / rh;
+            int sy = ofsy < rh ? -1 : (ofsy - rh) / rh;
             int sx = ofsx / (context->fontWidth * 2 + mX);
-            auto insert = [&](int ch) {
-                if (body.size() < body.capacity())
-                    body.insert(editIdx++, ch);
+            auto insert = [&](char ch) {
+                body.insert(ch);
             };
             auto chgLayer = [&](int l) {
                 layer = l;
-                gfx->fillRect(x, y + rh, w, h - rh, TFT_BLACK);
+                keysDirty = true;
             };
 
-            const auto &ly = getLayer();
-            current = nullptr;
-            // 選択する文字を検索
-            for (const auto &l : ly)
-            {
-                int ssx = sx;
-                for (const auto &c : l)
-                {
-                    if (ssx >= 0 && ssx < c.size && sy == 0)
-                    {
-                        current = &c;
-                        break;
-                    }
-                    ssx -= c.size;
-                }
-                if (current)
-                    break;
-                sy -= 1;
-            }
+            // 選択する文字(表引き)
+            current = getLayer().hit(sy, sx);
             //
             if (current)
             {
@@ -922,39 +1257,35 @@ namespace UI
                         chgLayer(2);
                         break;
                     case Type::Left:
-                        if (editIdx != body.begin())
-                            --editIdx;
+                        body.left();
                         break;
                     case Type::Right:
-                        if (editIdx < body.end())
-                            editIdx++;
+                        body.right();
                         break;
                     case Type::BackSpace:
-                        if (editIdx != body.begin())
-                            body.erase(--editIdx);
+                        body.backSpace();
                         break;
                     case Type::Delete:
-                        if (body.empty() == false && editIdx != body.end())
-                            body.erase(editIdx);
+                        body.erase();
                         break;
                     case Type::Home:
-                        editIdx = body.begin();
+                        body.home();
                         break;
                     case Type::End:
-                        editIdx = body.end();
+                        body.end();
                         break;
                     case Type::Clear:
-                        body.resize(0);
-                        editIdx = body.begin();
+                        body.clear();
                         break;
                     case Type::Copy:
                         context->copy(body);
                         break;
                     case Type::Paste:
-                        context->paste(body, editIdx);
+                        context->paste(body);
                         break;
                     case Type::PWMode:
                         passwordMode = !passwordMode;
+                        fieldDirty = true;
                         break;
                     default:
                         break;
@@ -962,6 +1293,8 @@ namespace UI
                 }
                 else
                     insert(current->code);
+                stats.keystrokes++;
+                inputTime = micros();
             }
             update();
         }
@@ -969,15 +1302,13 @@ namespace UI
     public:
         ~Keyboard() = default;
 
+        // capは入力できる最大バイト数(UTF-8)
         void init(size_t cap = 16)
         {
-            if (cap > 32)
-                cap = 32;
             w = (context->fontWidth * 2 + mX) * 10;
             h = (context->fontHeight + mY) * 6;
-            body.reserve(cap);
-            body.resize(0);
-            editIdx = body.begin();
+            body.setLimit(cap);
+            body.clear();
         }
 
         void setPlaceHolder(const char *ph)
@@ -987,25 +1318,23 @@ namespace UI
 
         void setString(const char *buff)
         {
-            int len = strlen(buff);
-            if (len > body.capacity())
-                len = body.capacity();
-            body.resize(len);
-            editIdx = body.end();
-            memcpy(body.data(), buff, len);
+            body.assign(buff);
+            update();
             // Serial.println(buff);
         }
 
         void getString(char *buff, size_t buffsize) const
         {
-            auto sz = min(body.size(), buffsize);
-            memset(buff, '\0', buffsize);
-            memcpy(buff, body.data(), sz);
+            body.copyTo(buff, buffsize);
         }
 
         void setPasswordMode(bool md)
         {
             passwordMode = md;
+            fieldDirty = true;
+            update();
         }
+
+        const Stats &getStats() const { return stats; }
     };
 }
@@ -0,0 +1,393 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_wifi.h>
+#include <netflow.hpp>
+
+namespace Net
+{
+    ///
+    /// 実機(ESP32)のLink
+    /// 接続は参照数で管理する。最後の利用者が離れてもIdleTimeoutまではつないだままにし、
+    /// その間のconnect()は待たずに済む(update()を定期的に呼んで止める)
+    /// つながったときのBSSID・チャンネル・アドレスを覚えておき、次は探索とDHCPを省いてつなぐ
+    /// arduino-esp32 1.0.6(platformio.iniで固定)のイベントAPIを使う。
+    /// 1.0.6のscanNetworks()はチャンネルを絞れないので、スキャンはesp_wifi_scan_start()で始め、
+    /// 結果はWiFiのスキャン完了処理が読み込んだものを使う
+    ///
+    class WiFiLink : public Link
+    {
+    public:
+        // HTTPの受信バッファ(要求行とヘッダもここで組み立てる)
+        static constexpr size_t HttpBufferSize = 512;
+        // 前回の接続先(設定に保存して次の起動でも使う)
+        struct Cache
+        {
+            char ssid[32];
+            uint8_t bssid[6];
+            uint8_t channel;
+            uint8_t reserved;
+            uint32_t ip;
+            uint32_t gateway;
+            uint32_t mask;
+            uint32_t dns;
+        };
+        enum ConnectKind : uint8_t
+        {
+            Warm,   // つながったままだった
+            Cached, // 覚えていた接続先へ直接
+            Cold,   // 探索・DHCPから
+            NumKinds,
+        };
+        struct Stats
+        {
+            uint32_t count[NumKinds];
+            uint32_t last[NumKinds]; // 接続までの時間(ms)
+            uint32_t max[NumKinds];
+            uint32_t fallbacks; // 覚えていた接続先でつながらずやり直した回数
+            uint32_t powerDowns;
+        };
+
+    private:
+        using Wakeup = void (*)();
+        static Wakeup &wakeup()
+        {
+            static Wakeup w = nullptr;
+            return w;
+        }
+        static WiFiLink *&instance()
+        {
+            static WiFiLink *p = nullptr;
+            return p;
+        }
+        static void onEvent(system_event_id_t ev)
+        {
+            if (ev == SYSTEM_EVENT_STA_GOT_IP && instance())
+                instance()->onConnected();
+            if (ev == SYSTEM_EVENT_SCAN_DONE && instance())
+            {
+                instance()->scanDoneAt = micros();
+                __atomic_store_n(&instance()->scanState, uint8_t(ScanDone), __ATOMIC_RELEASE);
+            }
+            if (auto w = wakeup())
+                w();
+        }
+
+        SemaphoreHandle_t lock = nullptr;
+        int users = 0;
+        bool radioOn = false;
+        uint32_t lastUse = 0; // 最後に使い終えた(スキャンした)時刻
+        uint32_t scanDoneAt = 0; // 最後のスキャン完了イベント(us)
+        const void *scanOwner = nullptr; // スキャン結果を持っているフロー
+        enum : uint8_t
+        {
+            ScanIdle,
+            ScanStarted,
+            ScanDone, // イベントタスクが書く
+            ScanStartFailed,
+        };
+        uint8_t scanState = ScanIdle;
+        // HTTP(接続は切れるまで次の要求に使い回す)
+        WiFiClient tcp;
+        uint8_t httpBuff[HttpBufferSize];
+        HttpClient<WiFiClient> http{tcp, httpBuff, sizeof(httpBuff)};
+        bool httpBusy = false;
+        Credentials current{};
+        char target[32] = {}; // 接続しようとしているSSID(イベントタスクも読むのでcacheMuxで守る)
+        // 接続中の試行
+        bool connecting = false;
+        ConnectKind kind = Cold;
+        uint32_t connectStart = 0;
+        // 前回の接続先
+        portMUX_TYPE cacheMux = portMUX_INITIALIZER_UNLOCKED;
+        Cache cache{};
+        bool cacheValid = false;
+        bool cacheChanged = false;
+        Stats stats{};
+
+        struct Guard
+        {
+            SemaphoreHandle_t s;
+            Guard(SemaphoreHandle_t s) : s(s) { xSemaphoreTake(s, portMAX_DELAY); }
+            ~Guard() { xSemaphoreGive(s); }
+        };
+
+        // イベントタスクから呼ばれる(currentはlockの中でしか読まない)
+        void onConnected()
+        {
+            Cache c{};
+            portENTER_CRITICAL(&cacheMux);
+            strlcpy(c.ssid, target, sizeof(c.ssid));
+            portEXIT_CRITICAL(&cacheMux);
+            if (c.ssid[0] == '\0')
+                return; // 止めた後に届いた
+            if (auto b = WiFi.BSSID())
+                memcpy(c.bssid, b, sizeof(c.bssid));
+            c.channel = WiFi.channel();
+            c.ip = WiFi.localIP();
+            c.gateway = WiFi.gatewayIP();
+            c.mask = WiFi.subnetMask();
+            c.dns = WiFi.dnsIP();
+            portENTER_CRITICAL(&cacheMux);
+            if (!cacheValid || memcmp(&c, &cache, sizeof(c)) != 0)
+                cacheChanged = true;
+            cache = c;
+            cacheValid = true;
+            portEXIT_CRITICAL(&cacheMux);
+        }
+        bool cachedFor(const Credentials &cred, Cache &c)
+        {
+            portENTER_CRITICAL(&cacheMux);
+            c = cache;
+            bool ok = cacheValid && strcmp(c.ssid, cred.ssid) == 0 && c.channel != 0;
+            portEXIT_CRITICAL(&cacheMux);
+            return ok;
+        }
+        void forgetCache()
+        {
+            portENTER_CRITICAL(&cacheMux);
+            cacheValid = false;
+            portEXIT_CRITICAL(&cacheMux);
+        }
+
+        void setTarget(const char *ssid)
+        {
+            portENTER_CRITICAL(&cacheMux);
+            strlcpy(target, ssid, sizeof(target));
+            portEXIT_CRITICAL(&cacheMux);
+        }
+        void startConnect(ConnectKind k)
+        {
+            Cache c;
+            if (k == Cached && !cachedFor(current, c))
+                k = Cold;
+            setTarget(current.ssid);
+            Serial.printf("Wifi connect:[%s] %s\n", current.ssid, k == Cached ? "cached" : "cold");
+            WiFi.mode(WIFI_STA);
+            radioOn = true;
+            if (k == Cached)
+            {
+                // DHCPも省く(前回もらったアドレスをそのまま使う)
+                if (c.ip != 0)
+                    WiFi.config(IPAddress(c.ip), IPAddress(c.gateway), IPAddress(c.mask), IPAddress(c.dns));
+                WiFi.begin(current.ssid, current.password, c.channel, c.bssid);
+            }
+            else
+            {
+                WiFi.config(IPAddress(uint32_t(0)), IPAddress(uint32_t(0)), IPAddress(uint32_t(0)));
+                WiFi.begin(current.ssid, current.password);
+            }
+            kind = k;
+            connecting = true;
+            connectStart = millis();
+        }
+        void finishConnect(ConnectKind k, uint32_t t)
+        {
+            stats.count[k]++;
+            stats.last[k] = t;
+            if (t > stats.max[k])
+                stats.max[k] = t;
+        }
+        void powerDown()
+        {
+            // 使い回していた接続も閉じる
+            http.close();
+            WiFi.disconnect(true);
+            WiFi.mode(WIFI_OFF);
+            radioOn = false;
+            connecting = false;
+            current.ssid[0] = '\0';
+            setTarget("");
+        }
+
+    public:
+        static constexpr uint32_t IdleTimeout = 30 * 1000;
+        // 覚えていた接続先へこの時間でつながらなければ探索からやり直す
+        static constexpr uint32_t CachedTimeout = 3 * 1000;
+        // 1チャンネルあたりの探索時間(ms)
+        static constexpr uint32_t FullScanDwell = 300;
+        static constexpr uint32_t QuickScanDwell = 120;
+
+        // 接続・スキャン完了のイベントでwを呼ぶ(待っているフローを起こす)
+        void begin(Wakeup w)
+        {
+            lock = xSemaphoreCreateMutex();
+            instance() = this;
+            wakeup() = w;
+            WiFi.onEvent(onEvent, SYSTEM_EVENT_STA_GOT_IP);
+            WiFi.onEvent(onEvent, SYSTEM_EVENT_STA_DISCONNECTED);
+            WiFi.onEvent(onEvent, SYSTEM_EVENT_SCAN_DONE);
+        }
+
+        // 保存しておいた接続先を戻す
+        void setCache(const Cache &c)
+        {
+            portENTER_CRITICAL(&cacheMux);
+            cache = c;
+            cacheValid = c.ssid[0] != '\0';
+            cacheChanged = false;
+            portEXIT_CRITICAL(&cacheMux);
+        }
+        // 接続先が変わっていればtrue(呼び出し側で保存する)
+        bool takeCache(Cache &c)
+        {
+            portENTER_CRITICAL(&cacheMux);
+            bool changed = cacheChanged;
+            if (changed)
+                c = cache;
+            cacheChanged = false;
+            portEXIT_CRITICAL(&cacheMux);
+            return changed;
+        }
+        const Stats &getStats() const { return stats; }
+
+        // 使われないままIdleTimeoutが過ぎたら無線を止める
+        void update()
+        {
+            Guard g(lock);
+            if (users > 0 || !radioOn || millis() - lastUse < IdleTimeout || scanOwner)
+                return;
+            Serial.println("Wifi idle: power down");
+            powerDown();
+            stats.powerDowns++;
+        }
+
+        uint32_t now() override { return millis(); }
+
+        bool connect(const Credentials &cred) override
+        {
+            Guard g(lock);
+            bool same = radioOn && strcmp(current.ssid, cred.ssid) == 0 && strcmp(current.password, cred.password) == 0;
+            // 使われている間は切り替えない(別の接続先へつながったと取り違えないように)
+            if (users > 0 && !same)
+                return false;
+            if (users++ > 0)
+                return true;
+            // 同じ接続先へつながったまま(つなぎかけ)なら何もしない
+            if (same)
+            {
+                if (connecting)
+                    return true;
+                if (WiFi.status() == WL_CONNECTED)
+                {
+                    finishConnect(Warm, 0);
+                    return true;
+                }
+            }
+            current = cred;
+            startConnect(Cached);
+            return true;
+        }
+        bool isConnected() override
+        {
+            Guard g(lock);
+            bool ok = WiFi.status() == WL_CONNECTED;
+            if (!connecting)
+                return ok;
+            uint32_t t = millis() - connectStart;
+            if (ok)
+            {
+                connecting = false;
+                finishConnect(kind, t);
+            }
+            else if (kind == Cached && t >= CachedTimeout)
+            {
+                // 接続先が変わったか、アドレスが使えなくなった
+                stats.fallbacks++;
+                forgetCache();
+                WiFi.disconnect();
+                startConnect(Cold);
+            }
+            return ok;
+        }
+        void release() override
+        {
+            Guard g(lock);
+            if (users > 0 && --users == 0)
+                lastUse = millis();
+        }
+
+        bool startScan(const void *owner, uint8_t channel = 0) override
+        {
+            Guard g(lock);
+            if (scanOwner && scanOwner != owner)
+                return false;
+            scanOwner = owner;
+            WiFi.mode(WIFI_STA);
+            radioOn = true;
+            lastUse = millis();
+            WiFi.scanDelete();
+            // 隠しSSIDは返さない。チャンネルを絞るときは見ている先が分かっているので短めに
+            wifi_scan_config_t config{};
+            config.channel = channel;
+            config.show_hidden = false;
+            config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+            config.scan_time.active.min = 100;
+            config.scan_time.active.max = channel ? QuickScanDwell : FullScanDwell;
+            __atomic_store_n(&scanState, uint8_t(ScanStarted), __ATOMIC_RELEASE);
+            if (esp_wifi_scan_start(&config, false) != ESP_OK)
+                __atomic_store_n(&scanState, uint8_t(ScanStartFailed), __ATOMIC_RELEASE);
+            return true;
+        }
+        int scanComplete() override
+        {
+            switch (__atomic_load_n(&scanState, __ATOMIC_ACQUIRE))
+            {
+            case ScanStarted:
+                return ScanRunning;
+            case ScanDone:
+            {
+                // 完了イベントで結果は読み込み済み
+                int ret = WiFi.scanComplete();
+                return ret < 0 ? ScanFailed : ret;
+            }
+            default:
+                return ScanFailed;
+            }
+        }
+        void scanSSID(int i, char *buff, size_t size) override { strlcpy(buff, WiFi.SSID(i).c_str(), size); }
+        int scanRSSI(int i) override { return WiFi.RSSI(i); }
+        int scanChannel(int i) override { return WiFi.channel(i); }
+        uint32_t getScanDoneTime() const { return scanDoneAt; }
+        void scanDelete(const void *owner) override
+        {
+            Guard g(lock);
+            if (scanOwner != owner)
+                return;
+            WiFi.scanDelete();
+            __atomic_store_n(&scanState, uint8_t(ScanIdle), __ATOMIC_RELEASE);
+            scanOwner = nullptr;
+            lastUse = millis();
+        }
+
+        void startNtp(const char *server, long tz) override { configTime(tz, 0, server); }
+        bool getTime(struct tm &t) override { return getLocalTime(&t, 0); }
+
+        int httpStart(const char *url, const char *type, const char *body, HttpSink *sink) override
+        {
+            if (httpBusy)
+                return HttpSendFailed;
+            int ret = http.request("POST", url, type, body, sink);
+            httpBusy = ret == HttpRunning;
+            return ret;
+        }
+        int httpPoll() override
+        {
+            int ret = http.poll();
+            httpBusy = ret == HttpRunning;
+            return ret;
+        }
+        uint32_t httpReceived() override { return http.getStats().bytes; }
+        void httpAbort() override
+        {
+            http.close();
+            httpBusy = false;
+        }
+        const HttpClient<WiFiClient>::Stats &getHttpStats() const { return http.getStats(); }
+    };
+}
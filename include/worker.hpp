@@ -5,53 +5,799 @@
 #pragma once
 
 #include <Arduino.h>
+#include <freertos/event_groups.h>
+#include <freertos/timers.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <mpscring.hpp>
+#include <timerwheel.hpp>
+#include <trace.hpp>
+#ifdef ENABLE_WORKER_STATS
+#include <esp_timer.h>
+#include <histogram.hpp>
+#endif
 
 namespace Worker
 {
-    using Func = void (*)(int);
+    enum class Priority : uint8_t
+    {
+        Low,
+        Normal,
+        High,
+    };
+    constexpr int NumPriority = 3;
+
+    enum class State : uint8_t
+    {
+        Free,
+        Reserved, // 確保して中身を書いている途中(まだ他から見えない)
+        Queued,
+        Running,
+        Done,
+        Cancelled,
+    };
+
+    ///
+    /// キャンセル要求(ジョブ側が時々確認して自分で抜ける)
+    ///
+    class Token
+    {
+        friend class Task;
+        volatile bool cancelled = false;
+
+    public:
+        bool isCancelled() const { return cancelled; }
+    };
+
+    ///
+    /// 呼び出し可能オブジェクトを固定長の領域に直接置く(ヒープを使わない)
+    /// ムーブのみ。キャプチャが入りきらなければコンパイルエラー
+    ///
+    template <typename Sig, size_t Size>
+    class Function;
+
+    template <typename R, typename... Args, size_t Size>
+    class Function<R(Args...), Size>
+    {
+        using Storage = typename std::aligned_storage<Size, alignof(double)>::type;
+
+        Storage storage;
+        R (*invoker)(void *, Args...) = nullptr;
+        // dstがnullptrなら破棄のみ、そうでなければdstへムーブしてsrcを破棄
+        void (*manager)(void *dst, void *src) = nullptr;
+
+        void moveFrom(Function &o)
+        {
+            if (o.manager)
+                o.manager(&storage, &o.storage);
+            invoker = o.invoker;
+            manager = o.manager;
+            o.invoker = nullptr;
+            o.manager = nullptr;
+        }
+
+    public:
+        Function() = default;
+        Function(std::nullptr_t) {}
+        template <typename F, typename T = typename std::decay<F>::type,
+                  typename = typename std::enable_if<!std::is_same<T, Function>::value>::type,
+                  typename = decltype(std::declval<T &>()(std::declval<Args>()...))>
+        Function(F &&f)
+        {
+            static_assert(sizeof(T) <= Size, "capture too large for worker job slot");
+            static_assert(alignof(T) <= alignof(Storage), "capture alignment too large");
+            new (&storage) T(std::forward<F>(f));
+            invoker = [](void *p, Args... a) -> R {
+                return (*static_cast<T *>(p))(std::forward<Args>(a)...);
+            };
+            manager = [](void *dst, void *src) {
+                if (dst)
+                    new (dst) T(std::move(*static_cast<T *>(src)));
+                static_cast<T *>(src)->~T();
+            };
+        }
+        Function(Function &&o) { moveFrom(o); }
+        Function &operator=(Function &&o)
+        {
+            if (this != &o)
+            {
+                reset();
+                moveFrom(o);
+            }
+            return *this;
+        }
+        Function(const Function &) = delete;
+        Function &operator=(const Function &) = delete;
+        ~Function() { reset(); }
+
+        void reset()
+        {
+            if (manager)
+                manager(nullptr, &storage);
+            invoker = nullptr;
+            manager = nullptr;
+        }
+        explicit operator bool() const { return invoker != nullptr; }
+        R operator()(Args... a) { return invoker(&storage, std::forward<Args>(a)...); }
+    };
+
+    // ジョブ本体(ワーカータスクで実行)
+    using Func = Function<int(const Token &), 64>;
+    // 完了通知(poll()を呼んだスレッドで実行)
+    using Done = Function<void(int result, State state), 24>;
+
+    ///
+    /// ジョブハンドル(スロット番号と世代)
+    /// 完了通知が済むとスロットは再利用され、古いハンドルは完了扱いになる
+    ///
+    struct Handle
+    {
+        uint8_t slot = 0xff;
+        uint8_t generation = 0;
+
+        bool valid() const { return slot != 0xff; }
+    };
+
+    ///
+    /// 周期ジョブのずれ(予定時刻から実行開始までの遅れ、ms)
+    ///
+    struct TimerStats
+    {
+        uint32_t runs = 0;
+        uint32_t late = 0;     // 許容幅を超えて遅れた回数
+        uint32_t overruns = 0; // 前回が終わっておらず見送った回数
+        uint32_t skipped = 0;  // 1周期以上遅れて飛ばした回数
+        uint32_t lastDrift = 0;
+        uint32_t maxDrift = 0;
+        uint32_t driftSum = 0;
+
+        uint32_t meanDrift() const { return runs ? driftSum / runs : 0; }
+    };
+
+    ///
+    /// 投入時に空きが無い、または同じキーのジョブが待っているときの扱い
+    ///
+    enum class Policy : uint8_t
+    {
+        Drop,          // 空きが無ければ捨てる
+        Coalesce,      // 同じキーが待っていればそれを返し、新しい方を捨てる
+        ReplaceLatest, // 同じキーが待っていればそれを取り消して新しい方を入れる
+    };
+
     ///
+    /// ワーカープール
+    /// 投入・完了通知はロックフリーのリングで受け渡し、UIスレッドを待たせない
     ///
     class Task
     {
+    public:
+        struct Stats
+        {
+            uint32_t submitted = 0;
+            uint32_t rejects = 0; // 空きスロット無し
+            uint32_t coalesced = 0;
+            uint32_t replaced = 0;
+            uint32_t highWater = 0; // 待ち行列の最大長
+        };
+
+        static constexpr uint32_t TimerTick = 100; // ms
+
+#ifdef ENABLE_WORKER_STATS
+        // ジョブの種類(名前)ごとの時間(1/16us単位のヒストグラム)
+        struct KindStats
+        {
+            const char *name = nullptr;
+            uint32_t count = 0;
+            uint32_t maxRun = 0; // us
+            Profile::Histogram wait; // 投入から開始まで
+            Profile::Histogram run;  // 実行時間
+        };
+        // ワーカータスクごとのスタック残量
+        struct TaskStats
+        {
+            TaskHandle_t handle = nullptr;
+            uint32_t stackFree = 0;       // 最小の空き(バイト)
+            const char *lowest = nullptr; // 最小を更新したジョブ
+        };
+#endif
+
+    private:
+        static constexpr int MaxJobs = 16; // イベントグループのビット数以下
+        static constexpr int MaxTasks = 4;
+        static constexpr int MaxTimers = 8;
+        static constexpr int MaxKinds = 8;
+        static constexpr int WheelSlots = 64;
         static constexpr const uint16_t stackSize = 4096;
-        static constexpr TickType_t delayTime = 100 / portTICK_PERIOD_MS;
+
+        struct Job
+        {
+            Func func;
+            Done done;
+            int result = 0;
+            Token token;
+            // 世代(上位8bit、poll()で解放するときに増やす)と状態(下位8bit)
+            // 1語にまとめて、取り消しなどのCASで別の世代を巻き込まないようにする
+            uint16_t status = 0;
+            uint16_t key = 0;       // Queuedの間は変わらない
+            const char *name = "job";
+#ifdef ENABLE_WORKER_STATS
+            uint32_t queued = 0; // 投入時刻(us)
+#endif
+        };
+        static_assert(sizeof(Job) <= 96 + 8 * sizeof(void *), "worker job slot grew"); // ESP32で128バイト
+        Job jobs[MaxJobs];
+        MpscRing<uint8_t, MaxJobs> queues[NumPriority];
+        MpscRing<uint8_t, MaxJobs> doneQueue;
+        SemaphoreHandle_t pending;
+        EventGroupHandle_t finished;
+        Stats stats;
+#ifdef ENABLE_WORKER_STATS
+        KindStats kinds[MaxKinds];
+        TaskStats taskStats[MaxTasks];
+        int numTasks = 0;
+        portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+
+        static uint32_t nowUs() { return esp_timer_get_time(); }
+        static uint32_t toHist(uint32_t us) { return us < 0x0fffffff ? us << 4 : 0xffffffff; }
+
+        void record(int task, const char *name, uint32_t queued, uint32_t started, uint32_t ended)
+        {
+            // ESP32ではバイト単位
+            uint32_t stackFree = uxTaskGetStackHighWaterMark(nullptr);
+            portENTER_CRITICAL(&statsMux);
+            for (auto &k : kinds)
+            {
+                if (k.name && k.name != name && strcmp(k.name, name) != 0)
+                    continue;
+                uint32_t runTime = ended - started;
+                k.name = name;
+                k.count++;
+                k.wait.record(toHist(started - queued));
+                k.run.record(toHist(runTime));
+                if (runTime > k.maxRun)
+                    k.maxRun = runTime;
+                break;
+            }
+            auto &ts = taskStats[task];
+            if (ts.stackFree == 0 || stackFree < ts.stackFree)
+            {
+                ts.stackFree = stackFree;
+                ts.lowest = name;
+            }
+            portEXIT_CRITICAL(&statsMux);
+        }
+#endif
+
+        // タイマー(1本のFreeRTOSタイマーでホイールを回し、期限が来たらジョブを投入する)
+        struct Timer
+        {
+            Func func;
+            Done done;
+            uint32_t due = 0; // 次の予定時刻(ms)
+            uint32_t firedDue = 0;
+            uint32_t period = 0; // 0なら1回だけ
+            uint32_t jitter = 0; // 許容する遅れ(ms)
+            Priority priority = Priority::Normal;
+            const char *name = "timer";
+            bool active = false;
+            bool busy = false; // 投入してから完了通知まで
+            bool rerun = false; // 実行中にtrigger()された
+            bool cancelled = false;
+            Handle job;
+            uint8_t generation = 0;
+            TimerStats stats;
+        };
+        Timer timers[MaxTimers];
+        TimerWheel<MaxTimers, WheelSlots> wheel;
+        TimerHandle_t wheelTimer = nullptr;
+        portMUX_TYPE timerMux = portMUX_INITIALIZER_UNLOCKED;
+
+        static uint16_t makeStatus(uint8_t gen, State s) { return uint16_t(gen << 8 | uint8_t(s)); }
+        static State stateOf(uint16_t status) { return State(status & 0xff); }
+        static uint8_t generationOf(uint16_t status) { return status >> 8; }
+
+        static uint16_t loadStatus(const Job &j) { return __atomic_load_n(&j.status, __ATOMIC_ACQUIRE); }
+        static State loadState(const Job &j) { return stateOf(loadStatus(j)); }
+        // 世代を変えるのはpoll()だけなので、状態を持っている側は世代を読み直して書いてよい
+        static void storeState(Job &j, State s)
+        {
+            __atomic_store_n(&j.status, makeStatus(generationOf(loadStatus(j)), s), __ATOMIC_RELEASE);
+        }
+        static bool casStatus(Job &j, uint8_t gen, State from, State to)
+        {
+            auto expected = makeStatus(gen, from);
+            return __atomic_compare_exchange_n(&j.status, &expected, makeStatus(gen, to), false, __ATOMIC_ACQ_REL,
+                                               __ATOMIC_RELAXED);
+        }
+        static bool casState(Job &j, State from, State to)
+        {
+            return casStatus(j, generationOf(loadStatus(j)), from, to);
+        }
+
         static void job(void *arg)
         {
             Task *self = static_cast<Task *>(arg);
             self->update();
         }
 
-        struct Event
+        // 優先度の高いリングから取り出す
+        bool fetch(uint8_t &idx)
         {
-            Func func;
-            int arg;
-        };
-        QueueHandle_t queue;
+            for (int p = NumPriority - 1; p >= 0; p--)
+                if (queues[p].tryPop(idx))
+                    return true;
+            return false;
+        }
+
+        void run(int task, uint8_t idx)
+        {
+            auto &j = jobs[idx];
+            bool skip = j.token.cancelled || !casState(j, State::Queued, State::Running);
+            if (skip)
+                storeState(j, State::Cancelled);
+            else
+            {
+                TRACE_SCOPE(j.name);
+#ifdef ENABLE_WORKER_STATS
+                uint32_t started = nowUs();
+                j.result = j.func(j.token);
+                record(task, j.name, j.queued, started, nowUs());
+#else
+                j.result = j.func(j.token);
+#endif
+                storeState(j, j.token.cancelled ? State::Cancelled : State::Done);
+            }
+            j.func.reset(); // キャプチャはワーカー側で破棄する
+            xEventGroupSetBits(finished, 1 << idx);
+            doneQueue.tryPush(idx); // スロット数以上は入らないので失敗しない
+        }
 
         void update()
         {
+            int task = 0;
+#ifdef ENABLE_WORKER_STATS
+            task = __atomic_fetch_add(&numTasks, 1, __ATOMIC_RELAXED);
+            taskStats[task].handle = xTaskGetCurrentTaskHandle();
+#endif
             while (true)
             {
-                Event ev;
-                auto stat = xQueueReceive(queue, &ev, portTICK_RATE_MS * 1000);
-                if (stat == pdPASS)
+                uint8_t idx;
+                if (xSemaphoreTake(pending, portMAX_DELAY) == pdPASS && fetch(idx))
+                    run(task, idx);
+            }
+        }
+
+        Job *lookup(Handle h)
+        {
+            if (!h.valid())
+                return nullptr;
+            auto &j = jobs[h.slot];
+            auto st = loadStatus(j);
+            return generationOf(st) == h.generation && stateOf(st) != State::Free ? &j : nullptr;
+        }
+
+        // 実行待ちで同じキーのジョブ
+        // 読んでいる間に解放・再利用されていないかを、前後で世代と状態を見比べて確かめる
+        bool findQueued(uint16_t key, Handle &h)
+        {
+            for (int i = 0; i < MaxJobs; i++)
+            {
+                auto &j = jobs[i];
+                uint16_t st = loadStatus(j);
+                if (stateOf(st) != State::Queued)
+                    continue;
+                bool match = __atomic_load_n(&j.key, __ATOMIC_RELAXED) == key && !j.token.cancelled;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (match && __atomic_load_n(&j.status, __ATOMIC_RELAXED) == st)
+                {
+                    h.slot = i;
+                    h.generation = generationOf(st);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static uint32_t ticksUntil(uint32_t due, uint32_t now)
+        {
+            int32_t ms = int32_t(due - now);
+            return ms > 0 ? (ms + TimerTick - 1) / TimerTick : 0;
+        }
+
+        static void onWheelTimer(TimerHandle_t th)
+        {
+            static_cast<Task *>(pvTimerGetTimerID(th))->advanceTimers();
+        }
+
+        // タイマーサービスタスクで呼ばれる
+        void advanceTimers()
+        {
+            int fired[MaxTimers];
+            int numFired = 0;
+            uint32_t now = millis();
+            portENTER_CRITICAL(&timerMux);
+            wheel.advance([&](int id) {
+                auto &t = timers[id];
+                if (t.busy)
+                    t.stats.overruns++;
+                else
                 {
-                    ev.func(ev.arg);
+                    t.busy = true;
+                    t.firedDue = t.due;
+                    fired[numFired++] = id;
                 }
+                if (t.period == 0)
+                    return;
+                // 周期は予定時刻基準で進める(実行時間で遅れが積もらない)
+                t.due += t.period;
+                if (int32_t(now - t.due) >= int32_t(t.period))
+                {
+                    t.stats.skipped++;
+                    t.due = now + t.period;
+                }
+                wheel.insert(id, ticksUntil(t.due, now));
+            });
+            portEXIT_CRITICAL(&timerMux);
+
+            // 投入はクリティカルセクションの外で行う
+            for (int i = 0; i < numFired; i++)
+            {
+                int id = fired[i];
+                auto h = signal(timers[id].name,
+                                [this, id](const Token &tok) { return runTimer(id, tok); },
+                                [this, id](int result, State st) { finishTimer(id, result, st); },
+                                timers[id].priority);
+                portENTER_CRITICAL(&timerMux);
+                timers[id].job = h;
+                portEXIT_CRITICAL(&timerMux);
+                if (!h.valid())
+                    endTimer(id); // 投入できなければ今回は見送り
             }
         }
 
+        // ワーカーで実行
+        int runTimer(int id, const Token &tok)
+        {
+            auto &t = timers[id];
+            uint32_t drift = millis() - t.firedDue;
+            portENTER_CRITICAL(&timerMux);
+            auto &st = t.stats;
+            st.runs++;
+            st.lastDrift = drift;
+            st.driftSum += drift;
+            if (drift > st.maxDrift)
+                st.maxDrift = drift;
+            if (drift > t.jitter)
+                st.late++;
+            portEXIT_CRITICAL(&timerMux);
+            return t.func(tok);
+        }
+
+        // 完了通知(poll()の中)
+        void finishTimer(int id, int result, State st)
+        {
+            auto &t = timers[id];
+            if (t.done && !t.cancelled)
+                t.done(result, st);
+            endTimer(id);
+        }
+        // 1回限りか取り消し済みならここで解放する
+        void endTimer(int id)
+        {
+            auto &t = timers[id];
+            portENTER_CRITICAL(&timerMux);
+            t.busy = false;
+            if (t.rerun && !t.cancelled)
+            {
+                t.due = millis();
+                wheel.insert(id, 0);
+            }
+            t.rerun = false;
+            bool release = t.cancelled || (t.period == 0 && !wheel.isLinked(id));
+            portEXIT_CRITICAL(&timerMux);
+            if (release)
+                releaseTimer(id);
+        }
+
+        void releaseTimer(int id)
+        {
+            auto &t = timers[id];
+            t.func.reset();
+            t.done.reset();
+            portENTER_CRITICAL(&timerMux);
+            t.generation++;
+            t.active = false;
+            portEXIT_CRITICAL(&timerMux);
+        }
+
+        // 空きスロットを取る(CASで確保するのでロック不要)
+        // 中身を書き終えてからQueuedにするまでは、findQueued()などからは見えない
+        int reserve()
+        {
+            for (int i = 0; i < MaxJobs; i++)
+                if (casState(jobs[i], State::Free, State::Reserved))
+                    return i;
+            return -1;
+        }
+
     public:
-        void start(int core = 1)
+        // core: 負ならタスクを両コアに振り分ける
+        void start(int tasks = 1, int core = 1)
         {
-            queue = xQueueCreate(4, sizeof(Event));
-            xTaskCreatePinnedToCore(job, "Worker", stackSize, this, 1, nullptr, core);
+            pending = xSemaphoreCreateCounting(MaxJobs, 0);
+            finished = xEventGroupCreate();
+            wheelTimer = xTimerCreate("Wheel", pdMS_TO_TICKS(TimerTick), pdTRUE, this, onWheelTimer);
+            xTimerStart(wheelTimer, 0);
+            tasks = constrain(tasks, 1, MaxTasks);
+            for (int i = 0; i < tasks; i++)
+            {
+                char name[] = "Worker0";
+                name[6] += i;
+                xTaskCreatePinnedToCore(job, name, stackSize, this, 1, nullptr, core < 0 ? i & 1 : core);
+            }
         }
-        bool signal(Func f, int a)
+
+        // 待たずに投入する。投入できなければ無効なハンドルを返す
+        // name: 統計・トレースでの種類(文字列リテラル)
+        // key: 0以外ならpolicyのCoalesce/ReplaceLatestでまとめる対象
+        Handle signal(const char *name, Func f, Done d = nullptr, Priority pri = Priority::Normal,
+                      Policy policy = Policy::Drop, uint16_t key = 0)
         {
-            Event ev{f, a};
-            auto stat = xQueueSend(queue, &ev, portTICK_RATE_MS * 1000);
-            return stat == pdPASS;
+            TRACE_SCOPE("signal");
+            Handle h;
+            bool keyed = key != 0 && policy != Policy::Drop;
+            if (keyed && policy == Policy::Coalesce)
+            {
+                Handle q;
+                if (findQueued(key, q))
+                {
+                    __atomic_fetch_add(&stats.coalesced, 1, __ATOMIC_RELAXED);
+                    return q;
+                }
+            }
+            int i = reserve();
+            if (i < 0)
+            {
+                __atomic_fetch_add(&stats.rejects, 1, __ATOMIC_RELAXED);
+                return h;
+            }
+            // 置き換えは新しい方を確保できてから(拒否されたときに両方失わない)
+            // 見つけた世代のままなら、取り出された時点で実行せずに捨てられる(もう実行が始まっていればそのまま)
+            Handle q;
+            if (keyed && policy == Policy::ReplaceLatest && findQueued(key, q) &&
+                casStatus(jobs[q.slot], q.generation, State::Queued, State::Cancelled))
+                __atomic_fetch_add(&stats.replaced, 1, __ATOMIC_RELAXED);
+            auto &j = jobs[i];
+            j.func = std::move(f);
+            j.done = std::move(d);
+            j.result = 0;
+            __atomic_store_n(&j.key, key, __ATOMIC_RELAXED);
+            j.name = name;
+            j.token.cancelled = false;
+#ifdef ENABLE_WORKER_STATS
+            j.queued = nowUs();
+#endif
+            h.slot = i;
+            h.generation = generationOf(loadStatus(j));
+            xEventGroupClearBits(finished, 1 << i);
+            // 中身を書き終えてから公開する
+            storeState(j, State::Queued);
+            // リングはスロット数分あるので溢れない
+            queues[int(pri)].tryPush(h.slot);
+            xSemaphoreGive(pending);
+            __atomic_fetch_add(&stats.submitted, 1, __ATOMIC_RELAXED);
+            return h;
+        }
+        Handle signal(Func f, Done d = nullptr, Priority pri = Priority::Normal,
+                      Policy policy = Policy::Drop, uint16_t key = 0)
+        {
+            return signal("job", std::move(f), std::move(d), pri, policy, key);
+        }
+
+        ///
+        /// delay(ms)後に投入する。period(ms)が0でなければ繰り返す
+        /// jitter: 予定時刻からの遅れの許容幅(超えたらstats.lateに数える)
+        /// doneはpoll()を呼んだスレッドで毎回呼ばれる
+        ///
+        Handle schedule(const char *name, Func f, Done d, uint32_t delay, uint32_t period = 0,
+                        uint32_t jitter = TimerTick, Priority pri = Priority::Normal)
+        {
+            Handle h;
+            portENTER_CRITICAL(&timerMux);
+            for (int i = 0; i < MaxTimers; i++)
+            {
+                if (!timers[i].active)
+                {
+                    timers[i].active = true;
+                    h.slot = i;
+                    h.generation = timers[i].generation;
+                    break;
+                }
+            }
+            portEXIT_CRITICAL(&timerMux);
+            if (!h.valid())
+            {
+                __atomic_fetch_add(&stats.rejects, 1, __ATOMIC_RELAXED);
+                return h;
+            }
+            auto &t = timers[h.slot];
+            t.func = std::move(f);
+            t.done = std::move(d);
+            t.period = period;
+            t.jitter = jitter;
+            t.priority = pri;
+            t.name = name;
+            t.busy = false;
+            t.rerun = false;
+            t.cancelled = false;
+            t.job = Handle{};
+            t.stats = TimerStats{};
+            uint32_t now = millis();
+            portENTER_CRITICAL(&timerMux);
+            t.due = now + delay;
+            wheel.insert(h.slot, ticksUntil(t.due, now));
+            portEXIT_CRITICAL(&timerMux);
+            return h;
+        }
+
+        // 実行中なら完了通知の後で解放する
+        void cancelTimer(Handle h)
+        {
+            if (!h.valid())
+                return;
+            auto &t = timers[h.slot];
+            portENTER_CRITICAL(&timerMux);
+            bool live = t.active && t.generation == h.generation && !t.cancelled;
+            bool release = live && !t.busy;
+            Handle job = t.job;
+            if (live)
+            {
+                wheel.remove(h.slot);
+                t.cancelled = true;
+            }
+            portEXIT_CRITICAL(&timerMux);
+            if (live)
+                cancel(job);
+            if (release)
+                releaseTimer(h.slot);
+        }
+
+        // 次のティックで実行する(実行中なら終わってからもう一度)。周期はそこから数え直す
+        void trigger(Handle h)
+        {
+            if (!h.valid())
+                return;
+            auto &t = timers[h.slot];
+            portENTER_CRITICAL(&timerMux);
+            if (t.active && t.generation == h.generation && !t.cancelled)
+            {
+                if (t.busy)
+                    t.rerun = true;
+                else
+                {
+                    t.due = millis();
+                    wheel.insert(h.slot, 0);
+                }
+            }
+            portEXIT_CRITICAL(&timerMux);
+        }
+
+        // 実行中の回だけを取り消す(タイマーは残す)
+        void cancelTimerRun(Handle h)
+        {
+            if (!h.valid())
+                return;
+            auto &t = timers[h.slot];
+            portENTER_CRITICAL(&timerMux);
+            bool live = t.active && t.generation == h.generation && t.busy;
+            Handle job = t.job;
+            portEXIT_CRITICAL(&timerMux);
+            if (live)
+                cancel(job);
+        }
+
+        bool getTimerStats(Handle h, TimerStats &out)
+        {
+            if (!h.valid())
+                return false;
+            auto &t = timers[h.slot];
+            portENTER_CRITICAL(&timerMux);
+            bool live = t.active && t.generation == h.generation;
+            if (live)
+                out = t.stats;
+            portEXIT_CRITICAL(&timerMux);
+            return live;
+        }
+
+        // 実行前なら実行せず、実行中ならトークンで知らせる
+        void cancel(Handle h)
+        {
+            if (auto *j = lookup(h))
+                j->token.cancelled = true;
+        }
+
+        bool isFinished(Handle h)
+        {
+            auto *j = lookup(h);
+            if (j == nullptr)
+                return true;
+            auto st = loadState(*j);
+            return st == State::Done || st == State::Cancelled;
+        }
+
+        // 完了を待つ(UIスレッドからは短いtimeoutで使う)
+        bool wait(Handle h, TickType_t timeout = portMAX_DELAY)
+        {
+            if (isFinished(h))
+                return true;
+            xEventGroupWaitBits(finished, 1 << h.slot, pdFALSE, pdTRUE, timeout);
+            return isFinished(h);
+        }
+
+        // 完了通知前なら結果を取り出せる
+        bool getResult(Handle h, int &result)
+        {
+            auto *j = lookup(h);
+            if (j == nullptr || loadState(*j) != State::Done)
+                return false;
+            result = j->result;
+            return true;
+        }
+
+        // 完了したジョブの通知を呼び、スロットを返す(UIスレッドのloopから呼ぶ)
+        void poll()
+        {
+            uint8_t idx;
+            while (doneQueue.tryPop(idx))
+            {
+                auto &j = jobs[idx];
+                if (j.done)
+                    j.done(j.result, loadState(j));
+                j.done.reset();
+                __atomic_store_n(&j.status, makeStatus(generationOf(loadStatus(j)) + 1, State::Free), __ATOMIC_RELEASE);
+            }
+        }
+
+        Stats getStats() const
+        {
+            Stats s = stats;
+            for (auto &q : queues)
+                if (q.getHighWater() > s.highWater)
+                    s.highWater = q.getHighWater();
+            return s;
+        }
+
+#ifdef ENABLE_WORKER_STATS
+        int getKindCount() const
+        {
+            int n = 0;
+            while (n < MaxKinds && kinds[n].name)
+                n++;
+            return n;
+        }
+        // 読んでいる間も更新されるので目安として使う
+        const KindStats &getKindStats(int i) const { return kinds[i]; }
+        int getTaskCount() const { return numTasks; }
+        const TaskStats &getTaskStats(int i) const { return taskStats[i]; }
+
+        void dumpStats(Print &out) const
+        {
+            out.println("job        count wait(p50/p99) run(p50/p99/max) us");
+            for (int i = 0; i < getKindCount(); i++)
+            {
+                const auto &k = kinds[i];
+                out.printf("%-10s %5u %6u/%-7u %6u/%u/%u\n", k.name, k.count,
+                           k.wait.percentile(50) >> 4, k.wait.percentile(99) >> 4,
+                           k.run.percentile(50) >> 4, k.run.percentile(99) >> 4, k.maxRun);
+            }
+            for (int i = 0; i < numTasks; i++)
+            {
+                const auto &t = taskStats[i];
+                out.printf("Worker%d stack free min %u/%u bytes (%s)\n", i, t.stackFree, stackSize,
+                           t.lowest ? t.lowest : "-");
+            }
         }
+#endif
     };
 }
@@ -7,7 +7,11 @@
 #include <worker.hpp>
 #include <store.hpp>
 #include <SD.h>
-#include <HTTPClient.h>
+#include <wifilink.hpp>
+#include <networks.hpp>
+#include <scanset.hpp>
+#include <jsonpull.hpp>
+#include <trace.hpp>
 
 namespace
 {
@@ -52,6 +56,8 @@ namespace
   TouchButton Btn2(230, 241, 310, 280);
 
   LGFX gfx;
+  UI::Painter painter;
+  UI::GlyphCache glyphCache;
   UI::Control ctrl;
   RTC rtc;
   Store::Data store;
@@ -62,6 +68,13 @@ namespace
   RTC_TimeTypeDef nTime;
 
   UI::CheckBox infoBtn;
+#ifdef ENABLE_PROFILER
+  UI::CheckBox profBtn;
+  Profile::Overlay profOverlay;
+#endif
+#ifdef ENABLE_TRACE
+  UI::TextButton traceBtn;
+#endif
   UI::TextButton wifiBtn;
   UI::TextButton dateBtn;
 
@@ -75,10 +88,23 @@ namespace
   UI::Keyboard keyboard;
 
   hw_timer_t *timer = nullptr;
-  portMUX_TYPE timerMux = portMUX_INITIALIZER_UNLOCKED;
-  volatile int vcnt = 0;
+  SemaphoreHandle_t vsyncSem = nullptr;
   bool updateSSID = false;
 
+  // 何も変化がないフレームは描画をスキップし、続いたらクロックを落とす
+  constexpr uint32_t ActiveCpuMhz = 240;
+  constexpr uint32_t IdleCpuMhz = 80;
+  constexpr int IdleFramesToSlow = 30;
+  constexpr bool ReportFrameStats = false;
+
+  void setCpuClock(uint32_t mhz)
+  {
+    setCpuFrequencyMhz(mhz);
+#ifdef ENABLE_PROFILER
+    Profile::setCpuMhz(mhz);
+#endif
+  }
+
   enum LayerID : int
   {
     lyDEFAULT,
@@ -90,65 +116,314 @@ namespace
     lySETTING,
   };
 
-  char ssid[32];
-  char password[32];
+  // 表示中のレイヤー(UIスレッドが書き、ワーカーの定期ジョブはこちらを見る)
+  int shownLayer = lyDEFAULT;
+
+  // 画面を切り替える(UIスレッドから)
+  void showLayer(int ly)
+  {
+    ctrl.setLayer(ly);
+    __atomic_store_n(&shownLayer, ly, __ATOMIC_RELEASE);
+  }
+  int getShownLayer() { return __atomic_load_n(&shownLayer, __ATOMIC_ACQUIRE); }
+
   const char *ntpServer = "ntp.jst.mfeed.ad.jp";
   constexpr int TimeZone = 9 * 3600;
 
+  // 保存する設定(起動時に一度だけ読み込み、以降はこの写しを参照する)
+  struct Settings
+  {
+    static constexpr uint16_t Version = 3;
+    Store::SmallArray<Net::Network, Net::Networks::MaxNetworks> networks; // v3
+    int32_t timeZone = TimeZone;
+    Net::WiFiLink::Cache wifiCache{}; // v2
+
+    template <typename V>
+    void visit(V &&v)
+    {
+      v("networks", networks);
+      v("timeZone", timeZone);
+      v("wifiCache", wifiCache);
+    }
+    void migrate(uint16_t from, Store::Data &st)
+    {
+      Store::FixedString<31> ssid, password;
+      if (from < 1)
+      {
+        // v0: 型なしの文字列
+        char buff[32];
+        if (st.loadString("ssid", buff, sizeof(buff)))
+          ssid = buff;
+        if (st.loadString("password", buff, sizeof(buff)))
+          password = buff;
+      }
+      else if (from < 3)
+      {
+        st.load("ssid", ssid);
+        st.load("password", password);
+      }
+      // v1→v2: 接続先の記録を追加(空から始める)
+      // v2→v3: 接続先を複数持つ。今までの1件を先頭に入れる
+      if (from < 3)
+      {
+        if (!ssid.empty())
+        {
+          Net::Network n{};
+          strlcpy(n.cred.ssid, ssid.c_str(), sizeof(n.cred.ssid));
+          strlcpy(n.cred.password, password.c_str(), sizeof(n.cred.password));
+          networks.push(n);
+        }
+        st.remove("ssid");
+        st.remove("password");
+      }
+    }
+  } settings;
+
   Worker::Task worker;
-  volatile bool wifiScanLoop = true;
+
+  Net::WiFiLink wifiLink;
+  Net::Networks networks;
+  // パスワード入力中の接続先(リストで選んだもの)
+  Store::FixedString<31> editSsid;
+  // 起動してから最初につながるまで(ms)
+  uint32_t bootJoinTime = 0;
+
+  // 通信のフロー(1本のワーカーで交互に進める)
+  Async::Runner flows;
+  SemaphoreHandle_t flowWake;
+  SemaphoreHandle_t scanWake;
+  constexpr uint32_t FlowTick = 50; // イベントが無くても進める間隔(ms)
+
+  // スキャン結果(ワーカーで集め、完了通知でUIスレッドからリストへ移す)
+  struct ScanResult
+  {
+    static constexpr size_t MaxEntries = 20;
+    char buffer[640];
+    UI::StringPool pool;
+    UI::StringPool::Handle entries[MaxEntries];
+    size_t count = 0;
+
+    void reset()
+    {
+      pool.attach(buffer, sizeof(buffer));
+      count = 0;
+    }
+    bool add(const char *s)
+    {
+      if (count < MaxEntries && pool.add(s, entries[count]))
+      {
+        count++;
+        return true;
+      }
+      return false;
+    }
+    // 定期的な取り直しで中身が変わっていなければ選択位置を残す
+    bool matches(const UI::ListBox &list) const
+    {
+      if (list.size() != count)
+        return false;
+      for (size_t i = 0; i < count; i++)
+        if (strcmp(list[i], pool.get(entries[i])) != 0)
+          return false;
+      return true;
+    }
+    void moveTo(UI::ListBox &list) const
+    {
+      if (matches(list))
+        return;
+      list.clear();
+      for (size_t i = 0; i < count; i++)
+        list.append(pool.get(entries[i]));
+    }
+  };
+  ScanResult fileScanResult;
+
+  // WiFiのスキャン結果(ワーカーが取り込み、UIスレッドが変化を見て表示を書き換える)
+  Net::ScanSet wifiScanSet;
+  struct ScanStats
+  {
+    uint32_t full = 0;
+    uint32_t quick = 0;
+    uint32_t lastFullTime = 0; // ms
+    uint32_t lastQuickTime = 0;
+    uint32_t lastLatency = 0; // スキャン完了イベントからリストを描くまで(us)
+    uint32_t maxLatency = 0;
+  } scanStats;
+  uint32_t scanShownAt = 0; // 描画待ちの結果の完了時刻(us)
+
+  // 定期ジョブ
+  constexpr uint32_t WifiRescanPeriod = 15 * 1000;
+  // 全チャンネルを見てからこの間は、何か見えていたチャンネルだけを見直す
+  constexpr uint32_t WifiFullScanAge = 60 * 1000;
+  constexpr int QuickScanChannels = 3;
+  constexpr uint32_t ScanWaitTick = 500; // 完了・取り消しはイベントで起きる
+  constexpr uint32_t FileRescanPeriod = 30 * 1000;
+  constexpr uint32_t NtpBootDelay = 500;
+  constexpr uint32_t NtpResyncPeriod = 60 * 60 * 1000;
+  constexpr uint32_t NtpResyncJitter = 60 * 1000;
+  constexpr uint32_t WifiIdleCheckPeriod = 5 * 1000;
+#ifdef ENABLE_WORKER_STATS
+  constexpr uint32_t WorkerStatsPeriod = 30 * 1000;
+#endif
+  Worker::Handle wifiScanTimer;
+  Worker::Handle fileScanTimer;
+  Worker::Handle ntpTimer;
+  // ジョブのまとめ用キー
+  constexpr uint16_t StoreJobKey = 1;
+
   void cancelScanWifi()
   {
-    wifiScanLoop = false;
+    worker.cancelTimerRun(wifiScanTimer);
+    xSemaphoreGive(scanWake);
     Serial.println("wifi scan cancel");
   }
 }
 
 //
-// 時刻
+// 通信フローの実行
 //
-void adjustDayTime()
+int pumpFlows()
+{
+  TRACE_SCOPE("flows");
+  while (flows.pump(millis()))
+    xSemaphoreTake(flowWake, pdMS_TO_TICKS(FlowTick)); // WiFiのイベントで起きる
+  return 0;
+}
+// 動いていなければ投入する(prepare()済みのもの)
+void startFlow(Async::Task &t)
 {
-  if (ssid[0] == '\0')
+  bool started;
+  if (!flows.submit(&t, started))
   {
-    Serial.println("adjust time failed: no ssid");
+    Serial.println("flow queue full");
     return;
   }
-  WiFi.begin(ssid, password);
-  Serial.printf("Wifi connect:[%s]", ssid);
-  while (WiFi.status() != WL_CONNECTED)
+  if (started && !worker.signal("flows", [](const Worker::Token &) { return pumpFlows(); }).valid())
+    flows.pumpFailed();
+}
+void wakeFlows()
+{
+  xSemaphoreGive(flowWake);
+  xSemaphoreGive(scanWake);
+}
+
+//
+// 登録済みの接続先から選んでつなぐ(フローごとに1つ)
+//
+class Join : public Net::JoinFlow
+{
+protected:
+  void onFinish(Async::Status st) override
   {
-    delay(500);
-    Serial.print(".");
+    if (st != Async::Status::Done)
+    {
+      Serial.printf("wifi join failed (%d)\n", int(st));
+      return;
+    }
+    Serial.printf("wifi join: %s %ums%s\n", joined.ssid, time, scanned ? " (scanned)" : "");
+    if (bootJoinTime == 0)
+    {
+      bootJoinTime = millis();
+      Serial.printf("wifi: connected %ums after boot\n", bootJoinTime);
+    }
   }
-  Serial.print("\n");
 
-  // get time from NTP server(UTC+9)
-  configTime(TimeZone, 0, ntpServer);
+public:
+  Join() : JoinFlow(wifiLink, ::networks) {}
+};
+Join timeJoin;
+Join httpJoin;
 
-  // Get local time
-  struct tm timeInfo;
-  if (getLocalTime(&timeInfo))
+//
+// 時刻
+//
+class TimeSync : public Net::TimeSyncFlow
+{
+protected:
+  void onFinish(Async::Status st) override
   {
+    if (st != Async::Status::Done)
+    {
+      Serial.printf("adjust time failed (%d)\n", int(st));
+      return;
+    }
     // Set RTC time
     RTC_TimeTypeDef rtime;
-    rtime.Hours = timeInfo.tm_hour;
-    rtime.Minutes = timeInfo.tm_min;
-    rtime.Seconds = timeInfo.tm_sec;
+    rtime.Hours = time.tm_hour;
+    rtime.Minutes = time.tm_min;
+    rtime.Seconds = time.tm_sec;
     RTC_DateTypeDef rdate;
-    rdate.WeekDay = timeInfo.tm_wday;
-    rdate.Month = timeInfo.tm_mon + 1;
-    rdate.Date = timeInfo.tm_mday;
-    rdate.Year = timeInfo.tm_year + 1900;
+    rdate.WeekDay = time.tm_wday;
+    rdate.Month = time.tm_mon + 1;
+    rdate.Date = time.tm_mday;
+    rdate.Year = time.tm_year + 1900;
     // TODO: ここは排他にするべき
     rtc.SetTime(&rtime);
     rtc.SetDate(&rdate);
+    Serial.println("setting done.");
   }
 
-  //disconnect WiFi
-  WiFi.disconnect(true);
-  WiFi.mode(WIFI_OFF);
-  Serial.println("setting done.");
+public:
+  TimeSync() : TimeSyncFlow(wifiLink) { connector = &timeJoin; }
+} timeSync;
+
+void adjustDayTime()
+{
+  if (!timeSync.prepare())
+    return; // 実行中
+  timeSync.server = ntpServer;
+  timeSync.timeZone = settings.timeZone;
+  startFlow(timeSync);
+}
+
+// 起動直後と、以降1時間ごとに時刻を合わせる(接続先が変わったら登録し直す)
+void scheduleNtpSync()
+{
+  worker.cancelTimer(ntpTimer);
+  ntpTimer = Worker::Handle{};
+  if (networks.size() == 0)
+    return;
+  // ジョブはフローを投入するだけで、待ちはフローの中で行う(接続先はその時に選ぶ)
+  ntpTimer = worker.schedule(
+      "ntp",
+      [](const Worker::Token &) {
+        adjustDayTime();
+        return 0;
+      },
+      nullptr, NtpBootDelay, NtpResyncPeriod, NtpResyncJitter, Worker::Priority::Low);
+}
+
+// commit()した変更をワーカーで書き込む。空きセクタが減っていたら続けて回収しておく
+void flushStore()
+{
+  auto h = worker.signal(
+      "store",
+      [](const Worker::Token &) {
+        bool ok = store.flush();
+        store.compact();
+        return ok ? 0 : -1;
+      },
+      nullptr, Worker::Priority::Low, Worker::Policy::Coalesce, StoreJobKey);
+  if (!h.valid())
+    store.flush(); // 投入できなければその場で書く
+}
+
+// ワーカー側で変わった接続先・接続の記録を設定に写して保存する(UIスレッドから)
+void saveNetworkSettings()
+{
+  bool changed = wifiLink.takeCache(settings.wifiCache);
+  if (networks.take(settings.networks))
+  {
+    changed = true;
+    updateSSID = true;
+  }
+  if (!changed)
+    return;
+  if (!store.begin())
+    return; // 写しは更新済み。次に保存するときに差分として書かれる
+  store.save(settings);
+  if (store.commit() == Store::Data::Commit::Pending)
+    flushStore();
 }
 
 //
@@ -163,71 +438,107 @@ bool updateTime()
 }
 
 //
-// Wifi scan
+// ヒープの断片化具合(再スキャンの前後で比べる)
 //
-void scanWifi()
+void reportHeap(const char *tag)
 {
-  WiFi.mode(WIFI_STA);
-  WiFi.scanNetworks(true);
+  size_t freeSize = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  Serial.printf("heap(%s): free %u, largest %u, frag %u%%\n", tag, freeSize, largest,
+                freeSize ? 100 - largest * 100 / freeSize : 0);
+}
 
-  bool scan = true;
-  while (wifiScanLoop)
+//
+// Wifi scan
+//
+int scanWifi(const Worker::Token &token)
+{
+  TRACE_SCOPE("scanWifi");
+  static Net::ScanFlow scanFlow(wifiLink);
+  uint8_t channels[QuickScanChannels];
+  int n = 0;
+  if (wifiScanSet.hasFullScanWithin(wifiLink.now(), WifiFullScanAge))
+    n = wifiScanSet.channels(channels, QuickScanChannels);
+  bool quick = n > 0;
+  if (!quick)
+    channels[n++] = 0; // 全チャンネル
+  Serial.printf("scanning%s...\n", quick ? " (quick)" : "");
+  auto start = millis();
+  auto st = Async::Status::Done;
+  for (int i = 0; i < n && st == Async::Status::Done; i++)
   {
-    int ret = WiFi.scanComplete();
-    if (ret == WIFI_SCAN_FAILED)
-    {
-      Serial.println("failed... retry");
-      WiFi.scanDelete();
-      WiFi.scanNetworks(true);
-      scan = true;
-    }
-    else if (ret == WIFI_SCAN_RUNNING)
-    {
-      if (scan)
-        Serial.println("scanning...");
-      scan = false;
-    }
-    else if (ret == 0)
-    {
-      Serial.println("no networks");
-      break;
-    }
-    else
-    {
-      for (int i = 0; i < ret; i++)
-      {
-        auto ssid = WiFi.SSID(i);
-        Serial.println(ssid);
-        apList.append(ssid.c_str());
-      }
-      WiFi.scanDelete();
+    scanFlow.channel = channels[i];
+    if (!scanFlow.prepare())
+      return -1;
+    st = Async::run(
+        scanFlow, [] { return wifiLink.now(); },
+        [] { xSemaphoreTake(scanWake, pdMS_TO_TICKS(ScanWaitTick)); },
+        [&] { return token.isCancelled(); });
+    if (st != Async::Status::Done)
       break;
-    }
-    delay(100);
+    // チャンネルごとに取り込み、UIはその都度表示を書き換える
+    wifiScanSet.merge(wifiLink, scanFlow.count, channels[i], wifiLink.now(), wifiLink.getScanDoneTime());
+    // 自動接続の候補選びには全チャンネルの結果だけを使う
+    if (!quick)
+      networks.updateScan(wifiLink, scanFlow.count, wifiLink.now());
+    scanFlow.discard();
+  }
+  auto time = millis() - start;
+  if (st == Async::Status::Done)
+  {
+    (quick ? scanStats.quick : scanStats.full)++;
+    (quick ? scanStats.lastQuickTime : scanStats.lastFullTime) = time;
   }
-  Serial.println("wifi scan done");
+  Serial.printf("wifi scan done (%d) %ums\n", int(st), time);
+  return st == Async::Status::Done ? wifiScanSet.size() : -1;
+}
+
+// スキャン結果が変わっていればリストを書き換える(UIスレッドから毎フレーム)
+void showWifiScan()
+{
+  static uint32_t shown = 0;
+  if (wifiScanSet.getVersion() == shown)
+    return;
+  Net::AccessPoint aps[Net::ScanSet::MaxEntries];
+  const char *names[Net::ScanSet::MaxEntries];
+  uint32_t doneAt;
+  int n = wifiScanSet.snapshot(aps, Net::ScanSet::MaxEntries, shown, doneAt);
+  for (int i = 0; i < n; i++)
+    names[i] = aps[i].ssid;
+  apList.assign(names, n);
+  scanShownAt = doneAt;
 }
 
 //
 // SD "/" scan
 //
-void scanFileSD()
+int scanFileSD(const Worker::Token &token)
 {
+  TRACE_SCOPE("scanFileSD");
   Serial.println("SD scan");
-  if (File dir = SD.open("/"))
+  fileScanResult.reset();
   {
-    while (File file = dir.openNextFile())
+    // LCDと同じSPIバスなので1件ごとに描画へ譲る
+    UI::Painter::BusLock bus(painter);
+    if (File dir = SD.open("/"))
     {
-      Serial.println(file.name());
-      if (file.isDirectory() == false)
-        imgList.append(file.name());
-      file.close();
+      while (File file = dir.openNextFile())
+      {
+        if (token.isCancelled())
+          break;
+        Serial.println(file.name());
+        if (file.isDirectory() == false)
+          fileScanResult.add(file.name());
+        file.close();
+        bus.yield();
+      }
+      dir.rewindDirectory();
+      dir.close();
     }
-    dir.rewindDirectory();
-    dir.close();
   }
   delay(1000);
   Serial.println("SD scan done");
+  return fileScanResult.count;
 }
 
 //
@@ -245,6 +556,7 @@ void startDispImage(const char *fname)
 //
 void initDispImage()
 {
+  TRACE_SCOPE("initDispImage");
   if (File f = SD.open(imageFileName))
   {
     Serial.printf("image open: [%s]\n", imageFileName.c_str());
@@ -271,10 +583,15 @@ void initDispImage()
 //
 void updateDispImage()
 {
+  if (!imageFile && imageFileName.isEmpty())
+    return;
+  // 描画タスクの転送とSPIバスを取り合わないよう、SDを触る間は占有する
+  UI::Painter::BusLock bus(painter);
   if (imageFile)
   {
     if (imageProcY < imageHeight)
     {
+      TRACE_SCOPE("sdRead");
       imageFile.read((uint8_t *)imageLine, imageWidth * 2);
     }
     else
@@ -295,45 +612,124 @@ void drawDispImage()
   if (imageProcY < 0)
     return;
 
-  for (int x = 0; x < imageWidth; x++)
-  {
-    auto color = imageLine[x];
-    gfx.drawPixel(x, imageProcY, color);
-  }
+  painter.pushImage(0, imageProcY, imageWidth, 1, imageLine);
   imageProcY++;
 }
 
 //
 // HTTP
 //
-void httpConnect()
+class HttpTest : public Net::HttpPostFlow
 {
-  WiFi.begin(ssid, password);
-  Serial.printf("Wifi connect:[%s]", ssid);
-  while (WiFi.status() != WL_CONNECTED)
+  Json::Parser<> json;
+  char key[32];
+
+  // トップレベルのメンバーを出す(入れ子の値は中を読み飛ばす)
+  bool printJson()
   {
-    delay(500);
-    Serial.print(".");
+    for (;;)
+    {
+      auto ev = json.next();
+      switch (ev)
+      {
+      case Json::Event::NeedMore:
+      case Json::Event::End:
+        return true;
+      case Json::Event::Error:
+        return false;
+      case Json::Event::Key:
+        if (json.depth() == 1)
+          json.copyValue(key, sizeof(key));
+        break;
+      case Json::Event::BeginObject:
+      case Json::Event::BeginArray:
+        if (json.depth() == 1)
+          key[0] = '\0';
+        else if (json.depth() == 2)
+        {
+          Serial.printf("  %s: %s\n", key, ev == Json::Event::BeginObject ? "{...}" : "[...]");
+          json.skip();
+        }
+        break;
+      case Json::Event::EndObject:
+      case Json::Event::EndArray:
+        break;
+      default:
+        if (json.depth() <= 1)
+        {
+          char v[64];
+          json.copyValue(v, sizeof(v));
+          Serial.printf("  %s: %s\n", key, v);
+        }
+        break;
+      }
+    }
   }
 
-  HTTPClient http;
-  http.begin("http://localhost:23456/demo");
-  http.addHeader("Content-Type", "application/json");
-  int code = http.POST("{\"machine\":\"M5Core2\"}");
-  if (code > 0)
+protected:
+  void onFinish(Async::Status st) override
   {
-    Serial.printf("Result: %s\n", http.getString().c_str());
+    if (st == Async::Status::Done)
+    {
+      json.finish();
+      bool ok = printJson() && json.done();
+      Serial.printf("Result(%d): %u bytes%s\n", code, bodyBytes, ok ? "" : " (not json)");
+    }
+    else
+      Serial.printf("Error HTTP (%d, %d)\n", int(st), code);
   }
-  else
+
+public:
+  uint32_t bodyBytes = 0;
+
+  HttpTest() : HttpPostFlow(wifiLink) { connector = &httpJoin; }
+
+  void clear()
+  {
+    bodyBytes = 0;
+    json.reset();
+    key[0] = '\0';
+  }
+  // 届いた分ずつ読む(応答全体は溜めない)
+  bool onBody(const uint8_t *data, size_t size) override
   {
-    Serial.println("Error HTTP");
+    bodyBytes += size;
+    json.feed(reinterpret_cast<const char *>(data), size);
+    if (printJson())
+      return true;
+    Serial.println("json: parse error");
+    return false;
   }
-  http.end();
+} httpTest;
 
-  WiFi.disconnect(true);
-  WiFi.mode(WIFI_OFF);
+void httpConnect()
+{
+  if (!httpTest.prepare())
+    return; // 実行中
+  httpTest.clear();
+  httpTest.url = "http://localhost:23456/demo";
+  httpTest.body = "{\"machine\":\"M5Core2\"}";
+  startFlow(httpTest);
 }
 
+//
+// trace
+//
+#ifdef ENABLE_TRACE
+void dumpTrace()
+{
+  UI::Painter::BusLock bus(painter);
+  if (File f = SD.open("/trace.bin", FILE_WRITE))
+  {
+    Trace::Dumper(f).dump();
+    f.close();
+    Serial.println("trace saved: /trace.bin");
+  }
+  else
+    Serial.println("trace save failed");
+}
+#endif
+
 //
 // Application
 //
@@ -346,9 +742,16 @@ void buttonUpdate(int x, int y, bool touch)
 
 void IRAM_ATTR onTimer()
 {
-  portENTER_CRITICAL_ISR(&timerMux);
-  vcnt++;
-  portEXIT_CRITICAL_ISR(&timerMux);
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(vsyncSem, &woken);
+  if (woken)
+    portYIELD_FROM_ISR();
+}
+
+//
+bool isImageBusy()
+{
+  return imageProcY >= 0 || imageFile || !imageFileName.isEmpty();
 }
 
 void setup()
@@ -358,10 +761,15 @@ void setup()
   gfx.init();
   rtc.begin();
   SD.begin(4);
-  store.init("TEST", 128);
+  if (store.init("kvstore"))
+    store.load(settings);
+  wifiLink.setCache(settings.wifiCache);
+  networks.load(settings.networks);
 
-  gfx.setFont(&fonts::lgfxJapanGothic_24);
-  ctrl.init(&gfx);
+  painter.init(&gfx, &fonts::lgfxJapanGothic_24);
+  if (glyphCache.init(&fonts::lgfxJapanGothic_24, 24))
+    painter.setGlyphCache(&glyphCache);
+  ctrl.init(&painter);
 
   // main
   ctrl.setLayer(lyDEFAULT);
@@ -373,21 +781,21 @@ void setup()
   settingBtn.setCaption("設定");
   settingBtn.setGeometory(40, topY);
   settingBtn.setPressFunction([](UI::Widget *) {
-    ctrl.setLayer(lySETTING);
+    showLayer(lySETTING);
   });
   topY += settingBtn.getHeight() + 5;
   imgBtn.setCaption("画像リスト");
   imgBtn.setGeometory(40, topY);
   imgBtn.setPressFunction([](UI::Widget *) {
-    ctrl.setLayer(lyIMGLIST);
-    worker.signal([](int) { scanFileSD(); }, 0);
+    showLayer(lyIMGLIST);
+    worker.trigger(fileScanTimer);
   });
   topY += imgBtn.getHeight() + 5;
   httpBtn.setCaption("HTTPテスト");
   httpBtn.setGeometory(40, topY);
   httpBtn.setPressFunction([](UI::Widget *) {
-    ctrl.setLayer(lyIMGLIST);
-    worker.signal([](int) { httpConnect(); }, 0);
+    showLayer(lyIMGLIST);
+    httpConnect();
   });
   // topY += imgBtn.getHeight() + 5;
 
@@ -404,15 +812,36 @@ void setup()
   wifiBtn.setCaption("Wifi設定");
   wifiBtn.setGeometory(40, topY);
   wifiBtn.setPressFunction([](UI::Widget *) {
-    ctrl.setLayer(lyWIFI);
-    apList.clear();
-    wifiScanLoop = true;
-    worker.signal([](int) { scanWifi(); }, 0);
+    showLayer(lyWIFI);
+    // 新しいうちは前回の結果を出したまま見直す
+    if (!wifiScanSet.hasFullScanWithin(wifiLink.now(), WifiFullScanAge))
+      wifiScanSet.clear();
+    worker.trigger(wifiScanTimer);
   });
   topY += wifiBtn.getHeight() + 5;
   dateBtn.setCaption("日付・時刻");
   dateBtn.setGeometory(40, topY);
-  dateBtn.setPressFunction([](UI::Widget *) { ctrl.setLayer(lyDATETIME); });
+  dateBtn.setPressFunction([](UI::Widget *) { showLayer(lyDATETIME); });
+#ifdef ENABLE_TRACE
+  ctrl.appendWidget(&traceBtn);
+  traceBtn.setCaption("トレース");
+  traceBtn.setGeometory(190, topY);
+  traceBtn.setPressFunction([](UI::Widget *) {
+    worker.signal(
+        "trace",
+        [](const Worker::Token &) {
+          dumpTrace();
+          return 0;
+        },
+        nullptr, Worker::Priority::Low);
+  });
+#endif
+#ifdef ENABLE_PROFILER
+  topY += dateBtn.getHeight() + 5;
+  ctrl.appendWidget(&profBtn);
+  profBtn.setCaption("プロファイル");
+  profBtn.setGeometory(40, topY);
+#endif
 
   // time
   ctrl.setLayer(lyDATETIME);
@@ -422,18 +851,12 @@ void setup()
   reqBtn.setCaption("時刻合わせ");
   reqBtn.setGeometory(50, topY);
   reqBtn.setPressFunction([](UI::Widget *) {
-    static int test = 0;
-    worker.signal(
-        [](int n) {
-          adjustDayTime();
-        },
-        test);
-    test++;
+    adjustDayTime();
   });
   topY += reqBtn.getHeight() + 5;
   retBtn.setCaption("戻る");
   retBtn.setGeometory(50, topY);
-  retBtn.setPressFunction([](UI::Widget *) { ctrl.setLayer(lyDEFAULT); });
+  retBtn.setPressFunction([](UI::Widget *) { showLayer(lyDEFAULT); });
 
   // wifi
   ctrl.setLayer(lyWIFI);
@@ -443,9 +866,12 @@ void setup()
   apList.init(6, 240);
   apList.setSelectFunction([](int idx, const char *str) {
     cancelScanWifi();
-    strlcpy(ssid, str, sizeof(ssid));
-    Serial.println(ssid);
-    ctrl.setLayer(lyWIFIPW);
+    editSsid = str;
+    Serial.println(str);
+    // 登録済みならパスワードを出しておく
+    Net::Credentials cred;
+    keyboard.setString(networks.get(str, cred) ? cred.password : "");
+    showLayer(lyWIFIPW);
   });
 
   // keyboard
@@ -455,14 +881,7 @@ void setup()
   keyboard.init(22);
   keyboard.setGeometory(10, topY);
   keyboard.setPlaceHolder("wifi password");
-  if (store.loadString(0, password, sizeof(password)))
-    keyboard.setString(password);
-  else
-    strlcpy(password, "", sizeof(password));
-  if (store.loadString(1, ssid, sizeof(ssid)))
-    updateSSID = true;
-  else
-    strlcpy(ssid, "", sizeof(ssid));
+  updateSSID = !settings.networks.empty();
 
   // image list
   ctrl.setLayer(lyIMGLIST);
@@ -473,9 +892,15 @@ void setup()
   imgList.setSelectFunction([](int idx, const char *str) {
     Serial.println(str);
     startDispImage(str);
-    ctrl.setLayer(lyIMGDISP);
+    showLayer(lyIMGDISP);
   });
 
+#ifdef RENDER_TASK
+  // 頻繁に行き来するレイヤーは画面をキャッシュしておく(読み戻しは描画タスクで)
+  for (int ly : {lyDEFAULT, lySETTING, lyIMGLIST})
+    ctrl.enableSnapshot(ly);
+#endif
+
   //
   ctrl.setLayer(lyDEFAULT);
   Btn0.setPressFunction([] {
@@ -483,16 +908,16 @@ void setup()
     {
     case lyWIFI:
       cancelScanWifi();
-      ctrl.setLayer(lySETTING);
+      showLayer(lySETTING);
       break;
     case lyWIFIPW:
-      ctrl.setLayer(lySETTING);
+      showLayer(lySETTING);
       break;
     case lyIMGLIST:
-      ctrl.setLayer(lyDEFAULT);
+      showLayer(lyDEFAULT);
       break;
     case lyIMGDISP:
-      ctrl.setLayer(lyIMGLIST);
+      showLayer(lyIMGLIST);
       break;
     default:
       break;
@@ -502,13 +927,16 @@ void setup()
     switch (ctrl.getLayer())
     {
     case lyWIFIPW:
-      keyboard.getString(password, sizeof(password));
-      store.clearIndex();
-      store.storeString(password);
-      store.storeString(ssid);
-      ctrl.setLayer(lySETTING);
-      updateSSID = true;
+    {
+      Net::Credentials cred{};
+      strlcpy(cred.ssid, editSsid.c_str(), sizeof(cred.ssid));
+      keyboard.getString(cred.password, sizeof(cred.password));
+      networks.add(cred);
+      saveNetworkSettings();
+      scheduleNtpSync();
+      showLayer(lySETTING);
       break;
+    }
     case lyIMGLIST:
       imgList.scoll(-1);
       break;
@@ -529,77 +957,274 @@ void setup()
 
   //
   int vsync = 100 * 1000 * 1000 / 5995;
+  vsyncSem = xSemaphoreCreateBinary();
   timer = timerBegin(0, 80, true);
   timerAttachInterrupt(timer, &onTimer, true);
   timerAlarmWrite(timer, vsync, true);
   timerAlarmEnable(timer);
 
-  worker.start();
+  // WiFi待ちのジョブがあってもスキャン等を止めないよう2本にする
+  flowWake = xSemaphoreCreateBinary();
+  scanWake = xSemaphoreCreateBinary();
+  wifiLink.begin(wakeFlows);
+  worker.start(2);
+
+  // 表示中のリストだけ定期的に取り直す(画面に入った時はtrigger()ですぐ実行)
+  // 取り直しはタイマーの1本だけが行うので、結果バッファを取り合わない
+  wifiScanTimer = worker.schedule(
+      "wifiScan",
+      [](const Worker::Token &token) { return getShownLayer() == lyWIFI ? scanWifi(token) : -1; },
+      [](int n, Worker::State st) {
+        if (st != Worker::State::Done || n < 0)
+          return;
+        Serial.printf("wifi scan: %d networks\n", n);
+        reportHeap("wifi scan");
+      },
+      WifiRescanPeriod, WifiRescanPeriod, 1000, Worker::Priority::High);
+  fileScanTimer = worker.schedule(
+      "fileScan",
+      [](const Worker::Token &token) { return getShownLayer() == lyIMGLIST ? scanFileSD(token) : -1; },
+      [](int n, Worker::State st) {
+        if (st != Worker::State::Done || n < 0)
+          return;
+        fileScanResult.moveTo(imgList);
+        Serial.printf("imgList: %u entries, %u/%u bytes\n", imgList.size(), imgList.getPoolUsed(), imgList.getPoolCapacity());
+        reportHeap("SD scan");
+      },
+      FileRescanPeriod, FileRescanPeriod, 1000, Worker::Priority::High);
+  scheduleNtpSync();
+  // 使われていない無線を止め、接続先や接続の記録が変わったら保存する(保存は完了通知でUIスレッドから)
+  worker.schedule(
+      "wifiIdle",
+      [](const Worker::Token &) {
+        wifiLink.update();
+        return 0;
+      },
+      [](int, Worker::State) { saveNetworkSettings(); },
+      WifiIdleCheckPeriod, WifiIdleCheckPeriod, 500, Worker::Priority::Low);
+#ifdef ENABLE_WORKER_STATS
+  worker.schedule(
+      "stats",
+      [](const Worker::Token &) {
+        worker.dumpStats(Serial);
+        return 0;
+      },
+      nullptr, WorkerStatsPeriod, WorkerStatsPeriod, 1000, Worker::Priority::Low);
+#endif
+#ifdef RENDER_TASK
+  // 入力・UI更新はloopタスク(core1)、LCD転送は描画タスク(core0)
+  painter.startTask(0);
+#endif
 }
 
-void loop()
+void updateFrame()
 {
-  int lvcnt;
-  portENTER_CRITICAL(&timerMux);
-  lvcnt = vcnt;
-  portEXIT_CRITICAL(&timerMux);
+  auto frameStart = micros();
 
   static bool touch_first = true;
   static int x, y;
   int tch = 0;
-  if (gfx.touch())
   {
-    if (gfx.getTouch(&x, &y, 0))
+    PROFILE_SCOPE(Touch);
+    if (gfx.touch())
     {
-      ctrl.touchCheck(x, y, touch_first);
-      tch++;
+      if (gfx.getTouch(&x, &y, 0))
+      {
+        PROFILE_SCOPE(TouchCheck);
+        if (touch_first)
+        {
+          TRACE_INSTANT("touch");
+          painter.markTouch();
+        }
+        ctrl.touchCheck(x, y, touch_first);
+        tch++;
+      }
+      buttonUpdate(x, y, tch > 0);
+      touch_first = tch == 0;
     }
-    buttonUpdate(x, y, tch > 0);
-    touch_first = tch == 0;
   }
 
-  updateDispImage();
-  updateTime();
+  // ワーカーの完了通知(ウィジェットの更新はここだけで行う)
+  worker.poll();
+  if (ctrl.getLayer() == lyWIFI)
+    showWifiScan();
+
+  {
+    PROFILE_SCOPE(UpdateImage);
+    updateDispImage();
+  }
+  bool timeChanged;
+  {
+    PROFILE_SCOPE(UpdateTime);
+    timeChanged = updateTime();
+  }
+
+  static bool infoDisp = false;
+  static bool btnPress[3] = {true, true, true};
+  bool infoChanged = infoDisp != infoBtn.getValue();
+  bool btnChanged = btnPress[0] != Btn0.onPressed() || btnPress[1] != Btn1.onPressed() || btnPress[2] != Btn2.onPressed();
+  // SSIDは情報表示が出ているときだけ描く(消えている間は出したときにinfoChangedで描き直す)
+  bool ssidChanged = updateSSID && infoBtn.getValue();
+  bool active = tch > 0 || ctrl.needDraw() || timeChanged || infoChanged || btnChanged || ssidChanged || isImageBusy();
+#ifdef ENABLE_PROFILER
+  static bool profDisp = false;
+  bool profChanged = profDisp != profBtn.getValue();
+  active |= profChanged || (profBtn.getValue() && profOverlay.due());
+#endif
+
+  static int idleFrames = 0;
+  static uint32_t drawFrames = 0;
+  static uint32_t skipFrames = 0;
+  static uint32_t busyTime = 0;
+  if (active)
   {
+    if (idleFrames >= IdleFramesToSlow)
+      setCpuClock(ActiveCpuMhz);
+    idleFrames = 0;
+    drawFrames++;
+
     char buff[24];
-    gfx.startWrite();
-    ctrl.drawWidgets();
+    painter.startWrite();
+    {
+      PROFILE_SCOPE(DrawWidgets);
+      TRACE_SCOPE("drawWidgets");
+      ctrl.drawWidgets();
+    }
     if (infoBtn.getValue())
     {
-      gfx.setTextColor(TFT_YELLOW);
+      painter.setTextColor(TFT_YELLOW);
       static int ns = 0;
-      if (ns != nTime.Seconds)
+      if (ns != nTime.Seconds || infoChanged)
       {
-        gfx.fillRect(5, 205, 110, 24, TFT_BLACK);
+        painter.fillRect(5, 205, 110, 24, TFT_BLACK);
         snprintf(buff, sizeof(buff), "%02d:%02d.%02d", nTime.Hours, nTime.Minutes, nTime.Seconds);
-        gfx.drawString(buff, 5, 205);
+        painter.drawString(buff, 5, 205);
         ns = nTime.Seconds;
       }
-      if (updateSSID)
+      if (updateSSID || infoChanged)
       {
-        gfx.fillRect(120, 205, 200, 24, TFT_BLACK);
-        gfx.drawString(ssid, 120, 205);
+        painter.fillRect(120, 205, 200, 24, TFT_BLACK);
+        painter.drawString(settings.networks.empty() ? "" : settings.networks[0].cred.ssid, 120, 205);
         updateSSID = false;
       }
     }
-    else
+    else if (infoChanged)
+    {
+      painter.fillRect(0, 205, 320, 24, TFT_BLACK);
+    }
+    infoDisp = infoBtn.getValue();
+    if (btnChanged)
+    {
+      btnPress[0] = Btn0.onPressed();
+      btnPress[1] = Btn1.onPressed();
+      btnPress[2] = Btn2.onPressed();
+      painter.fillRect(20, 230, 60, 10, btnPress[0] ? TFT_BLUE : TFT_BLACK);
+      painter.fillRect(130, 230, 60, 10, btnPress[1] ? TFT_RED : TFT_BLACK);
+      painter.fillRect(240, 230, 60, 10, btnPress[2] ? TFT_GREEN : TFT_BLACK);
+    }
+    {
+      PROFILE_SCOPE(DrawImage);
+      drawDispImage();
+    }
+#ifdef ENABLE_PROFILER
+    // 情報表示の右上に重ねる
+    constexpr int ovX = 320 - Profile::Overlay::Width;
+    constexpr int ovY = 205 - Profile::Overlay::Height;
+    // スナップショットの範囲に重なるので、描き変えたらどのレイヤーのキャッシュも使えない
+    if (profBtn.getValue() && (profChanged || profOverlay.due()))
+    {
+      profOverlay.draw(&painter, ovX, ovY);
+      painter.setFont(&fonts::lgfxJapanGothic_24);
+      ctrl.invalidateSnapshots();
+    }
+    else if (profChanged)
+    {
+      painter.fillRect(ovX, ovY, Profile::Overlay::Width, Profile::Overlay::Height, TFT_BLACK);
+      ctrl.invalidateSnapshots();
+    }
+    profDisp = profBtn.getValue();
+#endif
+    painter.endWrite();
+    if (scanShownAt != 0)
     {
-      gfx.fillRect(0, 205, 320, 24, TFT_BLACK);
-      updateSSID = true;
+      scanStats.lastLatency = micros() - scanShownAt;
+      if (scanStats.lastLatency > scanStats.maxLatency)
+        scanStats.maxLatency = scanStats.lastLatency;
+      scanShownAt = 0;
     }
-    gfx.fillRect(20, 230, 60, 10, Btn0.onPressed() ? TFT_BLUE : TFT_BLACK);
-    gfx.fillRect(130, 230, 60, 10, Btn1.onPressed() ? TFT_RED : TFT_BLACK);
-    gfx.fillRect(240, 230, 60, 10, Btn2.onPressed() ? TFT_GREEN : TFT_BLACK);
-    drawDispImage();
-    gfx.endWrite();
+  }
+  else
+  {
+    ctrl.captureIdle();
+    painter.flush();
+    skipFrames++;
+    if (++idleFrames == IdleFramesToSlow)
+      setCpuClock(IdleCpuMhz);
   }
 
-  bool wait = true;
-  while (wait)
+  if (ReportFrameStats)
+  {
+    busyTime += micros() - frameStart;
+    static uint32_t reportTime = 0;
+    auto now = millis();
+    if (now - reportTime >= 10 * 1000)
+    {
+      // busyはフレーム処理時間の合計(低クロック時は長めに出る)
+      Serial.printf("frame: draw=%u skip=%u busy=%u.%u%% cpu=%uMHz\n",
+                    drawFrames, skipFrames, busyTime / 100000, busyTime / 10000 % 10,
+                    getCpuFrequencyMhz());
+      const auto &ps = painter.getStats();
+      Serial.printf("render(%s): frames=%u stalls=%u touch-to-photon avg=%uus max=%uus\n",
+                    painter.isDeferred() ? "task" : "direct", ps.frames, ps.stalls,
+                    ps.latencyCount ? ps.latencySum / ps.latencyCount : 0, ps.latencyMax);
+      const auto &ls = ctrl.getLayerStats();
+      Serial.printf("layer: switch=%u cached=%u last=%uus max=%uus\n",
+                    ls.switches, ls.cacheHits, ls.lastTime, ls.maxTime);
+      const auto &ks = keyboard.getStats();
+      const auto &gs = glyphCache.getStats();
+      Serial.printf("glyph: hit=%u miss=%u %u glyphs/s\n", gs.hits, gs.misses,
+                    gs.time ? (uint32_t)((uint64_t)gs.glyphs * 1000000 / gs.time) : 0);
+      Serial.printf("keyboard: keys=%u last=%upx %uus input-to-draw=%uus\n",
+                    ks.keystrokes, ks.pixels, ks.time, ks.latency);
+      const auto &wl = wifiLink.getStats();
+      Serial.printf("wifi: warm=%u cached=%u(last %ums max %ums) cold=%u(last %ums max %ums) fallback=%u off=%u\n",
+                    wl.count[Net::WiFiLink::Warm], wl.count[Net::WiFiLink::Cached],
+                    wl.last[Net::WiFiLink::Cached], wl.max[Net::WiFiLink::Cached], wl.count[Net::WiFiLink::Cold],
+                    wl.last[Net::WiFiLink::Cold], wl.max[Net::WiFiLink::Cold], wl.fallbacks, wl.powerDowns);
+      Serial.printf("wifi join: networks=%d boot-to-connected=%ums\n", networks.size(), bootJoinTime);
+      const auto &hs = wifiLink.getHttpStats();
+      Serial.printf("http: requests=%u reused=%u retries=%u received=%u\n", hs.requests, hs.reused, hs.retries, hs.bytes);
+      Serial.printf("wifi scan: full=%u(last %ums) quick=%u(last %ums) scan-to-display last=%uus max=%uus\n",
+                    scanStats.full, scanStats.lastFullTime, scanStats.quick, scanStats.lastQuickTime,
+                    scanStats.lastLatency, scanStats.maxLatency);
+      auto ws = worker.getStats();
+      Serial.printf("worker: jobs=%u reject=%u coalesce=%u replace=%u high-water=%u\n",
+                    ws.submitted, ws.rejects, ws.coalesced, ws.replaced, ws.highWater);
+      Worker::TimerStats ts;
+      if (worker.getTimerStats(wifiScanTimer, ts))
+        Serial.printf("timer(wifi): runs=%u drift avg=%ums max=%ums late=%u overrun=%u skip=%u\n",
+                      ts.runs, ts.meanDrift(), ts.maxDrift, ts.late, ts.overruns, ts.skipped);
+      if (worker.getTimerStats(ntpTimer, ts))
+        Serial.printf("timer(ntp): runs=%u drift avg=%ums max=%ums late=%u overrun=%u skip=%u\n",
+                      ts.runs, ts.meanDrift(), ts.maxDrift, ts.late, ts.overruns, ts.skipped);
+      Serial.printf("store: keys=%d live=%u/%u erase=%u flush=%u last=%uus/%uB max=%uus\n",
+                    store.getKeyCount(), store.getLiveBytes(), store.getCapacity(), store.getEraseCount(),
+                    store.getFlushCount(), store.getLastFlushTime(), store.getLastFlushBytes(), store.getMaxFlushTime());
+      drawFrames = skipFrames = busyTime = 0;
+      reportTime = now;
+    }
+  }
+}
+
+void loop()
+{
+  // 前フレーム中に溜まったvsyncは捨てる
+  xSemaphoreTake(vsyncSem, 0);
   {
-    portENTER_CRITICAL(&timerMux);
-    wait = lvcnt == vcnt;
-    portEXIT_CRITICAL(&timerMux);
+    PROFILE_SCOPE(Frame);
+    TRACE_SCOPE("frame");
+    updateFrame();
   }
-  //delay(50);
+  // 次のvsyncまでブロック(アイドル中はここでCPUを手放す)
+  xSemaphoreTake(vsyncSem, portMAX_DELAY);
 }
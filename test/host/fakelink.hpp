@@ -0,0 +1,210 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <netflow.hpp>
+#include <stdio.h>
+#include <string.h>
+
+//
+// ホストのテスト用のLink
+// 時刻はテストが進める(t)。接続・スキャン・NTP・HTTPはそれぞれ決めた時間が経つと終わる
+//
+class FakeLink : public Net::Link
+{
+public:
+    struct AccessPoint
+    {
+        const char *ssid;
+        int rssi;
+        int channel;
+        const char *password; // 正しいパスワード(nullptrなら何でもよい)
+    };
+
+    uint32_t t = 0;
+    // 接続
+    uint32_t connectDelay = 3000;
+    AccessPoint aps[32] = {};
+    int numAps = 0;
+    // スキャン
+    uint32_t scanDelay = 2000;
+    int scanFails = 0; // 次からこの回数だけScanFailedで終わる
+    // NTP
+    uint32_t ntpDelay = 500; // 0xffffffffなら返らない
+    // HTTP
+    int httpCode = 200;
+    const char *httpBody = "ok";
+    uint32_t httpDelay = 100;  // 1チャンクごと
+    size_t httpChunk = 4;
+    bool httpStall = false; // 最初のチャンクの後で止まる
+
+    // 記録
+    int users = 0;
+    Net::Credentials current{};
+    int connects = 0; // 接続を始めた回数(つながったままなら数えない)
+    int refused = 0;
+    int scans = 0;
+    int scanDeletes = 0; // 持っていたownerが捨てた回数
+    int foreignDeletes = 0; // 持っていないownerのscanDelete
+    const void *scanOwner = nullptr;
+    int httpAborts = 0;
+    int posts = 0;
+
+    void add(const char *ssid, int rssi, int channel, const char *password = nullptr)
+    {
+        aps[numAps++] = AccessPoint{ssid, rssi, channel, password};
+    }
+
+    uint32_t now() override { return t; }
+
+    bool connect(const Net::Credentials &cred) override
+    {
+        bool same = strcmp(current.ssid, cred.ssid) == 0 && strcmp(current.password, cred.password) == 0;
+        if (users > 0 && !same)
+        {
+            refused++;
+            return false;
+        }
+        if (users++ == 0 && (!same || !up))
+        {
+            current = cred;
+            up = false;
+            connectAt = t + connectDelay;
+            connects++;
+        }
+        return true;
+    }
+    bool isConnected() override
+    {
+        if (users == 0)
+            return false;
+        if (!up && t >= connectAt)
+        {
+            auto *ap = find(current.ssid);
+            up = ap && (!ap->password || strcmp(ap->password, current.password) == 0);
+        }
+        return up;
+    }
+    void release() override
+    {
+        if (users <= 0)
+        {
+            fprintf(stderr, "FakeLink: release without connect\n");
+            users = -1000; // 確認で分かるように
+            return;
+        }
+        --users;
+    }
+    // 使われなくなってからも、つながったまま(WiFiLinkのIdleTimeout内と同じ)
+    void powerDown()
+    {
+        up = false;
+        current = Net::Credentials{};
+    }
+
+    bool startScan(const void *owner, uint8_t channel) override
+    {
+        if (scanOwner && scanOwner != owner)
+            return false;
+        scanOwner = owner;
+        scanChannelFilter = channel;
+        scanAt = t + scanDelay;
+        scanFailed = scanFails > 0;
+        if (scanFailed)
+            scanFails--;
+        scans++;
+        return true;
+    }
+    int scanComplete() override
+    {
+        if (t < scanAt)
+            return ScanRunning;
+        if (scanFailed)
+            return ScanFailed;
+        found = 0;
+        for (int i = 0; i < numAps; i++)
+            if (scanChannelFilter == 0 || aps[i].channel == scanChannelFilter)
+                index[found++] = i;
+        return found;
+    }
+    void scanSSID(int i, char *buff, size_t size) override { snprintf(buff, size, "%s", aps[index[i]].ssid); }
+    int scanRSSI(int i) override { return aps[index[i]].rssi; }
+    int scanChannel(int i) override { return aps[index[i]].channel; }
+    void scanDelete(const void *owner) override
+    {
+        if (scanOwner != owner)
+        {
+            foreignDeletes++;
+            return;
+        }
+        scanOwner = nullptr;
+        scanDeletes++;
+    }
+
+    void startNtp(const char *, long) override { ntpAt = ntpDelay == 0xffffffff ? ntpDelay : t + ntpDelay; }
+    bool getTime(struct tm &tm) override
+    {
+        if (t < ntpAt)
+            return false;
+        tm = {};
+        tm.tm_hour = 12;
+        return true;
+    }
+
+    int httpStart(const char *, const char *, const char *, Net::HttpSink *s) override
+    {
+        if (!up)
+            return Net::HttpSendFailed;
+        posts++;
+        sink = s;
+        sent = 0;
+        nextChunk = t + httpDelay;
+        return Net::HttpRunning;
+    }
+    int httpPoll() override
+    {
+        if (!sink)
+            return Net::HttpAborted;
+        size_t len = strlen(httpBody);
+        while (t >= nextChunk && sent < len && !(httpStall && sent > 0))
+        {
+            size_t n = len - sent < httpChunk ? len - sent : httpChunk;
+            sink->onBody(reinterpret_cast<const uint8_t *>(httpBody + sent), n);
+            sent += n;
+            nextChunk += httpDelay;
+        }
+        if (sent < len || t < nextChunk)
+            return Net::HttpRunning;
+        sink = nullptr;
+        return httpCode;
+    }
+    uint32_t httpReceived() override { return sent; }
+    void httpAbort() override
+    {
+        httpAborts++;
+        sink = nullptr;
+    }
+
+private:
+    bool up = false;
+    uint32_t connectAt = 0;
+    uint8_t scanChannelFilter = 0;
+    uint32_t scanAt = 0;
+    bool scanFailed = false;
+    int index[32];
+    int found = 0;
+    uint32_t ntpAt = 0;
+    Net::HttpSink *sink = nullptr;
+    size_t sent = 0;
+    uint32_t nextChunk = 0;
+
+    AccessPoint *find(const char *ssid)
+    {
+        for (int i = 0; i < numAps; i++)
+            if (strcmp(aps[i].ssid, ssid) == 0)
+                return &aps[i];
+        return nullptr;
+    }
+};
@@ -0,0 +1,247 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <mutex>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+//
+// ホストのテスト用のHTTPサーバ(127.0.0.1の空いているポート)
+// 接続ごとにスレッドを立て、パス(/種類/バイト数)で応答の形を選ぶ
+//   /len/N       Content-Length
+//   /chunked/N   chunked(chunkバイトずつ、拡張とトレーラ付き)
+//   /close/N     長さなし、送り終わったら切る
+//   /continue/N  100 Continueの後にContent-Length
+//   /http10/N    HTTP/1.0(keep-aliveなし)
+//   /empty       204
+//   /echo        要求の本文をそのまま返す
+//   /garbage     ステータス行が壊れている
+//   /truncate/N  Content-Lengthより短く切る
+//   /badchunk    チャンクの長さが読めない
+// 本文は"0123456789abcdef"の繰り返し
+//
+class HttpServer
+{
+public:
+    static char patternAt(size_t i) { return "0123456789abcdef"[i % 16]; }
+
+    size_t chunk = 3000;
+    std::atomic<int> dropAfter{-1}; // 1つの接続でこの数だけ応えたら、次の要求は読んで黙って切る(keep-aliveの切れ目)
+    std::atomic<int> accepts{0};
+    std::atomic<int> requests{0};
+
+    HttpServer()
+    {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(listener, reinterpret_cast<sockaddr *>(&addr), len) != 0 || listen(listener, 8) != 0 ||
+            getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len) != 0)
+        {
+            perror("HttpServer");
+            abort();
+        }
+        port = ntohs(addr.sin_port);
+        acceptor = std::thread([this] { acceptLoop(); });
+    }
+    ~HttpServer()
+    {
+        stopping = true;
+        ::shutdown(listener, SHUT_RDWR);
+        acceptor.join();
+        {
+            std::lock_guard<std::mutex> lk(m);
+            for (int fd : fds)
+                ::shutdown(fd, SHUT_RDWR);
+        }
+        for (auto &t : threads)
+            t.join();
+        for (int fd : fds)
+            ::close(fd);
+        ::close(listener);
+    }
+
+    uint16_t getPort() const { return port; }
+    // http://127.0.0.1:port/path
+    std::string url(const char *path) const { return "http://127.0.0.1:" + std::to_string(port) + path; }
+
+private:
+    int listener = -1;
+    uint16_t port = 0;
+    std::atomic<bool> stopping{false};
+    std::thread acceptor;
+    std::mutex m;
+    std::vector<std::thread> threads;
+    std::vector<int> fds;
+
+    void acceptLoop()
+    {
+        for (;;)
+        {
+            int fd = ::accept(listener, nullptr, nullptr);
+            if (fd < 0 || stopping)
+            {
+                if (fd >= 0)
+                    ::close(fd);
+                return;
+            }
+            accepts++;
+            std::lock_guard<std::mutex> lk(m);
+            fds.push_back(fd);
+            threads.emplace_back([this, fd] {
+                serve(fd);
+                ::shutdown(fd, SHUT_RDWR);
+            });
+        }
+    }
+
+    static bool sendAll(int fd, const void *p, size_t n)
+    {
+        auto *b = static_cast<const char *>(p);
+        while (n > 0)
+        {
+            ssize_t r = ::send(fd, b, n, MSG_NOSIGNAL);
+            if (r <= 0)
+                return false;
+            b += r;
+            n -= r;
+        }
+        return true;
+    }
+    static bool sendString(int fd, const std::string &s) { return sendAll(fd, s.data(), s.size()); }
+    // 模様の本文をoffsetから
+    static bool sendPattern(int fd, size_t size, size_t offset = 0)
+    {
+        char buff[16 * 1024];
+        for (size_t i = 0; i < sizeof(buff); i++)
+            buff[i] = patternAt(offset + i);
+        while (size > 0)
+        {
+            size_t n = size < sizeof(buff) ? size : sizeof(buff);
+            if (!sendAll(fd, buff, n))
+                return false;
+            size -= n;
+        }
+        return true;
+    }
+
+    // 要求を1つ読む(ヘッダと本文)
+    static bool readRequest(int fd, std::string &rest, std::string &path, std::string &body)
+    {
+        size_t end;
+        while ((end = rest.find("\r\n\r\n")) == std::string::npos)
+        {
+            char buff[1024];
+            ssize_t r = ::recv(fd, buff, sizeof(buff), 0);
+            if (r <= 0)
+                return false;
+            rest.append(buff, r);
+        }
+        std::string head = rest.substr(0, end);
+        rest.erase(0, end + 4);
+        size_t sp = head.find(' ');
+        path = head.substr(sp + 1, head.find(' ', sp + 1) - sp - 1);
+        size_t length = 0;
+        auto cl = head.find("Content-Length:");
+        if (cl != std::string::npos)
+            length = strtoul(head.c_str() + cl + 15, nullptr, 10);
+        while (rest.size() < length)
+        {
+            char buff[1024];
+            ssize_t r = ::recv(fd, buff, sizeof(buff), 0);
+            if (r <= 0)
+                return false;
+            rest.append(buff, r);
+        }
+        body = rest.substr(0, length);
+        rest.erase(0, length);
+        return true;
+    }
+
+    void serve(int fd)
+    {
+        std::string rest, path, body;
+        for (int served = 0; readRequest(fd, rest, path, body); served++)
+        {
+            requests++;
+            if (served == dropAfter)
+                return;
+            if (!respond(fd, path, body))
+                return;
+        }
+    }
+    // falseなら切る
+    bool respond(int fd, const std::string &path, const std::string &body)
+    {
+        auto slash = path.find('/', 1);
+        std::string kind = path.substr(1, slash == std::string::npos ? std::string::npos : slash - 1);
+        size_t size = slash == std::string::npos ? 0 : strtoull(path.c_str() + slash + 1, nullptr, 10);
+        auto length = [](size_t n) { return "Content-Length: " + std::to_string(n) + "\r\n\r\n"; };
+        if (kind == "len")
+            return sendString(fd, "HTTP/1.1 200 OK\r\n" + length(size)) && sendPattern(fd, size);
+        if (kind == "chunked")
+        {
+            if (!sendString(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"))
+                return false;
+            for (size_t done = 0; done < size;)
+            {
+                size_t n = size - done < chunk ? size - done : chunk;
+                char line[32];
+                snprintf(line, sizeof(line), "%zx;ext=1\r\n", n);
+                if (!sendString(fd, line) || !sendPattern(fd, n, done) || !sendString(fd, "\r\n"))
+                    return false;
+                done += n;
+            }
+            return sendString(fd, "0\r\nX-Trailer: y\r\n\r\n");
+        }
+        if (kind == "close")
+        {
+            sendString(fd, "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n") && sendPattern(fd, size);
+            return false;
+        }
+        if (kind == "continue")
+            return sendString(fd, "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\n" + length(size)) &&
+                   sendPattern(fd, size);
+        if (kind == "http10")
+        {
+            sendString(fd, "HTTP/1.0 200 OK\r\n" + length(size)) && sendPattern(fd, size);
+            return false;
+        }
+        if (kind == "empty")
+            return sendString(fd, "HTTP/1.1 204 No Content\r\n\r\n");
+        if (kind == "echo")
+            return sendString(fd, "HTTP/1.1 200 OK\r\n" + length(body.size()) + body);
+        if (kind == "garbage")
+        {
+            sendString(fd, "garbage\r\n\r\n");
+            return false;
+        }
+        if (kind == "truncate")
+        {
+            sendString(fd, "HTTP/1.1 200 OK\r\n" + length(size)) && sendPattern(fd, size / 2);
+            return false;
+        }
+        if (kind == "badchunk")
+        {
+            sendString(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\nabc\r\n");
+            return false;
+        }
+        return sendString(fd, "HTTP/1.1 404 Not Found\r\n" + length(0));
+    }
+};
@@ -0,0 +1,114 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <httpserver.hpp>
+#include <httpstream.hpp>
+#include <posixconn.hpp>
+#include <atomic>
+#include <chrono>
+#include <malloc.h>
+#include <new>
+#include <string>
+
+//
+// 応答を流して読むときの速さとヒープの山
+// 以前のhttp.getString()の形(本文を全部Stringに溜めてから使う)と比べる
+// ヒープはoperator newを数える(サーバのスレッドの分も入るが、要求1つにつき数百バイト)
+//
+namespace
+{
+    std::atomic<size_t> heapNow{0}, heapPeak{0};
+
+    void heapAdd(void *p)
+    {
+        size_t now = heapNow += malloc_usable_size(p);
+        size_t peak = heapPeak;
+        while (now > peak && !heapPeak.compare_exchange_weak(peak, now))
+        {
+        }
+    }
+    void resetPeak() { heapPeak = heapNow.load(); }
+
+    using Clock = std::chrono::steady_clock;
+    using Client = Net::HttpClient<PosixConn>;
+
+    // 数えるだけ
+    struct Count : Net::HttpSink
+    {
+        uint64_t bytes = 0;
+        bool onBody(const uint8_t *, size_t size) override
+        {
+            bytes += size;
+            return true;
+        }
+    };
+    // getString()と同じく全部溜める
+    struct Whole : Net::HttpSink
+    {
+        std::string body;
+        bool onBody(const uint8_t *data, size_t size) override
+        {
+            body.append(reinterpret_cast<const char *>(data), size);
+            return true;
+        }
+    };
+
+    void measure(const char *label, HttpServer &server, const char *kind, size_t size, size_t buffSize, bool whole)
+    {
+        PosixConn conn;
+        auto *buff = new uint8_t[buffSize];
+        Client client(conn, buff, buffSize);
+        char path[64];
+        snprintf(path, sizeof(path), "/%s/%zu", kind, size);
+        std::string url = server.url(path);
+        size_t base = heapNow;
+        resetPeak();
+        Count count;
+        Whole all;
+        auto t0 = Clock::now();
+        int r = client.request("GET", url.c_str(), nullptr, nullptr, whole ? static_cast<Net::HttpSink *>(&all) : &count);
+        while (r == Net::HttpRunning)
+        {
+            conn.wait(100);
+            r = client.poll();
+        }
+        double sec = std::chrono::duration<double>(Clock::now() - t0).count();
+        uint64_t got = whole ? all.body.size() : count.bytes;
+        size_t peak = heapPeak - base;
+        printf("  %-26s %-8s %7.1f MB/s  heap peak %9zu B%s\n", label, kind, size / sec / 1e6, peak,
+               r == 200 && got == size ? "" : "  FAILED");
+        delete[] buff;
+    }
+}
+
+void *operator new(size_t n)
+{
+    void *p = malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    heapAdd(p);
+    return p;
+}
+void operator delete(void *p) noexcept
+{
+    if (!p)
+        return;
+    heapNow -= malloc_usable_size(p);
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+int main(int argc, char **argv)
+{
+    size_t size = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 64) << 20;
+    HttpServer server;
+    printf("%zu MB from 127.0.0.1:\n", size >> 20);
+    for (const char *kind : {"len", "chunked"})
+    {
+        measure("stream, 512 B buffer", server, kind, size, 512, false);
+        measure("stream, 4 KB buffer", server, kind, size, 4096, false);
+        measure("whole body (getString)", server, kind, size, 512, true);
+    }
+    return 0;
+}
@@ -0,0 +1,263 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <check.hpp>
+#include <httpserver.hpp>
+#include <httpstream.hpp>
+#include <posixconn.hpp>
+#include <chrono>
+#include <string>
+
+//
+// 応答の読み方(httpstream.hpp)
+// パーサはどこで分けて渡しても同じ結果になるか、クライアントはホストのサーバ相手に
+// 100 Continue、keep-aliveの使い回しと張り直し、失敗の返し方を確かめる
+//
+namespace
+{
+    using Net::HttpParser;
+    using Client = Net::HttpClient<PosixConn>;
+
+    // 本文を全部溜める
+    struct Collect : Net::HttpSink
+    {
+        std::string body;
+        size_t limit = size_t(-1); // これを超えたら打ち切る
+        bool onBody(const uint8_t *data, size_t size) override
+        {
+            body.append(reinterpret_cast<const char *>(data), size);
+            return body.size() <= limit;
+        }
+    };
+
+    struct Result
+    {
+        HttpParser::State state;
+        int status;
+        bool keepAlive;
+        std::string body;
+        bool operator==(const Result &o) const
+        {
+            return state == o.state && status == o.status && keepAlive == o.keepAlive && body == o.body;
+        }
+    };
+    Result parse(const std::string &resp, const std::vector<size_t> &cuts, bool closed)
+    {
+        HttpParser p;
+        Collect c;
+        p.reset(&c);
+        size_t at = 0;
+        for (size_t cut : cuts)
+        {
+            p.feed(reinterpret_cast<const uint8_t *>(resp.data()) + at, cut - at);
+            at = cut;
+        }
+        p.feed(reinterpret_cast<const uint8_t *>(resp.data()) + at, resp.size() - at);
+        if (closed)
+            p.finish();
+        return Result{p.getState(), p.status, p.keepAlive, c.body};
+    }
+
+    // 1回で渡した結果が期待どおりで、2つ・3つに分けたどの位置でも、1バイトずつでも同じになる
+    void checkSplits(const std::string &resp, HttpParser::State state, int status, bool keepAlive, const char *body,
+                     bool closed = false)
+    {
+        Result whole = parse(resp, {}, closed);
+        CHECK(whole == (Result{state, status, keepAlive, body}));
+        int differ = 0;
+        for (size_t i = 0; i <= resp.size(); i++)
+            for (size_t j = i; j <= resp.size(); j++)
+                differ += !(parse(resp, {i, j}, closed) == whole);
+        std::vector<size_t> bytes;
+        for (size_t i = 1; i < resp.size(); i++)
+            bytes.push_back(i);
+        differ += !(parse(resp, bytes, closed) == whole);
+        CHECK_EQ(differ, 0);
+    }
+
+    void testParserSplits()
+    {
+        using S = HttpParser::State;
+        checkSplits("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhelloEXTRA", S::Done, 200, true, "hello");
+        checkSplits("HTTP/1.1 200 OK\r\ntransfer-encoding: Chunked\r\n\r\n3\r\nabc\r\nA;x=y\r\n0123456789\r\n"
+                    "0\r\nX-Trailer: 1\r\n\r\n",
+                    S::Done, 200, true, "abc0123456789");
+        checkSplits("HTTP/1.0 200 OK\r\n\r\nuntil close", S::Done, 200, false, "until close", true);
+        checkSplits("HTTP/1.1 404 Not Found\r\nConnection: close\r\nContent-Length: 2\r\n\r\nno", S::Done, 404, false,
+                    "no");
+        checkSplits("HTTP/1.0 200 OK\r\nConnection: keep-alive\r\nContent-Length: 0\r\n\r\n", S::Done, 200, true, "");
+        checkSplits("HTTP/1.1 204 No Content\r\n\r\n", S::Done, 204, true, "");
+        // 100 Continueは読み捨てる。長すぎるヘッダは切り詰める
+        checkSplits("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 201 Created\r\nX-Long: " + std::string(300, 'a') +
+                        "\r\nContent-Length: 1\r\n\r\nx",
+                    S::Done, 201, true, "x");
+        // LFだけの改行
+        checkSplits("HTTP/1.0 200 OK\nContent-Length: 2\n\nok", S::Done, 200, false, "ok");
+        // 失敗
+        checkSplits("garbage\r\n", S::Error, 0, false, "");
+        checkSplits("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nabc", S::Error, 200, true, "abc", true);
+        checkSplits("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabcX\r\n", S::Error, 200, true, "abc");
+        checkSplits("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", S::Error, 200, true, "");
+
+        // HEADの応答は本文を読まない
+        HttpParser p;
+        p.reset(nullptr, true);
+        const char head[] = "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n";
+        p.feed(reinterpret_cast<const uint8_t *>(head), sizeof(head) - 1);
+        CHECK(p.isDone());
+        CHECK_EQ(p.bodyBytes, 0u);
+    }
+
+    // 終わるまで回す
+    int run(Client &client, PosixConn &conn, const std::string &url, Net::HttpSink *sink,
+            const char *method = "POST", const char *body = "{\"machine\":\"M5Core2\"}")
+    {
+        int r = client.request(method, url.c_str(), "application/json", body, sink);
+        auto until = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (r == Net::HttpRunning && std::chrono::steady_clock::now() < until)
+        {
+            conn.wait(100);
+            r = client.poll();
+        }
+        return r;
+    }
+    bool isPattern(const std::string &s, size_t size)
+    {
+        if (s.size() != size)
+            return false;
+        for (size_t i = 0; i < size; i++)
+            if (s[i] != HttpServer::patternAt(i))
+                return false;
+        return true;
+    }
+
+    void testClient()
+    {
+        HttpServer server;
+        server.chunk = 700;
+        PosixConn conn;
+        uint8_t buff[512];
+        Client client(conn, buff, sizeof(buff));
+
+        // 形が違っても本文はそのまま。同じ接続を使い回す
+        const char *paths[] = {"/len/1000", "/chunked/10000", "/len/0", "/continue/500", "/empty"};
+        size_t sizes[] = {1000, 10000, 0, 500, 0};
+        int codes[] = {200, 200, 200, 200, 204};
+        for (int i = 0; i < 5; i++)
+        {
+            Collect c;
+            CHECK_EQ(run(client, conn, server.url(paths[i]), &c), codes[i]);
+            CHECK(isPattern(c.body, sizes[i]));
+            CHECK(client.isOpen());
+        }
+        {
+            Collect c;
+            CHECK_EQ(run(client, conn, server.url("/echo"), &c, "POST", "posted body"), 200);
+            CHECK(c.body == "posted body");
+        }
+        CHECK_EQ(conn.connects, 1);
+        CHECK_EQ(server.accepts.load(), 1);
+        CHECK_EQ(client.getStats().reused, 5u);
+
+        // 相手が閉じる応答の後は張り直す
+        {
+            Collect c;
+            CHECK_EQ(run(client, conn, server.url("/close/7777"), &c), 200);
+            CHECK(isPattern(c.body, 7777));
+            CHECK(!client.isOpen());
+            CHECK_EQ(run(client, conn, server.url("/http10/10"), &c), 200);
+            CHECK(!client.isOpen());
+            CHECK_EQ(run(client, conn, server.url("/len/10"), &c), 200);
+            CHECK_EQ(conn.connects, 3);
+        }
+        // 別のポートなら別の接続
+        {
+            HttpServer other;
+            Collect c;
+            CHECK_EQ(run(client, conn, other.url("/len/3"), &c), 200);
+            CHECK_EQ(other.accepts.load(), 1);
+            CHECK_EQ(run(client, conn, server.url("/len/3"), &c), 200);
+            CHECK_EQ(conn.connects, 5);
+        }
+    }
+
+    // keep-aliveの接続が要求を受けたところで切れたら、1度だけ張り直して送り直す
+    void testRetry()
+    {
+        HttpServer server;
+        server.dropAfter = 1;
+        PosixConn conn;
+        uint8_t buff[512];
+        Client client(conn, buff, sizeof(buff));
+        for (int i = 0; i < 4; i++)
+        {
+            Collect c;
+            CHECK_EQ(run(client, conn, server.url("/len/100"), &c), 200);
+            CHECK(isPattern(c.body, 100));
+        }
+        // 2回目からは毎回、使い回した接続で断られて張り直す
+        CHECK_EQ(client.getStats().retries, 3u);
+        CHECK_EQ(conn.connects, 4);
+        CHECK_EQ(server.requests.load(), 7);
+
+        // 新しい接続で何も返らなければ送り直さない
+        server.dropAfter = 0;
+        client.close();
+        Collect c;
+        CHECK_EQ(run(client, conn, server.url("/len/100"), &c), int(Net::HttpBadResponse));
+        CHECK_EQ(client.getStats().retries, 3u);
+    }
+
+    void testErrors()
+    {
+        HttpServer server;
+        PosixConn conn;
+        uint8_t buff[512];
+        Client client(conn, buff, sizeof(buff));
+        Collect c;
+        CHECK_EQ(run(client, conn, server.url("/garbage"), &c), int(Net::HttpBadResponse));
+        CHECK(!client.isOpen());
+        CHECK_EQ(run(client, conn, server.url("/truncate/1000"), &c), int(Net::HttpConnectionLost));
+        CHECK(!client.isOpen());
+        CHECK_EQ(run(client, conn, server.url("/badchunk"), &c), int(Net::HttpConnectionLost));
+        CHECK_EQ(run(client, conn, server.url("/nothing"), &c), 404);
+        CHECK(client.isOpen());
+
+        // 受け取り側が打ち切ったら接続を捨てる
+        Collect small;
+        small.limit = 1000;
+        CHECK_EQ(run(client, conn, server.url("/len/100000"), &small), int(Net::HttpAborted));
+        CHECK(!client.isOpen());
+        CHECK_EQ(run(client, conn, server.url("/len/10"), &c), 200);
+
+        CHECK_EQ(client.request("POST", "https://example.com/", "t", "b", nullptr), int(Net::HttpBadUrl));
+        CHECK_EQ(client.request("POST", "http://:80/", "t", "b", nullptr), int(Net::HttpBadUrl));
+        // 誰も聞いていないポート
+        uint16_t closed;
+        {
+            HttpServer gone;
+            closed = gone.getPort();
+        }
+        char url[64];
+        snprintf(url, sizeof(url), "http://127.0.0.1:%u/", closed);
+        CHECK_EQ(client.request("GET", url, nullptr, nullptr, &c), int(Net::HttpConnectFailed));
+        // 要求がバッファに入らなければ、つながずに断る(送り直さない)
+        CHECK_EQ(run(client, conn, server.url("/len/10"), &c), 200);
+        int connects = conn.connects;
+        auto retries = client.getStats().retries;
+        std::string path = server.url("/len/1/") + std::string(600, 'p');
+        CHECK_EQ(client.request("GET", path.c_str(), nullptr, nullptr, &c), int(Net::HttpSendFailed));
+        CHECK_EQ(conn.connects, connects);
+        CHECK_EQ(client.getStats().retries, retries);
+    }
+}
+
+int main()
+{
+    testParserSplits();
+    testClient();
+    testRetry();
+    testErrors();
+    return CHECK_RESULT("httpstream");
+}
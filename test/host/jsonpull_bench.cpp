@@ -0,0 +1,292 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <jsonpull.hpp>
+#include <algorithm>
+#include <chrono>
+#include <malloc.h>
+#include <map>
+#include <memory>
+#include <new>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#ifdef HAVE_NLOHMANN_JSON
+#include <nlohmann/json.hpp>
+#endif
+
+//
+// 逐次のJSONパーサの速さとヒープの山
+// 512バイトずつ(HTTPの受信バッファと同じ)渡して要素のidを足す。
+// 本文を全部溜めて木にしてから同じことをするのと比べる(下の最小のDOM。nlohmann::jsonがあればそれとも)
+//
+namespace
+{
+    size_t heapNow = 0, heapPeak = 0;
+
+    using Clock = std::chrono::steady_clock;
+
+    std::string makeDoc(int items)
+    {
+        std::string doc = "{\"items\":[";
+        for (int i = 0; i < items; i++)
+        {
+            char b[256];
+            snprintf(b, sizeof(b),
+                     "%s{\"id\":%d,\"name\":\"device-%d\",\"temp\":%d.%d,\"ok\":%s,\"tags\":[\"a\",\"b\\u00e9\"],"
+                     "\"note\":null}",
+                     i ? "," : "", i, i, 20 + i % 10, i % 10, i % 3 ? "true" : "false");
+            doc += b;
+        }
+        return doc + "],\"status\":\"ok\"}";
+    }
+
+    long long pull(const std::string &doc)
+    {
+        Json::Parser<> p;
+        char buff[512];
+        long long sum = 0;
+        bool id = false;
+        for (size_t i = 0; i < doc.size(); i += sizeof(buff))
+        {
+            size_t n = std::min(sizeof(buff), doc.size() - i);
+            memcpy(buff, doc.data() + i, n);
+            p.feed(buff, n);
+            for (Json::Event ev; (ev = p.next()) != Json::Event::NeedMore && ev != Json::Event::End;)
+            {
+                if (ev == Json::Event::Key)
+                    id = p.depth() == 3 && p.is("id");
+                else if (ev == Json::Event::Number && id)
+                {
+                    int32_t v;
+                    if (p.getInt(v))
+                        sum += v;
+                }
+            }
+        }
+        p.finish();
+        p.next();
+        return p.done() ? sum : -1;
+    }
+    //
+    // 比べる相手の最小のDOM(値ごとにヒープに置く、よくある木の形)
+    //
+    struct Value
+    {
+        enum Type : uint8_t
+        {
+            Null,
+            Bool,
+            Number,
+            String,
+            Array,
+            Object,
+        } type = Null;
+        bool b = false;
+        double num = 0;
+        std::string str;
+        std::vector<std::unique_ptr<Value>> items;
+        std::map<std::string, std::unique_ptr<Value>> members;
+
+        const Value *get(const char *key) const
+        {
+            auto it = members.find(key);
+            return it == members.end() ? nullptr : it->second.get();
+        }
+    };
+    // 失敗したらnullptr(エスケープは\uを含めて読み飛ばすだけ、比べる量は変わらない)
+    class DomReader
+    {
+        const char *p, *end;
+
+        void ws()
+        {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+                p++;
+        }
+        bool string(std::string &out)
+        {
+            if (*p++ != '"')
+                return false;
+            while (p < end && *p != '"')
+            {
+                if (*p == '\\' && ++p == end)
+                    return false;
+                out += *p++;
+            }
+            return p++ < end;
+        }
+        bool literal(const char *s)
+        {
+            size_t n = strlen(s);
+            if (size_t(end - p) < n || memcmp(p, s, n) != 0)
+                return false;
+            p += n;
+            return true;
+        }
+        std::unique_ptr<Value> value()
+        {
+            ws();
+            if (p == end)
+                return nullptr;
+            std::unique_ptr<Value> v(new Value);
+            char c = *p;
+            if (c == '{')
+            {
+                v->type = Value::Object;
+                p++;
+                ws();
+                if (p < end && *p == '}')
+                    return p++, std::move(v);
+                for (;;)
+                {
+                    std::string key;
+                    ws();
+                    if (p == end || !string(key))
+                        return nullptr;
+                    ws();
+                    if (p == end || *p++ != ':')
+                        return nullptr;
+                    auto item = value();
+                    if (!item)
+                        return nullptr;
+                    v->members[key] = std::move(item);
+                    ws();
+                    if (p == end)
+                        return nullptr;
+                    if (*p == '}')
+                        return p++, std::move(v);
+                    if (*p++ != ',')
+                        return nullptr;
+                }
+            }
+            if (c == '[')
+            {
+                v->type = Value::Array;
+                p++;
+                ws();
+                if (p < end && *p == ']')
+                    return p++, std::move(v);
+                for (;;)
+                {
+                    auto item = value();
+                    if (!item)
+                        return nullptr;
+                    v->items.push_back(std::move(item));
+                    ws();
+                    if (p == end)
+                        return nullptr;
+                    if (*p == ']')
+                        return p++, std::move(v);
+                    if (*p++ != ',')
+                        return nullptr;
+                }
+            }
+            if (c == '"')
+            {
+                v->type = Value::String;
+                return string(v->str) ? std::move(v) : nullptr;
+            }
+            if (literal("true") || literal("false"))
+            {
+                v->type = Value::Bool;
+                v->b = c == 't';
+                return v;
+            }
+            if (literal("null"))
+                return v;
+            char *e;
+            v->num = strtod(p, &e);
+            if (e == p)
+                return nullptr;
+            v->type = Value::Number;
+            p = e;
+            return v;
+        }
+
+    public:
+        std::unique_ptr<Value> parse(const std::string &doc)
+        {
+            p = doc.data();
+            end = p + doc.size();
+            auto v = value();
+            ws();
+            return p == end ? std::move(v) : nullptr;
+        }
+    };
+
+    // getString()と同じく本文を全部溜めてから木にする
+    long long tree(const std::string &doc)
+    {
+        std::string body;
+        for (size_t i = 0; i < doc.size(); i += 512)
+            body.append(doc, i, 512);
+        auto root = DomReader().parse(body);
+        const Value *items = root ? root->get("items") : nullptr;
+        if (!items)
+            return -1;
+        long long sum = 0;
+        for (auto &it : items->items)
+            if (const Value *id = it->get("id"))
+                sum += (long long)id->num;
+        return sum;
+    }
+#ifdef HAVE_NLOHMANN_JSON
+    long long dom(const std::string &doc)
+    {
+        auto j = nlohmann::json::parse(doc);
+        long long sum = 0;
+        for (auto &it : j["items"])
+            sum += it["id"].get<int>();
+        return sum;
+    }
+#endif
+
+    template <typename F>
+    void measure(const char *label, const std::string &doc, int reps, F &&f)
+    {
+        size_t base = heapPeak = heapNow;
+        long long sum = 0;
+        auto t0 = Clock::now();
+        for (int r = 0; r < reps; r++)
+            sum = f(doc);
+        double sec = std::chrono::duration<double>(Clock::now() - t0).count() / reps;
+        printf("  %-16s %7.1f MB/s  heap peak %11zu B  (sum %lld)\n", label, doc.size() / sec / 1e6, heapPeak - base,
+               sum);
+    }
+}
+
+// 置き換えを呼び出し側へ展開させない(展開するとnew/freeの組み合わせをgccが誤って警告する)
+__attribute__((noinline)) void *operator new(size_t n)
+{
+    void *p = malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    heapNow += malloc_usable_size(p);
+    heapPeak = std::max(heapPeak, heapNow);
+    return p;
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    if (!p)
+        return;
+    heapNow -= malloc_usable_size(p);
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+int main(int argc, char **argv)
+{
+    int items = argc > 1 ? atoi(argv[1]) : 100000;
+    std::string doc = makeDoc(items);
+    printf("%.1f MB, %d items (parser %zu B + 512 B buffer):\n", doc.size() / 1e6, items, sizeof(Json::Parser<>));
+    measure("Json::Parser", doc, 10, pull);
+    measure("whole body + DOM", doc, 10, tree);
+#ifdef HAVE_NLOHMANN_JSON
+    measure("nlohmann::json", doc, 10, dom);
+#else
+    printf("  (nlohmann/json.hpp not found, nlohmann::json skipped)\n");
+#endif
+    return 0;
+}
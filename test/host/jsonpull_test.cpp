@@ -0,0 +1,171 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <check.hpp>
+#include <jsonpull.hpp>
+#include <string>
+#include <vector>
+
+//
+// 逐次のJSONパーサ(jsonpull.hpp)
+// どの大きさのかたまりに分けて渡しても、イベントの並びが1回で渡したときと同じになるか
+// かたまりは次のfeed()の前に塗りつぶす(HTTPの受信バッファを使い回すのと同じ)
+//
+namespace
+{
+    using Json::Event;
+    using Parser = Json::Parser<16, 64>;
+
+    const char *names[] = {"more", "{", "}", "[", "]", "key", "str", "num", "true", "false", "null", "end", "ERR"};
+
+    // イベントの並びを文字列にする。最後にdone()の結果を付ける
+    std::string events(const std::string &doc, size_t split, bool skipKey = false)
+    {
+        Parser p;
+        std::string out;
+        std::vector<char> chunk;
+        auto pump = [&] {
+            for (;;)
+            {
+                auto ev = p.next();
+                if (ev == Event::NeedMore)
+                    return true;
+                if (ev == Event::End)
+                {
+                    // 空白だけの続きでも何度か返る
+                    if (out.size() < 4 || out.compare(out.size() - 4, 4, "end ") != 0)
+                        out += "end ";
+                    return true;
+                }
+                out += names[int(ev)];
+                if (ev == Event::Key || ev == Event::String || ev == Event::Number)
+                {
+                    char buff[256];
+                    p.copyValue(buff, sizeof(buff));
+                    out += "(" + std::string(buff) + (p.truncated() ? "~" : "") + ")";
+                }
+                if (ev == Event::Key && skipKey && p.is("skip"))
+                    p.skip();
+                out += " ";
+                if (ev == Event::Error)
+                    return false;
+            }
+        };
+        bool ok = true;
+        for (size_t i = 0; ok && i < doc.size(); i += split)
+        {
+            chunk.assign(doc.begin() + i, doc.begin() + std::min(doc.size(), i + split));
+            p.feed(chunk.data(), chunk.size());
+            ok = pump();
+            std::fill(chunk.begin(), chunk.end(), '#');
+        }
+        if (ok)
+        {
+            p.finish();
+            pump();
+        }
+        return out + (p.done() ? "done" : "-");
+    }
+
+    // 1バイトずつから全体まで、すべての分け方で同じ
+    std::string same(const std::string &doc, bool skip = false)
+    {
+        std::string whole = events(doc, doc.size() ? doc.size() : 1, skip);
+        int differ = 0;
+        for (size_t s = 1; s < doc.size(); s++)
+        {
+            auto e = events(doc, s, skip);
+            if (e != whole && differ++ == 0)
+                fprintf(stderr, "split %zu:\n  %s\n  %s\n", s, whole.c_str(), e.c_str());
+        }
+        CHECK_EQ(differ, 0);
+        return whole;
+    }
+
+    void testSplits()
+    {
+        CHECK(same(R"({"a":1,"b":[true,false,null,-1.5e+3,0],"c":{"d":"x\"y\\zé😀\né"},"e":[],"f":{}})") ==
+              "{ key(a) num(1) key(b) [ true false null num(-1.5e+3) num(0) ] key(c) { key(d) str(x\"y\\zé😀\né) } "
+              "key(e) [ ] key(f) { } } end done");
+        CHECK(same(R"(  [ 1 , "two" , [ [ ] ] ]  )") == "[ num(1) str(two) [ [ ] ] ] end done");
+        // トップレベルの数値はfinish()で確定する
+        CHECK(same("12345") == "num(12345) end done");
+        CHECK(same("\"top\"") == "str(top) end done");
+        // skip()はかたまりをまたいでも飛ばし続ける
+        CHECK(same(R"({"skip":{"x":[1,{"y":2}],"z":"q"},"keep":3,"skip":[1,2],"last":"s"})", true) ==
+              "{ key(skip) key(keep) num(3) key(skip) key(last) str(s) } end done");
+    }
+
+    // 境目をまたいだ長い文字列だけ切り詰める(1つのかたまりに収まれば切らない)
+    void testLongString()
+    {
+        std::string v(70, 'x');
+        std::string doc = "{\"long\":\"" + v + "\",\"n\":1}";
+        CHECK(events(doc, doc.size()) == "{ key(long) str(" + v + ") key(n) num(1) } end done");
+        int cut = 0, bad = 0;
+        for (size_t s = 1; s < doc.size(); s++)
+        {
+            auto e = events(doc, s);
+            cut += e.find("~") != std::string::npos;
+            bad += e.find("key(n) num(1) } end done") == std::string::npos;
+        }
+        CHECK(cut > 0);
+        CHECK_EQ(bad, 0);
+    }
+
+    void testErrors()
+    {
+        // どこで分けても、どこかでErrorになりdone()はfalse
+        const char *bad[] = {"{\"a\" 1}", "[1,]",  "{,}", "[1 2]",     "{\"a\":tru}", "[01]", "[1.]", "[-]",
+                             "{\"a\":1]", "[\"\x01\"]", "[1", "}", "[1] x", "{\"a\":1,}", "tru", "01",   "1.",  "-",
+                             "\"open"};
+        for (const char *doc : bad)
+        {
+            int missed = 0;
+            for (size_t s = 1; s <= strlen(doc); s++)
+            {
+                auto e = events(doc, s);
+                missed += e.find("ERR") == std::string::npos || e.compare(e.size() - 4, 4, "done") == 0;
+            }
+            if (!CHECK_EQ(missed, 0))
+                fprintf(stderr, "  %s\n", doc);
+        }
+        // 深さの上限
+        CHECK(events(std::string(17, '[') + std::string(17, ']'), 5).find("ERR") != std::string::npos);
+        CHECK(events(std::string(16, '[') + std::string(16, ']'), 5).find("ERR") == std::string::npos);
+
+        // 値が読めなかった後もdone()はfalseのまま(トップレベルの値は読み終えた扱いになっていた)
+        Parser p;
+        p.feed("nul", 3);
+        p.finish();
+        CHECK(p.next() == Event::Error);
+        CHECK(!p.done());
+        CHECK(p.next() == Event::Error);
+    }
+
+    void testNumbers()
+    {
+        Parser p;
+        const char *doc = "[2147483647, 3.25, -0]";
+        p.feed(doc, strlen(doc));
+        p.next();
+        int32_t v = 0;
+        float f = 0;
+        CHECK(p.next() == Event::Number && p.getInt(v) && v == 2147483647);
+        CHECK(p.next() == Event::Number && !p.getInt(v) && p.getFloat(f) && f == 3.25f);
+        CHECK(p.next() == Event::Number && p.getInt(v) && v == 0);
+        CHECK(p.next() == Event::EndArray);
+        CHECK(p.next() == Event::End && p.done());
+    }
+}
+
+int main()
+{
+    testSplits();
+    testLongString();
+    testErrors();
+    testNumbers();
+    printf("sizeof(Json::Parser<>) = %zu\n", sizeof(Json::Parser<>));
+    return CHECK_RESULT("jsonpull");
+}
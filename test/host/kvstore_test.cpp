@@ -0,0 +1,320 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <check.hpp>
+#include <kvstore.hpp>
+#include <simflash.hpp>
+#include <map>
+#include <random>
+#include <string>
+
+//
+// 追記型の保存(kvstore.hpp)を模擬フラッシュで
+// 消去回数・参照モデルとの一致・電源断からの復帰・回収・まとめ書きを確かめる
+//
+namespace
+{
+    using KV = Store::Log<SimFlash>;
+    using Batch = Store::Batch<256, 8>;
+
+    std::mt19937 rng(1);
+    int random(int n) { return rng() % n; }
+
+    // 全キーが参照モデルと同じか
+    bool matches(KV &kv, const std::map<std::string, std::string> &ref)
+    {
+        for (auto &p : ref)
+        {
+            char buff[KV::MaxValue];
+            int n = kv.get(p.first.c_str(), buff, sizeof(buff));
+            if (n != int(p.second.size()) || memcmp(buff, p.second.data(), n) != 0)
+                return false;
+        }
+        return kv.getKeyCount() == int(ref.size());
+    }
+
+    // 接続先の保存(2キー)を1000回。旧方式は保存ごとに1セクタ消去していた
+    void testEraseCount()
+    {
+        SimFlash flash(4);
+        KV kv;
+        CHECK(kv.mount(&flash));
+        uint64_t before = flash.totalErases();
+        for (int i = 0; i < 1000; i++)
+        {
+            char pass[24], ssid[24];
+            snprintf(pass, sizeof(pass), "pass%08d", i);
+            snprintf(ssid, sizeof(ssid), "ssid-%d", i % 7);
+            CHECK(kv.putString("password", pass));
+            CHECK(kv.putString("ssid", ssid));
+            kv.compact();
+        }
+        uint64_t erases = flash.totalErases() - before;
+        uint32_t lo = flash.erases[0], hi = flash.erases[0];
+        for (auto e : flash.erases)
+        {
+            lo = e < lo ? e : lo;
+            hi = e > hi ? e : hi;
+        }
+        printf("1000 saves: %llu erases, per sector %u..%u, %llu bytes written\n", (unsigned long long)erases, lo, hi,
+               (unsigned long long)flash.writeBytes);
+        CHECK(erases <= 20);
+        CHECK(hi - lo <= 1); // リング状に使うので均等
+        CHECK_EQ(uint64_t(kv.getEraseCount()), flash.totalErases());
+
+        KV again;
+        CHECK(again.mount(&flash));
+        char buff[32];
+        CHECK(again.getString("password", buff, sizeof(buff)) && strcmp(buff, "pass00000999") == 0);
+        CHECK(again.getString("ssid", buff, sizeof(buff)) && strcmp(buff, "ssid-5") == 0);
+    }
+
+    // 乱数の更新・削除を参照モデルと比べる(途中で読み直す)
+    void testRandomOps()
+    {
+        SimFlash flash(4);
+        KV kv;
+        CHECK(kv.mount(&flash));
+        std::map<std::string, std::string> ref;
+        uint32_t puts = 0, remounts = 0;
+        for (int i = 0; i < 50000; i++)
+        {
+            char key[16];
+            snprintf(key, sizeof(key), "key%d", random(30));
+            if (random(10) == 0)
+            {
+                CHECK(kv.remove(key) || ref.count(key) == 0);
+                ref.erase(key);
+            }
+            else
+            {
+                std::string v(random(60), char('a' + random(26)));
+                if (!CHECK(kv.put(key, v.data(), v.size())))
+                    break;
+                ref[key] = v;
+                puts++;
+            }
+            if (random(7) == 0)
+                kv.compact();
+            if (random(2000) == 0)
+            {
+                kv = KV();
+                CHECK(kv.mount(&flash));
+                remounts++;
+            }
+        }
+        CHECK(matches(kv, ref));
+        KV again;
+        CHECK(again.mount(&flash));
+        CHECK(matches(again, ref));
+        printf("random: %u puts, %u remounts, %.2f erases per 1000 updates, live %u/%u\n", puts, remounts,
+               flash.totalErases() * 1000.0 / puts, again.getLiveBytes(), again.getCapacity());
+    }
+
+    // 回収: 容量いっぱいまで入れても書き続けられ、入らないものは何も壊さずに断る
+    void testCompaction()
+    {
+        SimFlash flash(4);
+        KV kv;
+        CHECK(kv.mount(&flash));
+        std::map<std::string, std::string> ref;
+        // 生きているデータを容量近くまで(キーの数は上限より少なく)
+        for (int i = 0; i < 24; i++)
+        {
+            char key[16];
+            snprintf(key, sizeof(key), "big%d", i);
+            std::string v(300, char('A' + i % 26));
+            if (kv.getLiveBytes() + 512 > kv.getCapacity())
+                break;
+            CHECK(kv.put(key, v.data(), v.size()));
+            ref[key] = v;
+        }
+        // 同じキーを何度も書き換えると古いセクタの回収が回る
+        for (int i = 0; i < 2000; i++)
+        {
+            std::string v(100, char('a' + i % 26));
+            CHECK(kv.put("hot", v.data(), v.size()));
+            ref["hot"] = v;
+            kv.compact();
+        }
+        CHECK(matches(kv, ref));
+        CHECK(kv.getLiveBytes() <= kv.getCapacity());
+        // 容量・キーの数の上限を超えるものは断る
+        uint32_t live = kv.getLiveBytes();
+        int refused = 0;
+        for (int i = 0; i < 40; i++)
+        {
+            char key[16];
+            snprintf(key, sizeof(key), "extra%d", i);
+            std::string v(200, 'x');
+            if (kv.put(key, v.data(), v.size()))
+                ref[key] = v;
+            else
+                refused++;
+        }
+        CHECK(refused > 0);
+        CHECK(kv.getLiveBytes() >= live);
+        KV again;
+        CHECK(again.mount(&flash));
+        CHECK(matches(again, ref));
+    }
+
+    // 電源断: どこで落ちても、読み直せば書きかけの1つ以外は元のまま。読み直した後も書き続けられる
+    void testPowerCut()
+    {
+        constexpr int Trials = 1000;
+        int bad = 0;
+        for (int t = 0; t < Trials; t++)
+        {
+            SimFlash flash(4);
+            KV kv;
+            kv.mount(&flash);
+            std::map<std::string, std::string> ref;
+            for (int i = 0; i < 300; i++)
+            {
+                char key[16];
+                snprintf(key, sizeof(key), "k%d", i % 5);
+                std::string v(10 + i % 40, char('A' + i % 26));
+                kv.put(key, v.data(), v.size());
+                ref[key] = v;
+                kv.compact();
+            }
+            flash.failAfter = random(4000);
+            for (int i = 0; i < 200; i++)
+            {
+                char key[16];
+                snprintf(key, sizeof(key), "k%d", i % 5);
+                std::string v(5 + i % 50, char('a' + i % 26));
+                if (!kv.put(key, v.data(), v.size()))
+                    break;
+                ref[key] = v;
+                kv.compact();
+            }
+            flash.failAfter = -1;
+            KV again;
+            if (!again.mount(&flash))
+            {
+                bad++;
+                continue;
+            }
+            int same = 0;
+            for (auto &p : ref)
+            {
+                char buff[128];
+                int n = again.get(p.first.c_str(), buff, sizeof(buff));
+                if (n == int(p.second.size()) && memcmp(buff, p.second.data(), n) == 0)
+                    same++;
+            }
+            if (same < int(ref.size()) - 1)
+                bad++;
+            for (int i = 0; i < 500; i++)
+            {
+                std::string v(20, 'q');
+                if (!again.put("k1", v.data(), v.size()))
+                {
+                    bad++;
+                    break;
+                }
+                again.compact();
+            }
+            KV last;
+            char buff[64];
+            if (!last.mount(&flash) || last.get("k1", buff, sizeof(buff)) != 20)
+                bad++;
+        }
+        printf("power cut: %d trials, %d bad\n", Trials, bad);
+        CHECK_EQ(bad, 0);
+    }
+
+    // まとめ書き: 途中で落ちたら全部古いか全部新しいか
+    void testBatchPowerCut()
+    {
+        constexpr int Trials = 2000;
+        int bad = 0, fresh = 0, old = 0;
+        for (int t = 0; t < Trials; t++)
+        {
+            SimFlash flash(4);
+            KV kv;
+            kv.mount(&flash);
+            int rounds = random(400);
+            for (int i = 0; i < rounds; i++)
+            {
+                Batch b;
+                char v[32];
+                snprintf(v, sizeof(v), "v%d", i);
+                b.putString("a", v);
+                b.putString("b", v);
+                if (random(3) == 0)
+                    b.putString("c", v);
+                kv.commit(b);
+                kv.compact();
+            }
+            char a0[32] = "", b0[32] = "";
+            kv.getString("a", a0, sizeof(a0));
+            kv.getString("b", b0, sizeof(b0));
+            flash.failAfter = random(120);
+            Batch b;
+            b.putString("a", "NEW-A-VALUE");
+            b.putString("b", "NEW-B-VALUE");
+            b.remove("c");
+            bool ok = kv.commit(b);
+            if (ok)
+                kv.compact();
+            flash.failAfter = -1;
+
+            KV again;
+            again.mount(&flash);
+            char a[32] = "", bb[32] = "";
+            again.getString("a", a, sizeof(a));
+            again.getString("b", bb, sizeof(bb));
+            bool isNew = strcmp(a, "NEW-A-VALUE") == 0 && strcmp(bb, "NEW-B-VALUE") == 0 && !again.contains("c");
+            bool isOld = strcmp(a, a0) == 0 && strcmp(bb, b0) == 0;
+            if (isNew)
+                fresh++;
+            else if (isOld)
+                old++;
+            else
+                bad++;
+            if (ok && !isNew)
+                bad++;
+        }
+        printf("batch power cut: %d new, %d old, %d torn\n", fresh, old, bad);
+        CHECK_EQ(bad, 0);
+        CHECK(fresh > 0 && old > 0);
+    }
+
+    void testBatch()
+    {
+        Batch a, b;
+        CHECK(a.putString("x", "1"));
+        CHECK(a.putString("y", "22"));
+        CHECK(a.putString("x", "333")); // 置き換え
+        CHECK(b.remove("y"));
+        CHECK(b.putString("z", "4"));
+        CHECK(a.merge(b));
+        char buff[8];
+        CHECK_EQ(a.size(), 3);
+        CHECK_EQ(a.get("x", buff, sizeof(buff)), 3);
+        CHECK_EQ(a.get("y", buff, sizeof(buff)), -2);
+        CHECK_EQ(a.get("w", buff, sizeof(buff)), -1);
+        // 長すぎるキー、溢れ
+        CHECK(!a.putString("0123456789abcdef", "v"));
+        Batch full;
+        std::string v(250, 'v');
+        CHECK(full.put("k", v.data(), v.size()));
+        CHECK(!full.put("l", v.data(), 10));
+        CHECK_EQ(full.size(), 1);
+    }
+}
+
+int main()
+{
+    testEraseCount();
+    testRandomOps();
+    testCompaction();
+    testPowerCut();
+    testBatchPowerCut();
+    testBatch();
+    return CHECK_RESULT("kvstore");
+}
@@ -0,0 +1,102 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <mpscring.hpp>
+#include <check.hpp>
+#include <thread>
+#include <vector>
+
+//
+// リングの単体の振る舞いと、複数スレッドからの同時投入
+//
+namespace
+{
+    void testSingleThread()
+    {
+        Worker::MpscRing<uint32_t, 8> ring;
+        uint32_t v;
+        CHECK(!ring.tryPop(v));
+        for (uint32_t i = 0; i < 8; i++)
+            CHECK(ring.tryPush(i));
+        CHECK(!ring.tryPush(99)); // 満杯
+        CHECK_EQ(ring.getRejects(), 1u);
+        CHECK_EQ(ring.getHighWater(), 8u);
+        CHECK_EQ(ring.size(), 8u);
+        for (uint32_t i = 0; i < 8; i++)
+            CHECK(ring.tryPop(v) && v == i);
+        CHECK(!ring.tryPop(v));
+
+        // 何周も回す
+        for (uint32_t i = 0; i < 1000; i++)
+        {
+            CHECK(ring.tryPush(i));
+            CHECK(ring.tryPush(i + 1));
+            CHECK(ring.tryPop(v) && v == i);
+            CHECK(ring.tryPop(v) && v == i + 1);
+        }
+        CHECK_EQ(ring.size(), 0u);
+    }
+
+    // producers本から投入しconsumers本で取り出す。値は(投入側 << 24 | 通し番号)
+    // 投入側ごとの順序が取り出し側ごとに保たれ、全部が1回ずつ届くこと
+    void testStress(int producers, int consumers, uint32_t perProducer)
+    {
+        Worker::MpscRing<uint32_t, 16> ring;
+        int finished = 0;
+        uint64_t sum = 0, count = 0;
+        int outOfOrder = 0;
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++)
+            threads.emplace_back([&, p] {
+                for (uint32_t i = 1; i <= perProducer; i++)
+                    while (!ring.tryPush(uint32_t(p) << 24 | i))
+                        std::this_thread::yield();
+                __atomic_fetch_add(&finished, 1, __ATOMIC_RELEASE);
+            });
+        for (int c = 0; c < consumers; c++)
+            threads.emplace_back([&] {
+                std::vector<uint32_t> last(producers, 0);
+                uint64_t s = 0, n = 0;
+                int bad = 0;
+                uint32_t v;
+                while (true)
+                {
+                    if (ring.tryPop(v))
+                    {
+                        uint32_t p = v >> 24, i = v & 0xffffff;
+                        if (p >= uint32_t(producers) || i <= last[p])
+                            bad++;
+                        else
+                            last[p] = i;
+                        s += i;
+                        n++;
+                    }
+                    else if (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) == producers && ring.size() == 0)
+                        break;
+                    else
+                        std::this_thread::yield();
+                }
+                __atomic_fetch_add(&sum, s, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&count, n, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&outOfOrder, bad, __ATOMIC_RELAXED);
+            });
+        for (auto &t : threads)
+            t.join();
+        uint64_t expect = uint64_t(producers) * perProducer * (perProducer + 1) / 2;
+        CHECK_EQ(count, uint64_t(producers) * perProducer);
+        CHECK_EQ(sum, expect);
+        CHECK_EQ(outOfOrder, 0);
+        CHECK(ring.getHighWater() <= 16);
+        printf("stress %dP/%dC: %llu items, high-water %u, full %u times\n", producers, consumers,
+               (unsigned long long)count, ring.getHighWater(), ring.getRejects());
+    }
+}
+
+int main()
+{
+    testSingleThread();
+    testStress(4, 1, 200000); // ワーカーの完了通知と同じ形
+    testStress(4, 2, 200000);
+    return CHECK_RESULT("mpscring");
+}
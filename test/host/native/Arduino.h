@@ -0,0 +1,66 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+//
+// ホストのテスト用のArduino/FreeRTOSの代わり(include/のヘッダが使う分だけ)
+// タスク・セマフォ・タイマーはstd::threadで動かす。1tick = 1ms
+//
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void *SemaphoreHandle_t;
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define portMAX_DELAY 0xffffffffu
+#define pdFAIL 0
+#define pdPASS 1
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdMS_TO_TICKS(ms) (TickType_t(ms))
+
+// ESP32と同じく同じスレッドからは入れ子にできる
+struct portMUX_TYPE
+{
+    void *owner;
+    int count;
+};
+#define portMUX_INITIALIZER_UNLOCKED {nullptr, 0}
+void portENTER_CRITICAL(portMUX_TYPE *mux);
+void portEXIT_CRITICAL(portMUX_TYPE *mux);
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+SemaphoreHandle_t xSemaphoreCreateBinary();
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t timeout);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t func, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+void vTaskDelay(TickType_t ticks);
+
+// ログは標準出力へ
+struct HostSerial
+{
+    void begin(unsigned long) {}
+    size_t print(const char *s) { return fputs(s, stdout) < 0 ? 0 : strlen(s); }
+    size_t println(const char *s = "") { return print(s) + print("\n"); }
+    int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+extern HostSerial Serial;
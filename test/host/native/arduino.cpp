@@ -0,0 +1,187 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <freertos/event_groups.h>
+#include <freertos/timers.h>
+#include <stdarg.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+    const Clock::time_point bootTime = Clock::now();
+
+    thread_local char taskTag; // アドレスをタスクの識別に使う
+
+    // 待ち(portMAX_DELAYなら無期限)
+    template <typename Lock, typename Pred>
+    bool waitFor(std::condition_variable &cv, Lock &lk, TickType_t timeout, Pred pred)
+    {
+        if (timeout == portMAX_DELAY)
+        {
+            cv.wait(lk, pred);
+            return true;
+        }
+        return cv.wait_for(lk, std::chrono::milliseconds(timeout), pred);
+    }
+
+    struct Semaphore
+    {
+        std::mutex m;
+        std::condition_variable cv;
+        UBaseType_t count;
+        UBaseType_t max;
+    };
+
+    struct EventGroup
+    {
+        std::mutex m;
+        std::condition_variable cv;
+        EventBits_t bits = 0;
+    };
+
+    struct Timer
+    {
+        TickType_t period;
+        void *id;
+        TimerCallbackFunction_t callback;
+    };
+}
+
+void portENTER_CRITICAL(portMUX_TYPE *mux)
+{
+    void *self = &taskTag;
+    if (__atomic_load_n(&mux->owner, __ATOMIC_RELAXED) == self)
+    {
+        mux->count++;
+        return;
+    }
+    void *expected = nullptr;
+    while (!__atomic_compare_exchange_n(&mux->owner, &expected, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        expected = nullptr;
+        std::this_thread::yield();
+    }
+    mux->count = 1;
+}
+void portEXIT_CRITICAL(portMUX_TYPE *mux)
+{
+    if (--mux->count == 0)
+        __atomic_store_n(&mux->owner, nullptr, __ATOMIC_RELEASE);
+}
+
+unsigned long millis() { return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - bootTime).count(); }
+unsigned long micros() { return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - bootTime).count(); }
+int64_t esp_timer_get_time() { return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - bootTime).count(); }
+void delay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+    auto *s = new Semaphore;
+    s->count = initial;
+    s->max = max;
+    return s;
+}
+SemaphoreHandle_t xSemaphoreCreateBinary() { return xSemaphoreCreateCounting(1, 0); }
+SemaphoreHandle_t xSemaphoreCreateMutex() { return xSemaphoreCreateCounting(1, 1); }
+BaseType_t xSemaphoreTake(SemaphoreHandle_t h, TickType_t timeout)
+{
+    auto *s = static_cast<Semaphore *>(h);
+    std::unique_lock<std::mutex> lk(s->m);
+    if (!waitFor(s->cv, lk, timeout, [s] { return s->count > 0; }))
+        return pdFAIL;
+    s->count--;
+    return pdPASS;
+}
+BaseType_t xSemaphoreGive(SemaphoreHandle_t h)
+{
+    auto *s = static_cast<Semaphore *>(h);
+    {
+        std::lock_guard<std::mutex> lk(s->m);
+        if (s->count >= s->max)
+            return pdFAIL;
+        s->count++;
+    }
+    s->cv.notify_one();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t func, const char *, uint32_t, void *arg, UBaseType_t,
+                                   TaskHandle_t *handle, BaseType_t)
+{
+    // タスクは止めない(テストのプロセスと一緒に終わる)
+    std::thread(func, arg).detach();
+    if (handle)
+        *handle = nullptr;
+    return pdPASS;
+}
+TaskHandle_t xTaskGetCurrentTaskHandle() { return &taskTag; }
+void vTaskDelay(TickType_t ticks) { delay(ticks); }
+
+HostSerial Serial;
+int HostSerial::printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+EventGroupHandle_t xEventGroupCreate() { return new EventGroup; }
+EventBits_t xEventGroupSetBits(EventGroupHandle_t h, EventBits_t bits)
+{
+    auto *g = static_cast<EventGroup *>(h);
+    EventBits_t now;
+    {
+        std::lock_guard<std::mutex> lk(g->m);
+        now = g->bits |= bits;
+    }
+    g->cv.notify_all();
+    return now;
+}
+EventBits_t xEventGroupClearBits(EventGroupHandle_t h, EventBits_t bits)
+{
+    auto *g = static_cast<EventGroup *>(h);
+    std::lock_guard<std::mutex> lk(g->m);
+    EventBits_t before = g->bits;
+    g->bits &= ~bits;
+    return before;
+}
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t h, EventBits_t bits, BaseType_t clear, BaseType_t all,
+                                TickType_t timeout)
+{
+    auto *g = static_cast<EventGroup *>(h);
+    std::unique_lock<std::mutex> lk(g->m);
+    waitFor(g->cv, lk, timeout, [&] { return all ? (g->bits & bits) == bits : (g->bits & bits) != 0; });
+    EventBits_t now = g->bits;
+    if (clear)
+        g->bits &= ~bits;
+    return now;
+}
+
+TimerHandle_t xTimerCreate(const char *, TickType_t period, UBaseType_t, void *id, TimerCallbackFunction_t callback)
+{
+    return new Timer{period, id, callback};
+}
+BaseType_t xTimerStart(TimerHandle_t h, TickType_t)
+{
+    auto *t = static_cast<Timer *>(h);
+    std::thread([t] {
+        auto next = Clock::now();
+        while (true)
+        {
+            next += std::chrono::milliseconds(t->period);
+            std::this_thread::sleep_until(next);
+            t->callback(t);
+        }
+    }).detach();
+    return pdPASS;
+}
+void *pvTimerGetTimerID(TimerHandle_t h) { return static_cast<Timer *>(h)->id; }
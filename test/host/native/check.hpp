@@ -0,0 +1,56 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// ホストのテストの確認マクロ
+// 失敗しても続けて数え、最後にCHECK_RESULT()で終了コードを返す
+//
+namespace Check
+{
+    inline int &failures()
+    {
+        static int n = 0;
+        return n;
+    }
+    inline int &checks()
+    {
+        static int n = 0;
+        return n;
+    }
+    inline bool report(bool ok, const char *file, int line, const char *expr)
+    {
+        __atomic_fetch_add(&checks(), 1, __ATOMIC_RELAXED);
+        if (!ok)
+        {
+            __atomic_fetch_add(&failures(), 1, __ATOMIC_RELAXED);
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expr);
+        }
+        return ok;
+    }
+    template <typename A, typename B>
+    bool reportEq(const A &a, const B &b, const char *file, int line, const char *ea, const char *eb)
+    {
+        bool ok = report(a == b, file, line, ea);
+        if (!ok)
+            fprintf(stderr, "    %s = %lld, %s = %lld\n", ea, (long long)a, eb, (long long)b);
+        return ok;
+    }
+    // ワーカーなどのスレッドは止めずに終える(静的オブジェクトの破棄と重ねない)
+    inline int result(const char *name)
+    {
+        printf("%s: %d checks, %d failed\n", name, checks(), failures());
+        fflush(stdout);
+        fflush(stderr);
+        _Exit(failures() == 0 ? 0 : 1);
+    }
+}
+
+#define CHECK(cond) Check::report(bool(cond), __FILE__, __LINE__, #cond)
+#define CHECK_EQ(a, b) Check::reportEq((a), (b), __FILE__, __LINE__, #a, #b)
+#define CHECK_RESULT(name) Check::result(name)
@@ -0,0 +1,10 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stdint.h>
+
+// 起動からの時間(us)
+int64_t esp_timer_get_time();
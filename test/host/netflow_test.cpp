@@ -0,0 +1,403 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <check.hpp>
+#include <fakelink.hpp>
+#include <networks.hpp>
+
+//
+// 通信フロー(netflow.hpp/networks.hpp)を模擬のLinkで回す
+// 1つのAsync::Runnerで複数のフローを交互に進め、時間切れ・取り消し・接続とスキャンの取り合いを確かめる
+//
+namespace
+{
+    using Async::Status;
+    using Net::Credentials;
+
+    constexpr uint32_t Tick = 50;
+
+    Credentials cred(const char *ssid, const char *password = "pw")
+    {
+        Credentials c{};
+        snprintf(c.ssid, sizeof(c.ssid), "%s", ssid);
+        snprintf(c.password, sizeof(c.password), "%s", password);
+        return c;
+    }
+
+    // 終わったときのステータスを覚える
+    template <typename Flow>
+    struct Probe : Flow
+    {
+        Status last = Status::Running;
+        int finished = 0;
+
+        template <typename... Args>
+        explicit Probe(Args &... args) : Flow(args...) {}
+        void onFinish(Status st) override
+        {
+            last = st;
+            finished++;
+        }
+    };
+
+    // Runnerが空になるまで時刻を進めながら回す
+    void pumpAll(Async::Runner &r, FakeLink &link, uint32_t limit = 60 * 1000)
+    {
+        uint32_t end = link.t + limit;
+        while (r.pump(link.t) && link.t < end)
+            link.t += Tick;
+    }
+    void submit(Async::Runner &r, Async::Task &t)
+    {
+        bool started;
+        CHECK(r.submit(&t, started));
+    }
+
+    // NTPとPOSTを1つのRunnerで交互に(同じ接続先なら接続は1回)
+    void testInterleave()
+    {
+        FakeLink link;
+        link.add("home", -50, 6);
+        link.httpBody = "{\"result\":\"ok\"}";
+        Async::Runner r;
+        Net::ConnectFlow c1(link), c2(link);
+        c1.cred = c2.cred = cred("home");
+        Probe<Net::TimeSyncFlow> ts(link);
+        Probe<Net::HttpPostFlow> hp(link);
+        ts.connector = &c1;
+        hp.connector = &c2;
+        CHECK(ts.prepare());
+        CHECK(hp.prepare());
+        submit(r, ts);
+        submit(r, hp);
+        CHECK(!ts.prepare()); // 動いている間は投入できない
+        pumpAll(r, link);
+        CHECK(ts.last == Status::Done);
+        CHECK(hp.last == Status::Done);
+        CHECK_EQ(ts.time.tm_hour, 12);
+        CHECK_EQ(hp.code, 200);
+        CHECK(strcmp(hp.response, link.httpBody) == 0);
+        CHECK_EQ(link.connects, 1);
+        CHECK_EQ(link.users, 0);
+        // 接続3秒+NTP0.5秒、POSTは5チャンク。並んで進むので足し算にならない
+        CHECK(link.t < 5000);
+    }
+
+    void testConnectTimeout()
+    {
+        FakeLink link; // 接続先が見えない
+        Async::Runner r;
+        Net::ConnectFlow c(link);
+        c.cred = cred("nowhere");
+        Probe<Net::TimeSyncFlow> ts(link);
+        ts.connector = &c;
+        CHECK(ts.prepare());
+        submit(r, ts);
+        pumpAll(r, link);
+        CHECK(ts.last == Status::TimedOut);
+        CHECK(link.t >= Net::ConnectFlow::ConnectTimeout);
+        CHECK_EQ(link.users, 0);
+        // 接続先が空なら待たずに失敗
+        c.cred = Credentials{};
+        CHECK(ts.prepare());
+        submit(r, ts);
+        pumpAll(r, link);
+        CHECK(ts.last == Status::Failed);
+        CHECK_EQ(link.users, 0);
+    }
+
+    void testNtpTimeout()
+    {
+        FakeLink link;
+        link.add("home", -50, 6);
+        link.ntpDelay = 0xffffffff;
+        Async::Runner r;
+        Net::ConnectFlow c(link);
+        c.cred = cred("home");
+        Probe<Net::TimeSyncFlow> ts(link);
+        ts.connector = &c;
+        CHECK(ts.prepare());
+        submit(r, ts);
+        pumpAll(r, link);
+        CHECK(ts.last == Status::TimedOut);
+        CHECK_EQ(link.users, 0);
+    }
+
+    // 本文が途中で止まったら打ち切る。届いている間は待ち時間を数え直す
+    void testHttpStall()
+    {
+        FakeLink link;
+        link.add("home", -50, 6);
+        link.httpBody = "0123456789abcdef";
+        link.httpDelay = Net::HttpPostFlow::ResponseTimeout - 1000; // 1チャンクごとなら間に合う
+        Async::Runner r;
+        Net::ConnectFlow c(link);
+        c.cred = cred("home");
+        Probe<Net::HttpPostFlow> hp(link);
+        hp.connector = &c;
+        CHECK(hp.prepare());
+        submit(r, hp);
+        pumpAll(r, link);
+        CHECK(hp.last == Status::Done);
+        CHECK(strcmp(hp.response, link.httpBody) == 0);
+
+        link.httpStall = true;
+        CHECK(hp.prepare());
+        submit(r, hp);
+        pumpAll(r, link);
+        CHECK(hp.last == Status::TimedOut);
+        CHECK_EQ(link.httpAborts, 1);
+        CHECK(strcmp(hp.response, "0123") == 0);
+        CHECK_EQ(link.users, 0);
+    }
+
+    // 接続中・受信中に取り消しても参照と要求が残らない
+    void testCancel()
+    {
+        FakeLink link;
+        link.add("home", -50, 6);
+        link.httpDelay = 1000;
+        Async::Runner r;
+        Net::ConnectFlow c(link);
+        c.cred = cred("home");
+        Probe<Net::HttpPostFlow> hp(link);
+        hp.connector = &c;
+
+        CHECK(hp.prepare());
+        submit(r, hp);
+        r.pump(link.t);
+        CHECK_EQ(link.users, 1);
+        hp.cancel();
+        pumpAll(r, link);
+        CHECK(hp.last == Status::Cancelled);
+        CHECK_EQ(link.users, 0);
+        CHECK_EQ(link.httpAborts, 0);
+
+        CHECK(hp.prepare());
+        submit(r, hp);
+        while (link.posts == 0)
+        {
+            r.pump(link.t);
+            link.t += Tick;
+        }
+        hp.cancel();
+        pumpAll(r, link);
+        CHECK(hp.last == Status::Cancelled);
+        CHECK_EQ(link.httpAborts, 1);
+        CHECK_EQ(link.users, 0);
+    }
+
+    // 失敗したらやり直す。Doneの後はdiscard()まで結果を持つ
+    void testScanRetry()
+    {
+        FakeLink link;
+        link.add("a", -40, 1);
+        link.add("b", -60, 6);
+        link.add("c", -70, 6);
+        link.scanFails = 1;
+        Probe<Net::ScanFlow> sf(link);
+        CHECK(sf.prepare());
+        auto st = Async::run(sf, [&] { return link.t; }, [&] { link.t += Tick; }, [] { return false; });
+        CHECK(st == Status::Done);
+        CHECK_EQ(sf.count, 3);
+        CHECK_EQ(link.scans, 2);
+        CHECK(link.scanOwner == &sf);
+        sf.discard();
+        CHECK(link.scanOwner == nullptr);
+        CHECK_EQ(link.scanDeletes, 2); // 失敗した1回目と、読み終えた2回目
+
+        // チャンネルを絞る
+        sf.channel = 6;
+        CHECK(sf.prepare());
+        st = Async::run(sf, [&] { return link.t; }, [&] { link.t += Tick; }, [] { return false; });
+        CHECK(st == Status::Done);
+        CHECK_EQ(sf.count, 2);
+        sf.discard();
+
+        // 毎回失敗
+        link.scanFails = Net::ScanFlow::MaxRetry;
+        CHECK(sf.prepare());
+        st = Async::run(sf, [&] { return link.t; }, [&] { link.t += Tick; }, [] { return false; });
+        CHECK(st == Status::Failed);
+        CHECK(link.scanOwner == nullptr);
+    }
+
+    // 他が持っているスキャンは消さず、手放されるまで待つ
+    void testScanOwnership()
+    {
+        FakeLink link;
+        link.add("a", -40, 1);
+        Async::Runner r;
+        int other = 0;
+        CHECK(link.startScan(&other, 0));
+        Probe<Net::ScanFlow> sf(link);
+        CHECK(sf.prepare());
+        submit(r, sf);
+        for (int i = 0; i < 20; i++, link.t += Tick)
+            r.pump(link.t);
+        CHECK(sf.isRunning());
+        CHECK_EQ(link.scans, 1);
+        // 取り消しても他のスキャンは消さない
+        sf.cancel();
+        pumpAll(r, link);
+        CHECK(sf.last == Status::Cancelled);
+        CHECK(link.scanOwner == &other);
+        CHECK_EQ(link.foreignDeletes, 0);
+
+        // 手放されたら続ける
+        CHECK(sf.prepare());
+        submit(r, sf);
+        r.pump(link.t);
+        link.scanDelete(&other);
+        pumpAll(r, link);
+        CHECK(sf.last == Status::Done);
+        CHECK(link.scanOwner == &sf);
+        sf.discard();
+
+        // 手放されなければ時間切れ
+        CHECK(link.startScan(&other, 0));
+        CHECK(sf.prepare());
+        submit(r, sf);
+        pumpAll(r, link);
+        CHECK(sf.last == Status::TimedOut);
+        CHECK(link.scanOwner == &other);
+        link.scanDelete(&other);
+    }
+
+    // 見えている中で強いものを選ぶ。2つ同時に動いてもスキャンは1回
+    void testJoin()
+    {
+        FakeLink link;
+        link.add("near", -40, 1, "pw");
+        link.add("far", -80, 11, "pw");
+        link.add("other", -30, 6);
+        Net::Networks networks;
+        networks.add(cred("far"));
+        networks.add(cred("near"));
+        networks.add(cred("gone"));
+        Async::Runner r;
+        Probe<Net::JoinFlow> j1(link, networks), j2(link, networks);
+        Probe<Net::TimeSyncFlow> ts(link);
+        Probe<Net::HttpPostFlow> hp(link);
+        ts.connector = &j1;
+        hp.connector = &j2;
+        CHECK(ts.prepare());
+        CHECK(hp.prepare());
+        submit(r, ts);
+        submit(r, hp);
+        pumpAll(r, link);
+        CHECK(ts.last == Status::Done);
+        CHECK(hp.last == Status::Done);
+        CHECK_EQ(link.scans, 1);
+        CHECK(j1.scanned != j2.scanned); // 片方はもう片方のスキャン結果を使う
+        CHECK(strcmp(j1.joined.ssid, "near") == 0);
+        CHECK(strcmp(j2.joined.ssid, "near") == 0);
+        CHECK_EQ(link.connects, 1);
+        CHECK_EQ(link.users, 0);
+        CHECK(link.scanOwner == nullptr);
+        Credentials latest;
+        CHECK(networks.latest(latest) && strcmp(latest.ssid, "near") == 0);
+
+        // パスワードが違えば次の候補へ(記録は失敗として残る)
+        link.powerDown();
+        link.aps[0].password = "changed";
+        CHECK(ts.prepare());
+        submit(r, ts);
+        pumpAll(r, link);
+        CHECK(ts.last == Status::Done);
+        CHECK(strcmp(j1.joined.ssid, "far") == 0);
+        CHECK_EQ(link.users, 0);
+    }
+
+    // 別の接続先で使われている間は、その先に切り替えず、つながっている方を使う
+    void testJoinWhileHeld()
+    {
+        FakeLink link;
+        link.add("a", -70, 1);
+        link.add("b", -40, 6);
+        Net::Networks networks;
+        networks.add(cred("a"));
+        networks.add(cred("b")); // 最近使ったのはb
+        Async::Runner r;
+        Net::ConnectFlow holder(link);
+        holder.cred = cred("a");
+        Probe<Net::HttpPostFlow> hp(link);
+        hp.connector = &holder;
+        link.httpDelay = 20 * 1000 / 4; // 長い応答の間、aを持ち続ける
+        link.httpBody = "0123456789abcdef";
+        CHECK(hp.prepare());
+        submit(r, hp);
+        while (link.posts == 0)
+        {
+            r.pump(link.t);
+            link.t += Tick;
+        }
+        Probe<Net::JoinFlow> join(link, networks);
+        Probe<Net::TimeSyncFlow> ts(link);
+        ts.connector = &join;
+        CHECK(ts.prepare());
+        submit(r, ts);
+        pumpAll(r, link, 120 * 1000);
+        CHECK(ts.last == Status::Done);
+        CHECK(strcmp(join.joined.ssid, "a") == 0);
+        CHECK(link.refused > 0);
+        CHECK_EQ(link.connects, 1);
+        CHECK_EQ(link.users, 0);
+        // bは試していないので記録しない
+        Net::Network list[Net::Networks::MaxNetworks];
+        int n = networks.rank(list, Net::Networks::MaxNetworks, link.t, false);
+        for (int i = 0; i < n; i++)
+            if (strcmp(list[i].cred.ssid, "b") == 0)
+                CHECK_EQ(list[i].attempts, 0);
+    }
+
+    // スキャン中に取り消したら、自分のスキャンだけを消す
+    void testJoinCancelDuringScan()
+    {
+        FakeLink link;
+        link.add("a", -40, 1);
+        Net::Networks networks;
+        networks.add(cred("a"));
+        Async::Runner r;
+        Probe<Net::JoinFlow> join(link, networks);
+        Probe<Net::TimeSyncFlow> ts(link);
+        ts.connector = &join;
+        CHECK(ts.prepare());
+        submit(r, ts);
+        r.pump(link.t);
+        CHECK(link.scanOwner == &join);
+        ts.cancel();
+        pumpAll(r, link);
+        CHECK(ts.last == Status::Cancelled);
+        CHECK(link.scanOwner == nullptr);
+        CHECK_EQ(link.foreignDeletes, 0);
+
+        // 他のスキャン中に取り消しても消さない
+        int other = 0;
+        CHECK(link.startScan(&other, 0));
+        CHECK(ts.prepare());
+        submit(r, ts);
+        r.pump(link.t);
+        ts.cancel();
+        pumpAll(r, link);
+        CHECK(link.scanOwner == &other);
+        CHECK_EQ(link.foreignDeletes, 0);
+        CHECK_EQ(link.users, 0);
+    }
+}
+
+int main()
+{
+    testInterleave();
+    testConnectTimeout();
+    testNtpTimeout();
+    testHttpStall();
+    testCancel();
+    testScanRetry();
+    testScanOwnership();
+    testJoin();
+    testJoinWhileHeld();
+    testJoinCancelDuringScan();
+    return CHECK_RESULT("netflow");
+}
@@ -0,0 +1,89 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//
+// ホストのテスト用の接続(Net::HttpClientのConn)
+// ArduinoのWiFiClientと同じ形で、ソケットをそのまま使う(読み書きは届いている分だけ)
+//
+class PosixConn
+{
+    int fd = -1;
+
+public:
+    int connects = 0; // 張った回数
+
+    ~PosixConn() { stop(); }
+
+    int connect(const char *host, uint16_t port)
+    {
+        stop();
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, strcmp(host, "localhost") == 0 ? "127.0.0.1" : host, &addr.sin_addr) != 1)
+            return 0;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return 0;
+        connects++;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            stop();
+            return 0;
+        }
+        return 1;
+    }
+    size_t write(const uint8_t *p, size_t n)
+    {
+        ssize_t r = fd < 0 ? -1 : ::send(fd, p, n, MSG_NOSIGNAL);
+        return r < 0 ? 0 : r;
+    }
+    int available()
+    {
+        int n = 0;
+        if (fd < 0 || ioctl(fd, FIONREAD, &n) < 0)
+            return 0;
+        return n;
+    }
+    int read(uint8_t *p, size_t n) { return fd < 0 ? -1 : ::recv(fd, p, n, MSG_DONTWAIT); }
+    // WiFiClientと同じく、切れていても読み残しがあればつながっている扱い
+    uint8_t connected()
+    {
+        if (fd < 0)
+            return 0;
+        char c;
+        int r = ::recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+    void stop()
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+
+    // 何か届くか切れるまで待つ(テストのループ用)
+    void wait(int ms)
+    {
+        if (fd < 0)
+            return;
+        pollfd p{fd, POLLIN, 0};
+        ::poll(&p, 1, ms);
+    }
+};
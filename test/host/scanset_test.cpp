@@ -0,0 +1,168 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <check.hpp>
+#include <fakelink.hpp>
+#include <scanset.hpp>
+#include <string>
+
+//
+// スキャン結果の集合(scanset.hpp)に模擬のLinkの結果を取り込む
+// 同じSSID・隠しSSID・上限を超えた分の扱いと、チャンネルを絞ったスキャンで他のチャンネルを残すかを確かめる
+//
+namespace
+{
+    using Net::ScanSet;
+
+    const int Owner = 0;
+
+    // スキャンして取り込む。merge()の結果を返す
+    // filter: 実際に見るチャンネル、channel: merge()に渡すチャンネル(普段は同じ)
+    bool scan(FakeLink &link, ScanSet &set, uint8_t channel, int filter = -1)
+    {
+        CHECK(link.startScan(&Owner, filter < 0 ? channel : filter));
+        link.t += link.scanDelay;
+        int found = link.scanComplete();
+        CHECK(found >= 0);
+        bool changed = set.merge(link, found, channel, link.t, link.t * 1000);
+        link.scanDelete(&Owner);
+        return changed;
+    }
+
+    // 並びを"ssid:rssi:ch ..."にする
+    std::string order(ScanSet &set)
+    {
+        Net::AccessPoint aps[ScanSet::MaxEntries];
+        uint32_t ver, at;
+        int n = set.snapshot(aps, ScanSet::MaxEntries, ver, at);
+        std::string s;
+        for (int i = 0; i < n; i++)
+            s += std::string(i ? " " : "") + aps[i].ssid + ":" + std::to_string(aps[i].rssi) + ":" +
+                 std::to_string(aps[i].channel);
+        return s;
+    }
+
+    // 同じSSIDは一番強いもの1つ、隠しSSIDは入れない
+    void testDuplicates()
+    {
+        FakeLink link;
+        ScanSet set;
+        link.add("home", -70, 1);
+        link.add("", -20, 1);
+        link.add("cafe", -60, 11);
+        link.add("home", -50, 6);
+        link.add("home", -80, 11);
+        link.add("", -30, 6);
+        CHECK(scan(link, set, 0));
+        CHECK(order(set) == "home:-50:6 cafe:-60:11");
+        CHECK_EQ(set.size(), 2);
+
+        // 同じ結果なら並びは変わらない。強さだけ変わっても並びが同じなら変わらない扱い
+        uint32_t ver = set.getVersion();
+        CHECK(!scan(link, set, 0));
+        link.aps[2].rssi = -65;
+        CHECK(!scan(link, set, 0));
+        CHECK(order(set) == "home:-50:6 cafe:-65:11");
+        CHECK_EQ(set.getVersion(), ver);
+        // 並びが入れ替われば変わる
+        link.aps[2].rssi = -40;
+        CHECK(scan(link, set, 0));
+        CHECK(order(set) == "cafe:-40:11 home:-50:6");
+        CHECK_EQ(set.getVersion(), ver + 1);
+    }
+
+    // 上限を超えたら弱いものから捨てる
+    void testOverflow()
+    {
+        FakeLink link;
+        ScanSet set;
+        static char names[30][8];
+        for (int i = 0; i < 30; i++)
+        {
+            snprintf(names[i], sizeof(names[i]), "ap%02d", i);
+            // 強さの順と登録の順を混ぜる
+            link.add(names[i], -30 - (i * 7) % 30, 1 + i % 13);
+        }
+        CHECK(scan(link, set, 0));
+        CHECK_EQ(set.size(), int(ScanSet::MaxEntries));
+        Net::AccessPoint aps[ScanSet::MaxEntries];
+        uint32_t ver, at;
+        int n = set.snapshot(aps, ScanSet::MaxEntries, ver, at);
+        int sorted = 0, weakOnes = 0;
+        for (int i = 0; i < n; i++)
+        {
+            sorted += i > 0 && aps[i - 1].rssi < aps[i].rssi;
+            weakOnes += aps[i].rssi < -30 - (ScanSet::MaxEntries - 1);
+        }
+        CHECK_EQ(sorted, 0);
+        CHECK_EQ(weakOnes, 0);
+        CHECK_EQ(aps[0].rssi, -30);
+        CHECK_EQ(aps[n - 1].rssi, -49);
+
+        // 満杯でも、絞ったスキャンで見つけた強いものは一番弱いものと入れ替える
+        FakeLink quick;
+        quick.add("strong", -10, 5);
+        quick.add("weak", -90, 5);
+        CHECK(scan(quick, set, 5));
+        n = set.snapshot(aps, ScanSet::MaxEntries, ver, at);
+        CHECK_EQ(n, int(ScanSet::MaxEntries));
+        CHECK(strcmp(aps[0].ssid, "strong") == 0);
+        bool weak = false;
+        for (int i = 0; i < n; i++)
+            weak |= strcmp(aps[i].ssid, "weak") == 0;
+        CHECK(!weak);
+    }
+
+    // 絞ったスキャンはそのチャンネルだけ入れ替え、他は前回の結果を残す
+    void testQuickScan()
+    {
+        FakeLink link;
+        ScanSet set;
+        link.add("a", -60, 1);
+        link.add("b", -50, 6);
+        link.add("c", -40, 11);
+        CHECK(scan(link, set, 0));
+        CHECK(order(set) == "c:-40:11 b:-50:6 a:-60:1");
+        CHECK(set.hasFullScanWithin(link.t, 1000));
+
+        // 6chのbが消えてdが出た。1chと11chは見ていないので残る
+        link.aps[1].ssid = "d";
+        link.aps[1].rssi = -45;
+        link.aps[0].rssi = -20; // 見ていないチャンネルの変化は入らない
+        CHECK(scan(link, set, 6));
+        CHECK(order(set) == "c:-40:11 d:-45:6 a:-60:1");
+
+        // 絞ったスキャンに他のチャンネルが混じっても、見ていないものとして扱う
+        link.aps[1].rssi = -70;
+        CHECK(scan(link, set, 6, 0));
+        CHECK(order(set) == "c:-40:11 a:-60:1 d:-70:6");
+
+        // 同じSSIDが見たチャンネルに弱く出ても、見ていないチャンネルの強い方を残す
+        // (11chを見直して居なくなったら消える)
+        link.aps[2].channel = 6;
+        link.aps[2].rssi = -80;
+        CHECK(!scan(link, set, 6));
+        CHECK(order(set) == "c:-40:11 a:-60:1 d:-70:6");
+        CHECK(scan(link, set, 11));
+        CHECK(order(set) == "a:-60:1 d:-70:6");
+
+        // 絞ったスキャンは全チャンネルを見たことにしない
+        link.t += 2000;
+        CHECK(!set.hasFullScanWithin(link.t, 1000));
+
+        uint8_t ch[4];
+        CHECK_EQ(set.channels(ch, 4), 2);
+        set.clear();
+        CHECK_EQ(set.size(), 0);
+        CHECK_EQ(set.channels(ch, 4), 0);
+    }
+}
+
+int main()
+{
+    testDuplicates();
+    testOverflow();
+    testQuickScan();
+    return CHECK_RESULT("scanset");
+}
@@ -0,0 +1,329 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <check.hpp>
+#include <networks.hpp>
+#include <simflash.hpp>
+#include <store.hpp>
+#include <thread>
+
+//
+// 設定の型付きフィールド(schema.hpp)と、それを使った読み込み・移行(store.hpp)
+// 書いて読んで同じになるか、型・大きさが違えば読まずに既定値のままか、
+// v0(型なしの文字列)から今の版までData::loadで移行できるかを模擬フラッシュで確かめる
+//
+namespace
+{
+    using Data = Store::BasicData<SimFlash>;
+    using Store::Blob;
+    using Store::FixedString;
+    using Store::SmallArray;
+
+    enum class Mode : uint8_t
+    {
+        A,
+        B,
+        C,
+    };
+    struct Pair
+    {
+        int16_t a;
+        uint8_t b;
+    };
+    struct Wide
+    {
+        int16_t a;
+        uint8_t b;
+        uint32_t c;
+    };
+
+    // 書いて読む
+    template <typename T, typename U>
+    bool roundTrip(const T &in, U &out)
+    {
+        uint8_t buff[Store::fieldSize<T>()];
+        size_t n = Store::encodeField(in, buff);
+        return n <= sizeof(buff) && Store::decodeField(buff, n, out);
+    }
+
+    void testRoundTrip()
+    {
+        int32_t i = 0;
+        CHECK(roundTrip(int32_t(-123456), i) && i == -123456);
+        Mode m = Mode::A;
+        CHECK(roundTrip(Mode::C, m) && m == Mode::C);
+
+        FixedString<8> s, e;
+        s = "abc";
+        CHECK(roundTrip(s, e) && e.view() == "abc");
+        s.clear();
+        e = "x";
+        CHECK(roundTrip(s, e) && e.empty() && e.c_str()[0] == '\0');
+        s = "12345678";
+        CHECK(roundTrip(s, e) && e.view() == "12345678");
+
+        Blob<16> b, bb;
+        const uint8_t bytes[] = {0, 0xff, 0xf1, 7};
+        CHECK(b.assign(bytes, sizeof(bytes)));
+        CHECK(roundTrip(b, bb) && bb.size() == 4 && memcmp(bb.data(), bytes, 4) == 0);
+
+        SmallArray<Pair, 3> a, aa;
+        aa.push(Pair{9, 9});
+        CHECK(roundTrip(a, aa) && aa.empty());
+        for (int16_t k = 1; a.push(Pair{k, uint8_t(k * 2)}); k++)
+        {
+        }
+        CHECK(a.full());
+        CHECK(roundTrip(a, aa) && aa.size() == 3 && aa[2].a == 3 && aa[2].b == 6);
+
+        Pair p{-5, 200}, pp{};
+        CHECK(roundTrip(p, pp) && pp.a == -5 && pp.b == 200);
+    }
+
+    // 入りきらない文字列は切り詰めて常に終端する
+    void testTruncation()
+    {
+        FixedString<4> s;
+        CHECK(!s.assign("abcdef"));
+        CHECK(s.size() == 4 && strcmp(s.c_str(), "abcd") == 0);
+        CHECK(s.assign("xy") && strcmp(s.c_str(), "xy") == 0);
+        s = "0123456789";
+        CHECK(s.view() == "0123");
+    }
+
+    // 合わないものは読まず、読み先はそのまま
+    void testMismatch()
+    {
+        int32_t i = 77;
+        CHECK(!roundTrip(int16_t(1), i) && i == 77);
+        CHECK(!roundTrip(uint8_t(1), i) && i == 77);
+
+        // 文字列は短い方へは読まない(長い方へは読める)
+        FixedString<8> longer;
+        FixedString<4> shorter;
+        shorter = "keep";
+        longer = "12345";
+        CHECK(!roundTrip(longer, shorter) && shorter.view() == "keep");
+        CHECK(roundTrip(shorter, longer) && longer.view() == "keep");
+
+        // 配列は要素の大きさと数
+        SmallArray<int16_t, 4> a16;
+        SmallArray<int32_t, 4> a32;
+        SmallArray<int16_t, 2> two;
+        a16.push(1);
+        a16.push(2);
+        a16.push(3);
+        a32.push(42);
+        two.push(5);
+        CHECK(!roundTrip(a16, a32) && a32.size() == 1 && a32[0] == 42);
+        CHECK(!roundTrip(a16, two) && two.size() == 1 && two[0] == 5);
+
+        // 構造体は大きさが変わったら読まない
+        Wide w{1, 2, 3};
+        Pair p{4, 5};
+        CHECK(!roundTrip(p, w) && w.c == 3);
+        CHECK(!roundTrip(w, p) && p.a == 4);
+
+        // 型が違えば大きさが同じでも読まない
+        Blob<4> blob;
+        int32_t n = 1234;
+        CHECK(!roundTrip(n, blob) && blob.empty());
+        SmallArray<uint8_t, 4> bytes;
+        CHECK(!roundTrip(blob, bytes));
+
+        // 短すぎる・ヘッダだけ
+        uint8_t buff[8];
+        size_t len = Store::encodeField(int32_t(5), buff);
+        CHECK(!Store::decodeField(buff, 1, i) && i == 77);
+        CHECK(!Store::decodeField(buff, len - 1, i) && i == 77);
+        FixedString<8> fs;
+        fs = "x";
+        CHECK(Store::decodeField(buff, 0, fs) == false && fs.view() == "x");
+
+        // 旧形式の生の文字列は型の印(0xf1〜)と重ならない
+        static_assert(uint8_t(Store::FieldType::Int) > 0x7e, "type tag must not look like text");
+        const char *legacy = "home-ap";
+        CHECK(!Store::decodeField(reinterpret_cast<const uint8_t *>(legacy), strlen(legacy), fs) && fs.view() == "x");
+        uint8_t utf8[] = {0xe3, 0x81, 0x82}; // 「あ」も先頭は0xf1より小さい
+        CHECK(!Store::decodeField(utf8, sizeof(utf8), fs));
+    }
+
+    // main.cppの設定と同じ形(接続の記録は同じ大きさの構造体で代える)
+    struct Cache
+    {
+        char ssid[32];
+        uint8_t bssid[6];
+        uint8_t channel;
+        uint8_t reserved;
+        uint32_t ip, gateway, mask, dns;
+    };
+    struct Settings
+    {
+        static constexpr uint16_t Version = 3;
+        SmallArray<Net::Network, 4> networks; // v3
+        int32_t timeZone = 9 * 3600;
+        Cache wifiCache{}; // v2
+        int migrated = -1;
+
+        template <typename V>
+        void visit(V &&v)
+        {
+            v("networks", networks);
+            v("timeZone", timeZone);
+            v("wifiCache", wifiCache);
+        }
+        template <typename D>
+        void migrate(uint16_t from, D &st)
+        {
+            migrated = from;
+            FixedString<31> ssid, password;
+            if (from < 1)
+            {
+                char buff[32];
+                if (st.loadString("ssid", buff, sizeof(buff)))
+                    ssid = buff;
+                if (st.loadString("password", buff, sizeof(buff)))
+                    password = buff;
+            }
+            else if (from < 3)
+            {
+                st.load("ssid", ssid);
+                st.load("password", password);
+            }
+            if (from < 3)
+            {
+                if (!ssid.empty())
+                {
+                    Net::Network n{};
+                    snprintf(n.cred.ssid, sizeof(n.cred.ssid), "%s", ssid.c_str());
+                    snprintf(n.cred.password, sizeof(n.cred.password), "%s", password.c_str());
+                    networks.push(n);
+                }
+                st.remove("ssid");
+                st.remove("password");
+            }
+        }
+    };
+
+    // 電源を入れ直したことにする(同じフラッシュの中身で開き直す)
+    void reboot(Data &from, Data &to)
+    {
+        to.getFlash() = from.getFlash();
+        CHECK(to.init("kvstore"));
+    }
+
+    void testMigrateV0()
+    {
+        Data st;
+        CHECK(st.init("kvstore"));
+        // v0: 版なし、型なしの文字列
+        CHECK(st.storeString("ssid", "home-ap"));
+        CHECK(st.storeString("password", "secret"));
+        CHECK(st.storeString("timeZone", "32400"));
+
+        Settings s;
+        s.timeZone = 0;
+        CHECK(st.load(s));
+        CHECK_EQ(s.migrated, 0);
+        CHECK_EQ(s.networks.size(), 1u);
+        CHECK(strcmp(s.networks[0].cred.ssid, "home-ap") == 0);
+        CHECK(strcmp(s.networks[0].cred.password, "secret") == 0);
+        // 旧形式の値は読めないので既定値のまま、移行で型付きに書き直す
+        CHECK_EQ(s.timeZone, 0);
+        uint16_t version = 0;
+        CHECK(st.load(Data::VersionKey, version) && version == 3);
+        char buff[32];
+        CHECK_EQ(st.get("ssid", buff, sizeof(buff)), -1);
+        CHECK_EQ(st.get("password", buff, sizeof(buff)), -1);
+        CHECK_EQ(st.getFlushCount(), 1u);
+
+        // 入れ直した後は移行しない
+        Data again;
+        reboot(st, again);
+        Settings t;
+        CHECK(again.load(t));
+        CHECK_EQ(t.migrated, -1);
+        CHECK_EQ(t.networks.size(), 1u);
+        CHECK(strcmp(t.networks[0].cred.ssid, "home-ap") == 0);
+        CHECK_EQ(t.timeZone, 0);
+        CHECK_EQ(again.getFlushCount(), 0u);
+    }
+
+    // v1(型付きの文字列)から。v0で何もなければ接続先は空
+    void testMigrateV1()
+    {
+        {
+            Data st;
+            CHECK(st.init("kvstore"));
+            FixedString<31> ssid;
+            ssid = "office";
+            CHECK(st.save("ssid", ssid));
+            CHECK(st.save(Data::VersionKey, uint16_t(1)));
+            Settings s;
+            CHECK(st.load(s));
+            CHECK_EQ(s.migrated, 1);
+            CHECK(s.networks.size() == 1 && strcmp(s.networks[0].cred.ssid, "office") == 0);
+            CHECK(s.networks[0].cred.password[0] == '\0');
+        }
+        {
+            Data st;
+            CHECK(st.init("kvstore"));
+            Settings s;
+            CHECK(st.load(s));
+            CHECK_EQ(s.migrated, 0);
+            CHECK(s.networks.empty());
+        }
+    }
+
+    // 今の版で型が合わないフィールドは既定値のまま(書き直さない)
+    void testFieldMismatch()
+    {
+        Data st;
+        CHECK(st.init("kvstore"));
+        CHECK(st.save(Data::VersionKey, uint16_t(Settings::Version)));
+        CHECK(st.save("timeZone", int16_t(-1)));
+        Settings s;
+        CHECK(st.load(s));
+        CHECK_EQ(s.migrated, -1);
+        CHECK_EQ(s.timeZone, 9 * 3600);
+    }
+
+    // 同時に開けるのは1つだけ。溜めた変更は開いたタスクにだけ見える
+    void testTransaction()
+    {
+        Data st;
+        CHECK(!st.begin()); // init()前
+        CHECK(st.init("kvstore"));
+        CHECK(st.commit() == Data::Commit::Failed);
+        CHECK(st.begin());
+        CHECK(!st.begin());
+        CHECK(st.save("timeZone", int32_t(1)));
+        bool other = true;
+        int seen = 0;
+        std::thread([&] {
+            other = st.begin();
+            int32_t v;
+            seen = st.load("timeZone", v) ? v : -1;
+            CHECK(st.commit() == Data::Commit::Failed);
+        }).join();
+        CHECK(!other);
+        CHECK_EQ(seen, -1);
+        CHECK(st.commit() == Data::Commit::Pending);
+        CHECK(st.flush());
+        CHECK(st.begin());
+        CHECK(st.commit() == Data::Commit::Clean);
+    }
+}
+
+int main()
+{
+    testRoundTrip();
+    testTruncation();
+    testMismatch();
+    testMigrateV0();
+    testMigrateV1();
+    testFieldMismatch();
+    testTransaction();
+    return CHECK_RESULT("schema");
+}
@@ -0,0 +1,72 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+//
+// ホストのテスト用のフラッシュ(Store::LogのFlash)
+// 書き込みは1→0だけ、消去で全ビットを1に戻す。消去回数はセクタごとに数える
+// failAfterを0以上にすると、そのバイト数を書いたところで電源が落ちたことにする(以降の書き込み・消去は失敗)
+//
+struct SimFlash
+{
+    static constexpr uint32_t SectorSize = 4096;
+
+    std::vector<uint8_t> mem;
+    std::vector<uint32_t> erases;
+    uint64_t writeBytes = 0;
+    long failAfter = -1;
+
+    SimFlash() : SimFlash(4) {} // partitions.csvのkvstoreと同じ16KB
+    explicit SimFlash(uint32_t sectors) : mem(sectors * SectorSize, 0xff), erases(sectors) {}
+
+    // Store::BasicDataから(ラベルは見ない)
+    bool begin(const char *) { return !mem.empty(); }
+
+    uint32_t sectorCount() const { return erases.size(); }
+    bool read(uint32_t addr, void *dst, size_t size)
+    {
+        if (addr + size > mem.size())
+            return false;
+        memcpy(dst, &mem[addr], size);
+        return true;
+    }
+    bool write(uint32_t addr, const void *src, size_t size)
+    {
+        if (addr + size > mem.size())
+            abort(); // 範囲外はLog側の誤り
+        auto p = static_cast<const uint8_t *>(src);
+        for (size_t i = 0; i < size; i++)
+        {
+            if (failAfter == 0)
+                return false;
+            if (failAfter > 0)
+                failAfter--;
+            mem[addr + i] &= p[i];
+            writeBytes++;
+        }
+        return true;
+    }
+    bool erase(uint32_t sector)
+    {
+        if (failAfter == 0)
+            return false;
+        memset(&mem[sector * SectorSize], 0xff, SectorSize);
+        erases[sector]++;
+        return true;
+    }
+
+    uint64_t totalErases() const
+    {
+        uint64_t n = 0;
+        for (auto e : erases)
+            n += e;
+        return n;
+    }
+};
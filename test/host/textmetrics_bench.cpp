@@ -0,0 +1,73 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <textmetrics.hpp>
+#include <chrono>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+//
+// 長い日本語のファイル名の計測
+// 以前の1バイトずつ数える形とmeasure()(4バイト単位)を比べる
+//
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    volatile size_t sink;
+
+    size_t cellsByByte(const char *str)
+    {
+        size_t len = 0;
+        for (auto *p = reinterpret_cast<const uint8_t *>(str); *p; p++)
+        {
+            if (*p < 0x80)
+                len++;
+            else if (*p >= 0xc0)
+                len += 2;
+        }
+        return len;
+    }
+
+    template <typename F>
+    double nsPerCall(const std::vector<std::string> &names, int reps, F &&f)
+    {
+        size_t sum = 0;
+        auto t0 = Clock::now();
+        for (int r = 0; r < reps; r++)
+            for (auto &s : names)
+                sum += f(s.c_str());
+        sink = sum;
+        return std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / (double(reps) * names.size());
+    }
+}
+
+int main()
+{
+    const char *bases[] = {
+        "写真_2021年10月_京都の紅葉と金閣寺_その",
+        "議事録_第3四半期_営業企画部_定例会議_",
+        "IMG_20211018_旅行の思い出_",
+        "ｶﾀｶﾅのﾌｧｲﾙ名_",
+    };
+    std::vector<std::string> names;
+    for (int i = 0; i < 64; i++)
+    {
+        std::string s = bases[i % 4];
+        for (int k = 0; k < i % 5; k++)
+            s += "長い名前";
+        names.push_back(s + std::to_string(i) + ".jpg");
+    }
+    size_t bytes = 0;
+    for (auto &s : names)
+        bytes += s.size();
+    printf("%zu names, %.1f bytes on average:\n", names.size(), double(bytes) / names.size());
+    const int reps = 20000;
+    double a = nsPerCall(names, reps, cellsByByte);
+    double b = nsPerCall(names, reps, Text::cells);
+    printf("  byte at a time     %6.1f ns/name\n", a);
+    printf("  Text::measure      %6.1f ns/name (x%.2f)\n", b, a / b);
+    return 0;
+}
@@ -0,0 +1,121 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <check.hpp>
+#include <textmetrics.hpp>
+#include <random>
+#include <string>
+
+//
+// UTF-8の計測(textmetrics.hpp)
+// 4バイト単位のmeasure()が1バイトずつ数えたものと一致するか、開始位置と長さを全部ずらして確かめる
+// 壊れた列(単独の継続バイト、0xf8以上の先頭バイト)も同じ規則で数える
+//
+namespace
+{
+    Text::Metrics reference(const char *str)
+    {
+        Text::Metrics m;
+        for (auto *p = reinterpret_cast<const uint8_t *>(str); *p; p++)
+            Text::Detail::addByte(m, *p);
+        return m;
+    }
+    bool same(const Text::Metrics &a, const Text::Metrics &b)
+    {
+        return a.bytes == b.bytes && a.codePoints == b.codePoints && a.cells == b.cells;
+    }
+
+    // 位置をずらして置き、後ろにごみを続けても同じ
+    int mismatches(const std::string &s)
+    {
+        int bad = 0;
+        alignas(4) char buff[256];
+        for (size_t offset = 0; offset < 4; offset++)
+        {
+            memset(buff, 0xe3, sizeof(buff));
+            memcpy(buff + offset, s.c_str(), s.size() + 1);
+            const char *str = buff + offset;
+            auto m = Text::measure(str);
+            bad += !same(m, reference(str));
+            bad += Text::cells(str) != m.cells || Text::codePoints(str) != m.codePoints;
+        }
+        return bad;
+    }
+
+    void testValid()
+    {
+        const char *samples[] = {
+            "",
+            "a",
+            "abc",
+            "abcd",
+            "abcde",
+            "あ",
+            "aあ",
+            "ファイル名.jpg",
+            "写真_2021年10月_京都の紅葉と金閣寺_その1.jpg",
+            "😀 emoji 🎉",
+            "ｶﾀｶﾅ half width",
+            "éàü mixed ASCII and Latin-1 €",
+        };
+        int bad = 0;
+        for (const char *s : samples)
+        {
+            std::string str(s);
+            for (size_t i = 0; i <= str.size(); i++)
+                bad += mismatches(str.substr(i)) + mismatches(str.substr(0, i));
+            // 正しいUTF-8ならコンパイル時版とも同じ
+            bad += Text::cellsConst(s) != Text::cells(s);
+        }
+        CHECK_EQ(bad, 0);
+
+        // ちょうどの大きさで確保した文字列(終端の先を読んでも範囲外には出ないこと、ASanで誤検出しないこと)
+        for (size_t n = 0; n < 24; n++)
+        {
+            auto *p = static_cast<char *>(malloc(n + 1));
+            for (size_t i = 0; i < n; i++)
+                p[i] = i % 3 ? 'x' : char(0xe3);
+            p[n] = '\0';
+            bad += !same(Text::measure(p), reference(p));
+            free(p);
+        }
+        CHECK_EQ(bad, 0);
+
+        auto m = Text::measure("写真_2021.jpg");
+        CHECK_EQ(m.bytes, size_t(15));
+        CHECK_EQ(m.codePoints, size_t(11));
+        CHECK_EQ(m.cells, size_t(13));
+    }
+
+    void testBroken()
+    {
+        // 単独の継続バイトは数えない。0xf8以上も先頭バイトとして数える
+        auto m = Text::measure("a\x80\xbf" "b");
+        CHECK_EQ(m.bytes, size_t(4));
+        CHECK_EQ(m.codePoints, size_t(2));
+        CHECK_EQ(m.cells, size_t(2));
+        m = Text::measure("\xff\xfe\xf8");
+        CHECK_EQ(m.codePoints, size_t(3));
+        CHECK_EQ(m.cells, size_t(6));
+
+        // 0以外の全バイト値の乱数列
+        std::mt19937 rng(1);
+        int bad = 0;
+        for (int t = 0; t < 20000; t++)
+        {
+            std::string s(rng() % 40, ' ');
+            for (auto &c : s)
+                c = char(1 + rng() % 255);
+            bad += mismatches(s);
+        }
+        CHECK_EQ(bad, 0);
+    }
+}
+
+int main()
+{
+    testValid();
+    testBroken();
+    return CHECK_RESULT("textmetrics");
+}
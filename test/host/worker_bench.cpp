@@ -0,0 +1,193 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <worker.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string.h>
+#include <thread>
+
+//
+// ジョブ1件の投入/取り出しの重さ
+// 以前のxQueueSend(Event)の形(関数ポインタ+int引数を16件のキューにコピー)と
+// 今のWorker::Function(キャプチャをスロットに直接置く)を比べる
+// xQueueSend/xQueueReceiveはロックを取ってmemcpyするだけなので、ここではstd::mutexで置き換える
+//
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+    using Worker::Token;
+
+    volatile int sink;
+
+    double nsPerOp(Clock::time_point t0, int n)
+    {
+        return std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / n;
+    }
+
+    // 以前のイベント(ESP32では8バイト)
+    struct Event
+    {
+        int (*func)(const Token &, int);
+        int arg;
+    };
+    int eventFunc(const Token &, int a)
+    {
+        sink = sink + a;
+        return 0;
+    }
+
+    // xQueueCreate(16, sizeof(T))の代わり(満杯/空なら待つ)
+    template <typename T>
+    class PodQueue
+    {
+        std::mutex m;
+        std::condition_variable notEmpty, notFull;
+        uint8_t items[16][sizeof(T)];
+        int head = 0, count = 0;
+
+    public:
+        void send(const T &v)
+        {
+            std::unique_lock<std::mutex> lk(m);
+            notFull.wait(lk, [this] { return count < 16; });
+            memcpy(items[(head + count++) & 15], &v, sizeof(T));
+            lk.unlock();
+            notEmpty.notify_one();
+        }
+        void receive(T &v)
+        {
+            std::unique_lock<std::mutex> lk(m);
+            notEmpty.wait(lk, [this] { return count > 0; });
+            memcpy(&v, items[head], sizeof(T));
+            head = (head + 1) & 15;
+            count--;
+            lk.unlock();
+            notFull.notify_one();
+        }
+    };
+
+    // 同じスレッドで入れて出して呼ぶ(受け渡しのコストだけ)
+    void singleThread(int n)
+    {
+        std::mutex m;
+        Event events[16];
+        auto t0 = Clock::now();
+        for (int i = 0; i < n; i++)
+        {
+            Event e{eventFunc, i}, r;
+            {
+                std::lock_guard<std::mutex> lk(m);
+                memcpy(&events[i & 15], &e, sizeof(e));
+            }
+            {
+                std::lock_guard<std::mutex> lk(m);
+                memcpy(&r, &events[i & 15], sizeof(r));
+            }
+            r.func(Token(), r.arg);
+        }
+        printf("  Event copy (%2u bytes)        %6.1f ns/op\n", unsigned(sizeof(Event)), nsPerOp(t0, n));
+
+        Worker::Func slots[16];
+        t0 = Clock::now();
+        for (int i = 0; i < n; i++)
+        {
+            Worker::Func f([i](const Token &) {
+                sink = sink + i;
+                return 0;
+            });
+            {
+                std::lock_guard<std::mutex> lk(m);
+                slots[i & 15] = std::move(f);
+            }
+            {
+                std::lock_guard<std::mutex> lk(m);
+            }
+            slots[i & 15](Token());
+            slots[i & 15].reset();
+        }
+        printf("  Function (4-byte capture)     %6.1f ns/op\n", nsPerOp(t0, n));
+
+        // Credentialsを値で持つジョブと同じ大きさ
+        struct Cred
+        {
+            char ssid[32];
+            char pass[32];
+        } cred{};
+        t0 = Clock::now();
+        for (int i = 0; i < n; i++)
+        {
+            cred.ssid[0] = char(i);
+            Worker::Func f([cred](const Token &) {
+                sink = sink + cred.ssid[0];
+                return 0;
+            });
+            {
+                std::lock_guard<std::mutex> lk(m);
+                slots[i & 15] = std::move(f);
+            }
+            {
+                std::lock_guard<std::mutex> lk(m);
+            }
+            slots[i & 15](Token());
+            slots[i & 15].reset();
+        }
+        printf("  Function (%2u-byte capture)    %6.1f ns/op\n", unsigned(sizeof(cred)), nsPerOp(t0, n));
+    }
+
+    // 投入側と実行側を別スレッドにして、完了までの1件あたりの時間
+    void crossThread(int n)
+    {
+        PodQueue<Event> queue;
+        std::thread consumer([&] {
+            for (int i = 0; i < n; i++)
+            {
+                Event e;
+                queue.receive(e);
+                e.func(Token(), e.arg);
+            }
+        });
+        auto t0 = Clock::now();
+        for (int i = 0; i < n; i++)
+            queue.send(Event{eventFunc, i});
+        consumer.join();
+        printf("  xQueueSend(Event) + receive   %6.1f ns/op\n", nsPerOp(t0, n));
+
+        auto &w = *new Worker::Task; // ワーカーのスレッドは止めないので破棄しない
+        w.start(1);
+        int done = 0, rejects = 0;
+        t0 = Clock::now();
+        for (int i = 0; i < n;)
+        {
+            auto h = w.signal(
+                "bench",
+                [i](const Token &) {
+                    sink = sink + i;
+                    return 0;
+                },
+                [&done](int, Worker::State) { done++; });
+            if (h.valid())
+                i++;
+            else
+            {
+                rejects++;
+                w.poll();
+                std::this_thread::yield();
+            }
+        }
+        while (done < n)
+            w.poll();
+        printf("  Worker::signal + run + poll   %6.1f ns/op (rejected %d times)\n", nsPerOp(t0, n), rejects);
+    }
+}
+
+int main()
+{
+    printf("same thread:\n");
+    singleThread(10000000);
+    printf("producer -> worker thread:\n");
+    crossThread(1000000);
+    return 0;
+}
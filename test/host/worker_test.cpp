@@ -0,0 +1,339 @@
+///
+/// Copyright Y.Suzuki 2021
+/// wave.suzuki.z@gmail.com
+///
+#include <worker.hpp>
+#include <check.hpp>
+#include <thread>
+#include <vector>
+
+//
+// ワーカーの投入ポリシー(Drop/Coalesce/ReplaceLatest)
+// 前半は1本のワーカーを止めておいて順に確かめ、後半は複数スレッドから同時に投入する
+//
+namespace
+{
+    using Worker::Handle;
+    using Worker::Policy;
+    using Worker::Priority;
+    using Worker::State;
+    using Worker::Token;
+
+    bool load(const bool &b) { return __atomic_load_n(&b, __ATOMIC_ACQUIRE); }
+    void store(bool &b, bool v) { __atomic_store_n(&b, v, __ATOMIC_RELEASE); }
+
+    // 開けるまでワーカーを1本ふさぐ
+    struct Gate
+    {
+        bool open = false;
+        bool entered = false;
+
+        Handle block(Worker::Task &w)
+        {
+            store(open, false);
+            store(entered, false);
+            auto h = w.signal("gate", [this](const Token &) {
+                store(entered, true);
+                while (!load(open))
+                    std::this_thread::yield();
+                return 0;
+            });
+            while (!load(entered))
+                std::this_thread::yield();
+            return h;
+        }
+        void release() { store(open, true); }
+    };
+
+    // 終わるまで完了通知を回す(このスレッドがUIスレッドの役)
+    void settle(Worker::Task &w, Handle h)
+    {
+        while (!w.isFinished(h))
+        {
+            w.poll();
+            std::this_thread::yield();
+        }
+        w.poll();
+    }
+
+    struct Record
+    {
+        int runs = 0;
+        int result = -1;
+        State state = State::Free;
+    };
+    Handle submit(Worker::Task &w, Record &r, Policy policy, uint16_t key, int result = 1)
+    {
+        return w.signal(
+            "test",
+            [&r, result](const Token &) {
+                __atomic_fetch_add(&r.runs, 1, __ATOMIC_RELAXED);
+                return result;
+            },
+            [&r](int res, State st) {
+                r.result = res;
+                r.state = st;
+            },
+            Priority::Normal, policy, key);
+    }
+
+    void testCoalesce(Worker::Task &w)
+    {
+        Gate gate;
+        auto g = gate.block(w);
+        auto before = w.getStats();
+        Record a, b;
+        auto ha = submit(w, a, Policy::Coalesce, 7);
+        auto hb = submit(w, b, Policy::Coalesce, 7);
+        CHECK(ha.valid());
+        CHECK(hb.slot == ha.slot && hb.generation == ha.generation);
+        CHECK_EQ(w.getStats().coalesced - before.coalesced, 1u);
+        // 別のキーはまとめない
+        Record c;
+        auto hc = submit(w, c, Policy::Coalesce, 8);
+        CHECK(hc.slot != ha.slot);
+        gate.release();
+        settle(w, g);
+        settle(w, ha);
+        settle(w, hc);
+        CHECK_EQ(a.runs, 1);
+        CHECK_EQ(b.runs, 0);
+        CHECK_EQ(c.runs, 1);
+        CHECK(a.state == State::Done);
+        CHECK(b.state == State::Free); // 完了通知は呼ばれない
+    }
+
+    void testReplaceLatest(Worker::Task &w)
+    {
+        Gate gate;
+        auto g = gate.block(w);
+        auto before = w.getStats();
+        Record a, b;
+        auto ha = submit(w, a, Policy::ReplaceLatest, 9);
+        auto hb = submit(w, b, Policy::ReplaceLatest, 9);
+        CHECK(hb.valid() && hb.slot != ha.slot);
+        CHECK_EQ(w.getStats().replaced - before.replaced, 1u);
+        CHECK(w.isFinished(ha)); // 実行前に取り消し済み
+        gate.release();
+        settle(w, g);
+        settle(w, hb);
+        CHECK_EQ(a.runs, 0);
+        CHECK(a.state == State::Cancelled);
+        CHECK_EQ(b.runs, 1);
+        CHECK(b.state == State::Done);
+    }
+
+    // 実行が始まったジョブは置き換えで取り消さない
+    void testReplaceRunning(Worker::Task &w)
+    {
+        bool started = false, open = false, cancelled = false;
+        auto ha = w.signal(
+            "running",
+            [&](const Token &tok) {
+                store(started, true);
+                while (!load(open))
+                    std::this_thread::yield();
+                cancelled = tok.isCancelled();
+                return 0;
+            },
+            nullptr, Priority::Normal, Policy::ReplaceLatest, 10);
+        while (!load(started))
+            std::this_thread::yield();
+        auto before = w.getStats();
+        Record b;
+        auto hb = submit(w, b, Policy::ReplaceLatest, 10);
+        CHECK(hb.valid());
+        CHECK_EQ(w.getStats().replaced - before.replaced, 0u);
+        store(open, true);
+        settle(w, ha);
+        settle(w, hb);
+        CHECK(!cancelled);
+        CHECK_EQ(b.runs, 1);
+    }
+
+    // 空きスロットが無ければ待たずに捨てる
+    void testDrop(Worker::Task &w)
+    {
+        Gate gate;
+        auto g = gate.block(w);
+        auto before = w.getStats();
+        std::vector<Record> records(16);
+        std::vector<Handle> handles;
+        for (auto &r : records)
+        {
+            auto h = submit(w, r, Policy::Drop, 0);
+            if (h.valid())
+                handles.push_back(h);
+        }
+        CHECK_EQ(handles.size(), 15u); // 1つはゲートが使っている
+        CHECK_EQ(w.getStats().rejects - before.rejects, 1u);
+        gate.release();
+        settle(w, g);
+        for (auto h : handles)
+            settle(w, h);
+        int runs = 0;
+        for (auto &r : records)
+            runs += r.runs;
+        CHECK_EQ(runs, 15);
+    }
+
+    ///
+    /// 同時投入(実機と同じく、このスレッドがUIスレッドとしてpoll()と保存要求を出す)
+    /// - Coalesce: 返されたハンドルのジョブが終わった時点で、それまでの保存要求が書かれていること
+    /// - ReplaceLatest: 実行中のジョブが取り消されないこと、最後に受け付けたものは必ず実行されること
+    /// - 投入数 = 受付 + 拒否 + まとめ、受付はすべて完了通知まで進むこと
+    ///
+    void testConcurrent()
+    {
+        auto &w = *new Worker::Task; // スレッドは止めないので破棄しない
+        w.start(2);
+        constexpr int Rounds = 10000;
+        constexpr int Flooders = 2;
+        constexpr int MaxFloods = 3; // 残りのスロットをまとめ/置き換えの相手に使わせる
+
+        bool stop = false;
+        uint32_t signals = 0, doneCalls = 0;
+        uint32_t seq = 0, flushedSeq = 0, lost = 0;
+        uint32_t lastReplace = 0, lastReplaceRun = 0, cancelledWhileRunning = 0;
+        int floods = 0; // 完了通知待ちのflood
+
+        auto count = [&](Handle h) {
+            __atomic_fetch_add(&signals, 1, __ATOMIC_RELAXED);
+            return h;
+        };
+        auto onDone = [&](int, State) { __atomic_fetch_add(&doneCalls, 1, __ATOMIC_RELAXED); };
+        auto spin = [](int n) {
+            for (int k = 0; k < n; k++)
+                std::this_thread::yield();
+        };
+        // 保存に当たる処理: 始まった時点までの要求を書いたことにする
+        auto flush = [&] {
+            uint32_t s = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+            uint32_t cur = __atomic_load_n(&flushedSeq, __ATOMIC_RELAXED);
+            while (s > cur && !__atomic_compare_exchange_n(&flushedSeq, &cur, s, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                ;
+        };
+
+        std::vector<std::thread> threads;
+        for (int f = 0; f < Flooders; f++)
+            threads.emplace_back([&] {
+                while (!load(stop))
+                {
+                    if (__atomic_add_fetch(&floods, 1, __ATOMIC_ACQ_REL) > MaxFloods)
+                    {
+                        __atomic_fetch_sub(&floods, 1, __ATOMIC_ACQ_REL);
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    auto h = count(w.signal(
+                        "flood", [&](const Token &) { return spin(10), 0; },
+                        [&](int res, State st) {
+                            __atomic_fetch_sub(&floods, 1, __ATOMIC_ACQ_REL);
+                            onDone(res, st);
+                        }));
+                    if (!h.valid())
+                        __atomic_fetch_sub(&floods, 1, __ATOMIC_ACQ_REL);
+                }
+            });
+        threads.emplace_back([&] {
+            for (uint32_t id = 1; !load(stop); id++)
+            {
+                auto h = count(w.signal(
+                    "replace",
+                    [&, id](const Token &tok) {
+                        spin(10);
+                        if (tok.isCancelled())
+                            __atomic_fetch_add(&cancelledWhileRunning, 1, __ATOMIC_RELAXED);
+                        uint32_t cur = __atomic_load_n(&lastReplaceRun, __ATOMIC_RELAXED);
+                        while (id > cur && !__atomic_compare_exchange_n(&lastReplaceRun, &cur, id, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                            ;
+                        return 0;
+                    },
+                    onDone, Priority::High, Policy::ReplaceLatest, 2));
+                if (h.valid())
+                    lastReplace = id;
+                std::this_thread::yield();
+            }
+        });
+
+        // flushStore()と同じ形(投入できなければその場で書く)
+        struct Pending
+        {
+            Handle h;
+            uint32_t seq;
+        };
+        std::vector<Pending> pending;
+        for (int i = 0; i < Rounds; i++)
+        {
+            w.poll();
+            for (auto it = pending.begin(); it != pending.end();)
+            {
+                if (!w.isFinished(it->h))
+                {
+                    ++it;
+                    continue;
+                }
+                if (__atomic_load_n(&flushedSeq, __ATOMIC_ACQUIRE) < it->seq)
+                    lost++;
+                it = pending.erase(it);
+            }
+            for (int k = 0; k < 2; k++) // 2回目は待っている方へまとまることが多い
+            {
+                uint32_t mine = __atomic_add_fetch(&seq, 1, __ATOMIC_ACQ_REL);
+                auto h = count(w.signal(
+                    "flush", [&](const Token &) { return spin(5), flush(), 0; }, onDone, Priority::Normal,
+                    Policy::Coalesce, 1));
+                if (!h.valid())
+                {
+                    flush();
+                    continue;
+                }
+                bool merged = false;
+                for (auto &p : pending)
+                    if (p.h.slot == h.slot && p.h.generation == h.generation)
+                        p.seq = mine, merged = true;
+                if (!merged)
+                    pending.push_back({h, mine});
+            }
+            // 1コアでもワーカーに順番が回るように間をおく
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        store(stop, true);
+        for (auto &t : threads)
+            t.join();
+
+        // 残りが全部完了通知まで進むのを待つ
+        uint32_t deadline = millis() + 2000;
+        while (__atomic_load_n(&doneCalls, __ATOMIC_ACQUIRE) < w.getStats().submitted && millis() < deadline)
+        {
+            w.poll();
+            std::this_thread::yield();
+        }
+        for (auto &p : pending)
+            if (!w.isFinished(p.h) || flushedSeq < p.seq)
+                lost++;
+
+        auto st = w.getStats();
+        printf("concurrent: signals=%u submitted=%u rejects=%u coalesced=%u replaced=%u high-water=%u\n",
+               signals, st.submitted, st.rejects, st.coalesced, st.replaced, st.highWater);
+        CHECK(st.coalesced > 0);
+        CHECK(st.replaced > 0);
+        CHECK_EQ(lost, 0u);
+        CHECK_EQ(cancelledWhileRunning, 0u);
+        CHECK_EQ(signals, st.submitted + st.rejects + st.coalesced);
+        CHECK_EQ(doneCalls, st.submitted);
+        CHECK_EQ(lastReplaceRun, lastReplace);
+    }
+}
+
+int main()
+{
+    auto &w = *new Worker::Task;
+    w.start(1);
+    testCoalesce(w);
+    testReplaceLatest(w);
+    testReplaceRunning(w);
+    testDrop(w);
+    testConcurrent();
+    return CHECK_RESULT("worker");
+}
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+#
+# Copyright Y.Suzuki 2021
+# wave.suzuki.z@gmail.com
+#
+# trace.bin (include/trace.hpp の Trace::Dumper 出力) を
+# Chrome trace JSON (chrome://tracing / ui.perfetto.dev) に変換する
+#
+#   python3 tools/trace2json.py trace.bin > trace.json
+#
+import json
+import struct
+import sys
+
+PHASE = {0: "B", 1: "E", 2: "i"}
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, fmt):
+        v = struct.unpack_from("<" + fmt, self.data, self.pos)
+        self.pos += struct.calcsize("<" + fmt)
+        return v if len(v) > 1 else v[0]
+
+    def string(self):
+        n = self.take("B")
+        s = self.data[self.pos:self.pos + n].decode("utf-8", "replace")
+        self.pos += n
+        return s
+
+    def table(self):
+        return {self.take("I"): self.string() for _ in range(self.take("I"))}
+
+
+def convert(data):
+    r = Reader(data)
+    if data[:4] != b"CTRC":
+        raise ValueError("not a trace dump")
+    r.pos = 4
+    version = r.take("I")
+    if version != 1:
+        raise ValueError("unsupported version %d" % version)
+    names = r.table()
+    tasks = r.table()
+    tids = {t: i + 1 for i, t in enumerate(tasks)}
+
+    raw = []
+    for _ in range(2):
+        for _ in range(r.take("I")):
+            raw.append(r.take("IIIBB"))
+
+    # 時刻は32bit us(約71分で一周)なので、ダンプはそれより短い間隔で行うこと
+    raw.sort(key=lambda e: e[0])
+    events = []
+    base = raw[0][0] if raw else 0
+    for ts, name, task, kind, core in raw:
+        ev = {
+            "name": names.get(name, "0x%08x" % name),
+            "ph": PHASE.get(kind, "i"),
+            "ts": ts - base,
+            "pid": core,
+            "tid": tids.get(task, 0),
+        }
+        if ev["ph"] == "i":
+            ev["s"] = "t"
+        events.append(ev)
+
+    for core in (0, 1):
+        events.append({"name": "process_name", "ph": "M", "pid": core,
+                       "args": {"name": "core%d" % core}})
+        for task, tid in tids.items():
+            events.append({"name": "thread_name", "ph": "M", "pid": core,
+                           "tid": tid, "args": {"name": tasks[task]}})
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) < 2:
+        print("usage: trace2json.py trace.bin [out.json]", file=sys.stderr)
+        return 1
+    with open(sys.argv[1], "rb") as f:
+        trace = convert(f.read())
+    out = open(sys.argv[2], "w") if len(sys.argv) > 2 else sys.stdout
+    json.dump(trace, out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())